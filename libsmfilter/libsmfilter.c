@@ -202,6 +202,7 @@ int act_pchar_ini(smrule_t *r)
    }
 
    r->data = pd;
+   sm_unordered(r);
    return 0;
 }
 
@@ -334,7 +335,8 @@ int act_pchar_main(smrule_t *r, osm_obj_t *o)
             return 0;
    }
 
-   if ((ot = realloc(o->otag, sizeof(struct otag) * (o->tag_cnt + 1))) == NULL)
+   // tags of loaded objects may reside in the arena, thus use realloc_mem()
+   if ((ot = realloc_mem(o->otag, sizeof(struct otag) * o->tag_cnt, sizeof(struct otag) * (o->tag_cnt + 1))) == NULL)
    {
       log_msg(LOG_ERR, "could not realloc new node: %s", strerror(errno));
       return -1;
@@ -217,3 +217,20 @@ char *bs_strdup(const bstring_t *b)
    return s;
 }
 
+
+
+/*! Calculate the 64 bit FNV-1a hash of a bstring.
+ * @param b Bstring.
+ * @param h Initial hash value. This is BS_HASH_INIT or the hash of another
+ * bstring which allows to chain several strings.
+ * @return Returns the hash value.
+ */
+uint64_t bs_hash(bstring_t b, uint64_t h)
+{
+   for (; b.len; b.len--, b.buf++)
+   {
+      h ^= (unsigned char) *b.buf;
+      h *= 0x100000001b3ULL;
+   }
+   return h;
+}
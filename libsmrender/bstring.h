@@ -22,6 +22,11 @@
 #ifndef BSTRING_H
 #define BSTRING_H
 
+#include <stdint.h>
+
+
+//! initial value for bs_hash()
+#define BS_HASH_INIT 0xcbf29ce484222325ULL
 
 typedef struct bstrings
 {
@@ -32,6 +37,9 @@ typedef struct bstrings
 typedef struct bstring
 {
    int len;
+   //! atom of interned strings (see smintern.c), this uses the alignment gap
+   //! and it is only valid if bs_atom() says so
+   int atom;
    char *buf;
 } bstring_t;
 
@@ -50,6 +58,7 @@ int bs_cmp(bstring_t b, const char *s);
 long bs_tol(bstring_t b);
 double bs_tod(bstring_t b);
 char *bs_strdup(const bstring_t *b);
+uint64_t bs_hash(bstring_t b, uint64_t h);
 
 #endif
 
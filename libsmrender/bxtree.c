@@ -31,6 +31,7 @@
 
 #include "smrender.h"
 #include "bxtree.h"
+#include "sarray.h"
 
 #ifdef WITH_THREADS
 #include <pthread.h>
@@ -189,6 +190,12 @@ void bx_free_tree0(bx_node_t *node, bx_hash_t d)
    if (node == NULL)
       return;
 
+   if (!d && sa_is_store(node))
+   {
+      sa_free(node);
+      return;
+   }
+
    if (d < (((int) sizeof(bx_hash_t) * 8) / BX_RES))
       for (i = 0; i < 1 << BX_RES; i++)
          bx_free_tree0(node->next[i], d + 1);
@@ -196,3 +203,30 @@ void bx_free_tree0(bx_node_t *node, bx_hash_t d)
    bx_free(node);
 }
 
+
+/*! This function recursively calculates the memory allocated by a tree. The
+ * objects referenced by the leaves are not taken into account. This function
+ * does not take thread-locking into account.
+ * @param node Pointer to tree.
+ * @param d Current depth, starting with 0 at the root.
+ * @return Returns the number of bytes.
+ */
+size_t bx_tree_sizeof0(const bx_node_t *node, bx_hash_t d)
+{
+   size_t s;
+   int i;
+
+   if (node == NULL)
+      return 0;
+
+   if (!d && sa_is_store(node))
+      return sa_sizeof(node);
+
+   s = sizeof(*node);
+   if (d < (((int) sizeof(bx_hash_t) * 8) / BX_RES))
+      for (i = 0; i < 1 << BX_RES; i++)
+         s += bx_tree_sizeof0(node->next[i], d + 1);
+
+   return s;
+}
+
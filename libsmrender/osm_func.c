@@ -31,6 +31,9 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include "smrender.h"
 #include "osm_inplace.h"
@@ -43,6 +46,10 @@
                      x.len -= y
 
 
+#define MEM_ADD(x, y) __atomic_add_fetch(&(x), (y), __ATOMIC_RELAXED)
+
+
+//! memory counters, objects may be allocated concurrently by several threads
 static size_t mem_usage_ = 0;
 static size_t mem_freed_ = 0;
 
@@ -89,10 +96,38 @@ time_t parse_time(bstring_t b)
 }
 
 
+//! Free memory which may be static memory (see add_static_mem()).
+void free_mem(void *p)
+{
+   if (!is_static_mem(p))
+      free(p);
+}
+
+
+/*! Reallocate memory which may be static memory (see add_static_mem()). In
+ * the latter case new memory is allocated and the contents is copied.
+ * @param p Pointer to memory.
+ * @param olen Current size of memory at p.
+ * @param len New size of memory.
+ * @return Returns a pointer to the new memory or NULL in case of error.
+ */
+void *realloc_mem(void *p, size_t olen, size_t len)
+{
+   void *q;
+
+   if (!is_static_mem(p))
+      return realloc(p, len);
+
+   if ((q = malloc(len)) != NULL)
+      memcpy(q, p, olen < len ? olen : len);
+   return q;
+}
+
+
 void free_obj(osm_obj_t *o)
 {
-   free(o->otag);
-   mem_freed_ += sizeof(struct otag) * o->tag_cnt;
+   free_mem(o->otag);
+   MEM_ADD(mem_freed_, sizeof(struct otag) * o->tag_cnt);
    switch (o->type)
    {
       case OSM_NODE:
@@ -100,20 +135,20 @@ void free_obj(osm_obj_t *o)
          break;
 
       case OSM_WAY:
-         free(((osm_way_t*) o)->ref);
-         mem_freed_ += sizeof(int64_t) * ((osm_way_t*) o)->ref_cnt;
+         free_mem(((osm_way_t*) o)->ref);
+         MEM_ADD(mem_freed_, sizeof(int64_t) * ((osm_way_t*) o)->ref_cnt);
          break;
 
       case OSM_REL:
-         free(((osm_rel_t*) o)->mem);
-         mem_freed_ += sizeof(struct rmember) * ((osm_rel_t*) o)->mem_cnt;
+         free_mem(((osm_rel_t*) o)->mem);
+         MEM_ADD(mem_freed_, sizeof(struct rmember) * ((osm_rel_t*) o)->mem_cnt);
          break;
 
       default:
          log_msg(LOG_ERR, "no such object type: %d", o->type);
    }
-   mem_freed_ += SIZEOF_OSM_OBJ(o);
-   free(o);
+   MEM_ADD(mem_freed_, SIZEOF_OSM_OBJ(o));
+   free_mem(o);
 }
 
 
@@ -124,23 +159,57 @@ void *malloc_mem(size_t ele, int cnt)
    if ((mem = malloc(ele * cnt)) == NULL)
       log_msg(LOG_ERR, "could not malloc_mem(): %s", strerror(errno)),
       exit(EXIT_FAILURE);
-   mem_usage_ += ele *cnt;
+   MEM_ADD(mem_usage_, ele *cnt);
    return mem;
 }
 
 
+/*! Allocate an object of olen bytes together with tag_cnt tags and ecnt
+ * elements of esize bytes as a single block from the arena (see
+ * arena_alloc()). The object is initialized with 0.
+ * @param olen Size of object.
+ * @param tag_cnt Number of tags.
+ * @param esize Size of elements (refs or members).
+ * @param ecnt Number of elements.
+ * @param arr Pointer which receives the pointer to the elements. It is set to
+ * NULL if ecnt is 0.
+ * @return Returns a pointer to the object or NULL if the memory could not be
+ * allocated from the arena.
+ */
+static osm_obj_t *arena_obj(size_t olen, short tag_cnt, size_t esize, int ecnt, void **arr)
+{
+   size_t tlen = sizeof(struct otag) * tag_cnt;
+   osm_obj_t *o;
+   char *p;
+
+   if ((p = arena_alloc(olen + tlen + esize * ecnt)) == NULL)
+      return NULL;
+
+   o = (osm_obj_t*) p;
+   memset(o, 0, olen);
+   o->otag = tag_cnt ? (struct otag*) (p + olen) : NULL;
+   *arr = ecnt ? p + olen + tlen : NULL;
+   MEM_ADD(mem_usage_, olen + tlen + esize * ecnt);
+   return o;
+}
+
+
 osm_node_t *malloc_node(short tag_cnt)
 {
    osm_node_t *n;
+   void *dummy;
 
-   if ((n = calloc(1, sizeof(osm_node_t))) == NULL)
-      log_msg(LOG_ERR, "could not malloc_node(): %s", strerror(errno)),
-      exit(EXIT_FAILURE);
+   if ((n = (osm_node_t*) arena_obj(sizeof(*n), tag_cnt, 0, 0, &dummy)) == NULL)
+   {
+      if ((n = calloc(1, sizeof(osm_node_t))) == NULL)
+         log_msg(LOG_ERR, "could not malloc_node(): %s", strerror(errno)),
+         exit(EXIT_FAILURE);
+      n->obj.otag = malloc_mem(sizeof(struct otag), tag_cnt);
+      MEM_ADD(mem_usage_, sizeof(osm_node_t));
+   }
    n->obj.type = OSM_NODE;
    n->obj.vis = 2;
-   n->obj.otag = malloc_mem(sizeof(struct otag), tag_cnt);
    n->obj.tag_cnt = tag_cnt;
-   mem_usage_ += sizeof(osm_node_t);
    return n;
 }
 
@@ -148,17 +217,22 @@ osm_node_t *malloc_node(short tag_cnt)
 osm_way_t *malloc_way(short tag_cnt, int ref_cnt)
 {
    osm_way_t *w;
+   void *ref;
 
-   if ((w = calloc(1, sizeof(osm_way_t))) == NULL)
-      log_msg(LOG_ERR, "could not malloc_way(): %s", strerror(errno)),
-      exit(EXIT_FAILURE);
+   if ((w = (osm_way_t*) arena_obj(sizeof(*w), tag_cnt, sizeof(int64_t), ref_cnt, &ref)) == NULL)
+   {
+      if ((w = calloc(1, sizeof(osm_way_t))) == NULL)
+         log_msg(LOG_ERR, "could not malloc_way(): %s", strerror(errno)),
+         exit(EXIT_FAILURE);
+      w->obj.otag = malloc_mem(sizeof(struct otag), tag_cnt);
+      ref = malloc_mem(sizeof(int64_t), ref_cnt);
+      MEM_ADD(mem_usage_, sizeof(osm_way_t));
+   }
    w->obj.type = OSM_WAY;
    w->obj.vis = 2;
-   w->obj.otag = malloc_mem(sizeof(struct otag), tag_cnt);
    w->obj.tag_cnt = tag_cnt;
-   w->ref = malloc_mem(sizeof(int64_t), ref_cnt);
+   w->ref = ref;
    w->ref_cnt = ref_cnt;
-   mem_usage_ += sizeof(osm_way_t);
    return w;
 }
 
@@ -166,17 +240,22 @@ osm_way_t *malloc_way(short tag_cnt, int ref_cnt)
 osm_rel_t *malloc_rel(short tag_cnt, short mem_cnt)
 {
    osm_rel_t *r;
+   void *mem;
 
-   if ((r = calloc(1, sizeof(osm_rel_t))) == NULL)
-      log_msg(LOG_ERR, "could not malloc_rel(): %s", strerror(errno)),
-         exit(EXIT_FAILURE);
+   if ((r = (osm_rel_t*) arena_obj(sizeof(*r), tag_cnt, sizeof(struct rmember), mem_cnt, &mem)) == NULL)
+   {
+      if ((r = calloc(1, sizeof(osm_rel_t))) == NULL)
+         log_msg(LOG_ERR, "could not malloc_rel(): %s", strerror(errno)),
+            exit(EXIT_FAILURE);
+      r->obj.otag = malloc_mem(sizeof(struct otag), tag_cnt);
+      mem = malloc_mem(sizeof(struct rmember), mem_cnt);
+      MEM_ADD(mem_usage_, sizeof(osm_rel_t));
+   }
    r->obj.type = OSM_REL;
    r->obj.vis = 2;
-   r->obj.otag = malloc_mem(sizeof(struct otag), tag_cnt);
    r->obj.tag_cnt = tag_cnt;
-   r->mem = malloc_mem(sizeof(struct rmember), mem_cnt);
+   r->mem = mem;
    r->mem_cnt = mem_cnt;
-   mem_usage_ += sizeof(osm_rel_t);
    return r;
 }
 
@@ -206,6 +285,15 @@ void osm_node_default(osm_node_t *n)
 
 
 static list_t *role_root_ = NULL;
+#ifdef WITH_THREADS
+//! roles are added concurrently by the threads of the loaders
+static pthread_mutex_t role_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+#define role_lock() pthread_mutex_lock(&role_mutex_)
+#define role_unlock() pthread_mutex_unlock(&role_mutex_)
+#else
+#define role_lock()
+#define role_unlock()
+#endif
 
 
 void __attribute__((constructor)) role_ini(void)
@@ -249,12 +337,15 @@ const char *role_str(int role)
    if (role == ROLE_EMPTY)
       return "";
 
+   role_lock();
    for (i = ROLE_FIRST_FREE_NUM, elem = li_first(role_root_); elem != li_head(role_root_); i++, elem = elem->next)
    {
       if (i == role)
-         return elem->data;
+         break;
    }
-   return "n/a";
+   role_unlock();
+   // entries are never removed, thus they may be used without lock
+   return elem != li_head(role_root_) ? elem->data : "n/a";
 }
 
 
@@ -264,7 +355,7 @@ const char *role_str(int role)
  * @return This function returns an integer corresponding to role-string. These
  * integers are defined by an enum in osm_inplace.h name ROLE_xxx. If the
  * string is empty ROLE_EMPTY is returned. If the string is unknown or a NULL
- * pointer is passed ROLE_NA is returned.
+ * pointer is passed ROLE_NA is returned. The function is thread-safe.
  * */
 int strrole(const bstring_t *b)
 {
@@ -277,20 +368,26 @@ int strrole(const bstring_t *b)
    if (!b->len)
       return ROLE_EMPTY;
 
+   role_lock();
    for (i = ROLE_FIRST_FREE_NUM, elem = li_first(role_root_); elem != li_head(role_root_); i++, elem = elem->next)
    {
       if (!bs_cmp(*b, elem->data))
+      {
+         role_unlock();
          return i;
+      }
    }
 
    if ((s = bs_strdup(b)) == NULL)
    {
+      role_unlock();
       log_errno(LOG_ERR, "bs_strdup() failed");
       return 0;
    }
 
    log_debug("adding role '%s'(%d)", s, i);
    li_add(li_last(role_root_), s);
+   role_unlock();
    return i;
 }
 
@@ -329,12 +426,12 @@ int realloc_tags(osm_obj_t *o, int cnt)
    struct otag *new_tags;
    int ocnt;
 
-   if ((new_tags = realloc(o->otag, cnt * sizeof(*o->otag))) == NULL)
+   if ((new_tags = realloc_mem(o->otag, o->tag_cnt * sizeof(*o->otag), cnt * sizeof(*o->otag))) == NULL)
       return -1;
    o->otag = new_tags;
    ocnt = o->tag_cnt;
    o->tag_cnt = cnt;
-   mem_usage_ += (cnt - ocnt) * sizeof(*o->otag);
+   MEM_ADD(mem_usage_, (cnt - ocnt) * sizeof(*o->otag));
    return ocnt;
 }
 
@@ -358,7 +455,7 @@ int realloc_refs(osm_way_t *w, int cnt)
       return -1;
    }
 
-   if ((ref = realloc(w->ref, cnt * sizeof(*ref))) == NULL)
+   if ((ref = realloc_mem(w->ref, w->ref_cnt * sizeof(*ref), cnt * sizeof(*ref))) == NULL)
    {
       log_errno(LOG_EMERG, "could not realloc refs");
       return -1;
@@ -367,7 +464,7 @@ int realloc_refs(osm_way_t *w, int cnt)
    w->ref = ref;
    ocnt = w->ref_cnt;
    w->ref_cnt = cnt;
-   mem_usage_ += (cnt - ocnt) * sizeof(*ref);
+   MEM_ADD(mem_usage_, (cnt - ocnt) * sizeof(*ref));
    return cnt;
 }
 
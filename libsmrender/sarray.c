@@ -0,0 +1,491 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file sarray.c
+ * This file contains the sorted array object store. It is an alternative to
+ * the bx_node_t tree for the main object tree. The objects of each type are
+ * kept in an array of (id, pointer) pairs which is sorted by the id. Thus,
+ * lookups are done by a binary search and the memory is 16 bytes per object
+ * instead of at least one 128 byte leaf node of the bxtree.
+ *
+ * The ids are compared unsigned which results in the same order as the
+ * bxtree, thus traverse() visits the objects in the same order with both
+ * backends.
+ *
+ * Objects which are not appended to the end of the array (typically the
+ * objects created during rendering which get descending negative ids) are
+ * collected in a second array which is sorted descending. It is merged into
+ * the main array if it grows too large and no iteration is active.
+ *
+ * An array which is already sorted (e.g. part of a memory mapped snapshot)
+ * may be attached to a list with sa_attach(). It is used in place and it is
+ * copied to allocated memory not before it has to grow.
+ *
+ * The store is used through the same interface as the tree
+ * (put_object0(), get_object0(), traverse(), bx_free_tree()), thus a pointer to
+ * it is passed as bx_node_t*. sa_is_store() distinguishes both.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "smrender.h"
+#include "sarray.h"
+
+//! minimum number of elements of the pending list before it is merged
+#define SA_PEND_MIN 1024
+#define SA_ID(x) ((uint64_t) (x))
+
+#ifdef WITH_THREADS
+#define SA_RDLOCK(x) pthread_rwlock_rdlock(&(x)->lock)
+#define SA_WRLOCK(x) pthread_rwlock_wrlock(&(x)->lock)
+#define SA_UNLOCK(x) pthread_rwlock_unlock(&(x)->lock)
+#else
+#define SA_RDLOCK(x)
+#define SA_WRLOCK(x)
+#define SA_UNLOCK(x)
+#endif
+
+
+static const char sa_magic_[] = "SARRAY";
+
+
+/*! Create a new empty store.
+ * @param tree Pointer to tree pointer which receives the store. It must be
+ * empty, i.e. *tree must be NULL.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int sa_new_store(bx_node_t **tree)
+{
+   sa_store_t *sa;
+
+   if (*tree != NULL)
+   {
+      log_msg(LOG_ERR, "tree is not empty");
+      return -1;
+   }
+
+   if ((sa = calloc(1, sizeof(*sa))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return -1;
+   }
+
+   sa->magic = sa_magic_;
+#ifdef WITH_THREADS
+   pthread_rwlock_init(&sa->lock, NULL);
+#endif
+   *tree = (bx_node_t*) sa;
+   return 0;
+}
+
+
+/*! Test if the tree is a sorted array store.
+ * @return Returns 1 if it is a store, otherwise 0.
+ */
+int sa_is_store(const bx_node_t *tree)
+{
+   return tree != NULL && ((const sa_store_t*) tree)->magic == sa_magic_;
+}
+
+
+//! Free the store. The objects are not freed.
+void sa_free(bx_node_t *tree)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+
+   for (int i = 0; i < SA_NIDX; i++)
+   {
+      if (!sa->l[i].ext)
+         free(sa->l[i].ent);
+      free(sa->l[i].pend);
+   }
+#ifdef WITH_THREADS
+   pthread_rwlock_destroy(&sa->lock);
+#endif
+   free(sa);
+}
+
+
+/*! Return the position of the first element of the ascending array ent with
+ * an id greater or equal to id.
+ */
+static long sa_find_asc(const sa_ent_t *ent, long cnt, int64_t id)
+{
+   long lo = 0, hi = cnt, m;
+
+   while (lo < hi)
+   {
+      m = (lo + hi) / 2;
+      if (SA_ID(ent[m].id) < SA_ID(id))
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   return lo;
+}
+
+
+/*! Return the position of the first element of the descending array ent with
+ * an id less or equal to id.
+ */
+static long sa_find_desc(const sa_ent_t *ent, long cnt, int64_t id)
+{
+   long lo = 0, hi = cnt, m;
+
+   while (lo < hi)
+   {
+      m = (lo + hi) / 2;
+      if (SA_ID(ent[m].id) > SA_ID(id))
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   return lo;
+}
+
+
+/*! Make room for at least one more element in the array *ent. If ext is not
+ * NULL and *ext is set, *ent is external memory which is copied.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int sa_grow(sa_ent_t **ent, long cnt, long *size, int *ext)
+{
+   sa_ent_t *e;
+   long n;
+
+   if (cnt < *size)
+      return 0;
+
+   n = *size ? *size * 2 : 1024;
+   if (ext != NULL && *ext)
+   {
+      if ((e = malloc(sizeof(*e) * n)) == NULL)
+      {
+         log_errno(LOG_ERR, "malloc() failed");
+         return -1;
+      }
+      memcpy(e, *ent, sizeof(*e) * cnt);
+      *ext = 0;
+   }
+   else if ((e = realloc(*ent, sizeof(*e) * n)) == NULL)
+   {
+      log_errno(LOG_ERR, "realloc() failed");
+      return -1;
+   }
+   *ent = e;
+   *size = n;
+   return 0;
+}
+
+
+/*! Merge the pending elements into the main array. Elements which were
+ * removed (p == NULL) are dropped.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int sa_merge(sa_list_t *l)
+{
+   sa_ent_t *ent, *e;
+   long i, j, n;
+
+   if ((ent = malloc(sizeof(*ent) * (l->cnt + l->pcnt))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+
+   for (i = 0, j = l->pcnt - 1, n = 0; i < l->cnt || j >= 0;)
+   {
+      if (j < 0 || (i < l->cnt && SA_ID(l->ent[i].id) < SA_ID(l->pend[j].id)))
+         e = &l->ent[i++];
+      else
+         e = &l->pend[j--];
+
+      if (e->p != NULL)
+         ent[n++] = *e;
+   }
+
+   if (!l->ext)
+      free(l->ent);
+   l->ext = 0;
+   l->ent = ent;
+   l->size = l->cnt + l->pcnt;
+   l->cnt = n;
+   l->pcnt = 0;
+   return 0;
+}
+
+
+/*! Move all elements of the main array to the pending elements, thus the main
+ * array becomes empty.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int sa_move_pend(sa_list_t *l)
+{
+   sa_ent_t *pend;
+   long i, j, n;
+
+   if ((pend = malloc(sizeof(*pend) * (l->cnt + l->pcnt))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+
+   for (i = l->cnt - 1, j = 0, n = 0; i >= 0 || j < l->pcnt;)
+   {
+      if (j >= l->pcnt || (i >= 0 && SA_ID(l->ent[i].id) > SA_ID(l->pend[j].id)))
+         pend[n++] = l->ent[i--];
+      else
+         pend[n++] = l->pend[j++];
+   }
+
+   free(l->pend);
+   l->pend = pend;
+   l->pcnt = l->psize = n;
+   l->cnt = 0;
+   return 0;
+}
+
+
+//! Merge the pending elements if there are too many and no iteration is active.
+static void sa_check_merge(sa_store_t *sa, sa_list_t *l)
+{
+   if (!sa->trv && l->pcnt > SA_PEND_MIN + l->cnt / 1024)
+      (void) sa_merge(l);
+}
+
+
+/*! Put an object into the store. If p is NULL, the object is removed.
+ * @param tree Pointer to store.
+ * @param id Id of object.
+ * @param p Pointer to object.
+ * @param idx Index of list, i.e. IDX_NODE, IDX_WAY, or IDX_REL.
+ * @param old If not NULL it receives the previous pointer of this id or NULL
+ * if it did not exist.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int sa_put(bx_node_t *tree, int64_t id, void *p, int idx, void **old)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+   sa_list_t *l;
+   void *prev = NULL;
+   long i, j;
+   int e = 0;
+
+   if (idx < 0 || idx >= SA_NIDX)
+   {
+      log_msg(LOG_ERR, "index to object store out of range: %d", idx);
+      return -1;
+   }
+
+   SA_WRLOCK(sa);
+   l = &sa->l[idx];
+   if ((i = sa_find_asc(l->ent, l->cnt, id)) < l->cnt && l->ent[i].id == id)
+   {
+      prev = l->ent[i].p;
+      l->ent[i].p = p;
+   }
+   else if ((j = sa_find_desc(l->pend, l->pcnt, id)) < l->pcnt && l->pend[j].id == id)
+   {
+      prev = l->pend[j].p;
+      l->pend[j].p = p;
+   }
+   else if (i == l->cnt && p != NULL)
+   {
+      // id is greater than all others, this is the common case while loading
+      if (!(e = sa_grow(&l->ent, l->cnt, &l->size, &l->ext)))
+      {
+         l->ent[l->cnt].id = id;
+         l->ent[l->cnt].p = p;
+         l->cnt++;
+      }
+   }
+   else if (p != NULL)
+   {
+      i = j;
+      if (!(e = sa_grow(&l->pend, l->pcnt, &l->psize, NULL)))
+      {
+         memmove(&l->pend[i + 1], &l->pend[i], sizeof(*l->pend) * (l->pcnt - i));
+         l->pend[i].id = id;
+         l->pend[i].p = p;
+         l->pcnt++;
+         sa_check_merge(sa, l);
+      }
+   }
+   SA_UNLOCK(sa);
+
+   if (old != NULL)
+      *old = prev;
+   return e;
+}
+
+
+/*! Get an object from the store.
+ * @param tree Pointer to store.
+ * @param id Id of object.
+ * @param idx Index of list, i.e. IDX_NODE, IDX_WAY, or IDX_REL.
+ * @return Returns the pointer to the object or NULL if it does not exist.
+ */
+void *sa_get(bx_node_t *tree, int64_t id, int idx)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+   sa_list_t *l;
+   void *p = NULL;
+   long i;
+
+   if (idx < 0 || idx >= SA_NIDX)
+      return NULL;
+
+   SA_RDLOCK(sa);
+   l = &sa->l[idx];
+   if ((i = sa_find_asc(l->ent, l->cnt, id)) < l->cnt && l->ent[i].id == id)
+      p = l->ent[i].p;
+   else if ((i = sa_find_desc(l->pend, l->pcnt, id)) < l->pcnt && l->pend[i].id == id)
+      p = l->pend[i].p;
+   SA_UNLOCK(sa);
+
+   return p;
+}
+
+
+/*! Start an iteration over the objects of list idx. Merging of the lists is
+ * deferred until sa_iter_end() is called, thus objects may be added or
+ * removed during the iteration. Objects which are added behind the current
+ * position are visited, the same as with the bxtree.
+ */
+void sa_iter_init(bx_node_t *tree, int idx, sa_iter_t *it)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+
+   memset(it, 0, sizeof(*it));
+   it->idx = idx;
+   SA_WRLOCK(sa);
+   sa->trv++;
+   SA_UNLOCK(sa);
+}
+
+
+/*! Return the next object of an iteration in order of their ids.
+ * @return Returns a pointer to the object or NULL at the end of the list.
+ */
+void *sa_next(bx_node_t *tree, sa_iter_t *it)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+   sa_list_t *l;
+   sa_ent_t *e = NULL;
+   void *p = NULL;
+   long j;
+
+   if (it->idx < 0 || it->idx >= SA_NIDX)
+      return NULL;
+
+   SA_RDLOCK(sa);
+   l = &sa->l[it->idx];
+   while (it->i < l->cnt && l->ent[it->i].p == NULL)
+      it->i++;
+
+   // smallest pending element greater than the last one
+   j = it->started ? sa_find_desc(l->pend, l->pcnt, it->last) : l->pcnt;
+   for (j--; j >= 0 && l->pend[j].p == NULL; j--);
+
+   if (it->i < l->cnt && (j < 0 || SA_ID(l->ent[it->i].id) < SA_ID(l->pend[j].id)))
+      e = &l->ent[it->i++];
+   else if (j >= 0)
+      e = &l->pend[j];
+
+   if (e != NULL)
+   {
+      it->started = 1;
+      it->last = e->id;
+      p = e->p;
+   }
+   SA_UNLOCK(sa);
+
+   return p;
+}
+
+
+//! End an iteration.
+void sa_iter_end(bx_node_t *tree)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+
+   SA_WRLOCK(sa);
+   if (!--sa->trv)
+      for (int i = 0; i < SA_NIDX; i++)
+         sa_check_merge(sa, &sa->l[i]);
+   SA_UNLOCK(sa);
+}
+
+
+//! Return the number of bytes allocated by the store.
+size_t sa_sizeof(const bx_node_t *tree)
+{
+   const sa_store_t *sa = (const sa_store_t*) tree;
+   size_t s = sizeof(*sa);
+
+   for (int i = 0; i < SA_NIDX; i++)
+      s += ((sa->l[i].ext ? 0 : sa->l[i].size) + sa->l[i].psize) * sizeof(sa_ent_t);
+   return s;
+}
+
+
+/*! Attach the array ent to the list idx of the store. The array must be
+ * sorted ascending by the (unsigned) ids and it must stay valid as long as the
+ * store exists. It is not freed by the store. Elements which were put into
+ * the list before (e.g. objects created by rules) are kept as pending
+ * elements.
+ * @param tree Pointer to store.
+ * @param idx Index of list, i.e. IDX_NODE, IDX_WAY, or IDX_REL.
+ * @param ent Pointer to array.
+ * @param cnt Number of elements in ent.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int sa_attach(bx_node_t *tree, int idx, sa_ent_t *ent, long cnt)
+{
+   sa_store_t *sa = (sa_store_t*) tree;
+   sa_list_t *l;
+   int e = 0;
+
+   if (idx < 0 || idx >= SA_NIDX)
+   {
+      log_msg(LOG_ERR, "index to object store out of range: %d", idx);
+      return -1;
+   }
+
+   SA_WRLOCK(sa);
+   l = &sa->l[idx];
+   if (l->cnt && sa_move_pend(l))
+      e = -1;
+   else
+   {
+      if (!l->ext)
+         free(l->ent);
+      l->ent = ent;
+      l->cnt = l->size = cnt;
+      l->ext = 1;
+   }
+   SA_UNLOCK(sa);
+
+   return e;
+}
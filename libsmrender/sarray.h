@@ -0,0 +1,93 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file sarray.h
+ * This file contains the definitions of the sorted array object store.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifndef SARRAY_H
+#define SARRAY_H
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <stddef.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "bxtree.h"
+
+//! number of lists within a store (IDX_NODE, IDX_WAY, IDX_REL)
+#define SA_NIDX 3
+
+
+//! element of the sorted arrays
+typedef struct sa_ent
+{
+   int64_t id;
+   void *p;
+} sa_ent_t;
+
+typedef struct sa_list
+{
+   sa_ent_t *ent;          //!< array sorted ascending by (unsigned) id
+   long cnt;               //!< number of elements in ent
+   long size;              //!< number of elements allocated
+   sa_ent_t *pend;         //!< inserts which did not fit to the end of ent, sorted descending
+   long pcnt;              //!< number of elements in pend
+   long psize;             //!< number of elements allocated
+   int ext;                //!< 1 if ent is external memory (see sa_attach())
+} sa_list_t;
+
+typedef struct sa_store
+{
+   const void *magic;      //!< distinguishes the store from a bx_node_t
+   sa_list_t l[SA_NIDX];
+   int trv;                //!< number of active iterations, merging is deferred
+#ifdef WITH_THREADS
+   pthread_rwlock_t lock;
+#endif
+} sa_store_t;
+
+//! state of an iteration
+typedef struct sa_iter
+{
+   int idx;                //!< list to iterate
+   long i;                 //!< next position within ent
+   int started;            //!< 0 before the first element was returned
+   uint64_t last;          //!< id of the last element returned
+} sa_iter_t;
+
+
+int sa_new_store(bx_node_t **);
+int sa_is_store(const bx_node_t *);
+void sa_free(bx_node_t *);
+int sa_put(bx_node_t *, int64_t, void *, int, void **);
+void *sa_get(bx_node_t *, int64_t, int);
+void sa_iter_init(bx_node_t *, int, sa_iter_t *);
+void *sa_next(bx_node_t *, sa_iter_t *);
+void sa_iter_end(bx_node_t *);
+size_t sa_sizeof(const bx_node_t *);
+int sa_attach(bx_node_t *, int, sa_ent_t *, long);
+
+#endif
+
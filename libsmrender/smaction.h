@@ -52,6 +52,11 @@
 #define ACTION_OPEN_WAY (1 << 5)
 //! apply to closed ways only
 #define ACTION_CLOSED_WAY (1 << 6)
+//! main has no ordering dependency to adjacent rules, i.e. it may share an
+//! object traversal with them
+#define ACTION_UNORDERED (1 << 7)
+//! main and fini neither modify tags nor add or remove objects
+#define ACTION_TAGS_RO (1 << 8)
 
 #define TM_RESCALE 100
 #define T_RESCALE (60 * TM_RESCALE)
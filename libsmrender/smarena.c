@@ -0,0 +1,284 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smarena.c
+ * This file contains the arena allocator for the OSM objects and the table of
+ * static memory ranges.
+ *
+ * While the arena is enabled (typically during loading), malloc_node(),
+ * malloc_way(), and malloc_rel() allocate the object together with its tags
+ * and refs or members as a single block from large chunks of memory. Each
+ * thread allocates from its own chunk, thus no locking is necessary except if
+ * a new chunk is needed. Memory of the arena is never freed separately, all
+ * chunks are released at once by arena_free().
+ *
+ * The chunks are registered as static memory ranges. Static memory is never
+ * passed to free() or realloc() (see free_mem() and realloc_mem()), thus
+ * objects of the arena which grow later, e.g. by realloc_tags(), are copied
+ * to the heap.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "smrender.h"
+
+//! size of a memory chunk of the arena
+#define ARENA_CHUNK (16L * 1024 * 1024)
+//! larger allocations are not done from the arena
+#define ARENA_MAX (ARENA_CHUNK / 16)
+#define ARENA_ALIGN(x) (((x) + 7) & ~(size_t) 7)
+
+#ifdef WITH_THREADS
+#define SM_RDLOCK pthread_rwlock_rdlock(&static_lock_)
+#define SM_WRLOCK pthread_rwlock_wrlock(&static_lock_)
+#define SM_UNLOCK pthread_rwlock_unlock(&static_lock_)
+#else
+#define SM_RDLOCK
+#define SM_WRLOCK
+#define SM_UNLOCK
+#endif
+
+
+//! range of static memory
+typedef struct static_mem
+{
+   const char *lo, *hi;
+   //! 1 if the range is a chunk of the arena
+   int arena;
+} static_mem_t;
+
+
+//! list of static memory ranges, sorted by address
+static static_mem_t *static_ = NULL;
+static int static_cnt_ = 0, static_size_ = 0;
+#ifdef WITH_THREADS
+static pthread_rwlock_t static_lock_ = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+//! incremented if ranges are removed to invalidate the caches of all threads
+static int static_gen_ = 0;
+//! last range found by is_static_mem() in this thread
+static __thread const char *cache_lo_ = NULL, *cache_hi_ = NULL;
+static __thread int cache_gen_ = 0;
+//! 1 if the arena is enabled
+static int arena_on_ = 0;
+//! current chunk of this thread
+static __thread char *arena_ptr_ = NULL;
+static __thread size_t arena_left_ = 0;
+static __thread int arena_gen_ = 0;
+
+
+//! Return the position of the first range which ends behind p.
+static int static_find(const void *p)
+{
+   int lo = 0, hi = static_cnt_, m;
+
+   while (lo < hi)
+   {
+      m = (lo + hi) / 2;
+      if (static_[m].hi <= (const char*) p)
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   return lo;
+}
+
+
+//! Add a range. p is passed as integer since the memory is not accessed.
+static int static_add(uintptr_t p, size_t len, int arena)
+{
+   static_mem_t *sm;
+   int i;
+
+   SM_WRLOCK;
+   if (static_cnt_ >= static_size_)
+   {
+      if ((sm = realloc(static_, sizeof(*sm) * (static_size_ ? static_size_ * 2 : 64))) == NULL)
+      {
+         SM_UNLOCK;
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      static_ = sm;
+      static_size_ = static_size_ ? static_size_ * 2 : 64;
+   }
+
+   i = static_find((void*) p);
+   memmove(&static_[i + 1], &static_[i], sizeof(*static_) * (static_cnt_ - i));
+   static_[i].lo = (const char*) p;
+   static_[i].hi = (const char*) p + len;
+   static_[i].arena = arena;
+   static_cnt_++;
+   SM_UNLOCK;
+
+   return 0;
+}
+
+
+/*! Register the memory range of len bytes at p as static memory. Objects or
+ * parts of objects within this range are never passed to free() or
+ * realloc(). This is used e.g. for objects which are part of a memory mapped
+ * snapshot.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int add_static_mem(const void *p, size_t len)
+{
+   return static_add((uintptr_t) p, len, 0);
+}
+
+
+//! Unregister the static memory range which starts at p.
+void del_static_mem(const void *p)
+{
+   int i;
+
+   SM_WRLOCK;
+   if ((i = static_find(p)) < static_cnt_ && static_[i].lo == p)
+   {
+      memmove(&static_[i], &static_[i + 1], sizeof(*static_) * (static_cnt_ - i - 1));
+      static_cnt_--;
+      static_gen_++;
+   }
+   SM_UNLOCK;
+}
+
+
+//! Return 1 if p points into a static memory range, otherwise 0.
+int is_static_mem(const void *p)
+{
+   int i, r;
+
+   // quick checks without lock, these are the common cases
+   if (!static_cnt_)
+      return 0;
+   if (cache_gen_ == static_gen_ && (const char*) p >= cache_lo_ && (const char*) p < cache_hi_)
+      return 1;
+
+   SM_RDLOCK;
+   i = static_find(p);
+   if ((r = i < static_cnt_ && static_[i].lo <= (const char*) p))
+   {
+      cache_lo_ = static_[i].lo;
+      cache_hi_ = static_[i].hi;
+      cache_gen_ = static_gen_;
+   }
+   SM_UNLOCK;
+
+   return r;
+}
+
+
+/*! Enable or disable allocation of objects from the arena.
+ * @param on 1 to enable, 0 to disable.
+ */
+void arena_enable(int on)
+{
+   arena_on_ = on;
+}
+
+
+/*! Allocate len bytes of memory from the arena. The memory is 8 byte aligned
+ * and it is not initialized.
+ * @return Returns a pointer to the memory or NULL if the arena is disabled,
+ * len is too large, or the system is out of memory. In the latter cases the
+ * caller shall fall back to malloc().
+ */
+void *arena_alloc(size_t len)
+{
+   char *c;
+   void *p;
+
+   if (!arena_on_ || (len = ARENA_ALIGN(len)) > ARENA_MAX)
+      return NULL;
+
+   // chunk was released by arena_free()
+   if (arena_gen_ != static_gen_)
+   {
+      arena_gen_ = static_gen_;
+      arena_left_ = 0;
+   }
+
+   if (len > arena_left_)
+   {
+      if ((c = malloc(ARENA_CHUNK)) == NULL)
+      {
+         log_errno(LOG_WARN, "malloc() failed");
+         return NULL;
+      }
+      if (static_add((uintptr_t) c, ARENA_CHUNK, 1))
+      {
+         free(c);
+         return NULL;
+      }
+      arena_ptr_ = c;
+      arena_left_ = ARENA_CHUNK;
+   }
+
+   p = arena_ptr_;
+   arena_ptr_ += len;
+   arena_left_ -= len;
+   return p;
+}
+
+
+//! Return the number of bytes allocated for the arena.
+size_t arena_size(void)
+{
+   size_t s = 0;
+
+   SM_RDLOCK;
+   for (int i = 0; i < static_cnt_; i++)
+      if (static_[i].arena)
+         s += static_[i].hi - static_[i].lo;
+   SM_UNLOCK;
+
+   return s;
+}
+
+
+/*! Release all memory of the arena. All objects of the arena become invalid.
+ * The arena is disabled.
+ */
+void arena_free(void)
+{
+   int i, j;
+
+   arena_on_ = 0;
+   SM_WRLOCK;
+   for (i = 0, j = 0; i < static_cnt_; i++)
+   {
+      if (static_[i].arena)
+         free((void*) static_[i].lo);
+      else
+         static_[j++] = static_[i];
+   }
+   static_cnt_ = j;
+   static_gen_++;
+   SM_UNLOCK;
+}
@@ -0,0 +1,248 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smintern.c
+ * This file contains the string interning of tag keys and values. Each
+ * distinct string is assigned to an integer atom. The bstrings of all tags
+ * with equal content are set to the same buffer (the first occurrence within
+ * the input data), thus the strings stay in place and the index file is not
+ * affected.
+ *
+ * A bstring is interned if its atom is valid and its buffer and length are
+ * exactly the ones of the atom. This is checked by bs_atom(). Thus, tags
+ * which are modified later or created by rules are never taken for interned
+ * strings and they are compared byte by byte. Two interned strings are equal
+ * if and only if their atoms are equal.
+ *
+ * The table is only populated during loading, it is read-only afterwards.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "smrender.h"
+#include "bstring.h"
+
+
+//! list of interned strings, index is the atom, atom 0 is unused
+static bstring_t *atom_ = NULL;
+//! number of atoms in use (including atom 0) and number allocated
+static int atom_cnt_, atom_size_;
+//! hash table of atoms, size is a power of 2
+static int *slot_ = NULL;
+static int slot_size_;
+
+
+/*! Return the atom of the interned bstring b.
+ * @param b Pointer to bstring.
+ * @return Returns the atom (> 0) or 0 if b is not interned.
+ */
+int bs_atom(const bstring_t *b)
+{
+   if (b->atom <= 0 || b->atom >= atom_cnt_)
+      return 0;
+   if (atom_[b->atom].buf != b->buf || atom_[b->atom].len != b->len)
+      return 0;
+   return b->atom;
+}
+
+
+/*! Find the slot of the hash table which contains the atom of b or the empty
+ * slot where it would have to be inserted.
+ */
+static int *intern_slot(const bstring_t *b)
+{
+   unsigned i;
+
+   for (i = bs_hash(*b, BS_HASH_INIT) & (slot_size_ - 1); slot_[i]; i = (i + 1) & (slot_size_ - 1))
+      if (atom_[slot_[i]].len == b->len && !memcmp(atom_[slot_[i]].buf, b->buf, b->len))
+         break;
+   return &slot_[i];
+}
+
+
+/*! Double the size of the hash table and rehash all atoms.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int intern_grow(void)
+{
+   int *old = slot_, size = slot_size_;
+
+   slot_size_ = slot_size_ ? slot_size_ * 2 : 1024;
+   if ((slot_ = calloc(slot_size_, sizeof(*slot_))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      slot_ = old;
+      slot_size_ = size;
+      return -1;
+   }
+
+   for (int i = 0; i < size; i++)
+      if (old[i])
+         *intern_slot(&atom_[old[i]]) = old[i];
+
+   free(old);
+   return 0;
+}
+
+
+/*! Intern the bstring b. If a string with the same content was interned
+ * before, b is set to this string, otherwise b becomes a new atom.
+ * @param b Pointer to bstring.
+ * @return Returns the atom (> 0) or -1 in case of error.
+ */
+int bs_intern(bstring_t *b)
+{
+   bstring_t *a;
+   int *slot;
+
+   if (b->buf == NULL)
+      return b->atom = 0;
+
+   // keep load factor below 0.5
+   if (atom_cnt_ * 2 >= slot_size_ && intern_grow() == -1)
+      return -1;
+
+   if (*(slot = intern_slot(b)))
+   {
+      b->buf = atom_[*slot].buf;
+      return b->atom = *slot;
+   }
+
+   if (atom_cnt_ >= atom_size_)
+   {
+      if ((a = realloc(atom_, sizeof(*atom_) * (atom_size_ ? atom_size_ * 2 : 1024))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      atom_ = a;
+      atom_size_ = atom_size_ ? atom_size_ * 2 : 1024;
+      // atom 0 is not used
+      if (!atom_cnt_)
+         memset(&atom_[atom_cnt_++], 0, sizeof(*atom_));
+   }
+
+   b->atom = *slot = atom_cnt_;
+   atom_[atom_cnt_++] = *b;
+   return b->atom;
+}
+
+
+/*! Look up the bstring b in the table of interned strings without adding it.
+ * If it exists, b is set to the interned string.
+ * @param b Pointer to bstring.
+ * @return Returns the atom or 0 if there is no such string.
+ */
+int bs_intern_lookup(bstring_t *b)
+{
+   int *slot;
+
+   if (slot_ == NULL || b->buf == NULL || !*(slot = intern_slot(b)))
+      return b->atom = 0;
+
+   b->buf = atom_[*slot].buf;
+   return b->atom = *slot;
+}
+
+
+/*! Intern the keys and values of all tags of object o. This function may be
+ * used as tree function.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int intern_tags(osm_obj_t *o, void *UNUSED(p))
+{
+   for (int i = 0; i < o->tag_cnt; i++)
+      if (bs_intern(&o->otag[i].k) == -1 || bs_intern(&o->otag[i].v) == -1)
+         return -1;
+   return 0;
+}
+
+
+/*! Return the table of interned strings. The index is the atom, atom 0 is
+ * unused.
+ * @param cnt Pointer to integer which receives the number of elements in the
+ * table (including atom 0).
+ * @return Returns a pointer to the table. It may be NULL if cnt is 0.
+ */
+const bstring_t *intern_table(int *cnt)
+{
+   *cnt = atom_cnt_;
+   return atom_;
+}
+
+
+/*! Initialize the (empty) table of interned strings with the strings of the
+ * table tbl, e.g. from a snapshot, without touching the tags. The index into
+ * tbl is the atom, atom 0 is unused. The strings are not copied.
+ * @param tbl Pointer to table.
+ * @param cnt Number of elements in tbl (including atom 0).
+ * @return On success 0 is returned, otherwise -1.
+ */
+int intern_load(const bstring_t *tbl, int cnt)
+{
+   if (atom_cnt_)
+   {
+      log_msg(LOG_ERR, "string table is not empty");
+      return -1;
+   }
+   if (cnt < 1)
+      return 0;
+
+   for (slot_size_ = 1024; slot_size_ <= cnt * 2; slot_size_ *= 2);
+   if ((atom_ = malloc(sizeof(*atom_) * cnt)) == NULL || (slot_ = calloc(slot_size_, sizeof(*slot_))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      intern_free();
+      return -1;
+   }
+
+   memcpy(atom_, tbl, sizeof(*atom_) * cnt);
+   memset(&atom_[0], 0, sizeof(*atom_));
+   atom_cnt_ = atom_size_ = cnt;
+   for (int i = 1; i < cnt; i++)
+   {
+      atom_[i].atom = i;
+      *intern_slot(&atom_[i]) = i;
+   }
+   return 0;
+}
+
+
+//! Return the number of atoms.
+int intern_cnt(void)
+{
+   return atom_cnt_ ? atom_cnt_ - 1 : 0;
+}
+
+
+//! Free the table of interned strings. The strings themselves are not freed.
+void intern_free(void)
+{
+   free(atom_);
+   free(slot_);
+   atom_ = NULL;
+   slot_ = NULL;
+   atom_cnt_ = atom_size_ = slot_size_ = 0;
+}
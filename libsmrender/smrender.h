@@ -109,6 +109,25 @@ int realloc_tags(osm_obj_t *, int );
 int realloc_refs(osm_way_t *, int );
 const char *safe_null_str(const char *);
 
+/* smarena.c */
+int add_static_mem(const void *, size_t );
+void del_static_mem(const void *);
+int is_static_mem(const void *);
+void arena_enable(int );
+void *arena_alloc(size_t );
+size_t arena_size(void);
+void arena_free(void);
+
+/* smintern.c */
+int bs_atom(const bstring_t *);
+int bs_intern(bstring_t *);
+int bs_intern_lookup(bstring_t *);
+int intern_tags(osm_obj_t *, void *);
+int intern_cnt(void);
+const bstring_t *intern_table(int *);
+int intern_load(const bstring_t *, int );
+void intern_free(void);
+
 /* smlog.c */
 int log_msg(int, const char*, ...) __attribute__((format (printf, 2, 3)));
 int log_errno(int , const char *);
@@ -117,6 +136,8 @@ void clear_log_flags(int);
 
 /* smthread.c */
 void sm_threaded(smrule_t*);
+void sm_unordered(smrule_t*);
+void sm_tags_ro(smrule_t*);
 int sm_thread_id(void);
 int sm_is_exec_once(const smrule_t *);
 int sm_is_exec(const smrule_t *);
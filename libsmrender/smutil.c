@@ -50,6 +50,7 @@
 
 #include "smrender.h"
 #include "bxtree.h"
+#include "sarray.h"
 #include "smaction.h"
 
 
@@ -138,6 +139,7 @@ void set_unique_way_id(int64_t id)
 int put_object0_ctrl(bx_node_t **tree, int64_t id, void *p, int idx, void **ctrl)
 {
    bx_node_t *bn;
+   void *old;
 
    if ((idx < 0) || (idx >= (1 << BX_RES)))
    {
@@ -145,6 +147,24 @@ int put_object0_ctrl(bx_node_t **tree, int64_t id, void *p, int idx, void **ctrl
       return -1;
    }
 
+   if (sa_is_store(*tree))
+   {
+      // the previous entry is not overwritten if requested by ctrl
+      if (ctrl != NULL && *ctrl != NULL && p != NULL && (old = sa_get(*tree, id, idx)) != NULL)
+      {
+         log_msg(LOG_WARN, "object store (id = %"PRId64", idx = %d) contains valid pointer, not overwriting.", id, idx);
+         *ctrl = old;
+         return -1;
+      }
+      if (sa_put(*tree, id, p, idx, &old))
+         return -1;
+      if (old != NULL && p != NULL && tree == &obj_tree_)
+         log_msg(LOG_WARN, "object store (id = %"PRId64", idx = %d) contains valid pointer, overwriting.", id, idx);
+      if (ctrl != NULL)
+         *ctrl = old;
+      return 0;
+   }
+
    if ((bn = bx_add_node(tree, id)) == NULL)
    {
       log_msg(LOG_ERR, "bx_add_node() failed in put_object0()");
@@ -211,6 +231,9 @@ void *get_object0(bx_node_t *tree, int64_t id, int idx)
       return NULL;
    }
 
+   if (sa_is_store(tree))
+      return sa_get(tree, id, idx);
+
    if ((bn = bx_get_node(tree, id)) == NULL)
    {
       //log_msg(LOG_ERR, "bx_get_node() failed");
@@ -281,7 +304,7 @@ int bs_cmp2(const bstring_t *s1, const bstring_t *s2)
  */
 int bs_match(const bstring_t *dst, const bstring_t *pat, const struct specialTag *st)
 {
-   int r = 1;
+   int r = 1, a, b;
    char buf[dst->len + 1];
    double val;
 
@@ -290,7 +313,11 @@ int bs_match(const bstring_t *dst, const bstring_t *pat, const struct specialTag
 
    if ((st->type & SPECIAL_MASK) == SPECIAL_DIRECT)
    {
-      r = bs_cmp2(dst, pat);
+      // interned strings are equal if and only if their atoms are equal
+      if ((b = bs_atom(pat)) && (a = bs_atom(dst)))
+         r = a != b;
+      else
+         r = bs_cmp2(dst, pat);
    }
    else if ((st->type & SPECIAL_MASK) == SPECIAL_REGEX)
    {
@@ -637,6 +664,30 @@ void sm_threaded(smrule_t *r)
 }
 
 
+/*! Mark rule as having no ordering dependency to adjacent rules. This is that
+ * its main function only modifies the object it is called with (or its own
+ * private data) and it does not create new objects. Such rules may be applied
+ * together with adjacent rules within a single traversal of the object tree.
+ */
+void sm_unordered(smrule_t *r)
+{
+   log_debug("rule 0x%016lx has no ordering dependency", r->oo->id);
+   r->act->flags |= ACTION_UNORDERED;
+}
+
+
+/*! Mark rule as not modifying the object database. This is that neither its
+ * main nor its fini function changes tags of objects or adds or removes
+ * objects, and it does not move nodes. Such rules keep the tag index and the
+ * spatial index valid (see smtagidx.c and smspidx.c).
+ */
+void sm_tags_ro(smrule_t *r)
+{
+   log_debug("rule 0x%016lx does not modify tags", r->oo->id);
+   r->act->flags |= ACTION_TAGS_RO;
+}
+
+
 void sm_set_exec_once(smrule_t *r)
 {
    log_debug("set rule to execute only once");
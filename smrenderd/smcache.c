@@ -15,10 +15,28 @@
  * along with Smrender. If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*! \file smcache.c
+ * This file contains the query cache of smrenderd. Each entry keeps the result
+ * tree of a bbox query. The cache is limited by a memory budget (see
+ * qc_set_budget()). If it is exceeded, unused entries are evicted. The victim
+ * is the entry with the largest product of the time since its last use and its
+ * size, i.e. old and large entries are evicted first.
+ *
+ * A lookup returns an exact match or, if there is none, the smallest entry
+ * whose bbox contains the requested one. The caller may filter the result of
+ * the latter to create a new entry. Since only the caller knows if an entry
+ * finally served the request, it counts hits and misses with qc_count().
+ *
+ * Additionally, an entry keeps the encoded (compressed) responses of the query
+ * which are accounted to the memory budget as well. An entry may consist of
+ * responses only, i.e. without result tree.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #ifdef WITH_THREADS
@@ -29,101 +47,362 @@
 #include "smcache.h"
 
 
-static struct qcache qc_[MAX_CACHE];
+//! LRU list of cache entries, most recently used first
+static qcache_t *head_ = NULL, *tail_ = NULL;
+//! logical clock, incremented on each use of an entry
+static unsigned long tick_ = 0;
+static qc_stats_t stats_ = {0, 0, 0, 0, 0, 0, QC_BUDGET};
 #ifdef WITH_THREADS
 static pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
 #endif
 
 
+static void qc_unlink(qcache_t *qc)
+{
+   if (qc->prev != NULL)
+      qc->prev->next = qc->next;
+   else
+      head_ = qc->next;
+   if (qc->next != NULL)
+      qc->next->prev = qc->prev;
+   else
+      tail_ = qc->prev;
+   qc->prev = qc->next = NULL;
+}
+
+
+static void qc_push(qcache_t *qc)
+{
+   qc->prev = NULL;
+   qc->next = head_;
+   if (head_ != NULL)
+      head_->prev = qc;
+   else
+      tail_ = qc;
+   head_ = qc;
+}
+
+
+//! Mark entry as used and move it to the head of the LRU list.
+static void qc_use(qcache_t *qc)
+{
+   qc->age = time(NULL);
+   qc->tick = ++tick_;
+   qc->ctr++;
+   qc_unlink(qc);
+   qc_push(qc);
+}
+
+
+//! Test if bbox a contains bbox b.
+static int bbi_contains(const struct bboxi *a, const struct bboxi *b)
+{
+   return a->coord[0] <= b->coord[0] && a->coord[1] <= b->coord[1] &&
+      a->coord[2] >= b->coord[2] && a->coord[3] >= b->coord[3];
+}
+
+
+static double bbi_area(const struct bboxi *bb)
+{
+   return (double) (bb->coord[2] - bb->coord[0]) * (bb->coord[3] - bb->coord[1]);
+}
+
+
+/*! Find a cache entry for the bbox bb. If there is no exact match, the
+ * smallest entry whose bbox contains bb is returned. The caller has to compare
+ * the bbox of the entry to tell the difference. The entry has to be released
+ * with qc_release().
+ * @param bb Pointer to bbox.
+ * @return Returns a pointer to the cache entry or NULL if there is none.
+ */
 qcache_t *qc_lookup(const struct bboxi *bb)
 {
-   qcache_t *qc = NULL;
+   qcache_t *qc, *sub = NULL;
 
    qc_lock(&mutex_);
-   for (int i = 0; i < MAX_CACHE; i++)
+   for (qc = head_; qc != NULL; qc = qc->next)
    {
-      if (qc_[i].age && !memcmp(&qc_[i].bb, bb, sizeof(*bb)))
-      {
-         log_debug("cache hit");
-         qc_[i].age = time(NULL);
-         qc_[i].ctr++;
-         qc = &qc_[i];
+      if (!memcmp(&qc->bb, bb, sizeof(*bb)))
          break;
-      }
+      if (qc->tree != NULL && bbi_contains(&qc->bb, bb) && (sub == NULL || bbi_area(&qc->bb) < bbi_area(&sub->bb)))
+         sub = qc;
    }
+
+   if (qc == NULL)
+      qc = sub;
+   if (qc != NULL)
+      qc_use(qc);
    qc_unlock(&mutex_);
    return qc;
 }
 
 
+/*! Remove unused entries from the cache until it fits into the memory budget.
+ * This function must be called while holding the lock.
+ * @return Returns a list (linked by the member next) of removed entries. They
+ * have to be freed by the caller after releasing the lock.
+ */
+static qcache_t *qc_evict(void)
+{
+   qcache_t *qc, *victim, *list = NULL;
+   double score, max;
+
+   while (stats_.size > stats_.budget)
+   {
+      victim = NULL;
+      max = -1;
+      for (qc = tail_; qc != NULL; qc = qc->prev)
+      {
+         if (qc->ctr)
+            continue;
+         score = (double) (tick_ - qc->tick + 1) * qc->size;
+         if (score > max)
+         {
+            max = score;
+            victim = qc;
+         }
+      }
+
+      // all entries are in use, the budget may temporarily be exceeded
+      if (victim == NULL)
+         break;
+
+      log_debug("evicting cache entry of %ld kb", (long) victim->size / 1024);
+      qc_unlink(victim);
+      stats_.size -= victim->size;
+      stats_.entries--;
+      stats_.evictions++;
+      victim->next = list;
+      list = victim;
+   }
+
+   return list;
+}
+
+
+static void qc_free_list(qcache_t *list)
+{
+   qcache_t *qc;
+
+   while ((qc = list) != NULL)
+   {
+      list = qc->next;
+      bx_free_tree(qc->tree);
+      for (int i = 0; i < QC_NENC; i++)
+         free(qc->data[i].buf);
+      free(qc);
+   }
+}
+
+
 void qc_release(qcache_t *qc)
 {
+   qcache_t *list = NULL;
+
    qc_lock(&mutex_);
    qc->age = time(NULL);
    qc->ctr--;
    if (!qc->ctr)
+      list = qc_evict();
+   qc_unlock(&mutex_);
+
+   qc_free_list(list);
+}
+
+
+/*! Add the result tree of the query bb to the cache. The cache takes over the
+ * ownership of the tree. If an entry with the same bbox but without tree
+ * exists, the tree is added to it. If an entry with the same bbox and a tree
+ * was added in the meantime, the tree is freed and the existing entry is
+ * returned.
+ * @param bb Pointer to bbox of the query.
+ * @param tree Pointer to result tree.
+ * @return Returns a pointer to the cache entry which has to be released with
+ * qc_release(), or NULL in case of error. In the latter case the tree is not
+ * freed.
+ */
+qcache_t *qc_put(const struct bboxi *bb, bx_node_t *tree)
+{
+   qcache_t *qc, *nc, *list = NULL;
+
+   if ((nc = calloc(1, sizeof(*nc))) == NULL)
    {
-      qc_signal(&cond_);
+      log_errno(LOG_ERR, "calloc() failed");
+      return NULL;
    }
+   nc->bb = *bb;
+   nc->tree = tree;
+   nc->size = sizeof(*nc) + bx_tree_sizeof(tree);
+   log_debug("cache entry uses %ld kb", (long) nc->size / 1024);
+
+   qc_lock(&mutex_);
+   for (qc = head_; qc != NULL; qc = qc->next)
+      if (!memcmp(&qc->bb, bb, sizeof(*bb)))
+         break;
+
+   if (qc != NULL && qc->tree == NULL)
+   {
+      log_debug("adding tree to entry");
+      qc->tree = tree;
+      qc->size += nc->size - sizeof(*nc);
+      stats_.size += nc->size - sizeof(*nc);
+      free(nc);
+      nc = qc;
+   }
+   else if (qc != NULL)
+   {
+      log_debug("entry was added meanwhile");
+      list = nc;
+   }
+   else
+   {
+      qc = nc;
+      qc_push(qc);
+      stats_.size += qc->size;
+      stats_.entries++;
+   }
+   qc_use(qc);
+   if (qc == nc)
+      list = qc_evict();
    qc_unlock(&mutex_);
+
+   qc_free_list(list);
+   return qc;
 }
 
 
-static int qc_oldest(void)
+/*! Add the encoded response of the query bb to the cache. If there is no
+ * entry for bb, a new entry without result tree is created. The cache takes
+ * over the ownership of buf. If the entry contains a response of this encoding
+ * already, buf is freed.
+ * @param bb Pointer to bbox of the query.
+ * @param enc Content encoding.
+ * @param buf Pointer to response data allocated with malloc().
+ * @param len Length of response data.
+ * @return Returns 0 on success, or -1 in case of error. In the latter case buf
+ * is freed.
+ */
+int qc_put_data(const struct bboxi *bb, int enc, char *buf, size_t len)
 {
-   time_t t = time(NULL);
-   int n = -1;
+   qcache_t *qc, *nc, *list = NULL;
 
-   for (int i = 0; i < MAX_CACHE; i++)
-      if (!qc_[i].ctr && qc_[i].age < t)
-      {
-         t = qc_[i].age;
-         n = i;
-      }
+   if ((nc = calloc(1, sizeof(*nc))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      free(buf);
+      return -1;
+   }
+   nc->bb = *bb;
+   nc->size = sizeof(*nc);
+
+   qc_lock(&mutex_);
+   for (qc = head_; qc != NULL; qc = qc->next)
+      if (!memcmp(&qc->bb, bb, sizeof(*bb)))
+         break;
+
+   if (qc == NULL)
+   {
+      qc = nc;
+      nc = NULL;
+      qc_push(qc);
+      qc->tick = ++tick_;
+      qc->age = time(NULL);
+      stats_.size += qc->size;
+      stats_.entries++;
+   }
+
+   if (qc->data[enc].buf == NULL)
+   {
+      log_debug("adding response of %ld kb to cache", (long) len / 1024);
+      qc->data[enc].buf = buf;
+      qc->data[enc].len = len;
+      qc->size += len;
+      stats_.size += len;
+      buf = NULL;
+      list = qc_evict();
+   }
+   qc_unlock(&mutex_);
 
-   return n;
+   qc_free_list(list);
+   free(nc);
+   free(buf);
+   return 0;
 }
 
 
-void qc_cleanup(void)
+//! Return the result tree of an entry, or NULL if it contains responses only.
+bx_node_t *qc_tree(qcache_t *qc)
 {
    bx_node_t *tree;
-   int n;
 
    qc_lock(&mutex_);
-   while ((n = qc_oldest()) == -1)
-   {
-      log_debug("all caches are in use, waiting...");
-      qc_wait(&cond_, &mutex_);
-   }
-   tree = qc_[n].tree;
-   qc_[n].age = 0;
+   tree = qc->tree;
    qc_unlock(&mutex_);
+   return tree;
+}
+
+
+/*! Return the encoded response of an entry.
+ * @param qc Pointer to cache entry.
+ * @param enc Content encoding.
+ * @param len Pointer to variable which receives the length of the response.
+ * @return Returns a pointer to the response which is valid until the entry is
+ * released, or NULL if there is no response of this encoding.
+ */
+const char *qc_data(qcache_t *qc, int enc, size_t *len)
+{
+   const char *buf;
 
-   bx_free_tree(tree);
+   qc_lock(&mutex_);
+   buf = qc->data[enc].buf;
+   *len = qc->data[enc].len;
+   qc_unlock(&mutex_);
+   return buf;
 }
 
 
-qcache_t *qc_put(const struct bboxi *bb, bx_node_t *tree)
+//! Set the memory budget of the cache in bytes.
+void qc_set_budget(size_t budget)
 {
-   qcache_t *qc = NULL;
+   qcache_t *list;
 
    qc_lock(&mutex_);
-   for (int i = 0; i < MAX_CACHE; i++)
+   stats_.budget = budget;
+   list = qc_evict();
+   qc_unlock(&mutex_);
+
+   qc_free_list(list);
+}
+
+
+/*! Count a request by the way it was served.
+ * @param kind QC_HIT, QC_SUB_HIT, or QC_MISS.
+ */
+void qc_count(int kind)
+{
+   qc_lock(&mutex_);
+   switch (kind)
    {
-      if (!qc_[i].age)
-      {
-         qc_[i].bb = *bb;
-         qc_[i].tree = tree;
-         qc_[i].age = time(NULL);
-         qc_[i].ctr = 1;
-         qc = &qc_[i];
+      case QC_HIT:
+         log_debug("cache hit");
+         stats_.hits++;
          break;
-      }
+      case QC_SUB_HIT:
+         log_debug("cache hit by containing bbox");
+         stats_.sub_hits++;
+         break;
+      default:
+         stats_.misses++;
    }
    qc_unlock(&mutex_);
+}
 
-   return qc;
+
+//! Retrieve a copy of the cache counters.
+void qc_stats(qc_stats_t *st)
+{
+   qc_lock(&mutex_);
+   *st = stats_;
+   qc_unlock(&mutex_);
 }
 
@@ -30,7 +30,15 @@
 #include "bxtree.h"
 
 
-#define MAX_CACHE 3
+//! default memory budget of the query cache in bytes
+#define QC_BUDGET (256L * 1024 * 1024)
+//! number of content encodings of responses, see HTTP_ENC_xxx
+#define QC_NENC 3
+
+//! kinds of requests counted by qc_count()
+#define QC_MISS 0
+#define QC_HIT 1
+#define QC_SUB_HIT 2
 
 
 struct bboxi
@@ -38,33 +46,57 @@ struct bboxi
    int coord[4];
 };
 
+//! encoded response
+typedef struct qc_data
+{
+   char *buf;
+   size_t len;
+} qc_data_t;
+
 //! query cache structure
 typedef struct qcache
 {
    struct bboxi bb;  //!< bounding box of query
-   bx_node_t *tree;  //!< root element of tree
-   time_t age;       //!< age of cache entry, 0 means cache free
+   bx_node_t *tree;  //!< root element of tree, may be NULL if only responses are cached
+   qc_data_t data[QC_NENC];   //!< encoded responses, indexed by content encoding
+   size_t size;      //!< memory used by the tree in bytes
+   time_t age;       //!< time of last use
+   unsigned long tick;  //!< logical time of last use
    int ctr;          //!< usage counter, 0 means unused
+   struct qcache *prev, *next;  //!< LRU list, most recently used first
 } qcache_t;
 
+//! counters of the query cache
+typedef struct qc_stats
+{
+   unsigned long hits;     //!< requests served by an exact match
+   unsigned long sub_hits; //!< requests served by a containing bbox
+   unsigned long misses;   //!< requests which had to query the database
+   unsigned long evictions;   //!< number of evicted entries
+   int entries;      //!< current number of entries
+   size_t size;      //!< current memory used by all entries
+   size_t budget;    //!< memory budget
+} qc_stats_t;
+
 
 #ifdef WITH_THREADS
 #define qc_lock(x) pthread_mutex_lock(x)
 #define qc_unlock(x) pthread_mutex_unlock(x)
-#define qc_wait(x, y) pthread_cond_wait(x, y)
-#define qc_signal(x) pthread_cond_signal(x)
 #else
 #define qc_lock(x)
 #define qc_unlock(x)
-#define qc_wait(x, y)
-#define qc_signal(x)
 #endif
 
 
 qcache_t *qc_lookup(const struct bboxi *);
 void qc_release(qcache_t *);
-void qc_cleanup(void);
 qcache_t *qc_put(const struct bboxi *, bx_node_t *);
+int qc_put_data(const struct bboxi *, int, char *, size_t);
+bx_node_t *qc_tree(qcache_t *);
+const char *qc_data(qcache_t *, int, size_t *);
+void qc_set_budget(size_t);
+void qc_stats(qc_stats_t *);
+void qc_count(int);
 
 #endif
 
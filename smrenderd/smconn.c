@@ -0,0 +1,896 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smconn.c
+ * This file contains the connection handling of smrenderd. An event loop
+ * based on epoll(7) accepts new connections and receives the request lines
+ * and headers of all connections concurrently on non-blocking sockets. As
+ * soon as a request is complete the connection is removed from the event loop
+ * and queued to the compute pool. A thread of the pool processes the request
+ * (see http_handle()). Further requests which were pipelined by the client
+ * are processed subsequently by the same thread. Afterwards, persistent
+ * connections are returned to the event loop through a queue and an eventfd,
+ * all others are closed.
+ *
+ * The sockets stay non-blocking while a request is processed. The response is
+ * sent with conn_send() which buffers all data that the socket does not
+ * accept immediately. Connections with pending output are returned to the
+ * event loop which sends the rest as soon as the socket is writable (EPOLLOUT).
+ * Thus, idle or slowly reading clients do not occupy a thread. Up to
+ * HTTP_OBUF_MAX bytes of pending output are kept in memory, further output is
+ * appended to an unlinked temporary file which is sent with sendfile(2).
+ * Connections which do not make progress are closed after HTTP_TIMEOUT
+ * seconds by the event loop.
+ *
+ * Without threads (WITH_THREADS not defined) the requests are processed
+ * directly within the event loop.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+// accept4()
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "smrender.h"
+#include "smhttp.h"
+
+
+//! maximum number of events returned by epoll_wait()
+#define EV_MAX 64
+//! timeout of epoll_wait() in ms
+#define EV_TICK 1000
+
+#ifdef WITH_THREADS
+#define pool_lock() pthread_mutex_lock(&pool_.mutex)
+#define pool_unlock() pthread_mutex_unlock(&pool_.mutex)
+#else
+#define pool_lock()
+#define pool_unlock()
+#endif
+
+
+//! compute pool
+typedef struct http_pool
+{
+   http_conn_t *first, *last; //!< queue of connections with pending requests
+   http_conn_t *ret;          //!< connections returned to the event loop
+   int evfd;                  //!< eventfd to wake up the event loop
+   int conns;                 //!< number of open connections
+   int quit;                  //!< set to 1 to stop the threads
+#ifdef WITH_THREADS
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   int nth;                   //!< number of threads
+   pthread_t th[HTTP_MAX_WORKERS];
+#endif
+} http_pool_t;
+
+
+extern volatile sig_atomic_t int_;
+
+static http_pool_t pool_ =
+{
+   .first = NULL,
+   .evfd = -1,
+#ifdef WITH_THREADS
+   .mutex = PTHREAD_MUTEX_INITIALIZER,
+   .cond = PTHREAD_COND_INITIALIZER,
+#endif
+};
+
+
+static http_conn_t *conn_new(int fd, const struct sockaddr_in *saddr)
+{
+   http_conn_t *hc;
+
+   if ((hc = malloc(sizeof(*hc))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return NULL;
+   }
+
+   hc->fd = fd;
+   hc->saddr = *saddr;
+   hc->tim = time(NULL);
+   hc->len = 0;
+   hc->keep = 0;
+   hc->out = NULL;
+   hc->cap = NULL;
+   hc->obuf = NULL;
+   hc->olen = hc->opos = hc->osize = 0;
+   hc->ofd = -1;
+   hc->ooff = hc->oflen = 0;
+   hc->prev = hc->next = NULL;
+
+   pool_lock();
+   pool_.conns++;
+   pool_unlock();
+
+   return hc;
+}
+
+
+/*! Close the connection and free all its resources.
+ * @param hc Pointer to connection.
+ */
+void conn_free(http_conn_t *hc)
+{
+   log_debug("closing connection %d", hc->fd);
+   if (close(hc->fd) == -1)
+      log_errno(LOG_WARN, "close() failed");
+   if (hc->ofd != -1 && close(hc->ofd) == -1)
+      log_errno(LOG_WARN, "close() failed");
+   free(hc->obuf);
+   free(hc);
+
+   pool_lock();
+   pool_.conns--;
+   pool_unlock();
+}
+
+
+static void conn_list_add(http_conn_t **list, http_conn_t *hc)
+{
+   hc->prev = NULL;
+   hc->next = *list;
+   if (*list != NULL)
+      (*list)->prev = hc;
+   *list = hc;
+}
+
+
+static void conn_list_del(http_conn_t **list, http_conn_t *hc)
+{
+   if (hc->prev != NULL)
+      hc->prev->next = hc->next;
+   else
+      *list = hc->next;
+   if (hc->next != NULL)
+      hc->next->prev = hc->prev;
+   hc->prev = hc->next = NULL;
+}
+
+
+/*! Test if the request line and the headers were received completely. A
+ * request of HTTP/0.9 consists of the request line only which does not
+ * contain a protocol version.
+ * @return Returns 1 if the request is complete, otherwise 0.
+ */
+static int conn_req_complete(const http_conn_t *hc)
+{
+   const char *s, *eol;
+
+   if ((eol = memchr(hc->buf, '\n', hc->len)) == NULL)
+      return 0;
+
+   // check for version in request line
+   for (s = hc->buf; eol - s >= 6 && memcmp(s, " HTTP/", 6); s++);
+   if (eol - s < 6)
+      return 1;
+
+   // find empty line
+   for (s = eol; (s = memchr(s, '\n', hc->buf + hc->len - s)) != NULL; s++)
+   {
+      if (s + 1 < hc->buf + hc->len && s[1] == '\n')
+         return 1;
+      if (s + 2 < hc->buf + hc->len && s[1] == '\r' && s[2] == '\n')
+         return 1;
+   }
+   return 0;
+}
+
+
+/*! Read all available data from the connection.
+ * @return Returns 1 if the request is complete or if the buffer is full, 0 if
+ * more data is needed, and -1 on EOF or error.
+ */
+static int conn_read(http_conn_t *hc)
+{
+   ssize_t len;
+
+   for (;;)
+   {
+      if (hc->len >= HTTP_HDR_MAX)
+      {
+         // http_handle() will reply with an error
+         log_msg(LOG_WARN, "request headers on %d too long", hc->fd);
+         return 1;
+      }
+
+      if ((len = read(hc->fd, hc->buf + hc->len, HTTP_HDR_MAX - hc->len)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         if (errno == EINTR)
+            continue;
+         log_errno(LOG_WARN, "read() failed");
+         return -1;
+      }
+
+      if (!len)
+      {
+         log_debug("EOF on %d", hc->fd);
+         return -1;
+      }
+
+      hc->len += len;
+      hc->tim = time(NULL);
+      if (conn_req_complete(hc))
+         return 1;
+   }
+}
+
+
+/*! Send pending output of the connection as far as the socket accepts it
+ * without blocking.
+ * @return Returns 0 on success, -1 on error. Output may still be pending.
+ */
+static int conn_flush(http_conn_t *hc)
+{
+   ssize_t len;
+
+   while (hc->opos < hc->olen)
+   {
+      if ((len = write(hc->fd, hc->obuf + hc->opos, hc->olen - hc->opos)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         if (errno == EINTR)
+            continue;
+         log_errno(LOG_WARN, "write() failed");
+         return -1;
+      }
+      hc->opos += len;
+      hc->tim = time(NULL);
+   }
+   hc->opos = hc->olen = 0;
+
+   while (hc->ooff < hc->oflen)
+   {
+      if ((len = sendfile(hc->fd, hc->ofd, &hc->ooff, hc->oflen - hc->ooff)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+         if (errno == EINTR)
+            continue;
+         log_errno(LOG_WARN, "sendfile() failed");
+         return -1;
+      }
+      hc->tim = time(NULL);
+   }
+
+   if (hc->ofd != -1)
+   {
+      if (close(hc->ofd) == -1)
+         log_errno(LOG_WARN, "close() failed");
+      hc->ofd = -1;
+      hc->ooff = hc->oflen = 0;
+   }
+   return 0;
+}
+
+
+//! Return 1 if output of the connection is pending, otherwise 0.
+static int conn_pending(const http_conn_t *hc)
+{
+   return hc->opos < hc->olen || hc->ofd != -1;
+}
+
+
+/*! Append the data of the vector iov to the temporary output file of the
+ * connection. The file is created if it does not exist yet.
+ */
+static int conn_spill(http_conn_t *hc, struct iovec *iov, int cnt)
+{
+   char name[] = HTTP_OBUF_FILE;
+   ssize_t len;
+
+   if (hc->ofd == -1)
+   {
+      if ((hc->ofd = mkstemp(name)) == -1)
+      {
+         log_errno(LOG_ERR, "mkstemp() failed");
+         return -1;
+      }
+      log_debug("spilling output of %d to '%s'", hc->fd, name);
+      if (unlink(name) == -1)
+         log_msg(LOG_WARN, "unlink(%s) failed: %s", name, strerror(errno));
+   }
+
+   while (cnt)
+   {
+      if ((len = writev(hc->ofd, iov, cnt)) == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         log_errno(LOG_ERR, "writev() failed");
+         return -1;
+      }
+      hc->oflen += len;
+      for (; cnt && (size_t) len >= iov->iov_len; cnt--, iov++)
+         len -= iov->iov_len;
+      if (cnt)
+      {
+         iov->iov_base = (char*) iov->iov_base + len;
+         iov->iov_len -= len;
+      }
+   }
+   return 0;
+}
+
+
+/*! Append the data of the vector iov to the output buffer of the connection.
+ * If the buffer would exceed HTTP_OBUF_MAX, the data is appended to the
+ * temporary file instead.
+ */
+static int conn_buffer(http_conn_t *hc, struct iovec *iov, int cnt)
+{
+   size_t len, size;
+   char *buf;
+   int i;
+
+   for (len = 0, i = 0; i < cnt; i++)
+      len += iov[i].iov_len;
+
+   if (hc->ofd != -1 || hc->olen - hc->opos + len > HTTP_OBUF_MAX)
+      return conn_spill(hc, iov, cnt);
+
+   if (hc->opos)
+   {
+      memmove(hc->obuf, hc->obuf + hc->opos, hc->olen - hc->opos);
+      hc->olen -= hc->opos;
+      hc->opos = 0;
+   }
+
+   if (hc->olen + len > hc->osize)
+   {
+      for (size = hc->osize ? hc->osize : HTTP_WBUF; size < hc->olen + len; size *= 2);
+      if ((buf = realloc(hc->obuf, size)) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      hc->obuf = buf;
+      hc->osize = size;
+   }
+
+   for (i = 0; i < cnt; i++)
+   {
+      memcpy(hc->obuf + hc->olen, iov[i].iov_base, iov[i].iov_len);
+      hc->olen += iov[i].iov_len;
+   }
+   return 0;
+}
+
+
+/*! Send the data of the vector iov on the connection. Data which the socket
+ * does not accept immediately is buffered and sent later by the event loop,
+ * thus the function never waits for the client. The contents of iov is
+ * modified.
+ * @param hc Pointer to connection.
+ * @param iov Data to send.
+ * @param cnt Number of elements of iov.
+ * @return Returns 0 on success, -1 on error.
+ */
+int conn_send(http_conn_t *hc, struct iovec *iov, int cnt)
+{
+   ssize_t len;
+
+   // data is sent directly unless output is pending
+   while (cnt && !conn_pending(hc))
+   {
+      if ((len = writev(hc->fd, iov, cnt)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+            break;
+         if (errno == EINTR)
+            continue;
+         log_errno(LOG_WARN, "writev() failed");
+         return -1;
+      }
+      for (; cnt && (size_t) len >= iov->iov_len; cnt--, iov++)
+         len -= iov->iov_len;
+      if (cnt)
+      {
+         iov->iov_base = (char*) iov->iov_base + len;
+         iov->iov_len -= len;
+      }
+   }
+
+   return cnt ? conn_buffer(hc, iov, cnt) : 0;
+}
+
+
+/*! Set the socket of the connection to blocking mode with a send timeout and
+ * send all pending output. This is used by websocket sessions which are
+ * handled by their own thread.
+ * @return Returns 0 on success, -1 on error.
+ */
+int conn_blocking(http_conn_t *hc)
+{
+   struct timeval tv = {HTTP_TIMEOUT, 0};
+   int flags;
+
+   if ((flags = fcntl(hc->fd, F_GETFL, 0)) == -1 || fcntl(hc->fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+   {
+      log_errno(LOG_WARN, "could not clear O_NONBLOCK");
+      return -1;
+   }
+   if (setsockopt(hc->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+      log_errno(LOG_WARN, "setsockopt(SO_SNDTIMEO) failed");
+   return conn_flush(hc) || conn_pending(hc) ? -1 : 0;
+}
+
+
+//! Return a persistent connection to the event loop.
+static void pool_return(http_conn_t *hc)
+{
+   uint64_t v = 1;
+
+   pool_lock();
+   hc->next = pool_.ret;
+   pool_.ret = hc;
+   pool_unlock();
+
+   if (write(pool_.evfd, &v, sizeof(v)) == -1)
+      log_errno(LOG_ERR, "write() to eventfd failed");
+}
+
+
+/*! Process the requests of a connection. All complete requests within the
+ * buffer are processed, thus pipelined requests are answered in order.
+ * Connections with pending output are returned to the event loop, also if
+ * they are closed afterwards.
+ */
+static void conn_process(http_conn_t *hc)
+{
+   for (;;)
+   {
+      hc->buf[hc->len] = '\0';
+      switch (http_handle(hc))
+      {
+         case HTTP_KEEP:
+            if (conn_req_complete(hc))
+            {
+               log_debug("pipelined request on %d", hc->fd);
+               continue;
+            }
+            pool_return(hc);
+            return;
+
+         case HTTP_DETACH:
+            return;
+
+         default:
+            if (conn_pending(hc))
+            {
+               hc->keep = 0;
+               pool_return(hc);
+               return;
+            }
+            conn_free(hc);
+            return;
+      }
+   }
+}
+
+
+#ifdef WITH_THREADS
+static void *pool_worker(void * UNUSED(p))
+{
+   http_conn_t *hc;
+
+   for (;;)
+   {
+      pool_lock();
+      while (pool_.first == NULL && !pool_.quit)
+         pthread_cond_wait(&pool_.cond, &pool_.mutex);
+      if (pool_.quit)
+      {
+         pool_unlock();
+         break;
+      }
+      hc = pool_.first;
+      if ((pool_.first = hc->next) == NULL)
+         pool_.last = NULL;
+      pool_unlock();
+
+      hc->next = NULL;
+      conn_process(hc);
+   }
+
+   return NULL;
+}
+
+
+static void pool_start(void)
+{
+   long n;
+
+   if ((n = sysconf(_SC_NPROCESSORS_ONLN)) == -1)
+      n = 2;
+   n = n < 2 ? 2 : n > HTTP_MAX_WORKERS ? HTTP_MAX_WORKERS : n;
+
+   for (pool_.nth = 0; pool_.nth < n; pool_.nth++)
+      if ((errno = pthread_create(&pool_.th[pool_.nth], NULL, pool_worker, NULL)))
+      {
+         log_errno(LOG_ERR, "pthread_create() failed");
+         break;
+      }
+   log_msg(LOG_INFO, "compute pool started with %d threads", pool_.nth);
+}
+
+
+static void pool_stop(void)
+{
+   pool_lock();
+   pool_.quit = 1;
+   pthread_cond_broadcast(&pool_.cond);
+   pool_unlock();
+
+   for (int i = 0; i < pool_.nth; i++)
+      if ((errno = pthread_join(pool_.th[i], NULL)))
+         log_errno(LOG_ERR, "pthread_join() failed");
+
+   for (http_conn_t *hc; (hc = pool_.first) != NULL;)
+   {
+      pool_.first = hc->next;
+      conn_free(hc);
+   }
+   pool_.last = NULL;
+}
+#endif
+
+
+//! Hand the connection over to the compute pool.
+static void pool_put(http_conn_t *hc)
+{
+#ifdef WITH_THREADS
+   hc->next = NULL;
+   pool_lock();
+   if (pool_.last != NULL)
+      pool_.last->next = hc;
+   else
+      pool_.first = hc;
+   pool_.last = hc;
+   pthread_cond_signal(&pool_.cond);
+   pool_unlock();
+#else
+   conn_process(hc);
+#endif
+}
+
+
+static int pool_conns(void)
+{
+   int n;
+
+   pool_lock();
+   n = pool_.conns;
+   pool_unlock();
+   return n;
+}
+
+
+/*! Accept all pending connections on the listening socket sfd and add them to
+ * the event loop.
+ * @return Returns 1 if the maximum number of connections is reached,
+ * otherwise 0.
+ */
+static int loop_accept(int epfd, int sfd, http_conn_t **list)
+{
+   struct epoll_event ev;
+   struct sockaddr_in saddr;
+   socklen_t addrlen;
+   http_conn_t *hc;
+   int fd, e, on = 1;
+
+   for (;;)
+   {
+      if (pool_conns() >= HTTP_MAX_CONNS)
+         return 1;
+
+      addrlen = sizeof(saddr);
+      if ((fd = accept4(sfd, (struct sockaddr*) &saddr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+         e = errno;
+         log_errno(LOG_WARN, "accept() failed");
+         // stop accepting until next tick if out of file descriptors
+         return e == EMFILE || e == ENFILE;
+      }
+
+      log_debug("connection %d accepted", fd);
+      // responses are buffered, the last segment shall not be delayed on persistent connections
+      if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+         log_errno(LOG_WARN, "setsockopt(TCP_NODELAY) failed");
+      if ((hc = conn_new(fd, &saddr)) == NULL)
+      {
+         (void) close(fd);
+         continue;
+      }
+
+      ev.events = EPOLLIN;
+      ev.data.ptr = hc;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      {
+         log_errno(LOG_ERR, "epoll_ctl() failed");
+         conn_free(hc);
+         continue;
+      }
+      conn_list_add(list, hc);
+   }
+}
+
+
+/*! Add all connections which were returned by the compute pool to the event
+ * loop again.
+ */
+static void loop_return(int epfd, http_conn_t **list)
+{
+   struct epoll_event ev;
+   http_conn_t *hc, *ret;
+   uint64_t v;
+
+   if (read(pool_.evfd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+      log_errno(LOG_ERR, "read() from eventfd failed");
+
+   pool_lock();
+   ret = pool_.ret;
+   pool_.ret = NULL;
+   pool_unlock();
+
+   while ((hc = ret) != NULL)
+   {
+      ret = hc->next;
+      hc->tim = time(NULL);
+      // pending output is sent before the next request is read
+      ev.events = conn_pending(hc) ? EPOLLOUT : EPOLLIN;
+      ev.data.ptr = hc;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, hc->fd, &ev) == -1)
+      {
+         log_errno(LOG_ERR, "cannot return connection to event loop");
+         conn_free(hc);
+         continue;
+      }
+      conn_list_add(list, hc);
+   }
+}
+
+
+/*! Send pending output of a connection of the event loop. As soon as it is
+ * sent completely, the connection is closed or it waits for the next request.
+ */
+static void loop_send(int epfd, http_conn_t **list, http_conn_t *hc)
+{
+   struct epoll_event ev;
+
+   if (conn_flush(hc) == -1)
+   {
+      conn_list_del(list, hc);
+      conn_free(hc);
+      return;
+   }
+   if (conn_pending(hc))
+      return;
+
+   if (!hc->keep)
+   {
+      conn_list_del(list, hc);
+      conn_free(hc);
+      return;
+   }
+
+   ev.events = EPOLLIN;
+   ev.data.ptr = hc;
+   if (epoll_ctl(epfd, EPOLL_CTL_MOD, hc->fd, &ev) == -1)
+   {
+      log_errno(LOG_ERR, "epoll_ctl() failed");
+      conn_list_del(list, hc);
+      conn_free(hc);
+      return;
+   }
+
+   // the next request may have been pipelined already
+   if (conn_req_complete(hc))
+   {
+      (void) epoll_ctl(epfd, EPOLL_CTL_DEL, hc->fd, NULL);
+      conn_list_del(list, hc);
+      pool_put(hc);
+   }
+}
+
+
+/*! Close all connections of the event loop which neither sent a complete
+ * request nor received pending output within HTTP_TIMEOUT seconds.
+ */
+static void loop_timeout(http_conn_t **list, time_t t)
+{
+   http_conn_t *hc, *next;
+
+   for (hc = *list; hc != NULL; hc = next)
+   {
+      next = hc->next;
+      if (hc->tim + HTTP_TIMEOUT < t)
+      {
+         log_msg(LOG_INFO, "connection %d timed out", hc->fd);
+         conn_list_del(list, hc);
+         conn_free(hc);
+      }
+   }
+}
+
+
+/*! Run the event loop of the server on the listening socket sfd. The function
+ * returns if int_ is set.
+ * @return Returns 0 on success, -1 on error.
+ */
+int httpd_loop(int sfd)
+{
+   struct epoll_event ev, events[EV_MAX];
+   http_conn_t *list = NULL, *hc;
+   int epfd, n, paused = 0;
+   time_t t, tick;
+
+   // a client closing its connection must not terminate the server
+   (void) signal(SIGPIPE, SIG_IGN);
+
+   if (set_nonblock(sfd) == -1)
+      return -1;
+
+   if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+   {
+      log_errno(LOG_ERR, "epoll_create1() failed");
+      return -1;
+   }
+
+   // the listening socket is identified by ptr = NULL
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;
+   if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+   {
+      log_errno(LOG_ERR, "epoll_ctl() failed");
+      (void) close(epfd);
+      return -1;
+   }
+
+   // the eventfd of returned connections is identified by ptr = &pool_
+   ev.events = EPOLLIN;
+   ev.data.ptr = &pool_;
+   if ((pool_.evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, pool_.evfd, &ev) == -1)
+   {
+      log_errno(LOG_ERR, "cannot create eventfd");
+      if (pool_.evfd != -1)
+         (void) close(pool_.evfd);
+      (void) close(epfd);
+      return -1;
+   }
+
+#ifdef WITH_THREADS
+   pool_start();
+#endif
+
+   for (tick = time(NULL); !int_;)
+   {
+      if ((n = epoll_wait(epfd, events, EV_MAX, EV_TICK)) == -1)
+      {
+         if (errno == EINTR)
+            continue;
+         log_errno(LOG_ERR, "epoll_wait() failed");
+         break;
+      }
+
+      for (int i = 0; i < n; i++)
+      {
+         if ((hc = events[i].data.ptr) == NULL)
+         {
+            if (loop_accept(epfd, sfd, &list))
+            {
+               log_msg(LOG_WARN, "maximum number of connections reached, pausing accept()");
+               (void) epoll_ctl(epfd, EPOLL_CTL_DEL, sfd, NULL);
+               paused = 1;
+            }
+            continue;
+         }
+
+         if (hc == (http_conn_t*) &pool_)
+         {
+            loop_return(epfd, &list);
+            continue;
+         }
+
+         if (conn_pending(hc))
+         {
+            loop_send(epfd, &list, hc);
+            continue;
+         }
+
+         switch (conn_read(hc))
+         {
+            case 0:
+               break;
+
+            case 1:
+               (void) epoll_ctl(epfd, EPOLL_CTL_DEL, hc->fd, NULL);
+               conn_list_del(&list, hc);
+               pool_put(hc);
+               break;
+
+            default:
+               conn_list_del(&list, hc);
+               conn_free(hc);
+         }
+      }
+
+      if ((t = time(NULL)) == tick)
+         continue;
+      tick = t;
+
+      loop_timeout(&list, t);
+      if (paused && pool_conns() < HTTP_MAX_CONNS)
+      {
+         ev.events = EPOLLIN;
+         ev.data.ptr = NULL;
+         if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+            log_errno(LOG_ERR, "epoll_ctl() failed");
+         else
+            paused = 0;
+      }
+   }
+
+#ifdef WITH_THREADS
+   pool_stop();
+#endif
+   while ((hc = pool_.ret) != NULL)
+   {
+      pool_.ret = hc->next;
+      conn_free(hc);
+   }
+   while ((hc = list) != NULL)
+   {
+      conn_list_del(&list, hc);
+      conn_free(hc);
+   }
+   (void) close(pool_.evfd);
+   (void) close(epfd);
+
+   return 0;
+}
@@ -1,10 +1,25 @@
 
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
 #include "smrender.h"
 #include "smcore.h"
 #include "rdata.h"
 
 
+/* the following prototype is found in smrender_dev.h which is unsuitable to
+ * be included here. */
+int print_onode(FILE*, const osm_obj_t*);
+
+
+//! number of ids per page of an id set as power of 2
+#define IDS_PBITS 15
+#define IDS_PSIZE (1 << IDS_PBITS)
+
+
 struct query
 {
    bx_node_t *root;
@@ -12,6 +27,39 @@ struct query
    const struct bbox *bb;
 };
 
+//! page of an id set, i.e. a bitmap of IDS_PSIZE consecutive ids
+typedef struct idpage
+{
+   int64_t pg;    //!< id >> IDS_PBITS
+   uint64_t bit[IDS_PSIZE / 64];
+} idpage_t;
+
+//! set of object ids, implemented as hash table of bitmap pages
+typedef struct idset
+{
+   idpage_t **tab;
+   int size, cnt;
+} idset_t;
+
+//! list of objects
+typedef struct olist
+{
+   osm_obj_t **obj;
+   int size, cnt;
+} olist_t;
+
+//! state of a streaming query
+struct squery
+{
+   FILE *f;
+   bx_node_t *index;
+   const struct bbox *bb;
+   idset_t ids[3];      //!< objects already seen, indexed by IDX_xxx
+   olist_t way, rel;    //!< ways and relations to output
+   long len;            //!< bytes written
+   bx_node_t **root;    //!< result tree which receives all objects, may be NULL
+};
+
 
 int is_in_bb(const osm_node_t *n, const struct bbox *bb)
 {
@@ -90,11 +138,266 @@ int get_node_bb(osm_node_t *n, struct query *q)
 }
 
 
+/*! Return a tree of all objects within the bounding box bb. The candidate
+ * nodes are retrieved from the spatial index if available, otherwise all
+ * nodes are traversed.
+ */
 bx_node_t *get_obj_bb(bx_node_t *index, const struct bbox *bb)
 {
    struct query q = {NULL, index, bb};
 
-   traverse(*get_objtree(), 0, IDX_NODE, (tree_func_t) get_node_bb, &q);
+   if (get_spidx() != NULL)
+      spidx_query(get_spidx(), bb, (tree_func_t) get_node_bb, &q);
+   else
+      traverse(*get_objtree(), 0, IDX_NODE, (tree_func_t) get_node_bb, &q);
+   return q.root;
+}
+
+
+/*! Return a tree of all objects within the bounding box bb taking the nodes
+ * of the result tree of a previous query as candidates. The bbox of that query
+ * must contain bb. The result is the same as of get_obj_bb().
+ */
+bx_node_t *get_obj_bb_tree(bx_node_t *index, bx_node_t *tree, const struct bbox *bb)
+{
+   struct query q = {NULL, index, bb};
+
+   traverse(tree, 0, IDX_NODE, (tree_func_t) get_node_bb, &q);
    return q.root;
 }
 
+
+static unsigned ids_hash(int64_t pg, int size)
+{
+   return ((uint64_t) pg * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+}
+
+
+static int ids_grow(idset_t *ids)
+{
+   idpage_t **tab;
+   int size, i;
+   unsigned h;
+
+   size = ids->size ? ids->size * 2 : 64;
+   if ((tab = calloc(size, sizeof(*tab))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return -1;
+   }
+
+   for (i = 0; i < ids->size; i++)
+      if (ids->tab[i] != NULL)
+      {
+         for (h = ids_hash(ids->tab[i]->pg, size); tab[h] != NULL; h = (h + 1) & (size - 1));
+         tab[h] = ids->tab[i];
+      }
+
+   free(ids->tab);
+   ids->tab = tab;
+   ids->size = size;
+   return 0;
+}
+
+
+/*! Add id to the set.
+ * @return Returns 1 if the id was added, 0 if it already was a member of the
+ * set, or -1 in case of error.
+ */
+static int ids_add(idset_t *ids, int64_t id)
+{
+   int64_t pg = id >> IDS_PBITS;
+   unsigned h, b = id & (IDS_PSIZE - 1);
+   idpage_t *p;
+
+   if (ids->cnt * 2 >= ids->size && ids_grow(ids))
+      return -1;
+
+   for (h = ids_hash(pg, ids->size); (p = ids->tab[h]) != NULL && p->pg != pg; h = (h + 1) & (ids->size - 1));
+
+   if (p == NULL)
+   {
+      if ((p = calloc(1, sizeof(*p))) == NULL)
+      {
+         log_errno(LOG_ERR, "calloc() failed");
+         return -1;
+      }
+      p->pg = pg;
+      ids->tab[h] = p;
+      ids->cnt++;
+   }
+
+   if (p->bit[b / 64] & (1ULL << (b % 64)))
+      return 0;
+   p->bit[b / 64] |= 1ULL << (b % 64);
+   return 1;
+}
+
+
+static void ids_free(idset_t *ids)
+{
+   for (int i = 0; i < ids->size; i++)
+      free(ids->tab[i]);
+   free(ids->tab);
+}
+
+
+static int ol_add(olist_t *ol, osm_obj_t *o)
+{
+   osm_obj_t **obj;
+
+   if (ol->cnt >= ol->size)
+   {
+      if ((obj = realloc(ol->obj, sizeof(*obj) * (ol->size ? ol->size * 2 : 256))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      ol->obj = obj;
+      ol->size = ol->size ? ol->size * 2 : 256;
+   }
+   ol->obj[ol->cnt++] = o;
+   return 0;
+}
+
+
+/*! Output node n if it was not output before.
+ * @return Returns 1 if the node was output, 0 if it was output before, or -1
+ * in case of error.
+ */
+static int sq_node(struct squery *sq, osm_node_t *n)
+{
+   int e;
+
+   if ((e = ids_add(&sq->ids[IDX_NODE], n->obj.id)) != 1)
+      return e;
+
+   sq->len += print_onode(sq->f, (osm_obj_t*) n);
+   if (sq->root != NULL)
+      (void) put_object0(sq->root, n->obj.id, n, IDX_NODE);
+   return ferror(sq->f) ? -1 : 1;
+}
+
+
+//! Add object o to the list of ways or relations if it is not yet a member.
+static int sq_add(struct squery *sq, osm_obj_t *o)
+{
+   int idx = o->type - 1;
+   int e;
+
+   if ((e = ids_add(&sq->ids[idx], o->id)) != 1)
+      return e;
+
+   if (sq->root != NULL)
+      (void) put_object0(sq->root, o->id, o, idx);
+   return ol_add(idx == IDX_WAY ? &sq->way : &sq->rel, o);
+}
+
+
+//! Add all relations which reference o, equivalent to put_obj_rels().
+static int sq_add_rels(struct squery *sq, osm_obj_t *o)
+{
+   osm_obj_t **optr;
+
+   if ((optr = get_object0(sq->index, o->id, o->type - 1)) != NULL)
+      for (; *optr != NULL; optr++)
+         if ((*optr)->type == OSM_REL && sq_add(sq, *optr) == -1)
+            return -1;
+   return 0;
+}
+
+
+/*! Stream node n if it is within the bbox and collect the ways and relations
+ * which reference it. This is the streaming equivalent of get_node_bb().
+ */
+static int stream_node_bb(osm_node_t *n, struct squery *sq)
+{
+   osm_obj_t **optr;
+
+   if (!is_in_bb(n, sq->bb))
+      return 0;
+
+   if (sq_node(sq, n) == -1)
+      return -1;
+
+   if ((optr = get_object0(sq->index, n->obj.id, n->obj.type - 1)) == NULL)
+      return 0;
+
+   for (; *optr != NULL; optr++)
+   {
+      switch ((*optr)->type)
+      {
+         case OSM_REL:
+         case OSM_WAY:
+            if (sq_add(sq, *optr) == -1 || sq_add_rels(sq, *optr) == -1)
+               return -1;
+            break;
+
+         default:
+            log_msg(LOG_ERR, "ill object type!");
+      }
+   }
+   return 0;
+}
+
+
+/*! Write all objects within the bounding box bb to f without building a
+ * result tree. The set of objects is the same as of get_obj_bb() but the order
+ * is different. First, the nodes within bb are written as they are found.
+ * Then the remaining nodes of all ways which reference those nodes are
+ * written, and finally the ways and the relations. Objects which were written
+ * already are tracked in a bitmap.
+ * Optionally, all objects are added to a result tree which then equals the
+ * result of get_obj_bb().
+ * @param f Output stream.
+ * @param index Reverse index.
+ * @param tree Optional result tree of a previous query whose bbox contains bb.
+ * Its nodes are taken as candidates. If NULL, the spatial index is used.
+ * @param bb Bounding box.
+ * @param root Pointer to a result tree which receives all objects, or NULL.
+ * The tree has to be freed by the caller also in case of error.
+ * @return Returns the number of bytes written or -1 in case of error.
+ */
+long stream_obj_bb(FILE *f, bx_node_t *index, bx_node_t *tree, const struct bbox *bb, bx_node_t **root)
+{
+   struct squery sq;
+   osm_node_t *n;
+   osm_way_t *w;
+   int i, j, e;
+
+   memset(&sq, 0, sizeof(sq));
+   sq.f = f;
+   sq.index = index;
+   sq.bb = bb;
+   sq.root = root;
+
+   if (tree != NULL)
+      e = traverse(tree, 0, IDX_NODE, (tree_func_t) stream_node_bb, &sq);
+   else if (get_spidx() != NULL)
+      e = spidx_query(get_spidx(), bb, (tree_func_t) stream_node_bb, &sq);
+   else
+      e = traverse(*get_objtree(), 0, IDX_NODE, (tree_func_t) stream_node_bb, &sq);
+
+   // add all nodes of the ways
+   for (i = 0; !e && i < sq.way.cnt; i++)
+   {
+      w = (osm_way_t*) sq.way.obj[i];
+      for (j = 0; !e && j < w->ref_cnt; j++)
+         if ((n = get_object(OSM_NODE, w->ref[j])) != NULL && (e = sq_node(&sq, n)) == 1)
+            e = sq_add_rels(&sq, (osm_obj_t*) n);
+   }
+
+   for (i = 0; !e && i < sq.way.cnt; i++)
+      sq.len += print_onode(f, sq.way.obj[i]);
+   for (i = 0; !e && i < sq.rel.cnt; i++)
+      sq.len += print_onode(f, sq.rel.obj[i]);
+
+   log_debug("streamed %d ways, %d relations, %d node pages", sq.way.cnt, sq.rel.cnt, sq.ids[IDX_NODE].cnt);
+
+   for (i = 0; i < 3; i++)
+      ids_free(&sq.ids[i]);
+   free(sq.way.obj);
+   free(sq.rel.obj);
+
+   return e || ferror(f) ? -1 : sq.len;
+}
@@ -138,7 +138,7 @@ void *traverse_thread(void *p)
             tc->slave_cmd = TC_NEXT;
             r->data = tc;
             pthread_mutex_unlock(&tc->mtx);
-            trv_info_t ti = {tc->ot, r->oo->ver};
+            trv_info_t ti = {tc->ot, r->oo->ver, NULL};
             e = apply_smrules(r, &ti);
             break;
 
@@ -47,17 +47,21 @@ extern bx_node_t *index_;
  * be included here. */
 int print_onode(FILE*, const osm_obj_t*);
 size_t save_osm0(FILE *, bx_node_t *, const struct bbox *, const char *);
+long save_osm_head(FILE *, const struct bbox *, const char *);
+long save_osm_tail(FILE *);
 int init_rule(osm_obj_t *, smrule_t **);
 
 
 struct smhttpd
 {
    int fd;
-   int max_conns;
-   http_thread_t *htth;
 };
 
 
+//! size at which batched objects of websocket sessions are flushed
+static int ws_batch_ = HTTP_WS_BATCH;
+
+
 #ifdef OSM_BIN
 /* binary encoding of tags:
  * always: key + value
@@ -104,41 +108,26 @@ void log_access(const struct sockaddr_in * UNUSED(saddr), const char *req, int s
 }
 
 
-/*! Read '\n'-delimited line from file descriptor into buffer buf but not more
- * than size bytes. The buffer *  will NOT be \0-terminated.
- * @param fd Valid file descriptor.
- * @param buf Pointer to buffer.
+/*! Copy the next '\n'-delimited line of the request which was received into
+ * the buffer of the connection into buf but not more than size bytes. The
+ * buffer will NOT be \0-terminated.
+ * @param hc Pointer to connection.
+ * @param pos Pointer to position within the buffer of the connection. It is
+ * advanced to the beginning of the next line.
+ * @param buf Pointer to destination buffer.
  * @param size Size of buffer.
- * @return Returns the number of bytes read. In case of EOF, 0 is returned, in
- * case of error -1 is returned and errno is set appropriately (according to
- * read(2)). Please note that an error may occur after a set of bytes have
- * already been read. In this case the number of bytes that have been read
- * before the error occured are returned but errno is set. To detect this,
- * errno should be set to 0 before the call to read_line(). If it is not
- * handled in that way, read_line() should fail with -1 upon the next call.
+ * @return Returns the number of bytes copied. At the end of the request 0 is
+ * returned.
  */
-size_t read_line(int fd, char *buf, int size)
+static int http_line(const http_conn_t *hc, int *pos, char *buf, int size)
 {
-   int ret, len;
+   int len;
 
-   for (len = 0; size > 0; size--, buf++, len++)
+   for (len = 0; size > 0 && *pos < hc->len; size--, len++)
    {
-      ret = read(fd, buf, 1);
-
-      // check if read() failed
-      if (ret == -1)
-      {
-         // check if data was already read before
-         if (len)
-            return len;
-         return -1;
-      }
-      // check for EOF
-      else if (!ret)
-         return len;
-
+      *buf = hc->buf[(*pos)++];
       // check for EOL
-      if (*buf =='\n')
+      if (*buf++ == '\n')
          return len + 1;
    }
    return len;
@@ -166,34 +155,13 @@ int set_nonblock(int fd)
 }
 
 
-static int http_flush_input_headers(int fd)
-{
-   int buf[2048];
-   int s, len;
-
-   set_nonblock(fd);
-   for (len = 0; ; len += s)
-   {
-      if ((s = read(fd, buf, sizeof(buf))) == -1)
-         return -1;
-      if (s < (int) sizeof(buf))
-         break;
-   }
-   return len;
-}
-
-
-/*! Close file descriptor and exit on error.
- *  @param fd File descriptor to be closed.
+/*! Write the headers of a successful response to f and start the body.
+ * @param t Time of the Date header, 0 means now.
+ * @param clen Length of the body if it is sent unmodified, e.g. an encoded
+ * response taken from the cache, or -1 if the body is encoded by the response
+ * stream.
  */
-void eclose(int fd)
-{
-   if (close(fd) == -1)
-      perror("close"), exit(EXIT_FAILURE);
-}
-
-
-static int http_header(FILE *f, time_t t)
+static int http_header(http_conn_t *hc, FILE *f, time_t t, long clen)
 {
    struct tm tm;
    char buf[256];
@@ -203,7 +171,18 @@ static int http_header(FILE *f, time_t t)
       t = time(NULL);
    localtime_r(&t, &tm);
    strftime(buf, sizeof(buf), "%a, %d %b %Y %T %z", &tm);
-   len += fprintf(f, "%sServer: Smrenderd\r\nDate: %s\r\nContent-Type: text/xml; charset=utf-8\r\n\r\n", STATUS_200, buf);
+   len += fprintf(f, "%sServer: Smrenderd\r\nDate: %s\r\nContent-Type: text/xml; charset=utf-8\r\n",
+         hc->ver == HTTP_11 ? STATUS_200_11 : STATUS_200, buf);
+   if (hc->enc != HTTP_ENC_IDENTITY)
+      len += fprintf(f, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n", resp_enc_str(hc->enc));
+   if (clen >= 0)
+      len += fprintf(f, "Content-Length: %ld\r\n", clen);
+   else if (hc->keep)
+      len += fprintf(f, "Transfer-Encoding: chunked\r\n");
+   if (hc->ver == HTTP_11 && !hc->keep)
+      len += fprintf(f, "Connection: close\r\n");
+   len += fprintf(f, "\r\n");
+   resp_begin(hc, f, clen < 0);
    return len;
 }
 
@@ -284,60 +263,136 @@ static qcache_t *qc_get_bbi(const struct bboxi *bbi)
 
    bbi2bb(bbi, &bb);
 
-   if ((qc = qc_lookup(bbi)) == NULL)
+   if ((qc = qc_lookup(bbi)) != NULL && qc_tree(qc) == NULL)
+   {
+      log_debug("cache entry contains responses only");
+      qc_release(qc);
+      qc = NULL;
+   }
+
+   if (qc == NULL)
    {
       log_debug("no cache entry, creating query");
-      if ((tree = get_obj_bb(index_, &bb)) == NULL)
-      {
-         log_msg(LOG_ERR, "query failed");
-         return NULL;
-      }
+      qc_count(QC_MISS);
+      tree = get_obj_bb(index_, &bb);
+   }
+   else if (memcmp(&qc->bb, bbi, sizeof(*bbi)))
+   {
+      log_debug("filtering cache entry of containing bbox");
+      qc_count(QC_SUB_HIT);
+      tree = get_obj_bb_tree(index_, qc->tree, &bb);
+      qc_release(qc);
+   }
+   else
+   {
+      qc_count(QC_HIT);
+      return qc;
+   }
 
-      log_debug("adding query to cache");
-      while ((qc = qc_put(bbi, tree)) == NULL)
-      {
-         log_msg(LOG_INFO, "cache full, cleaning up");
-         qc_cleanup();
-      }
+   if (tree == NULL)
+   {
+      log_msg(LOG_ERR, "query failed");
+      return NULL;
    }
 
+   log_debug("adding query to cache");
+   if ((qc = qc_put(bbi, tree)) == NULL)
+      bx_free_tree(tree);
+
    return qc;
 }
 
 
-size_t http_map_bbox(int fd, const char *u)
+/*! Answer a map request. If the bbox is cached, the cached response is
+ * written if there is one of the requested content encoding, otherwise the
+ * cached result tree. Else the result is streamed directly to the client while
+ * it is queried, taking the nodes of a cached containing bbox as candidates if
+ * there is one. The objects of a streamed query are collected into a result
+ * tree which is added to the cache afterwards, as well as the compressed
+ * response.
+ */
+size_t http_map_bbox(http_conn_t *hc, const char *u)
 {
    struct bboxi bbi;
    struct bbox bb;
-   int i;
+   bx_node_t *tree = NULL, *root = NULL;
+   const char *data;
+   size_t dlen;
+   int i, exact;
    FILE *f;
-   size_t len;
+   long len, n;
    qcache_t *qc;
 
    if ((i = parse_bbi(u, &bbi)) < 0)
       return i;
 
-   if ((qc = qc_get_bbi(&bbi)) == NULL)
-      return -500;
+   bbi2bb(&bbi, &bb);
+   if ((qc = qc_lookup(&bbi)) != NULL)
+      tree = qc_tree(qc);
+   exact = qc != NULL && !memcmp(&qc->bb, &bbi, sizeof(bbi));
 
-   if ((f = fdopen(fd, "w")) == NULL)
+   if ((f = resp_open(hc, hc->enc != HTTP_ENC_IDENTITY)) == NULL)
    {
-      log_msg(LOG_ERR, "failed to fdopen(%d): %s", fd, strerror(errno));
+      if (qc != NULL)
+         qc_release(qc);
       return -500;
    }
 
-   http_header(f, 0);
-   bbi2bb(&bbi, &bb);
-   len = save_osm0(f, qc->tree, &bb, NULL);
+   if (exact && hc->enc != HTTP_ENC_IDENTITY && (data = qc_data(qc, hc->enc, &dlen)) != NULL)
+   {
+      log_debug("sending cached %s response", resp_enc_str(hc->enc));
+      qc_count(QC_HIT);
+      http_header(hc, f, 0, dlen);
+      len = fwrite(data, 1, dlen, f);
+   }
+   else
+   {
+      http_header(hc, f, 0, -1);
+      if (exact && tree != NULL)
+      {
+         qc_count(QC_HIT);
+         len = save_osm0(f, tree, &bb, NULL);
+      }
+      else if ((len = save_osm_head(f, &bb, NULL)) >= 0)
+      {
+         log_debug("streaming query");
+         qc_count(tree != NULL ? QC_SUB_HIT : QC_MISS);
+         if ((n = stream_obj_bb(f, index_, tree, &bb, &root)) < 0)
+         {
+            log_msg(LOG_WARN, "streaming query failed");
+            resp_abort(hc);
+            bx_free_tree(root);
+            root = NULL;
+         }
+         else
+            len += n + save_osm_tail(f);
+      }
+   }
    fclose(f);
 
-   qc_release(qc);
+   if (qc != NULL)
+      qc_release(qc);
+
+   if (root != NULL)
+   {
+      log_debug("adding query to cache");
+      if ((qc = qc_put(&bbi, root)) != NULL)
+         qc_release(qc);
+      else
+         bx_free_tree(root);
+   }
+
+   if (hc->cap != NULL)
+   {
+      (void) qc_put_data(&bbi, hc->enc, hc->cap, hc->cap_len);
+      hc->cap = NULL;
+   }
 
    return len;
 }
 
 
-int http_proc_api06(int fd, const char *uri)
+int http_proc_api06(http_conn_t *hc, const char *uri)
 {
    int len, type;
    osm_obj_t *o;
@@ -380,14 +435,11 @@ int http_proc_api06(int fd, const char *uri)
       return -404;
    }
 
-   if ((f = fdopen(fd, "w")) == NULL)
-   {
-      log_msg(LOG_ERR, "failed to fdopen(%d): %s", fd, strerror(errno));
+   if ((f = resp_open(hc, 0)) == NULL)
       return -500;
-   }
 
    len = 0;
-   http_header(f, o->tim);
+   http_header(hc, f, o->tim, -1);
    len += fprintf(f, "<osm>\n");
    len += print_onode(f, o);
    len += fprintf(f, "</osm>\n");
@@ -398,19 +450,16 @@ int http_proc_api06(int fd, const char *uri)
 }
 
 
-int http_changesets(int fd, const char * UNUSED(uri))
+int http_changesets(http_conn_t *hc, const char * UNUSED(uri))
 {
    FILE *f;
    int len;
 
-   if ((f = fdopen(fd, "w")) == NULL)
-   {
-      log_msg(LOG_ERR, "failed to fdopen(%d): %s", fd, strerror(errno));
+   if ((f = resp_open(hc, 0)) == NULL)
       return -500;
-   }
 
    len = 0;
-   http_header(f, 0);
+   http_header(hc, f, 0, -1);
    len += fprintf(f, "<osm>\n");
    //len += print_onode(f, o);
    len += fprintf(f, "</osm>\n");
@@ -421,19 +470,16 @@ int http_changesets(int fd, const char * UNUSED(uri))
 }
 
 
-int http_capabilities(int fd, const char * UNUSED(uri))
+int http_capabilities(http_conn_t *hc, const char * UNUSED(uri))
 {
    FILE *f;
    int len;
 
-   if ((f = fdopen(fd, "w")) == NULL)
-   {
-      log_msg(LOG_ERR, "failed to fdopen(%d): %s", fd, strerror(errno));
+   if ((f = resp_open(hc, 0)) == NULL)
       return -500;
-   }
 
    len = 0;
-   http_header(f, 0);
+   http_header(hc, f, 0, -1);
    len += fprintf(f,
          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
          "<osm version=\"0.6\" generator=\"Smrenderd\">\n"
@@ -454,7 +500,31 @@ int http_capabilities(int fd, const char * UNUSED(uri))
 }
 
 
-int http_proc_get(int fd, const char *uri)
+int http_cache_stats(http_conn_t *hc, const char * UNUSED(uri))
+{
+   qc_stats_t st;
+   FILE *f;
+   int len;
+
+   if ((f = resp_open(hc, 0)) == NULL)
+      return -500;
+
+   qc_stats(&st);
+   http_header(hc, f, 0, -1);
+   len = fprintf(f,
+         "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+         "<cache hits=\"%lu\" sub_hits=\"%lu\" misses=\"%lu\" evictions=\"%lu\" "
+         "entries=\"%d\" size=\"%lu\" budget=\"%lu\"/>\n",
+         st.hits, st.sub_hits, st.misses, st.evictions, st.entries,
+         (unsigned long) st.size, (unsigned long) st.budget);
+
+   fclose(f);
+
+   return len;
+}
+
+
+int http_proc_get(http_conn_t *hc, const char *uri)
 {
    log_debug("processing request '%s'", uri);
    if (!strncmp(API06_URI, uri, strlen(API06_URI)))
@@ -462,19 +532,21 @@ int http_proc_get(int fd, const char *uri)
       uri += strlen(API06_URI);
       log_debug("checking uri '%s'", uri);
       if (!strncmp(uri, "map?", 4))
-         return http_map_bbox(fd, uri + 4);
+         return http_map_bbox(hc, uri + 4);
       else if (!strncmp(uri, "changesets", 10))
-         return http_changesets(fd, uri + 10);
+         return http_changesets(hc, uri + 10);
       else if (!strncmp(uri, "capabilities", 12))
-         return http_capabilities(fd, uri + 12);
+         return http_capabilities(hc, uri + 12);
       else
-         return http_proc_api06(fd, uri);
+         return http_proc_api06(hc, uri);
    }
    else if (!strncmp("/api/", uri, 5))
    {
       uri += 5;
       if (!strncmp(uri, "capabilities", 12))
-         return http_capabilities(fd, uri + 12);
+         return http_capabilities(hc, uri + 12);
+      else if (!strncmp(uri, "cache", 5))
+         return http_cache_stats(hc, uri + 5);
       else
          return -404;
    }
@@ -586,6 +658,7 @@ int osm_to_bin(osm_obj_t *o, char *buf, int size)
  * "cmd", "object", and "error". The third parameter depends on the second and
  * qualifies more specifically the type of message.
  * Commands: "next" (get next object of query)
+ *           "next <n>" (get up to n objects of query in batches, see below)
  *           "disconn" (disconnect websocket)
  * Errors: "unexp" (last message was unexpected and thus ignored)
  *         "notsup" (not supported, i.e. msg understood but not supported in that way)
@@ -597,13 +670,32 @@ int osm_to_bin(osm_obj_t *o, char *buf, int size)
  *         "ack" (simple acknoledgement that last command was understood. This is just necessary if the command does not
  *         generate any visible result.)
  * Objects: "node", "way", "relation", "osm".
+ *
+ * The plain command "next" is acknowledged and followed by a single message
+ * containing the bare object. The command "next <n>" is acknowledged as well
+ * and followed by one or more messages of type "object osm" which contain the
+ * objects enclosed in an <osm> element. A message is sent as soon as its
+ * size exceeds the batch size (see option -b of smrenderd). If less than n
+ * objects were available, the last message is followed by "nodata".
+ *
+ * The websocket connection supports the extension permessage-deflate
+ * (RFC7692) which is negotiated with the header Sec-WebSocket-Extensions.
  */
 
 
  
-int http_init_ws(int fd, const char *u, qcache_t **qc)
+/*! Set the size at which batched objects of websocket sessions are flushed.
+ */
+void http_ws_set_batch(int size)
+{
+   ws_batch_ = size;
+}
+
+
+int http_init_ws(http_conn_t *hc, const char *u, qcache_t **qc)
 {
    struct bboxi bbi;
+   char buf[HTTP_LINE_LENGTH];
    int i;
    size_t len;
    //qcache_t *qc;
@@ -622,15 +714,22 @@ int http_init_ws(int fd, const char *u, qcache_t **qc)
    if ((*qc = qc_get_bbi(&bbi)) == NULL)
       return -500;
 
-#define str_write(x, y) write(x, y, strlen(y))
-
-   len = str_write(fd,
+   len = snprintf(buf, sizeof(buf),
          "HTTP/1.1 101 Switching Protocols\r\n"
          "Server: Smrenderd\r\n"
          "Upgrade: websocket\r\n"
-         "Connection: Upgrade\r\n"
-         "\r\n");
-   return len;
+         "Connection: Upgrade\r\n");
+   if (hc->pmd)
+   {
+      len += snprintf(buf + len, sizeof(buf) - len, "Sec-WebSocket-Extensions: permessage-deflate%s",
+            hc->pmd_reset ? "; server_no_context_takeover" : "");
+      if (hc->pmd < 15)
+         len += snprintf(buf + len, sizeof(buf) - len, "; server_max_window_bits=%d", hc->pmd);
+      len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+   }
+   len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+
+   return write(hc->fd, buf, len);
 }
 
 
@@ -797,12 +896,71 @@ int smws_print_onode(websocket_t *ws, const osm_obj_t *o)
 }
 
 
-int http_ws_com(int fd, qcache_t *qc)
+/*! Flush a batch of objects to the websocket.
+ * @param f Memory stream of the batch which is closed.
+ * @param buf Pointer to buffer of the memory stream which is freed.
+ * @return Returns 0 on success, otherwise -1.
+ */
+static int smws_flush(websocket_t *ws, FILE *f, char **buf, size_t *len)
+{
+   int e;
+
+   fputs("</osm>\n", f);
+   fclose(f);
+   log_debug("writing batch of %ld bytes to websocket", (long) *len);
+   e = ws_write(ws, *buf, *len) == -1 ? -1 : 0;
+   free(*buf);
+   *buf = NULL;
+   return e;
+}
+
+
+/*! Send up to cnt objects of the traversal to the websocket. The objects are
+ * batched into messages of type "object osm" which are flushed as soon as
+ * they exceed ws_batch_ bytes.
+ * @return Returns the number of objects sent, or -1 in case of error.
+ */
+static int smws_send_batch(websocket_t *ws, trv_com_t *tc, int cnt)
+{
+   FILE *f = NULL;
+   char *buf = NULL;
+   size_t len;
+   osm_obj_t *o;
+   int n;
+
+   for (n = 0; n < cnt && (o = tc_next(tc)) != NULL; n++)
+   {
+      if (f == NULL)
+      {
+         if ((f = open_memstream(&buf, &len)) == NULL)
+         {
+            log_errno(LOG_ERR, "open_memstream() failed");
+            return -1;
+         }
+         fprintf(f, "SMWS/1.0 %s %s\n<osm version='0.6' generator='smrenderd'>\n", msgt_[WS_MSGT_OBJ], objt_[WS_OBJT_OSM]);
+      }
+      print_onode(f, o);
+      if (ftell(f) >= ws_batch_)
+      {
+         if (smws_flush(ws, f, &buf, &len))
+            return -1;
+         f = NULL;
+      }
+   }
+
+   if (f != NULL && smws_flush(ws, f, &buf, &len))
+      return -1;
+
+   return n;
+}
+
+
+int http_ws_com(http_conn_t *hc, qcache_t *qc)
 {
    websocket_t ws;
    char buf[8000];
    bstring_t b;
-   int msgt, n;
+   int msgt, n, cnt;
    osm_obj_t *o = NULL, *nobj;
    hpx_tree_t *tlist = NULL;
    int disconn = 0, err = 0;
@@ -810,7 +968,7 @@ int http_ws_com(int fd, qcache_t *qc)
    smrule_t *r = NULL;
    trv_com_t tc;
 
-   ws_init(&ws, fd, 1000, 0);
+   ws_init(&ws, hc->fd, WS_FRAME_SIZE, 0);
    tc_init(&tc);
    tc.ot = qc->tree;
 
@@ -819,6 +977,10 @@ int http_ws_com(int fd, qcache_t *qc)
    if ((tlist->tag = hpx_tm_create(16)) == NULL)
       perror("hpx_tm_create"), exit(EXIT_FAILURE);
 
+   // errors leave the loop and share the cleanup below
+   if (hc->pmd && ws_pmd_init(&ws, hc->pmd_reset, hc->pmd))
+      err = -500, disconn++;
+
    for (; !disconn;)
    {
       log_debug("reading frame...");
@@ -826,7 +988,8 @@ int http_ws_com(int fd, qcache_t *qc)
       {
          // FIXME: this error should be handled better
          log_errno(LOG_ERR, "frame buffer too small");
-         return -500;
+         err = -500;
+         break;
       }
       if (!n)
          break;
@@ -872,7 +1035,7 @@ int http_ws_com(int fd, qcache_t *qc)
 
             // add _action_ tag here...
             struct otag *ot;
-            if ((ot = realloc(o->otag, sizeof(*o->otag) * (o->tag_cnt + 1))) == NULL)
+            if ((ot = realloc_mem(o->otag, sizeof(*o->otag) * o->tag_cnt, sizeof(*o->otag) * (o->tag_cnt + 1))) == NULL)
             {
                log_msg(LOG_ERR, "realloc() failed: %s", strerror(errno));
                free_obj(o);
@@ -899,7 +1062,16 @@ int http_ws_com(int fd, qcache_t *qc)
                   break;
 
                case WS_CMDT_NEXT:
-                  if ((nobj = tc_next(&tc)) != NULL)
+                  // batched variant "next <n>"
+                  if (b.len && (n = atoi(b.buf)) > 0)
+                  {
+                     smws_send_error(&ws, WS_ERRT_ACK);
+                     if ((cnt = smws_send_batch(&ws, &tc, n)) == -1)
+                        err = -500, disconn++;
+                     else if (cnt < n)
+                        smws_send_error(&ws, WS_ERRT_NODATA);
+                  }
+                  else if ((nobj = tc_next(&tc)) != NULL)
                   {
                      smws_send_error(&ws, WS_ERRT_ACK);
                      //print_onode(stdout, nobj);
@@ -920,6 +1092,7 @@ int http_ws_com(int fd, qcache_t *qc)
 
    hpx_tm_free_tree(tlist);
    tc_free(&tc);
+   free(r);
    ws_free(&ws);
    log_debug("exiting http_ws_com()");
 
@@ -927,243 +1100,333 @@ int http_ws_com(int fd, qcache_t *qc)
 }
 
 
-int SEND_STATUS(int f, const char *s)
+int SEND_STATUS(http_conn_t *hc, const char *s)
 {
-   int len;
+   struct iovec iov = {(void*) s, strlen(s)};
 
-   if ((len = write(f, s, strlen(s))) == -1)
-      log_errno(LOG_ERR, "write() failed");
-   return len;
+   if (conn_send(hc, &iov, 1) == -1)
+      return -1;
+   return strlen(s);
+}
+
+
+#ifdef WITH_THREADS
+//! websocket session which is handled by a separate thread
+typedef struct http_ws_session
+{
+   http_conn_t *hc;
+   char *uri;
+   char dbuf[HTTP_LINE_LENGTH + 1];
+} http_ws_session_t;
+#endif
+
+
+/*! Run websocket session on connection.
+ * @param dbuf Request line used for logging.
+ * @param uri URI following WS_URI.
+ */
+static void http_ws_run(http_conn_t *hc, const char *dbuf, const char *uri)
+{
+   qcache_t *qc;
+   int err;
+
+   // the session is handled by its own thread which may block
+   if (conn_blocking(hc))
+   {
+      log_access(&hc->saddr, dbuf, 500, 0);
+      return;
+   }
+
+   if ((err = http_init_ws(hc, uri, &qc)) < 0)
+   {
+      log_access(&hc->saddr, dbuf, -err, 0);
+      switch (-err)
+      {
+         case 404:
+            SEND_STATUS(hc, STATUS_404);
+            break;
+         case 500:
+         default:
+            SEND_STATUS(hc, STATUS_500);
+            break;
+      }
+      return;
+   }
+
+   log_access(&hc->saddr, dbuf, 101, 0);
+   err = http_ws_com(hc, qc);
+   qc_release(qc);
+   if (err < 0)
+      log_access(&hc->saddr, dbuf, -err, 0);
+}
+
+
+#ifdef WITH_THREADS
+static void *http_ws_thread(http_ws_session_t *ws)
+{
+   http_ws_run(ws->hc, ws->dbuf, ws->uri);
+   conn_free(ws->hc);
+   free(ws->uri);
+   free(ws);
+   return NULL;
+}
+#endif
+
+
+/*! Start websocket session. Websocket sessions are long-lasting, thus they are
+ * handled by a separate thread (if available) in order not to occupy a thread
+ * of the compute pool.
+ * @return Returns HTTP_DETACH if the session was handed over to a new thread,
+ * otherwise HTTP_CLOSE.
+ */
+static int http_ws_start(http_conn_t *hc, const char *dbuf, const char *uri)
+{
+#ifdef WITH_THREADS
+   http_ws_session_t *ws;
+   pthread_attr_t attr;
+   pthread_t th;
+
+   if ((ws = malloc(sizeof(*ws))) == NULL || (ws->uri = strdup(uri)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      free(ws);
+      SEND_STATUS(hc, STATUS_500);
+      log_access(&hc->saddr, dbuf, 500, 0);
+      return HTTP_CLOSE;
+   }
+   ws->hc = hc;
+   strcpy(ws->dbuf, dbuf);
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   errno = pthread_create(&th, &attr, (void*(*)(void*)) http_ws_thread, ws);
+   pthread_attr_destroy(&attr);
+   if (!errno)
+      return HTTP_DETACH;
+
+   log_errno(LOG_ERR, "pthread_create() failed");
+   free(ws->uri);
+   free(ws);
+#endif
+   http_ws_run(hc, dbuf, uri);
+   return HTTP_CLOSE;
+}
+
+
+/*! Test if the comma-separated list of tokens of a header value contains the
+ * token tok (case-insensitive). Tokens with a quality value of 0 are ignored.
+ * @return Returns 1 if the token is contained, otherwise 0.
+ */
+static int http_has_token(const char *s, const char *tok)
+{
+   int len = strlen(tok);
+   const char *q;
+
+   for (;;)
+   {
+      s += strspn(s, " \t,");
+      if (!*s)
+         return 0;
+      if (!strncasecmp(s, tok, len) && strchr(" \t,;", s[len]) != NULL)
+      {
+         // check for ";q=0"
+         for (q = s + len; *q == ' ' || *q == '\t'; q++);
+         if (*q != ';' || strtod(q + 1 + strspn(q + 1, " \tq="), NULL) > 0)
+            return 1;
+      }
+      s += strcspn(s, ",");
+   }
 }
 
 
-/*! Handle incoming connection.
- *  @param p Pointer to http_thread_t structure.
+/*! Handle a request. The request line and the headers were received into the
+ * buffer of the connection by the event loop already (see smconn.c). This
+ * function is called by a thread of the compute pool, the socket is in
+ * blocking mode.
+ * @param hc Pointer to connection.
+ * @return Returns HTTP_CLOSE if the connection shall be closed by the caller,
+ * HTTP_DETACH if the connection was handed over to a websocket session, or
+ * HTTP_KEEP if the connection is kept alive. In the latter case the request is
+ * removed from the buffer of the connection. It may contain the beginning of
+ * the next (pipelined) request.
  */
-void *handle_http(void *p)
+int http_handle(http_conn_t *hc)
 {
-   int fd;                    //!< local file descriptor
    char buf[HTTP_LINE_LENGTH + 1]; //!< input buffer, method, uri, and ver points to it
-   char dbuf[HTTP_LINE_LENGTH + 1]; //!< copy of input buffer used for logging
+   char dbuf[HTTP_LINE_LENGTH + 1] = ""; //!< copy of input buffer used for logging
    char buf0[HTTP_LINE_LENGTH + 1]; //!< input buffer to parse HTTP headers
    char *sptr;                //!< buffer used for strtok_r()
    char *method, *uri, *ver;  //!< pointers to tokens of request line
    off_t len;                 //!< length of (html) file
    int iver = 0;              //!< variable containing http version (9 = 0.9, 10 = 1.0, 11 = 1.1)
-   struct sockaddr_in saddr;  //!< buffer for socket address of remote end
-   socklen_t addrlen;         //!< variable containing socket address buffer length
-   int headers;
+   int headers, bits, pos = 0;
 
-   for (;;)
+   // read request line from buffer
+   len = http_line(hc, &pos, buf, sizeof(buf) - 1);
+   // check if EOF, or string too long (i.e. not \n-terminated)
+   if (!len || buf[len - 1] != '\n')
    {
-      // accept connections on server socket
-      addrlen = sizeof(saddr);
-      if ((fd = accept(((http_thread_t*)p)->sfd, (struct sockaddr*) &saddr, &addrlen)) == -1)
-         perror("accept"), exit(EXIT_FAILURE);
-
-      log_debug("connection accepted");
-      // read a line from socket
-      if ((len = read_line(fd, buf, sizeof(buf) - 1)) == -1)
-      {
-         eclose(fd);
-         log_access(&saddr, "", 0, 0);
-         continue;
-      } 
-      // check if EOF, or string too long (i.e. not \n-terminated)
-      if (!len || buf[len - 1] != '\n')
+      SEND_STATUS(hc, STATUS_400);
+      log_access(&hc->saddr, dbuf, 400, 0);
+      return HTTP_CLOSE;
+   }
+   // \0-terminate string (and remove '\r\n')
+   if (len > 1 && buf[len - 2] == '\r')
+      buf[len - 2] = '\0';
+   else
+      buf[len - 1] = '\0';
+
+   // make a copy of request line and split into tokens
+   strcpy(dbuf, buf);
+   if ((method = strtok_r(buf, " ", &sptr)) == NULL)
+   {
+      SEND_STATUS(hc, STATUS_400);
+      log_access(&hc->saddr, dbuf, 400, 0);
+      return HTTP_CLOSE;
+   }
+   uri = strtok_r(NULL, " ", &sptr);
+   if ((ver = strtok_r(NULL, " ", &sptr)) != NULL)
+   {
+      // check if protocol version is valid
+      if (!strcmp(ver, "HTTP/1.0"))
+         iver = HTTP_10;
+      else if (!strcmp(ver, "HTTP/1.1"))
+         iver = HTTP_11;
+      else
       {
-         SEND_STATUS(fd, STATUS_400);
-         log_access(&saddr, dbuf, 400, 0);
-         eclose(fd);
-         continue;
+         SEND_STATUS(hc, STATUS_400);
+         log_access(&hc->saddr, dbuf, 400, 0);
+         return HTTP_CLOSE;
       }
-      // \0-terminate string (and remove '\r\n')
-      if (buf[len - 2] == '\r')
-         buf[len - 2] = '\0';
-      else
-         buf[len - 1] = '\0';
+   }
+   // if no protocol version is sent assume version 0.9
+   else
+      iver = HTTP_09;
 
-      // make a copy of request line and split into tokens
-      strcpy(dbuf, buf);
-      method = strtok_r(buf, " ", &sptr);
-      uri = strtok_r(NULL, " ", &sptr);
-      if ((ver = strtok_r(NULL, " ", &sptr)) != NULL)
+   // check if request line contains URI and that it starts with '/'
+   if ((uri == NULL) || (uri[0] != '/'))
+   {
+      SEND_STATUS(hc, STATUS_400);
+      log_access(&hc->saddr, dbuf, 400, 0);
+      return HTTP_CLOSE;
+   }
+
+   // all other methods than "GET" are not implemented
+   if (strcmp(method, "GET"))
+   {
+      SEND_STATUS(hc, STATUS_501);
+      log_access(&hc->saddr, dbuf, 501, 0);
+      return HTTP_CLOSE;
+   }
+
+   log_debug("initial processing of GET");
+   // HTTP/1.1 connections are persistent by default
+   hc->ver = iver;
+   hc->keep = iver == HTTP_11;
+   hc->enc = HTTP_ENC_IDENTITY;
+   hc->pmd = 0;
+
+   // parse HTTP headers (HTTP/0.9 requests have no headers)
+   for (headers = 0; iver != HTTP_09;)
+   {  // ...and check for input errors
+      log_debug("reading HTTP header");
+      len = http_line(hc, &pos, buf0, sizeof(buf0) - 1);
+      if (len <= 0 || buf0[len - 1] != '\n')
       {
-         // check if protocol version is valid
-         if (!strcmp(ver, "HTTP/1.0"))
-            iver = HTTP_10;
-         else if (!strcmp(ver, "HTTP/1.1"))
-            iver = HTTP_11;
-         else
-         {
-            SEND_STATUS(fd, STATUS_400);
-            log_access(&saddr, dbuf, 400, 0);
-            eclose(fd);
-            continue;
-         }
+         SEND_STATUS(hc, STATUS_400);
+         log_access(&hc->saddr, dbuf, 400, 0);
+         return HTTP_CLOSE;
       }
-      // if no protocol version is sent assume version 0.9
-      else
-         iver = HTTP_09;
 
-      // check if request line contains URI and that it starts with '/'
-      if ((uri == NULL) || (uri[0] != '/'))
+      // check for empty line
+      if (buf0[0] == '\r' && buf0[1] == '\n')
       {
-         SEND_STATUS(fd, STATUS_400);
-         log_access(&saddr, dbuf, 400, 0);
-         eclose(fd);
-         continue;
+         log_debug("end of HTTP header found");
+         break;
       }
-
-      // check if request method is "GET"
-      if (!strcmp(method, "GET"))
+      // this is actually not conforming to the RFC
+      if (buf0[0] == '\n')
       {
-         int err;
-
-         log_debug("initial processing of GET");
-         // read HTTP headers 
-         for (headers = 0, err = 0; !err;)
-         {  // ...and check for input errors
-            log_debug("reading HTTP header");
-            len = read_line(fd, buf0, sizeof(buf0) - 1);
-            if (len <= 0 || buf0[len - 1] != '\n')
-            {
-               SEND_STATUS(fd, STATUS_400);
-               log_access(&saddr, dbuf, 400, 0);
-               eclose(fd);
-               err = 1;
-               continue;
-            }
-
-            // check for empty line
-            if (buf0[0] == '\r' && buf0[1] == '\n')
-            {
-               log_debug("end of HTTP header found");
-               break;
-            }
-            // this is actually not conforming to the RFC
-            if (buf0[0] == '\n')
-            {
-               log_debug("end of HTTP header found (only '\\n'-terminated)");
-               break;
-            }
-
-            // headers are not allowed int HTTP/0.9
-            if (iver == HTTP_09)
-            {
-               SEND_STATUS(fd, STATUS_400);
-               log_access(&saddr, dbuf, 400, 0);
-               eclose(fd);
-               err = 1;
-               continue;
-            }
-
-            if (buf0[len - 2] == '\r')
-               buf0[len - 2] = '\0';
-            else
-               buf0[len - 1] = '\0';
+         log_debug("end of HTTP header found (only '\\n'-terminated)");
+         break;
+      }
 
-            // check for websocket upgrade headers
-            if (!strcmp(buf0, "Upgrade: websocket"))
-            {
-               log_debug("Upgrade header");
-               headers |= 1;
-            }
-            else if (!strcmp(buf0, "Connection: Upgrade"))
-            {
-               log_debug("Connection header");
-               headers |= 2;
-            }
-         } // for (headers = 0, err = 0; !err;)
+      if (buf0[len - 2] == '\r')
+         buf0[len - 2] = '\0';
+      else
+         buf0[len - 1] = '\0';
 
-         // fail in case of error during header parser
-         if (err)
-            continue;
+      // check for websocket upgrade headers
+      if (!strcmp(buf0, "Upgrade: websocket"))
+      {
+         log_debug("Upgrade header");
+         headers |= 1;
+      }
+      else if (!strncasecmp(buf0, "Connection:", 11))
+      {
+         log_debug("Connection header");
+         if (http_has_token(buf0 + 11, "Upgrade"))
+            headers |= 2;
+         if (http_has_token(buf0 + 11, "close"))
+            hc->keep = 0;
+      }
+      else if (!strncasecmp(buf0, "Sec-WebSocket-Extensions:", 25))
+      {
+         // the first acceptable offer is taken
+         if (!hc->pmd && ws_pmd_parse(buf0 + 25, 0, &hc->pmd_reset, &bits))
+            hc->pmd = bits;
+      }
+#ifdef HAVE_ZLIB
+      else if (!strncasecmp(buf0, "Accept-Encoding:", 16))
+      {
+         if (http_has_token(buf0 + 16, "gzip"))
+            hc->enc = HTTP_ENC_GZIP;
+         else if (http_has_token(buf0 + 16, "deflate"))
+            hc->enc = HTTP_ENC_DEFLATE;
+      }
+#endif
+   }
 
-         if ((headers & 3) == 3 && !strncmp(uri, WS_URI, strlen(WS_URI)))
-         {
-            // websocket request only allowed in HTTP/1.1
-            if (iver == HTTP_11)
-            {
-               qcache_t *qc;
-               int err;
-
-               log_msg(LOG_INFO, "websocket request");
-               if ((err = http_init_ws(fd, uri + strlen(WS_URI), &qc)) < 0)
-               {
-                  log_access(&saddr, dbuf, -err, 0);
-                  switch (-err)
-                  {
-                     case 404:
-                        SEND_STATUS(fd, STATUS_404);
-                        break;
-                     case 500:
-                     default:
-                        SEND_STATUS(fd, STATUS_500);
-                        break;
-                  }
-                  continue;
-               }
-
-               log_access(&saddr, dbuf, 101, 0);
-               err = http_ws_com(fd, qc);
-               qc_release(qc);
-               // FIXME: if http_ws_com() returns, should it not always close the connection?
-               if (err < 0)
-               {
-                  log_access(&saddr, dbuf, -err, 0);
-                  eclose(fd);
-                  continue;
-               }
-            }
-            else
-            {
-               SEND_STATUS(fd, STATUS_400);
-               log_access(&saddr, dbuf, 400, 0);
-               eclose(fd);
-               continue;
-            }
-         }
-         else
-         {
-            len = http_proc_get(fd, uri);
-            http_flush_input_headers(fd);
+   if ((headers & 3) == 3 && !strncmp(uri, WS_URI, strlen(WS_URI)))
+   {
+      // websocket request only allowed in HTTP/1.1
+      if (iver != HTTP_11)
+      {
+         SEND_STATUS(hc, STATUS_400);
+         log_access(&hc->saddr, dbuf, 400, 0);
+         return HTTP_CLOSE;
+      }
 
-            if (len < 0)
-            {
-               log_debug("http_proc_get returned %ld", (long) len);
-               switch (len)
-               {
-                  case -500:
-                     SEND_STATUS(fd, STATUS_500);
-                     log_access(&saddr, dbuf, 500, 0);
-                     break;
-
-                  case -404:
-                  default:
-                     SEND_STATUS(fd, STATUS_404);
-                     log_access(&saddr, dbuf, 404, 0);
-               }
-               eclose(fd);
-            }
-            else
-               log_access(&saddr, dbuf, 200, len);
-         }
+      log_msg(LOG_INFO, "websocket request");
+      return http_ws_start(hc, dbuf, uri + strlen(WS_URI));
+   }
 
-         // http_proc_get() closes fd in case of success
-         //eclose(fd);
-      } // if (!strcmp(method, "GET"))
-      // all other methods are not implemented
-      else
+   if ((len = http_proc_get(hc, uri)) < 0)
+   {
+      log_debug("http_proc_get returned %ld", (long) len);
+      switch (len)
       {
-         http_flush_input_headers(fd);
-         SEND_STATUS(fd, STATUS_501);
-         log_access(&saddr, dbuf, 501, 0);
-         eclose(fd);
+         case -500:
+            SEND_STATUS(hc, STATUS_500);
+            log_access(&hc->saddr, dbuf, 500, 0);
+            break;
+
+         case -404:
+         default:
+            SEND_STATUS(hc, STATUS_404);
+            log_access(&hc->saddr, dbuf, 404, 0);
       }
    }
+   else
+      log_access(&hc->saddr, dbuf, 200, len);
 
-   return NULL;
+   if (len < 0 || !hc->keep)
+      return HTTP_CLOSE;
+
+   // remove request from buffer
+   memmove(hc->buf, hc->buf + pos, hc->len - pos);
+   hc->len -= pos;
+   return HTTP_KEEP;
 }
 
 
@@ -1190,83 +1453,23 @@ int httpd_init(struct smhttpd *smd)
       perror("bind"), exit(EXIT_FAILURE);
 
    // make it listening
-   if (listen(smd->fd, MAX_CONNS + 5) == -1)
+   if (listen(smd->fd, SOMAXCONN) == -1)
       perror("listen"), exit(EXIT_FAILURE);
 
-//#define SINGLE_THREADED
-#ifdef SINGLE_THREADED
-   smd->max_conns = 0;
-   smd->htth[0].n = 0;
-   smd->htth[0].sfd = smd->fd;
-   handle_http(&smd->htth[0]);
-   return 0;
-#endif
-   // create session handler tasks
-   for (int i = 0; i < smd->max_conns; i++)
-   {
-      smd->htth[i].n = i;
-      smd->htth[i].sfd = smd->fd;
-#ifdef WITH_THREADS
-      if ((errno = pthread_create(&smd->htth[i].th, NULL, handle_http, (void*) &smd->htth[i])))
-         perror("pthread_create"), exit(EXIT_FAILURE);
-#else
-      switch ((smd->htth[i].pid = fork()))
-      {
-         case -1:
-            perror("fork");
-            exit(EXIT_FAILURE);
-
-         // child
-         case 0:
-            handle_http((void*) &smd->htth[i]);
-            exit(EXIT_SUCCESS);
-
-      }
-#endif
-   }
    return 0;
 }
 
 
-int httpd_wait(struct smhttpd *smd)
+int main_smrenderd(void)
 {
-#ifndef WITH_THREADS
-   int so;
-#endif
+   struct smhttpd smd;
 
-   // join threads
-   for (int i = 0; i < smd->max_conns; i++)
-#ifdef WITH_THREADS
-      if ((errno = pthread_join(smd->htth[i].th, NULL)))
-         perror("pthread_join"), exit(EXIT_FAILURE);
-#else
-      if (wait(&so) == -1)
-         perror("wait"), exit(EXIT_FAILURE);
-#endif
+   httpd_init(&smd);
+   httpd_loop(smd.fd);
 
    // close server socket
-   if (close(smd->fd) == -1)
+   if (close(smd.fd) == -1)
       perror("close"), exit(EXIT_FAILURE);
 
    return 0;
 }
-
-
-int main_smrenderd(void)
-{
-   struct smhttpd *smd;
-
-   if ((smd = malloc(sizeof(*smd) + sizeof(*smd->htth) * MAX_CONNS)) == NULL)
-      perror("malloc"), exit(EXIT_FAILURE);
-
-   smd->max_conns = MAX_CONNS;
-   smd->htth = (http_thread_t*) (smd + 1);
-
-   httpd_init(smd);
-   httpd_wait(smd);
-
-   free(smd);
-
-   return 0;
-}
-
@@ -34,6 +34,7 @@
 #ifdef WITH_THREADS
 #include <pthread.h>
 #endif
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -44,12 +45,38 @@
 #define HTTP_10 10
 #define HTTP_11 11
 
+//! content encodings of responses
+#define HTTP_ENC_IDENTITY 0
+#define HTTP_ENC_GZIP 1
+#define HTTP_ENC_DEFLATE 2
+
+//! return values of http_handle()
+#define HTTP_CLOSE 0
+#define HTTP_DETACH 1
+#define HTTP_KEEP 2
+
 //! default listening port number
 #define DEF_PORT 8080
-//! number of sessions handled concurrently
-#define MAX_CONNS 25
+//! maximum number of connections handled concurrently
+#define HTTP_MAX_CONNS 1000
+//! maximum number of threads of the compute pool
+#define HTTP_MAX_WORKERS 16
 //! buffer length of lines being received
 #define HTTP_LINE_LENGTH 1024
+//! maximum length of the request line and the headers of a request
+#define HTTP_HDR_MAX 8192
+//! timeout in seconds for receiving a request and for sending data
+#define HTTP_TIMEOUT 30
+//! size of the output buffer of responses
+#define HTTP_WBUF 65536
+//! maximum amount of pending output of a connection kept in memory
+#define HTTP_OBUF_MAX (1024L * 1024)
+//! temporary file for pending output exceeding HTTP_OBUF_MAX
+#define HTTP_OBUF_FILE "/tmp/smrenderdXXXXXX"
+//! maximum size of a compressed response which is kept in the cache
+#define HTTP_CAP_MAX (16L * 1024 * 1024)
+//! default size at which batched objects of a websocket session are flushed
+#define HTTP_WS_BATCH 16384
 //! root path of contents (must be full path)
 #define DOC_ROOT "/home/eagle"
 
@@ -58,6 +85,7 @@
 #define STATUS_501 "HTTP/1.0 501 Not Implemented\r\n\r\n<html><body><h1>501 -- METHOD NOT IMPLEMENTED</h1></body></html>\r\n"
 #define STATUS_400 "HTTP/1.0 400 Bad Request\r\n\r\n<html><body><h1>400 -- BAD REQUEST</h1></body></html>\r\n"
 #define STATUS_200 "HTTP/1.0 200 OK\r\n"
+#define STATUS_200_11 "HTTP/1.1 200 OK\r\n"
 #define STATUS_404 "HTTP/1.0 404 Not Found\r\n\r\n<html><body><h1>404 -- NOT FOUND</h1></body></html>\r\n"
 
 
@@ -65,23 +93,52 @@
 #define API06_URI "/api/0.6/"
 #define WS_URI "/ws/"
 
-//! data structure handled over to threads
-typedef struct http_thread
+//! client connection
+typedef struct http_conn
 {
-#ifdef WITH_THREADS
-   pthread_t th;
-#else
-   pid_t pid;
-#endif
-   int n;
-   int sfd;
-} http_thread_t;
+   int fd;                       //!< socket of connection
+   struct sockaddr_in saddr;     //!< address of remote end
+   time_t tim;                   //!< time of last activity
+   int len;                      //!< number of bytes in buf
+   char buf[HTTP_HDR_MAX + 1];   //!< request line and headers
+   int ver;                      //!< HTTP version of current request
+   int keep;                     //!< 1 if connection is kept open after the response
+   int enc;                      //!< content encoding of the response, HTTP_ENC_xxx
+   struct http_out *out;         //!< response stream, see smresp.c
+   char *cap;                    //!< captured response body, see resp_open()
+   size_t cap_len;               //!< length of captured body
+   char *obuf;                   //!< output which was not sent yet, see conn_send()
+   size_t olen, opos, osize;     //!< length, position of next byte to send, and size of obuf
+   int ofd;                      //!< temporary file of output exceeding HTTP_OBUF_MAX, -1 if none
+   off_t ooff, oflen;            //!< position of next byte to send and length of ofd
+   int pmd;                      //!< window bits of permessage-deflate if offered by the websocket client, otherwise 0
+   int pmd_reset;                //!< 1 if the client requested server_no_context_takeover
+   //! list of connections of the event loop, or queue of the compute pool
+   struct http_conn *prev, *next;
+} http_conn_t;
 
 
 int main_smrenderd(void);
+int http_handle(http_conn_t *);
+void http_ws_set_batch(int );
+int set_nonblock(int );
+
+/* smconn.c */
+int httpd_loop(int );
+void conn_free(http_conn_t *);
+int conn_send(http_conn_t *, struct iovec *, int );
+int conn_blocking(http_conn_t *);
+
+/* smresp.c */
+FILE *resp_open(http_conn_t *, int);
+void resp_begin(http_conn_t *, FILE *, int);
+void resp_abort(http_conn_t *);
+const char *resp_enc_str(int);
 
 /* smdb.c */
 bx_node_t *get_obj_bb(bx_node_t *, const struct bbox *);
+bx_node_t *get_obj_bb_tree(bx_node_t *, bx_node_t *, const struct bbox *);
+long stream_obj_bb(FILE *, bx_node_t *, bx_node_t *, const struct bbox *, bx_node_t **);
 
 
 #endif
@@ -8,6 +8,7 @@
 #include "smrender.h"
 #include "smloadosm.h"
 #include "smcore.h"
+#include "smcache.h"
 #include "libhpxml.h"
 
 
@@ -27,6 +28,15 @@ static int free_objects(osm_obj_t *o, void * UNUSED(p))
 }
 
 
+static void usage(const char *s)
+{
+   printf("usage: %s [OPTIONS] [<osm input file>]\n"
+         "   -b <bytes> ... Size of batched websocket messages (default %d).\n"
+         "   -c <MB> ...... Memory budget of the query cache (default %ld MB).\n",
+         s, HTTP_WS_BATCH, QC_BUDGET / (1024 * 1024));
+}
+
+
 int main(int argc, char **argv)
 {
    char *osm_ifile = "/dev/stdin";
@@ -36,12 +46,44 @@ int main(int argc, char **argv)
    struct stat st;
    int w_mmap = 1;
    int fd = 0;
+   int n;
 
    (void) init_log("stderr", LOG_DEBUG);
+
+   while ((n = getopt(argc, argv, "b:c:h")) != -1)
+      switch (n)
+      {
+         case 'b':
+            if ((n = atoi(optarg)) < 0)
+            {
+               log_msg(LOG_ERR, "illegal batch size %s", optarg);
+               exit(EXIT_FAILURE);
+            }
+            http_ws_set_batch(n);
+            break;
+
+         case 'c':
+            if ((n = atoi(optarg)) <= 0)
+            {
+               log_msg(LOG_ERR, "illegal cache size %s", optarg);
+               exit(EXIT_FAILURE);
+            }
+            qc_set_budget((size_t) n * 1024 * 1024);
+            break;
+
+         case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+
+         default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+      }
+
    (void) init_threads(0);
 
-   if (argc > 1)
-      osm_ifile = argv[1];
+   if (optind < argc)
+      osm_ifile = argv[optind];
 
    if ((osm_ifile != NULL) && ((fd = open(osm_ifile, O_RDONLY)) == -1))
       log_msg(LOG_ERR, "cannot open file %s: %s", osm_ifile, strerror(errno)),
@@ -70,11 +112,14 @@ int main(int argc, char **argv)
    traverse(*get_objtree(), 0, IDX_WAY, (tree_func_t) rev_index_way_nodes, &index_);
    log_msg(LOG_INFO, "creating reverse pointers from relation members to relations");
    traverse(*get_objtree(), 0, IDX_REL, (tree_func_t) rev_index_rel_nodes, &index_);
+   if (spidx_main_init(0))
+      log_msg(LOG_WARN, "cannot build spatial index, queries will traverse all nodes");
 
    main_smrenderd();
    (void) close(ctl->fd);
    hpx_free(ctl);
 
+   spidx_main_free();
    log_debug("freeing main objects");
    traverse(*get_objtree(), 0, IDX_REL, free_objects, NULL);
    traverse(*get_objtree(), 0, IDX_WAY, free_objects, NULL);
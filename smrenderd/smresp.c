@@ -0,0 +1,316 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smresp.c
+ * This file contains the response stream of smrenderd. The handlers write
+ * their response to a stdio stream (see resp_open()) which is implemented with
+ * fopencookie(3). The headers are passed to conn_send() unmodified. After
+ * resp_begin() the body is compressed according to the content encoding of the
+ * connection and sent with chunked transfer encoding if the connection is kept
+ * alive. Optionally, the encoded body is captured in memory to be stored in
+ * the query cache.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+// fopencookie()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "smrender.h"
+#include "smhttp.h"
+
+
+//! state of a response stream
+typedef struct http_out
+{
+   http_conn_t *hc;
+   int body;         //!< 1 after the headers were written
+   int chunked;      //!< 1 if chunked transfer encoding is used
+   int enc;          //!< content encoding, 0 if the body is passed unmodified
+   int capture;      //!< 1 if the body is captured
+   int err;          //!< set to 1 on error
+   size_t cap_size;  //!< allocated size of hc->cap
+#ifdef HAVE_ZLIB
+   z_stream zs;
+   unsigned char zbuf[HTTP_WBUF];
+#endif
+} http_out_t;
+
+
+//! Return the token of a content encoding.
+const char *resp_enc_str(int enc)
+{
+   switch (enc)
+   {
+      case HTTP_ENC_GZIP:
+         return "gzip";
+      case HTTP_ENC_DEFLATE:
+         return "deflate";
+      default:
+         return "identity";
+   }
+}
+
+
+//! Append data to the captured body. Capturing is given up if it grows too large.
+static void resp_capture(http_out_t *out, const void *buf, size_t len)
+{
+   http_conn_t *hc = out->hc;
+   size_t size;
+   char *cap;
+
+   if (hc->cap_len + len > out->cap_size)
+   {
+      for (size = out->cap_size ? out->cap_size : HTTP_WBUF; size < hc->cap_len + len; size *= 2);
+      if (size > HTTP_CAP_MAX || (cap = realloc(hc->cap, size)) == NULL)
+      {
+         log_debug("response too large, not capturing");
+         free(hc->cap);
+         hc->cap = NULL;
+         hc->cap_len = 0;
+         out->capture = 0;
+         return;
+      }
+      hc->cap = cap;
+      out->cap_size = size;
+   }
+   memcpy(hc->cap + hc->cap_len, buf, len);
+   hc->cap_len += len;
+}
+
+
+//! Send encoded data of the body, framed as chunk if applicable.
+static int resp_emit(http_out_t *out, const void *buf, size_t len)
+{
+   struct iovec iov[3];
+   char hdr[24];
+
+   if (!len)
+      return 0;
+
+   if (out->capture)
+      resp_capture(out, buf, len);
+
+   iov[1].iov_base = (void*) buf;
+   iov[1].iov_len = len;
+   if (!out->chunked)
+      return conn_send(out->hc, &iov[1], 1);
+
+   iov[0].iov_base = hdr;
+   iov[0].iov_len = snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+   iov[2].iov_base = "\r\n";
+   iov[2].iov_len = 2;
+   return conn_send(out->hc, iov, 3);
+}
+
+
+#ifdef HAVE_ZLIB
+/*! Compress data into the output buffer and emit it whenever it is full.
+ * @param flush Z_NO_FLUSH or Z_FINISH.
+ */
+static int resp_deflate(http_out_t *out, const char *buf, size_t len, int flush)
+{
+   int e;
+
+   out->zs.next_in = (unsigned char*) buf;
+   out->zs.avail_in = len;
+   do
+   {
+      if ((e = deflate(&out->zs, flush)) == Z_STREAM_ERROR)
+      {
+         log_msg(LOG_ERR, "deflate() failed: %s", out->zs.msg ? out->zs.msg : "");
+         return -1;
+      }
+      if (!out->zs.avail_out || (flush == Z_FINISH && e == Z_STREAM_END))
+      {
+         if (resp_emit(out, out->zbuf, sizeof(out->zbuf) - out->zs.avail_out))
+            return -1;
+         out->zs.next_out = out->zbuf;
+         out->zs.avail_out = sizeof(out->zbuf);
+      }
+   }
+   while (out->zs.avail_in || (flush == Z_FINISH && e != Z_STREAM_END));
+
+   return 0;
+}
+#endif
+
+
+static ssize_t resp_write(http_out_t *out, const char *buf, size_t size)
+{
+   struct iovec iov = {(void*) buf, size};
+   int e;
+
+   if (out->err)
+      return -1;
+
+   if (!out->body)
+      e = conn_send(out->hc, &iov, 1);
+#ifdef HAVE_ZLIB
+   else if (out->enc)
+      e = resp_deflate(out, buf, size, Z_NO_FLUSH);
+#endif
+   else
+      e = resp_emit(out, buf, size);
+
+   if (e)
+   {
+      out->err = 1;
+      return -1;
+   }
+   return size;
+}
+
+
+/*! Finish the body and free the stream. The connection is not kept alive if
+ * an error occurred because the response is incomplete.
+ */
+static int resp_close(http_out_t *out)
+{
+   struct iovec iov = {"0\r\n\r\n", 5};
+   http_conn_t *hc = out->hc;
+   int err;
+
+#ifdef HAVE_ZLIB
+   if (out->enc)
+   {
+      if (!out->err && resp_deflate(out, NULL, 0, Z_FINISH))
+         out->err = 1;
+      (void) deflateEnd(&out->zs);
+   }
+#endif
+
+   // last chunk
+   if (out->body && out->chunked && !out->err && conn_send(hc, &iov, 1))
+      out->err = 1;
+
+   if (out->err || !out->capture)
+   {
+      free(hc->cap);
+      hc->cap = NULL;
+      hc->cap_len = 0;
+   }
+   if (out->err)
+      hc->keep = 0;
+
+   err = out->err;
+   hc->out = NULL;
+   free(out);
+   return err ? -1 : 0;
+}
+
+
+/*! Open the response stream of the connection. The output is buffered by
+ * HTTP_WBUF bytes. The stream must be closed with fclose().
+ * @param hc Pointer to connection.
+ * @param capture If 1, the body is captured into hc->cap and hc->cap_len if
+ * it is written completely and if it does not exceed HTTP_CAP_MAX. The caller
+ * has to free hc->cap after fclose().
+ * @return Returns a pointer to the stream or NULL in case of error.
+ */
+FILE *resp_open(http_conn_t *hc, int capture)
+{
+   cookie_io_functions_t io = {NULL, (cookie_write_function_t*) resp_write, NULL, (cookie_close_function_t*) resp_close};
+   http_out_t *out;
+   FILE *f;
+
+   if ((out = calloc(1, sizeof(*out))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return NULL;
+   }
+   out->hc = hc;
+   out->capture = capture;
+
+   if ((f = fopencookie(out, "w", io)) == NULL)
+   {
+      log_errno(LOG_ERR, "fopencookie() failed");
+      free(out);
+      return NULL;
+   }
+   setvbuf(f, NULL, _IOFBF, HTTP_WBUF);
+
+   hc->out = out;
+   hc->cap = NULL;
+   hc->cap_len = 0;
+   return f;
+}
+
+
+/*! Start the body of the response. Everything which was written to f before
+ * is sent unmodified.
+ * @param hc Pointer to connection.
+ * @param f Response stream of the connection.
+ * @param encode If 1, the body is compressed according to hc->enc and sent
+ * with chunked transfer encoding if the connection is kept alive. If 0, the
+ * body is sent unmodified, i.e. its length was sent in the headers.
+ */
+void resp_begin(http_conn_t *hc, FILE *f, int encode)
+{
+   http_out_t *out = hc->out;
+
+   (void) fflush(f);
+   out->body = 1;
+   if (!encode)
+   {
+      out->capture = 0;
+      return;
+   }
+
+   out->chunked = hc->keep;
+#ifdef HAVE_ZLIB
+   if (hc->enc != HTTP_ENC_IDENTITY)
+   {
+      // windowBits + 16 selects the gzip format
+      if (deflateInit2(&out->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+               hc->enc == HTTP_ENC_GZIP ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+         log_msg(LOG_ERR, "deflateInit2() failed");
+         out->err = 1;
+         return;
+      }
+      out->enc = hc->enc;
+      out->zs.next_out = out->zbuf;
+      out->zs.avail_out = sizeof(out->zbuf);
+   }
+#endif
+}
+
+
+/*! Mark the response as failed. The body is not terminated properly, thus the
+ * client can detect the error, and the connection is closed afterwards.
+ */
+void resp_abort(http_conn_t *hc)
+{
+   if (hc->out != NULL)
+      hc->out->err = 1;
+}
+
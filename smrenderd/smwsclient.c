@@ -1,6 +1,8 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+// strcasestr()
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,12 +25,17 @@ ssize_t write_log(int fd, const void *buf, size_t len)
 }
 
 
-int ws_connect(void)
+/*! Connect to smrenderd and initialize the websocket. The extension
+ * permessage-deflate is offered and enabled if the server accepts it.
+ */
+int ws_connect(websocket_t *ws)
 {
    struct sockaddr_in saddr;
    uint16_t port = 8080;
-   char buf[256] = "GET /ws/?bbox=14.7,43.9,14.9,44.1 HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n\r\n";
-   int fd, len;
+   char buf[1024] = "GET /ws/?bbox=14.7,43.9,14.9,44.1 HTTP/1.1\r\nConnection: Upgrade\r\nUpgrade: websocket\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n\r\n";
+   char *s;
+   int fd, len, reset, bits;
 
    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
       log_errno(LOG_ERR, "socket() failed"), exit(1);
@@ -44,23 +51,32 @@ int ws_connect(void)
    write_log(fd, buf, strlen(buf));
 
    // read answer
-   if ((len = read(fd, buf, sizeof(buf))) == -1)
+   if ((len = read(fd, buf, sizeof(buf) - 1)) == -1)
       log_errno(LOG_ERR, "read() failed"), exit(1);
 
    write_log(1, buf, len);
+   buf[len] = '\0';
+
+   ws_init(ws, fd, WS_FRAME_SIZE, 1);
+   if ((s = strcasestr(buf, "\nSec-WebSocket-Extensions:")) != NULL)
+   {
+      s += 27;
+      s[strcspn(s, "\r\n")] = '\0';
+      if (ws_pmd_parse(s, 1, &reset, &bits) && ws_pmd_init(ws, reset, bits))
+         exit(1);
+   }
+
    return fd;
 }
 
 
 int main(int UNUSED(argc), char **UNUSED(argv))
 {
-   char buf[8000];
+   static char buf[1024 * 1024];
    websocket_t ws;
    int fd, plen, len;
 
-   fd = ws_connect();
-
-   ws_init(&ws, fd, 1000, 1);
+   fd = ws_connect(&ws);
 
    for (int eof = 0; !eof;)
    {
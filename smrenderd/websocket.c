@@ -17,7 +17,7 @@
 
 /*! \file websocket.c
  * This file implements the functions for the Websocket protocol according to
- * RFC6455.
+ * RFC6455, and the permessage-deflate extension according to RFC7692.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -360,18 +360,239 @@ void ws_init(websocket_t *ws, int fd, int size, int mask)
    ws->size = size;
    ws->mask = mask;
    ws->op = WS_OP_BIN;
+   ws->pmd = 0;
+   ws->pmd_reset = 0;
 }
 
 
-void ws_free(websocket_t * UNUSED(ws))
+void ws_free(websocket_t *ws)
 {
-   // nothing to free yet
+#ifdef HAVE_ZLIB
+   if (ws->pmd)
+   {
+      (void) deflateEnd(&ws->zd);
+      (void) inflateEnd(&ws->zi);
+      ws->pmd = 0;
+   }
+#else
+   (void) ws;
+#endif
+}
+
+
+/*! Parse the value of a Sec-WebSocket-Extensions header for the extension
+ * permessage-deflate. On the server side s contains the offers of the client,
+ * the first acceptable offer is taken. On the client side s contains the
+ * response of the server. Only the parameters of the own compressor are taken
+ * into account because the decompressor always uses the maximum window size.
+ * @param s Value of header.
+ * @param client 0 on the server side, 1 on the client side.
+ * @param reset Pointer to variable which receives 1 if the own compressor has
+ * to reset its context after each message (*_no_context_takeover).
+ * @param bits Pointer to variable which receives the window bits of the own
+ * compressor (*_max_window_bits).
+ * @return Returns 1 if permessage-deflate shall be used, otherwise 0.
+ */
+int ws_pmd_parse(const char *s, int client, int *reset, int *bits)
+{
+#ifdef HAVE_ZLIB
+   const char *own = client ? "client_" : "server_";
+   const char *name;
+   int ok, mine, nlen, v;
+   char *end;
+
+   for (; *s; s += strcspn(s, ","))
+   {
+      s += strspn(s, " \t,");
+      if (strncmp(s, "permessage-deflate", 18) || strchr(" \t;,", s[18]) == NULL)
+         continue;
+
+      s += 18;
+      ok = 1;
+      *reset = 0;
+      *bits = 15;
+      for (s += strspn(s, " \t"); *s == ';'; s += strspn(s, " \t"))
+      {
+         s++;
+         s += strspn(s, " \t");
+         name = s;
+         nlen = strcspn(s, " \t=;,");
+         s += nlen + strspn(s + nlen, " \t");
+         v = -1;
+         if (*s == '=')
+         {
+            s++;
+            s += strspn(s, " \t\"");
+            v = strtol(s, &end, 10);
+            s = end + strspn(end, "\"");
+         }
+
+         // parameters of the compressor of the other side are accepted as is
+         // because the decompressor always uses the maximum window size
+         if (nlen < 8 || (strncmp(name, "client_", 7) && strncmp(name, "server_", 7)))
+         {
+            ok = 0;
+            continue;
+         }
+         mine = !strncmp(name, own, 7);
+         name += 7;
+         nlen -= 7;
+
+         if (nlen == 19 && !strncmp(name, "no_context_takeover", nlen))
+         {
+            if (mine)
+               *reset = 1;
+         }
+         else if (nlen == 15 && !strncmp(name, "max_window_bits", nlen))
+         {
+            if (!mine || v == -1)
+               continue;
+            // zlib does not support 8 bits for raw deflate streams
+            if (v < 9 || v > 15)
+               ok = 0;
+            else
+               *bits = v;
+         }
+         else
+            ok = 0;
+      }
+
+      if (ok)
+         return 1;
+   }
+#else
+   (void) s, (void) client, (void) reset, (void) bits;
+#endif
+   return 0;
+}
+
+
+/*! Initialize permessage-deflate on the websocket.
+ * @param reset 1 if the compression context shall be reset after each
+ * message.
+ * @param bits Window bits of the compressor (9 - 15).
+ * @return Returns 0 on success, otherwise -1.
+ */
+int ws_pmd_init(websocket_t *ws, int reset, int bits)
+{
+#ifdef HAVE_ZLIB
+   memset(&ws->zd, 0, sizeof(ws->zd));
+   memset(&ws->zi, 0, sizeof(ws->zi));
+   if (deflateInit2(&ws->zd, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+   {
+      log_msg(LOG_ERR, "deflateInit2() failed");
+      return -1;
+   }
+   if (inflateInit2(&ws->zi, -15) != Z_OK)
+   {
+      log_msg(LOG_ERR, "inflateInit2() failed");
+      (void) deflateEnd(&ws->zd);
+      return -1;
+   }
+   ws->pmd = 1;
+   ws->pmd_reset = reset;
+   log_debug("permessage-deflate enabled, reset = %d, window bits = %d", reset, bits);
+   return 0;
+#else
+   (void) ws, (void) reset, (void) bits;
+   return -1;
+#endif
+}
+
+
+#ifdef HAVE_ZLIB
+/*! Compress a message according to RFC7692.
+ * @param len Pointer to variable which receives the length of the compressed
+ * message.
+ * @return Returns a pointer to the compressed message which has to be freed
+ * by the caller, or NULL in case of error.
+ */
+static char *ws_deflate(websocket_t *ws, const char *buf, int size, int *len)
+{
+   int osize;
+   char *out;
+
+   osize = deflateBound(&ws->zd, size) + 16;
+   if ((out = malloc(osize)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return NULL;
+   }
+
+   ws->zd.next_in = (unsigned char*) buf;
+   ws->zd.avail_in = size;
+   ws->zd.next_out = (unsigned char*) out;
+   ws->zd.avail_out = osize;
+   if (deflate(&ws->zd, Z_SYNC_FLUSH) != Z_OK || ws->zd.avail_in || !ws->zd.avail_out)
+   {
+      log_msg(LOG_ERR, "deflate() failed");
+      free(out);
+      return NULL;
+   }
+   *len = osize - ws->zd.avail_out;
+
+   // remove the empty stored block (0x00 0x00 0xff 0xff) of the flush
+   if (*len >= 4 && !memcmp(out + *len - 4, "\0\0\xff\xff", 4))
+      *len -= 4;
+
+   if (ws->pmd_reset)
+      (void) deflateReset(&ws->zd);
+
+   return out;
+}
+
+
+/*! Decompress a message in place according to RFC7692.
+ * @param buf Buffer containing the compressed message.
+ * @param len Length of compressed message.
+ * @param size Total size of buf.
+ * @return Returns the length of the decompressed message or -1 in case of
+ * error. If the buffer is too small, errno is set to ENOMEM.
+ */
+static int ws_inflate(websocket_t *ws, char *buf, int len, int size)
+{
+   static unsigned char tail[] = {0, 0, 0xff, 0xff};
+   char *out;
+   int e;
+
+   if ((out = malloc(size)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+
+   ws->zi.next_in = (unsigned char*) buf;
+   ws->zi.avail_in = len;
+   ws->zi.next_out = (unsigned char*) out;
+   ws->zi.avail_out = size;
+   e = inflate(&ws->zi, Z_SYNC_FLUSH);
+   if ((e == Z_OK || e == Z_BUF_ERROR) && !ws->zi.avail_in)
+   {
+      ws->zi.next_in = tail;
+      ws->zi.avail_in = sizeof(tail);
+      e = inflate(&ws->zi, Z_SYNC_FLUSH);
+   }
+
+   if ((e != Z_OK && e != Z_BUF_ERROR) || ws->zi.avail_in)
+   {
+      log_msg(LOG_ERR, "inflate() failed: %d", e);
+      free(out);
+      if (ws->zi.avail_in)
+         errno = ENOMEM;
+      return -1;
+   }
+
+   len = size - ws->zi.avail_out;
+   memcpy(buf, out, len);
+   free(out);
+   return len;
 }
+#endif
 
 
 /* Note: ws->op and ws->mask must be initialized
  */
-int ws_write(websocket_t *ws, const char *buf, int size)
+static int ws_write0(websocket_t *ws, const char *buf, int size, int rsv)
 {
    char frmbuf[ws->size];
    ws_frame_t wf;
@@ -381,7 +602,7 @@ int ws_write(websocket_t *ws, const char *buf, int size)
 
    for (wlen = 0; size > 0; wlen += wf.plen)
    {
-      wf.op = wlen ? 0 : ws->op & 0xf;
+      wf.op = wlen ? 0 : (ws->op & 0xf) | rsv;
 
       len = size;
       // determine header and payload length
@@ -435,11 +656,37 @@ int ws_write(websocket_t *ws, const char *buf, int size)
 }
 
 
+/*! Write a message to the websocket. If permessage-deflate is enabled, the
+ * message is compressed unless it is very short.
+ * @return Returns the number of bytes written (without frame headers) or -1
+ * in case of error.
+ */
+int ws_write(websocket_t *ws, const char *buf, int size)
+{
+#ifdef HAVE_ZLIB
+   char *zbuf;
+   int len;
+
+   if (ws->pmd && size >= WS_PMD_MIN)
+   {
+      if ((zbuf = ws_deflate(ws, buf, size, &len)) == NULL)
+         return -1;
+      len = ws_write0(ws, zbuf, len, WS_RSV1);
+      free(zbuf);
+      return len;
+   }
+#endif
+   return ws_write0(ws, buf, size, 0);
+}
+
+
 int ws_read(websocket_t *ws, char *buf, int size)
 {
    char frmbuf[ws->size];
    ws_frame_t wf;
-   int len, rlen;
+   int len, rlen, rsv = 0;
+   char *mbuf = buf;
+   int msize = size;
 
    wf.buf = frmbuf;
    wf.op = 0;
@@ -455,6 +702,10 @@ int ws_read(websocket_t *ws, char *buf, int size)
       if (!len)
          return 0;
 
+      // RSV1 of the first frame marks a compressed message
+      if (!rlen)
+         rsv = wf.op & WS_RSV1;
+
       // check dest buffer size
       if (size < wf.plen)
       {
@@ -484,6 +735,19 @@ int ws_read(websocket_t *ws, char *buf, int size)
       size -= wf.plen;
    }
 
+#ifdef HAVE_ZLIB
+   if (rsv && ws->pmd)
+      return ws_inflate(ws, mbuf, rlen, msize);
+#endif
+   if (rsv)
+   {
+      log_msg(LOG_ERR, "compressed message received but permessage-deflate was not negotiated");
+      errno = EPROTO;
+      return -1;
+   }
+   (void) mbuf;
+   (void) msize;
+
    return rlen;
 }
 
@@ -23,9 +23,14 @@
 #endif
 
 #include <stdint.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 
 #define WS_FIN 0x80
+//! RSV1 bit, marks compressed messages of permessage-deflate (RFC 7692)
+#define WS_RSV1 0x40
 #define WS_MASK 0x80
 
 #define WS_OP_TXT 0x1
@@ -43,6 +48,10 @@
 #define WS_HDR_MAXLEN 14
 //! determine maximum payload size
 #define WS_PLD_SIZE(x) ((x)->size - WS_HDR_MAXLEN)
+//! maximum frame size used by smrenderd and smwsclient
+#define WS_FRAME_SIZE 65536
+//! messages shorter than this are not compressed
+#define WS_PMD_MIN 128
 
 
 typedef struct websocket
@@ -51,6 +60,12 @@ typedef struct websocket
    int size;      //!< maximum frame size
    int mask;      //!< 0 if frames shall not be masked
    int op;
+   int pmd;       //!< 1 if permessage-deflate is used
+   int pmd_reset; //!< 1 if the compression context is reset after each message
+#ifdef HAVE_ZLIB
+   z_stream zd;   //!< compressor of outgoing messages
+   z_stream zi;   //!< decompressor of incoming messages
+#endif
 } websocket_t;
 
 typedef struct ws_frame
@@ -73,5 +88,8 @@ void ws_free(websocket_t *);
 int ws_write(websocket_t *, const char *, int );
 int ws_read(websocket_t *, char *, int );
 
+int ws_pmd_parse(const char *, int , int *, int *);
+int ws_pmd_init(websocket_t *, int , int );
+
 #endif
 
@@ -618,6 +618,8 @@ void hpx_init_membuf(hpx_ctrl_t *ctl, void *buf, int len)
    ctl->fd = -1;
    ctl->len = len;
    ctl->lineno = 1;
+   // there is no more data, this also prevents the buffer from being moved
+   ctl->eof = 1;
 }
 
 
@@ -348,6 +348,71 @@ int cairo_smr_image_surface_color_reduce(cairo_surface_t *src, int ncol, uint32_
    free(blk);
    return ncol;
 }
+
+
+/*! This function calculates a palette of a defined number of colors for a
+ * list of pixels. Other than cairo_smr_image_surface_color_reduce() the pixels
+ * are not modified. It is used if the image is not available as a whole, thus
+ * the pixels may be a sample of it.
+ * @param pix Pointer to the pixels (Cairo RGB24 or ARGB32 format).
+ * @param n Number of pixels, n > 0.
+ * @param ncol Maximum number of final colors.
+ * @param Pointer to an array which will recieve the color values.
+ * @return The function returns the final number of colors or -1 on error.
+ */
+int mc_palette(const uint32_t *pix, long n, int ncol, uint32_t *palette)
+{
+   mc_block_t *blk;
+   mc_point_t *pt;
+
+   if ((pt = malloc(sizeof(*pt) * n)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+
+   for (long i = 0; i < n; i++)
+      mc_cairo_color_to_point(&pix[i], &pt[i]);
+
+   if ((blk = mc_block_list(ncol)) == NULL)
+   {
+      free(pt);
+      return -1;
+   }
+
+   ncol = mc_median_cut(pt, n, ncol, blk);
+   for (int i = 0; i < ncol; i++)
+      palette[i] = mc_point_to_cairo_color(&blk[i].avg);
+
+   free(pt);
+   free(blk);
+   return ncol;
+}
+
+
+/*! Find the color of the palette which is nearest to the color of a pixel.
+ * @param palette Pointer to the palette (see mc_palette()).
+ * @param ncol Number of colors in the palette.
+ * @param pix Pixel value (Cairo RGB24 or ARGB32 format).
+ * @return Returns the index, 0 <= index < ncol.
+ */
+int mc_palette_index(const uint32_t *palette, int ncol, uint32_t pix)
+{
+   int diff, dist = 0x1000000, idx = 0;
+   mc_point_t p, q;
+
+   mc_cairo_color_to_point(&pix, &p);
+   for (int i = 0; i < ncol; i++)
+   {
+      mc_cairo_color_to_point(&palette[i], &q);
+      if ((diff = mc_col_dist(&q, &p)) < dist)
+      {
+         dist = diff;
+         idx = i;
+      }
+   }
+   return idx;
+}
 #endif
 
 
@@ -0,0 +1,458 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smband.c
+ * This file contains the code for the banded output of raster images. Instead
+ * of rasterizing the whole page into one image surface, the recording surface
+ * is replayed into horizontal bands of a limited size (see --band-memory) and
+ * each band is passed to the encoder before the next one is rendered. Thus,
+ * the memory needed at output time depends on the band height but not on the
+ * size of the chart.
+ *
+ * PNG images are encoded directly with zlib because the PNG writer of Cairo
+ * needs the whole image. JPEG images are written line by line with libjpeg.
+ * The KAP encoder (see smkap.c) uses cairo_smr_bands() as well.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/resource.h>
+#ifdef HAVE_CAIRO
+#include <cairo.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+
+#include "smrender_dev.h"
+#include "rdata.h"
+
+
+//! memory for the band of banded image output in MB, 0 = disabled (default)
+int band_mem_ = 0;
+
+
+#ifdef HAVE_CAIRO
+
+//! size of the IDAT chunks of the PNG output
+#define PNG_CHUNK 65536
+//! number of PNG row filters
+#define PNG_NFILT 5
+//! JPEG quality of the main image
+#define BAND_JPG_QUALITY 90
+
+
+//! state of the PNG encoder
+typedef struct png_band
+{
+   FILE *f;
+   int w;                  //!< width of the image in pixels
+   unsigned char *prev;    //!< previous row, unfiltered
+   unsigned char *cur;     //!< current row, unfiltered
+   unsigned char *filt[PNG_NFILT]; //!< current row with each filter applied
+   unsigned char *out;     //!< output buffer of deflate
+#ifdef HAVE_ZLIB
+   z_stream z;
+#endif
+} png_band_t;
+
+
+/*! Log the peak resident set size of the process after a band was written.
+ */
+static void log_band_rss(int band, int nband, int y0, int h)
+{
+   struct rusage ru;
+
+   if (getrusage(RUSAGE_SELF, &ru) == -1)
+   {
+      log_errno(LOG_WARN, "getrusage() failed");
+      return;
+   }
+   log_msg(LOG_INFO, "band %d/%d, rows %d - %d, peak RSS %ld kB", band + 1, nband, y0, y0 + h - 1, ru.ru_maxrss);
+}
+
+
+/*! Return 1 if the file type can be written in bands, otherwise 0.
+ */
+int band_supported(int ftype)
+{
+   switch (ftype)
+   {
+#ifdef HAVE_ZLIB
+      case FTYPE_PNG:
+         return 1;
+#endif
+#ifdef HAVE_LIBJPEG
+      case FTYPE_JPG:
+         return 1;
+#endif
+   }
+   return 0;
+}
+
+
+/*! Render the image in horizontal bands and pass each band to func. The band
+ * height is chosen so that the band surface uses at most band_mem_ MB.
+ * @param w Width of the image in pixels.
+ * @param h Height of the image in pixels.
+ * @param fmt Format of the band surface.
+ * @param page 1 to render the page, 0 to render the chart only (see
+ * cairo_smr_paint_band()).
+ * @param alias Antialiasing mode.
+ * @param func Function which is called for each band. It receives the pixels,
+ * the stride, the first row, and the number of rows of the band. If it returns
+ * non-zero, rendering is stopped.
+ * @param p Pointer which is passed to func.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int cairo_smr_bands(int w, int h, cairo_format_t fmt, int page, cairo_antialias_t alias, band_func_t func, void *p)
+{
+   cairo_surface_t *band;
+   int bh, stride, y0, i, nband, e = 0;
+
+   stride = cairo_format_stride_for_width(fmt, w);
+   bh = (long) (band_mem_ > 0 ? band_mem_ : 1) * 1024 * 1024 / stride;
+   if (bh < 1)
+      bh = 1;
+   if (bh > h)
+      bh = h;
+   nband = (h + bh - 1) / bh;
+
+   log_msg(LOG_NOTICE, "rendering %dx%d image in %d bands of %d rows", w, h, nband, bh);
+   band = cairo_image_surface_create(fmt, w, bh);
+   if (cairo_surface_status(band) != CAIRO_STATUS_SUCCESS)
+   {
+      log_msg(LOG_ERR, "failed to create band surface: %s", cairo_status_to_string(cairo_surface_status(band)));
+      cairo_surface_destroy(band);
+      return -1;
+   }
+
+   for (y0 = 0, i = 0; y0 < h; y0 += bh, i++)
+   {
+      cairo_smr_paint_band(band, y0, page, alias);
+      cairo_surface_flush(band);
+      if (func(p, cairo_image_surface_get_data(band), cairo_image_surface_get_stride(band), y0, h - y0 < bh ? h - y0 : bh))
+      {
+         e = -1;
+         break;
+      }
+      log_band_rss(i, nband, y0, h - y0 < bh ? h - y0 : bh);
+   }
+
+   cairo_surface_destroy(band);
+   return e;
+}
+
+
+#ifdef HAVE_ZLIB
+//! Write a PNG chunk. Returns 0 on success, otherwise -1.
+static int png_chunk(FILE *f, const char *type, const unsigned char *data, uint32_t len)
+{
+   unsigned char buf[4];
+   uLong crc;
+
+   crc = crc32(crc32(0, NULL, 0), (const Bytef*) type, 4);
+   if (len)
+      crc = crc32(crc, data, len);
+
+   buf[0] = len >> 24;
+   buf[1] = len >> 16;
+   buf[2] = len >> 8;
+   buf[3] = len;
+   if (fwrite(buf, 4, 1, f) != 1 || fwrite(type, 4, 1, f) != 1 || (len && fwrite(data, len, 1, f) != 1))
+      return -1;
+
+   buf[0] = crc >> 24;
+   buf[1] = crc >> 16;
+   buf[2] = crc >> 8;
+   buf[3] = crc;
+   return fwrite(buf, 4, 1, f) == 1 ? 0 : -1;
+}
+
+
+/*! Pass data to deflate and write full output buffers as IDAT chunks.
+ * @param flush Z_NO_FLUSH or Z_FINISH.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int png_deflate(png_band_t *pb, unsigned char *data, size_t len, int flush)
+{
+   int e;
+
+   pb->z.next_in = data;
+   pb->z.avail_in = len;
+   do
+   {
+      e = deflate(&pb->z, flush);
+      if (e == Z_STREAM_ERROR)
+         return -1;
+      if (!pb->z.avail_out || (flush == Z_FINISH && pb->z.avail_out < PNG_CHUNK))
+      {
+         if (png_chunk(pb->f, "IDAT", pb->out, PNG_CHUNK - pb->z.avail_out))
+            return -1;
+         pb->z.next_out = pb->out;
+         pb->z.avail_out = PNG_CHUNK;
+      }
+   }
+   while (pb->z.avail_in || (flush == Z_FINISH && e != Z_STREAM_END));
+
+   return 0;
+}
+
+
+static int paeth(int a, int b, int c)
+{
+   int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+   if (pa <= pb && pa <= pc)
+      return a;
+   return pb <= pc ? b : c;
+}
+
+
+/*! Apply all PNG filters to the current row and return the filter with the
+ * minimum sum of absolute differences (the heuristic recommended by the PNG
+ * specification).
+ */
+static int png_filter(png_band_t *pb)
+{
+   const unsigned char *c = pb->cur, *p = pb->prev;
+   unsigned long sum, min = ~0UL;
+   int i, j, n = pb->w * 4, best = 0, a, b, d;
+
+   for (i = 0; i < n; i++)
+   {
+      a = i >= 4 ? c[i - 4] : 0;
+      b = p[i];
+      d = i >= 4 ? p[i - 4] : 0;
+      pb->filt[0][i] = c[i];
+      pb->filt[1][i] = c[i] - a;
+      pb->filt[2][i] = c[i] - b;
+      pb->filt[3][i] = c[i] - ((a + b) >> 1);
+      pb->filt[4][i] = c[i] - paeth(a, b, d);
+   }
+
+   for (j = 0; j < PNG_NFILT; j++)
+   {
+      for (i = 0, sum = 0; i < n; i++)
+         sum += pb->filt[j][i] < 128 ? pb->filt[j][i] : 256 - pb->filt[j][i];
+      if (sum < min)
+      {
+         min = sum;
+         best = j;
+      }
+   }
+   return best;
+}
+
+
+/*! Band function which encodes the rows of the band (ARGB32, premultiplied
+ * alpha) as PNG rows (RGBA).
+ */
+static int png_band(png_band_t *pb, const unsigned char *data, int stride, int y0, int h)
+{
+   const uint32_t *pix;
+   unsigned char *c, *t, ft;
+   int x, y, a;
+
+   (void) y0;
+   for (y = 0; y < h; y++)
+   {
+      pix = (const uint32_t*) (data + (long) y * stride);
+      for (x = 0, c = pb->cur; x < pb->w; x++, c += 4)
+      {
+         if (!(a = pix[x] >> 24))
+         {
+            memset(c, 0, 4);
+            continue;
+         }
+         c[0] = (((pix[x] >> 16) & 0xff) * 255 + a / 2) / a;
+         c[1] = (((pix[x] >> 8) & 0xff) * 255 + a / 2) / a;
+         c[2] = ((pix[x] & 0xff) * 255 + a / 2) / a;
+         c[3] = a;
+      }
+
+      ft = png_filter(pb);
+      if (png_deflate(pb, &ft, 1, Z_NO_FLUSH) || png_deflate(pb, pb->filt[ft], pb->w * 4, Z_NO_FLUSH))
+      {
+         log_msg(LOG_ERR, "failed to write PNG data");
+         return -1;
+      }
+
+      t = pb->prev;
+      pb->prev = pb->cur;
+      pb->cur = t;
+   }
+   return 0;
+}
+
+
+/*! Write the main image as PNG rendering it in bands.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int save_png_bands(FILE *f, int w, int h)
+{
+   unsigned char ihdr[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 6, 0, 0, 0};
+   png_band_t pb;
+   int e = -1, i;
+
+   memset(&pb, 0, sizeof(pb));
+   pb.f = f;
+   pb.w = w;
+   pb.prev = calloc(w, 4);
+   pb.cur = calloc(w, 4);
+   pb.out = malloc(PNG_CHUNK);
+   for (i = 0; i < PNG_NFILT; i++)
+      pb.filt[i] = malloc((size_t) w * 4);
+   for (i = 0; i < PNG_NFILT && pb.filt[i] != NULL; i++);
+
+   if (pb.prev == NULL || pb.cur == NULL || pb.out == NULL || i < PNG_NFILT)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      goto spb_exit;
+   }
+
+   if (deflateInit(&pb.z, Z_DEFAULT_COMPRESSION) != Z_OK)
+   {
+      log_msg(LOG_ERR, "deflateInit() failed");
+      goto spb_exit;
+   }
+   pb.z.next_out = pb.out;
+   pb.z.avail_out = PNG_CHUNK;
+
+   for (i = 0; i < 4; i++)
+   {
+      ihdr[i] = (uint32_t) w >> (24 - i * 8);
+      ihdr[i + 4] = (uint32_t) h >> (24 - i * 8);
+   }
+
+   if (fwrite("\x89PNG\r\n\x1a\n", 8, 1, f) != 1 || png_chunk(f, "IHDR", ihdr, sizeof(ihdr)))
+      log_errno(LOG_ERR, "failed to write PNG header");
+   else if (!cairo_smr_bands(w, h, CAIRO_FORMAT_ARGB32, 1, CAIRO_ANTIALIAS_DEFAULT, (band_func_t) png_band, &pb))
+   {
+      if (png_deflate(&pb, NULL, 0, Z_FINISH) || png_chunk(f, "IEND", NULL, 0))
+         log_errno(LOG_ERR, "failed to write PNG data");
+      else
+         e = 0;
+   }
+   deflateEnd(&pb.z);
+
+spb_exit:
+   for (i = 0; i < PNG_NFILT; i++)
+      free(pb.filt[i]);
+   free(pb.out);
+   free(pb.cur);
+   free(pb.prev);
+   return e;
+}
+#endif
+
+
+#ifdef HAVE_LIBJPEG
+//! Band function which passes the rows of the band to the JPEG compressor.
+static int jpg_band(struct jpeg_compress_struct *cinfo, unsigned char *data, int stride, int y0, int h)
+{
+   JSAMPROW row_pointer[1];
+
+   (void) y0;
+   for (int y = 0; y < h; y++)
+   {
+      row_pointer[0] = data + (long) y * stride;
+      (void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+   }
+   return 0;
+}
+
+
+/*! Write the main image as JPEG rendering it in bands.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int save_jpg_bands(FILE *f, int w, int h)
+{
+   struct jpeg_compress_struct cinfo;
+   struct jpeg_error_mgr jerr;
+   int e;
+
+   cinfo.err = jpeg_std_error(&jerr);
+   jpeg_create_compress(&cinfo);
+   jpeg_stdio_dest(&cinfo, f);
+   cinfo.image_width = w;
+   cinfo.image_height = h;
+   // same pixel layout as in cairo_image_surface_write_to_jpeg_mem()
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   cinfo.in_color_space = JCS_EXT_BGRX;
+#else
+   cinfo.in_color_space = JCS_EXT_XRGB;
+#endif
+   cinfo.input_components = 4;
+   jpeg_set_defaults(&cinfo);
+   jpeg_set_quality(&cinfo, BAND_JPG_QUALITY, TRUE);
+   jpeg_start_compress(&cinfo, TRUE);
+
+   e = cairo_smr_bands(w, h, CAIRO_FORMAT_ARGB32, 1, CAIRO_ANTIALIAS_DEFAULT, (band_func_t) jpg_band, &cinfo);
+
+   // the compressor can only be finished if all rows were written
+   if (!e)
+      jpeg_finish_compress(&cinfo);
+   jpeg_destroy_compress(&cinfo);
+   return e;
+}
+#endif
+
+
+/*! Save the main image as PNG or JPEG. The image is rendered in bands, thus
+ * only the memory of one band is needed (see --band-memory).
+ * @param f File to write to.
+ * @param ftype File type, FTYPE_PNG or FTYPE_JPG.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int save_main_image_bands(FILE *f, int ftype)
+{
+   int w = round(rdata_page_width(U_PX)), h = round(rdata_page_height(U_PX));
+
+   switch (ftype)
+   {
+#ifdef HAVE_ZLIB
+      case FTYPE_PNG:
+         return save_png_bands(f, w, h);
+#endif
+#ifdef HAVE_LIBJPEG
+      case FTYPE_JPG:
+         return save_jpg_bands(f, w, h);
+#endif
+   }
+
+   (void) w;
+   (void) h;
+   log_msg(LOG_ERR, "banded output not supported for file type %d", ftype);
+   return -1;
+}
+
+#endif
+
@@ -636,7 +636,7 @@ static int collect_tags(const osm_obj_t *cp, const osm_obj_t *src, osm_obj_t *ds
       }
 
       // reallocate tag list in dst
-      if ((tags = realloc(dst->otag, sizeof(*dst->otag) * (dst->tag_cnt + 1))) == NULL)
+      if ((tags = realloc_mem(dst->otag, sizeof(*dst->otag) * dst->tag_cnt, sizeof(*dst->otag) * (dst->tag_cnt + 1))) == NULL)
       {
          log_msg(LOG_ERR, "realloc() failed in collect_tags(): %s", strerror(errno));
          return -1;
@@ -916,7 +916,7 @@ static int connect_open(struct pdef *pd, struct wlist *wl, int ocnt, short no_co
             for (; k < l; k++)
             {
                // FIXME: realloc() and memmove() should be done outside of the loop
-               if ((ref = realloc(wl->ref[pd[i].wl_index].nw->ref, sizeof(int64_t) * (wl->ref[pd[i].wl_index].nw->ref_cnt + 1))) == NULL)
+               if ((ref = realloc_mem(wl->ref[pd[i].wl_index].nw->ref, sizeof(int64_t) * wl->ref[pd[i].wl_index].nw->ref_cnt, sizeof(int64_t) * (wl->ref[pd[i].wl_index].nw->ref_cnt + 1))) == NULL)
                   log_msg(LOG_ERR, "realloc() failed: %s", strerror(errno)), exit(EXIT_FAILURE);
 
                memmove(&ref[1], &ref[0], sizeof(int64_t) * wl->ref[pd[i].wl_index].nw->ref_cnt); 
@@ -930,7 +930,7 @@ static int connect_open(struct pdef *pd, struct wlist *wl, int ocnt, short no_co
          // if start and end point belong to same way close
          if (pd[i].wl_index == pd[j % ocnt].wl_index)
          {
-            if ((ref = realloc(wl->ref[pd[i].wl_index].nw->ref, sizeof(int64_t) * (wl->ref[pd[i].wl_index].nw->ref_cnt + 1))) == NULL)
+            if ((ref = realloc_mem(wl->ref[pd[i].wl_index].nw->ref, sizeof(int64_t) * wl->ref[pd[i].wl_index].nw->ref_cnt, sizeof(int64_t) * (wl->ref[pd[i].wl_index].nw->ref_cnt + 1))) == NULL)
                log_msg(LOG_ERR, "realloc() failed: %s", strerror(errno)), exit(EXIT_FAILURE);
 
             ref[wl->ref[pd[i].wl_index].nw->ref_cnt] = ref[0];
@@ -943,7 +943,7 @@ static int connect_open(struct pdef *pd, struct wlist *wl, int ocnt, short no_co
          else
          {
             log_debug("pd[%d].wl_index(%d) != pd[%d].wl_index(%d)", i, pd[i].wl_index, j % ocnt, pd[j % ocnt].wl_index);
-            if ((ref = realloc(wl->ref[pd[i].wl_index].nw->ref, sizeof(int64_t) * (wl->ref[pd[i].wl_index].nw->ref_cnt + wl->ref[pd[j % ocnt].wl_index].nw->ref_cnt))) == NULL)
+            if ((ref = realloc_mem(wl->ref[pd[i].wl_index].nw->ref, sizeof(int64_t) * wl->ref[pd[i].wl_index].nw->ref_cnt, sizeof(int64_t) * (wl->ref[pd[i].wl_index].nw->ref_cnt + wl->ref[pd[j % ocnt].wl_index].nw->ref_cnt))) == NULL)
                log_msg(LOG_ERR, "realloc() failed: %s", strerror(errno)), exit(EXIT_FAILURE);
 
             // move refs from i^th way back
@@ -1149,10 +1149,10 @@ static int cat_poly_ini_copy(fparam_t * const *fp, osm_obj_t *obj)
    {
       if (strcasecmp(fp[i]->attr, "copy"))
          continue;
-      if ((ot = realloc(obj->otag, sizeof(*ot) * (obj->tag_cnt + 1))) == NULL)
+      if ((ot = realloc_mem(obj->otag, sizeof(*ot) * obj->tag_cnt, sizeof(*ot) * (obj->tag_cnt + 1))) == NULL)
       {
          log_msg(LOG_ERR, "realloc() failed in cat_poly_ini(): %s", strerror(errno));
-         free(obj->otag);
+         free_mem(obj->otag);
          return -1;
       }
       obj->otag = ot;
@@ -1588,7 +1588,7 @@ static int refine_poly0(osm_way_t *w, double deviation)
    }
    ref[i * 2] = w->ref[i];
 
-   free(w->ref);
+   free_mem(w->ref);
    w->ref = ref;
    w->ref_cnt = w->ref_cnt * 2 - 1;
 
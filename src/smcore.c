@@ -43,6 +43,7 @@
 #include "smaction.h"
 #include "rdata.h"
 #include "lists.h"
+#include "sarray.h"
 
 extern volatile sig_atomic_t int_;
 volatile sig_atomic_t alarm_;
@@ -421,16 +422,14 @@ int call_ini(smrule_t *r)
 }
 
 
-int apply_smrules(smrule_t *r, trv_info_t *ti)
+/*! Check if the rule r is to be applied within the current rendering pass and
+ * prepare it for execution.
+ * @param r Pointer to rule.
+ * @param ti Pointer to traversal info.
+ * @return The function returns 1 if the rule shall be applied, otherwise 0.
+ */
+static int rule_ready(smrule_t *r, const trv_info_t *ti)
 {
-   int e = 0;
-
-   if (r == NULL)
-   {
-      log_msg(LOG_EMERG, "NULL pointer to rule, ignoring");
-      return 1;
-   }
-
    if (r->oo->ver != ti->ver)
       return 0;
 
@@ -455,6 +454,17 @@ int apply_smrules(smrule_t *r, trv_info_t *ti)
    }
 
    log_msg(LOG_INFO, "applying rule id 0x%"PRIx64" '%s'", r->oo->id, r->act->func_name);
+   return 1;
+}
+
+
+/*! Apply the rule r to all objects by traversing the object tree, and finally
+ * call its _fini() function.
+ */
+static int apply_smrules_main(smrule_t *r, trv_info_t *ti)
+{
+   const tidx_list_t *tl, *pl;
+   int e = 0;
 
    if (r->act->main.func != NULL)
    {
@@ -466,10 +476,19 @@ int apply_smrules(smrule_t *r, trv_info_t *ti)
       gettimeofday(&tv, NULL);
       t_apply_ = tv.tv_usec + tv.tv_sec * 1000000;
 #endif
-      e = traverse(ti->objtree, 0, r->oo->type - 1, (tree_func_t) apply_rule0, r);
+      // apply rule to candidates of tag index or to the nodes on the page only
+      // if possible, whichever list is shorter
+      tl = tidx_lookup(r, ti->objtree);
+      if ((pl = page_lookup(r, ti->objtree)) != NULL && (tl == NULL || pl->cnt < tl->cnt))
+         tl = pl;
+      if (tl != NULL)
+         e = tidx_traverse(tl, (tree_func_t) apply_rule0, r);
+      else
+         e = traverse(ti->objtree, 0, r->oo->type - 1, (tree_func_t) apply_rule0, r);
 #ifdef TH_OBJ_LIST
       obj_queue_signal();
       sm_wait_threads();
+      sm_thread_stats();
 #endif
 #ifdef DEBUG_T_APPLY
       gettimeofday(&tv, NULL);
@@ -486,11 +505,190 @@ int apply_smrules(smrule_t *r, trv_info_t *ti)
       e = 0;
       call_fini(r);
    }
+   tidx_update(r);
+   page_update(r);
 
    return e;
 }
 
 
+int apply_smrules(smrule_t *r, trv_info_t *ti)
+{
+   if (r == NULL)
+   {
+      log_msg(LOG_EMERG, "NULL pointer to rule, ignoring");
+      return 1;
+   }
+
+   if (!rule_ready(r, ti))
+      return 0;
+
+   return apply_smrules_main(r, ti);
+}
+
+
+/*! Test if a rule may share a traversal of the object tree with adjacent
+ * rules. Threaded rules are excluded if threads are active because they are
+ * dispatched through the object queue.
+ */
+static int is_mergeable(const smrule_t *r)
+{
+   return r->act->main.func != NULL && sm_is_flag_set(r, ACTION_UNORDERED) &&
+      !(get_nthreads() > 0 && sm_is_threaded(r));
+}
+
+
+/*! This is the tree function for a combined traversal. It applies all rules of
+ * the pass in their order to the object o. Rules whose main function returned
+ * a value != 0 are not applied to any further objects.
+ */
+static int apply_rule_pass(osm_obj_t *o, rule_pass_t *rp)
+{
+   for (int i = 0; i < rp->cnt; i++)
+      if (!rp->e[i])
+         (void) apply_rule(o, rp->r[i], &rp->e[i]);
+   return 0;
+}
+
+
+/*! Apply all rules collected in rp within a single traversal of the object
+ * tree and call their _fini() functions in order afterwards.
+ * @param rp Pointer to rule collection. It is empty after the call.
+ * @param ti Pointer to traversal info.
+ * @return On success 0 is returned. If traverse() fails or the main function of
+ * a rule returns a negative value, this value is returned. The _fini()
+ * functions of this and all subsequent rules are not called in that case.
+ */
+static int rule_pass_flush(rule_pass_t *rp, trv_info_t *ti)
+{
+   const tidx_list_t *pl = NULL;
+   int i, e;
+
+   if (!rp->cnt)
+      return 0;
+
+   rp->passes++;
+   rp->rules += rp->cnt;
+   if (rp->cnt == 1)
+   {
+      rp->cnt = 0;
+      return apply_smrules_main(rp->r[0], ti);
+   }
+
+   log_msg(LOG_INFO, "applying %d rules within a single traversal", rp->cnt);
+   memset(rp->e, 0, sizeof(*rp->e) * rp->cnt);
+#ifdef DEBUG_T_APPLY
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   t_apply_ = tv.tv_usec + tv.tv_sec * 1000000;
+#endif
+   // the nodes on the page are sufficient if all rules can use them
+   for (i = 0; i < rp->cnt && page_usable(rp->r[i], ti->objtree); i++);
+   if (i == rp->cnt)
+      pl = page_lookup(rp->r[0], ti->objtree);
+   if (pl != NULL)
+      e = tidx_traverse(pl, (tree_func_t) apply_rule_pass, rp);
+   else
+      e = traverse(ti->objtree, 0, rp->r[0]->oo->type - 1, (tree_func_t) apply_rule_pass, rp);
+#ifdef DEBUG_T_APPLY
+   gettimeofday(&tv, NULL);
+   t_apply_ = tv.tv_usec + tv.tv_sec * 1000000 - t_apply_;
+#endif
+
+   if (e) log_debug("traverse(apply_rule_pass) returned %d", e);
+
+   for (i = 0; e >= 0 && i < rp->cnt; i++)
+   {
+      if (rp->e[i])
+      {
+         log_msg(LOG_WARNING, "%s_main() of rule 0x%"PRIx64" returned %d", rp->r[i]->act->func_name, rp->r[i]->oo->id, rp->e[i]);
+         if (rp->e[i] < 0)
+         {
+            e = rp->e[i];
+            break;
+         }
+      }
+      call_fini(rp->r[i]);
+   }
+
+   for (i = 0; i < rp->cnt; i++)
+   {
+      tidx_update(rp->r[i]);
+      page_update(rp->r[i]);
+   }
+   rp->cnt = 0;
+   return e < 0 ? e : 0;
+}
+
+
+/*! This is the tree function to be called by traverse() on the rules tree
+ * instead of apply_smrules(). Adjacent rules which are mergeable (see
+ * sm_unordered()) are collected in ti->rp and applied together within a
+ * single traversal of the objects as soon as a rule is found which cannot be
+ * merged. The remaining rules have to be applied by a final call to
+ * rule_pass_flush().
+ * @param r Pointer to rule.
+ * @param ti Pointer to traversal info. ti->rp must point to a valid rule_pass_t.
+ * @return On success 0 is returned, otherwise the return value of
+ * apply_smrules_main() or rule_pass_flush().
+ */
+int apply_smrules_pass(smrule_t *r, trv_info_t *ti)
+{
+   rule_pass_t *rp = ti->rp;
+   int e, merge;
+
+   if (r == NULL)
+   {
+      log_msg(LOG_EMERG, "NULL pointer to rule, ignoring");
+      return 1;
+   }
+
+   if (!rule_ready(r, ti))
+      return 0;
+
+   // rules which cannot be merged are applied on their own, this is also true
+   // for rules served by the tag index because they do not traverse all objects
+   merge = is_mergeable(r) && !tidx_usable(r, ti->objtree);
+   if (!merge || (rp->cnt && rp->r[0]->oo->type != r->oo->type))
+   {
+      if ((e = rule_pass_flush(rp, ti)))
+         return e;
+      if (!merge)
+      {
+         if (r->act->main.func != NULL)
+         {
+            rp->passes++;
+            rp->rules++;
+         }
+         return apply_smrules_main(r, ti);
+      }
+   }
+
+   if (rp->cnt >= rp->size)
+   {
+      smrule_t **rl;
+      int *el;
+
+      if ((rl = realloc(rp->r, sizeof(*rp->r) * (rp->size + 16))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      rp->r = rl;
+      if ((el = realloc(rp->e, sizeof(*rp->e) * (rp->size + 16))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      rp->e = el;
+      rp->size += 16;
+   }
+
+   rp->r[rp->cnt++] = r;
+   return 0;
+}
+
+
 /*! This function calls traverse() 3 times subsquently, with IDX_NODE, IDX_WAY,
  * and IDX_REL if dir is set to NODES_FIRST. If dir is set to RELS_FIRST,
  * traverse() will be called with IDX_REL first.
@@ -523,12 +721,31 @@ int execute_rules0(bx_node_t *rules, tree_func_t func, void *p)
 
  
 /* This function traverses the rules and for each rule traverses the objects.
- * execute_rules() -> traverse(apply_smrules()) -> traverse(apply_rule0()) -> apply_rule()
+ * execute_rules() -> traverse(apply_smrules_pass()) -> traverse(apply_rule0()) -> apply_rule()
+ * Adjacent rules which are mergeable share a single traversal of the objects:
+ * execute_rules() -> traverse(apply_smrules_pass()) -> traverse(apply_rule_pass()) -> apply_rule()
 */
 int execute_rules(bx_node_t *rules, int version)
 {
-   trv_info_t ti = {*get_objtree(), version};
-   return execute_treefunc(rules, RELS_FIRST, (tree_func_t) apply_smrules, &ti);
+   rule_pass_t rp;
+   trv_info_t ti = {*get_objtree(), version, &rp};
+   int e, i;
+
+   memset(&rp, 0, sizeof(rp));
+   for (i = IDX_REL, e = 0; i >= IDX_NODE && !e; i--)
+   {
+      log_msg(LOG_INFO, "%ss...", type_str(i + 1));
+      if (!(e = traverse(rules, 0, i, (tree_func_t) apply_smrules_pass, &ti)))
+         e = rule_pass_flush(&rp, &ti);
+   }
+
+   if (rp.rules)
+      log_msg(LOG_NOTICE, "%d rules applied within %d object traversals, %d traversals collapsed",
+            rp.rules, rp.passes, rp.rules - rp.passes);
+
+   free(rp.r);
+   free(rp.e);
+   return e;
 }
 
 
@@ -601,6 +818,39 @@ int traverse(const bx_node_t *nt, int d, int idx, tree_func_t dhandler, void *p)
       return -1;
    }
 
+   // the sorted array store is iterated instead of recursed
+   if (!d && sa_is_store(nt))
+   {
+      sa_iter_t it;
+      void *o;
+
+      for (i = idx == -1 ? 0 : idx, e = 0; !e && i < (idx == -1 ? SA_NIDX : idx + 1); i++)
+      {
+         sa_iter_init((bx_node_t*) nt, i, &it);
+         while (!e && !int_ && (o = sa_next((bx_node_t*) nt, &it)) != NULL)
+         {
+            _leaf_cnt++;
+            if (alarm_)
+            {
+               alarm(traverse_alarm_);
+               alarm_ = 0;
+               log_msg(LOG_INFO, "traverse(nt = %p, idx = %d), _leaf_cnt = %ld", nt, i, _leaf_cnt);
+            }
+            e = dhandler(o, p);
+         }
+         sa_iter_end((bx_node_t*) nt);
+      }
+
+      if (e)
+      {
+         (void) func_name(buf, sizeof(buf), dhandler);
+         log_msg(LOG_WARNING, "dhandler(), sym = '%s', addr = '%p' returned %d", buf, dhandler, e);
+         log_msg(LOG_INFO, "breaking recursion");
+      }
+      alarm(0);
+      return e;
+   }
+
    if (d == sizeof(bx_hash_t) * 8 / BX_RES)
    {
       if (idx == -1)
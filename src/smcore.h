@@ -45,12 +45,29 @@ enum {
 
 typedef int (*tree_func_t)(osm_obj_t*, void*);
 
+//! spatial index (see smspidx.c)
+typedef struct spidx spidx_t;
+struct bbox;
+
+//! Structure to collect adjacent rules which share a single object traversal.
+typedef struct rule_pass
+{
+   smrule_t **r;           //!< list of rules in order of execution
+   int *e;                 //!< return values of the rules' main functions
+   int cnt;                //!< number of rules in list
+   int size;               //!< number of elements allocated
+   int rules;              //!< stats: number of rules applied
+   int passes;             //!< stats: number of object traversals
+} rule_pass_t;
+
 typedef struct trv_info
 {
    //! tree of objects to which is to be traversed by each rule
    bx_node_t *objtree;
    //! version of rules to apply
    long ver;
+   //! collector of rules sharing a traversal, NULL if each rule traverses on its own
+   rule_pass_t *rp;
 } trv_info_t;
 
 //! Structure to handle thread
@@ -58,15 +75,16 @@ typedef struct sm_thread
 {
    int (*main)(void*, osm_obj_t*);  //!< function to execute (this.main())
    void *param;            //!< parameter to pass to tree function
-   void **obj;             //!< list of objects
-   int obj_cnt;            //!< number of elements in object list
+   void **obj;             //!< ring buffer of queued objects
+   unsigned long head;     //!< position of next object to dequeue (workers)
    unsigned id;            //!< thread id
    unsigned cnt;           //!< total number of threads
-   int result;             //!< result of this.main()
-   int status;             //!< state of process (EXEC/WAIT/EXIT)
    unsigned call_cnt;      //!< stats: counts how often this.main() is called
+   unsigned steal_cnt;     //!< stats: number of steals from other threads
+   uint64_t idle_us;       //!< stats: time waiting for objects in microseconds
+   uint64_t idle_start;    //!< start of current wait, 0 if not waiting
    pthread_t thandle;      //!< thread handle
-   pthread_cond_t cond;    //!< condition of thread
+   unsigned long tail;     //!< position of next object to enqueue (main thread)
 } sm_thread_t;
 
 //! Structure to pass rule and thread info to tree function.
@@ -77,6 +95,14 @@ typedef struct smrule_threaded
    sm_thread_t *th;        //!< pointer to individual thread's th_param_t
 } smrule_threaded_t;
 
+//! list of objects of the tag index
+typedef struct tidx_list
+{
+   osm_obj_t **obj;        //!< objects in order of traverse()
+   int cnt;                //!< number of objects in list
+   int size;               //!< number of elements allocated
+} tidx_list_t;
+
 // indexes to object tree
 enum {IDX_NODE, IDX_WAY, IDX_REL};
 
@@ -92,6 +118,7 @@ int insert_refs(osm_way_t *, osm_node_t **, int, int);
 int find_shared_node_by_rev(osm_obj_t **, void *);
 
 int apply_smrules(smrule_t *, trv_info_t *);
+int apply_smrules_pass(smrule_t *, trv_info_t *);
 int apply_smrules0(osm_obj_t*, smrule_t*);
 int apply_rule(osm_obj_t*, smrule_t*, int*);
 int call_fini(smrule_t*);
@@ -103,6 +130,7 @@ void sm_wait_threads(void);
 void obj_queue_ini(int (*)(void*, osm_obj_t*), smrule_threaded_t *);
 int obj_queue(osm_obj_t *);
 void obj_queue_signal(void);
+void sm_thread_stats(void);
 int sm_is_threaded(const smrule_t *);
 int get_ncpu(void);
 int init_threads(int);
@@ -110,5 +138,27 @@ int get_thread_id(void);
 sm_thread_t *get_th_param(int);
 int get_nthreads(void);
 
+/* smtagidx.c */
+int tidx_usable(const smrule_t *, const bx_node_t *);
+const tidx_list_t *tidx_lookup(const smrule_t *, const bx_node_t *);
+int tidx_traverse(const tidx_list_t *, tree_func_t, void *);
+void tidx_update(const smrule_t *);
+void tidx_free(void);
+
+/* smspidx.c */
+spidx_t *spidx_new(void);
+int spidx_add(spidx_t *, const struct bbox *, osm_obj_t *);
+int spidx_finish(spidx_t *);
+int spidx_query(const spidx_t *, const struct bbox *, tree_func_t, void *);
+int spidx_radius(const spidx_t *, const struct coord *, double, tree_func_t, void *);
+void spidx_free(spidx_t *);
+spidx_t *spidx_build(const bx_node_t *, int);
+int spidx_main_init(int);
+const spidx_t *get_spidx(void);
+int page_usable(const smrule_t *, const bx_node_t *);
+const tidx_list_t *page_lookup(const smrule_t *, const bx_node_t *);
+void page_update(const smrule_t *);
+void spidx_main_free(void);
+
 #endif
 
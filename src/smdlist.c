@@ -0,0 +1,382 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smdlist.c
+ * This file contains the display list. It keeps the drawing operations of the
+ * chart in their order together with their bounding box in page coordinates
+ * (pt). The operations are bucketed into a regular grid over the page, thus
+ * dl_replay() replays only those operations which intersect the clip region
+ * of the destination. This is used for tiles, bands, and the cut-outs of the
+ * auto-rotation instead of painting the whole recording surface each time.
+ *
+ * An operation is either a recorded group (the output of a rule, see
+ * cairo_smr_pop_group0()) or a filled path. Operations which cover a large
+ * part of the grid are kept in a separate list and are not bucketed.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#ifdef HAVE_CAIRO
+#include <cairo.h>
+#endif
+
+#include "smrender_dev.h"
+
+
+#ifdef HAVE_CAIRO
+
+//! maximum number of grid cells in each direction
+#define DL_GRID 128
+//! operations covering more cells are not bucketed
+#define DL_BIG 256
+//! padding of the bounding boxes in pt to cover antialiasing
+#define DL_PAD 1.0
+
+
+//! drawing operation of the display list
+typedef struct dl_op
+{
+   cairo_surface_t *sfc;   //!< recorded group, NULL for fill operations
+   cairo_path_t *path;     //!< path of a fill operation (page coordinates)
+   cairo_pattern_t *src;   //!< source of a fill operation
+   double x1, y1, x2, y2;  //!< bounding box in page coordinates
+} dl_op_t;
+
+//! list of operation indexes
+typedef struct dl_idx
+{
+   int *idx;
+   int cnt, size;
+} dl_idx_t;
+
+struct dlist
+{
+   const dlist_t *base;    //!< display list which is replayed before
+   cairo_rectangle_t ext;  //!< extents of the page
+   double cell;            //!< size of a grid cell in pt
+   int cols, rows;
+   dl_op_t *op;            //!< operations in drawing order
+   int cnt, size;
+   dl_idx_t *cell_idx;     //!< operations of each grid cell
+   dl_idx_t big;           //!< operations which are not bucketed
+};
+
+
+/*! Create a new empty display list.
+ * @param ext Extents of the page in pt.
+ * @param base Display list which is replayed before the operations of this
+ * one, or NULL. The base must not be freed before this list.
+ * @return Returns a pointer to the display list or NULL in case of error.
+ */
+dlist_t *dl_new(const cairo_rectangle_t *ext, const dlist_t *base)
+{
+   dlist_t *dl;
+
+   if ((dl = calloc(1, sizeof(*dl))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return NULL;
+   }
+
+   dl->base = base;
+   dl->ext = *ext;
+   dl->cell = fmax(fmax(ext->width, ext->height) / DL_GRID, 1.0);
+   dl->cols = ceil(ext->width / dl->cell) + 1;
+   dl->rows = ceil(ext->height / dl->cell) + 1;
+   if ((dl->cell_idx = calloc(dl->cols * dl->rows, sizeof(*dl->cell_idx))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      free(dl);
+      return NULL;
+   }
+
+   log_debug("display list grid %dx%d, cell = %.1f pt", dl->cols, dl->rows, dl->cell);
+   return dl;
+}
+
+
+//! Free the display list and release all operations.
+void dl_free(dlist_t *dl)
+{
+   int i;
+
+   if (dl == NULL)
+      return;
+
+   for (i = 0; i < dl->cnt; i++)
+   {
+      if (dl->op[i].sfc != NULL)
+         cairo_surface_destroy(dl->op[i].sfc);
+      if (dl->op[i].path != NULL)
+         cairo_path_destroy(dl->op[i].path);
+      if (dl->op[i].src != NULL)
+         cairo_pattern_destroy(dl->op[i].src);
+   }
+   for (i = 0; i < dl->cols * dl->rows; i++)
+      free(dl->cell_idx[i].idx);
+   free(dl->cell_idx);
+   free(dl->big.idx);
+   free(dl->op);
+   free(dl);
+}
+
+
+static int dl_idx_add(dl_idx_t *di, int n)
+{
+   int *idx;
+
+   if (di->cnt >= di->size)
+   {
+      if ((idx = realloc(di->idx, sizeof(*idx) * (di->size ? di->size * 2 : 16))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      di->idx = idx;
+      di->size = di->size ? di->size * 2 : 16;
+   }
+   di->idx[di->cnt++] = n;
+   return 0;
+}
+
+
+//! Calculate the range of grid cells which is covered by the box.
+static void dl_cells(const dlist_t *dl, double x1, double y1, double x2, double y2, int *c0, int *r0, int *c1, int *r1)
+{
+   *c0 = fmax(floor((x1 - dl->ext.x) / dl->cell), 0);
+   *r0 = fmax(floor((y1 - dl->ext.y) / dl->cell), 0);
+   *c1 = fmin(floor((x2 - dl->ext.x) / dl->cell), dl->cols - 1);
+   *r1 = fmin(floor((y2 - dl->ext.y) / dl->cell), dl->rows - 1);
+}
+
+
+/*! Append an operation to the display list and insert it into the grid. The
+ * references of the operation are taken over by the list.
+ */
+static int dl_add(dlist_t *dl, const dl_op_t *op)
+{
+   int c0, r0, c1, r1, c, r;
+   dl_op_t *o;
+
+   if (dl->cnt >= dl->size)
+   {
+      if ((o = realloc(dl->op, sizeof(*o) * (dl->size ? dl->size * 2 : 64))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      dl->op = o;
+      dl->size = dl->size ? dl->size * 2 : 64;
+   }
+   dl->op[dl->cnt] = *op;
+
+   dl_cells(dl, op->x1, op->y1, op->x2, op->y2, &c0, &r0, &c1, &r1);
+   if (c0 > c1 || r0 > r1 || (long) (c1 - c0 + 1) * (r1 - r0 + 1) > DL_BIG)
+   {
+      if (dl_idx_add(&dl->big, dl->cnt))
+         return -1;
+   }
+   else
+   {
+      for (r = r0; r <= r1; r++)
+         for (c = c0; c <= c1; c++)
+            if (dl_idx_add(&dl->cell_idx[r * dl->cols + c], dl->cnt))
+               return -1;
+   }
+
+   dl->cnt++;
+   return 0;
+}
+
+
+/*! Add a recorded group to the display list. The bounding box is the ink
+ * extents of the recording. Empty recordings are not added.
+ * @param dl Pointer to display list.
+ * @param sfc Surface which is painted at the origin of the page. The display
+ * list takes a reference.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int dl_add_surface(dlist_t *dl, cairo_surface_t *sfc)
+{
+   double x, y, w, h, dx, dy;
+   dl_op_t op = {0};
+
+   cairo_surface_get_device_offset(sfc, &dx, &dy);
+   if (cairo_surface_get_type(sfc) == CAIRO_SURFACE_TYPE_RECORDING && dx == 0 && dy == 0)
+   {
+      cairo_recording_surface_ink_extents(sfc, &x, &y, &w, &h);
+      if (w <= 0 || h <= 0)
+         return 0;
+   }
+   else
+   {
+      x = dl->ext.x;
+      y = dl->ext.y;
+      w = dl->ext.width;
+      h = dl->ext.height;
+   }
+
+   op.sfc = cairo_surface_reference(sfc);
+   op.x1 = x - DL_PAD;
+   op.y1 = y - DL_PAD;
+   op.x2 = x + w + DL_PAD;
+   op.y2 = y + h + DL_PAD;
+   if (dl_add(dl, &op))
+   {
+      cairo_surface_destroy(sfc);
+      return -1;
+   }
+   return 0;
+}
+
+
+/*! Add the current path of ctx filled with the current source of ctx to the
+ * display list. The path is cleared afterwards, nothing is drawn to the
+ * target of ctx. The target must not have a device offset.
+ * @param dl Pointer to display list.
+ * @param ctx Cairo context.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int dl_add_fill(dlist_t *dl, cairo_t *ctx)
+{
+   dl_op_t op = {0};
+
+   cairo_save(ctx);
+   cairo_identity_matrix(ctx);
+   cairo_fill_extents(ctx, &op.x1, &op.y1, &op.x2, &op.y2);
+   op.path = cairo_copy_path(ctx);
+   cairo_restore(ctx);
+   cairo_new_path(ctx);
+
+   if (op.path->status != CAIRO_STATUS_SUCCESS)
+   {
+      log_msg(LOG_ERR, "cairo_copy_path() failed: %s", cairo_status_to_string(op.path->status));
+      cairo_path_destroy(op.path);
+      return -1;
+   }
+
+   op.src = cairo_pattern_reference(cairo_get_source(ctx));
+   op.x1 -= DL_PAD;
+   op.y1 -= DL_PAD;
+   op.x2 += DL_PAD;
+   op.y2 += DL_PAD;
+   if (dl_add(dl, &op))
+   {
+      cairo_path_destroy(op.path);
+      cairo_pattern_destroy(op.src);
+      return -1;
+   }
+   return 0;
+}
+
+
+static int cmp_int(const void *a, const void *b)
+{
+   return *(const int*) a - *(const int*) b;
+}
+
+
+static inline int dl_isect(const dl_op_t *op, double x1, double y1, double x2, double y2)
+{
+   return op->x1 < x2 && op->x2 > x1 && op->y1 < y2 && op->y2 > y1;
+}
+
+
+/*! Replay all operations of the display list which intersect the clip
+ * extents of dst. The current transformation of dst has to map page
+ * coordinates (pt). This function does not modify the display list but it
+ * replays its recorded groups, thus it must not be called by several threads
+ * concurrently (see cut_tile()).
+ * @param dl Pointer to display list.
+ * @param dst Destination context.
+ */
+void dl_replay(const dlist_t *dl, cairo_t *dst)
+{
+   double x1, y1, x2, y2;
+   int c0, r0, c1, r1, c, r, i, n, *idx;
+   const dl_idx_t *di;
+   const dl_op_t *op;
+
+   if (dl->base != NULL)
+      dl_replay(dl->base, dst);
+
+   // nothing is drawn outside of the page as it is with a recording surface
+   cairo_save(dst);
+   cairo_rectangle(dst, dl->ext.x, dl->ext.y, dl->ext.width, dl->ext.height);
+   cairo_clip(dst);
+   cairo_clip_extents(dst, &x1, &y1, &x2, &y2);
+   dl_cells(dl, x1, y1, x2, y2, &c0, &r0, &c1, &r1);
+
+   // collect the intersecting operations
+   n = dl->big.cnt;
+   for (r = r0; r <= r1; r++)
+      for (c = c0; c <= c1; c++)
+         n += dl->cell_idx[r * dl->cols + c].cnt;
+   if (!n || (idx = malloc(sizeof(*idx) * n)) == NULL)
+   {
+      if (n)
+         log_errno(LOG_ERR, "malloc() failed");
+      cairo_restore(dst);
+      return;
+   }
+
+   n = 0;
+   for (i = 0; i < dl->big.cnt; i++)
+      if (dl_isect(&dl->op[dl->big.idx[i]], x1, y1, x2, y2))
+         idx[n++] = dl->big.idx[i];
+   for (r = r0; r <= r1; r++)
+      for (c = c0; c <= c1; c++)
+      {
+         di = &dl->cell_idx[r * dl->cols + c];
+         for (i = 0; i < di->cnt; i++)
+            if (dl_isect(&dl->op[di->idx[i]], x1, y1, x2, y2))
+               idx[n++] = di->idx[i];
+      }
+
+   // replay in drawing order, operations spanning several cells only once
+   qsort(idx, n, sizeof(*idx), cmp_int);
+   for (i = 0; i < n; i++)
+   {
+      if (i && idx[i] == idx[i - 1])
+         continue;
+      op = &dl->op[idx[i]];
+      if (op->sfc != NULL)
+      {
+         cairo_set_source_surface(dst, op->sfc, 0, 0);
+         cairo_paint(dst);
+      }
+      else
+      {
+         cairo_new_path(dst);
+         cairo_append_path(dst, op->path);
+         cairo_set_source(dst, op->src);
+         cairo_fill(dst);
+      }
+   }
+   cairo_restore(dst);
+   free(idx);
+}
+
+#endif
+
@@ -133,7 +133,6 @@ struct transcoord_data
 
 
 #define NODE_MIN_DIST (1.0 / 60)
-#define MASK_NODE -1.0
 #define INC_MAX_NL 64
 typedef struct node_list
 {
@@ -449,7 +448,7 @@ int act_poly_area_main(smrule_t * UNUSED(r), osm_way_t *w)
    if (!poly_area(w, &c, &ar))
    {
       //log_msg(LOG_DEBUG, "poly_area of %ld = %f", w->obj.id, ar);
-      if ((ot = realloc(w->obj.otag, sizeof(struct otag) * (w->obj.tag_cnt + 1))) == NULL)
+      if ((ot = realloc_mem(w->obj.otag, sizeof(struct otag) * w->obj.tag_cnt, sizeof(struct otag) * (w->obj.tag_cnt + 1))) == NULL)
       {
          log_msg(LOG_DEBUG, "could not realloc tag list: %s", strerror(errno));
          return 0;
@@ -690,6 +689,10 @@ int act_set_tags_ini(smrule_t *r)
 
    // copy settags data to heap object
    *((struct settags*) r->data) = st;
+
+   // random template selection depends on the order of execution
+   if (st.o != NULL)
+      sm_unordered(r);
    return 0;
 }
 
@@ -722,7 +725,7 @@ int act_set_tags_main(smrule_t *r, osm_obj_t *o)
    else
       templ_o = st->o;
 
-   if ((ot = realloc(o->otag, sizeof(struct otag) * (o->tag_cnt + templ_o->tag_cnt))) == NULL)
+   if ((ot = realloc_mem(o->otag, sizeof(struct otag) * o->tag_cnt, sizeof(struct otag) * (o->tag_cnt + templ_o->tag_cnt))) == NULL)
    {
       log_msg(LOG_CRIT, "Cannot realloc tag memory: %s", strerror(errno));
       return -1;
@@ -1253,7 +1256,7 @@ int act_dist_median_main(smrule_t * UNUSED(r), osm_way_t *w)
    if (dist_median(w, &dist))
       return 1;
 
-   if ((ot = realloc(w->obj.otag, sizeof(struct otag) * (w->obj.tag_cnt + 1))) == NULL)
+   if ((ot = realloc_mem(w->obj.otag, sizeof(struct otag) * w->obj.tag_cnt, sizeof(struct otag) * (w->obj.tag_cnt + 1))) == NULL)
    {
       log_msg(LOG_ERR, "could not realloc tag list in dist_median(): %s", strerror(errno));
       return 1;
@@ -1460,7 +1463,7 @@ int act_poly_len_main(smrule_t * UNUSED(r), osm_way_t *w)
       return 1;
    }
    
-   if ((ot = realloc(w->obj.otag, sizeof(struct otag) * (w->obj.tag_cnt + 1))) == NULL)
+   if ((ot = realloc_mem(w->obj.otag, sizeof(struct otag) * w->obj.tag_cnt, sizeof(struct otag) * (w->obj.tag_cnt + 1))) == NULL)
    {
       log_msg(LOG_ERR, "could not realloc tag list in poly_len(): %s", strerror(errno));
       return 1;
@@ -1521,8 +1524,10 @@ static int parse_id(smrule_t *r)
 }
 
 
-int act_disable_ini(smrule_t * UNUSED(r))
+int act_disable_ini(smrule_t *r)
 {
+   sm_unordered(r);
+   sm_tags_ro(r);
    return 0;
 }
 
@@ -1542,8 +1547,10 @@ int act_disable_fini(smrule_t * UNUSED(r))
 }
 
 
-int act_enable_ini(smrule_t * UNUSED(r))
+int act_enable_ini(smrule_t *r)
 {
+   sm_unordered(r);
+   sm_tags_ro(r);
    return 0;
 }
 
@@ -1788,6 +1795,7 @@ int act_strfmt_ini(smrule_t *r)
    }
 
    memcpy(r->data, &fi, sizeof(fi));
+   sm_unordered(r);
    return 0;
 }
 
@@ -1809,7 +1817,7 @@ int act_strfmt_main(smrule_t *r, osm_obj_t *o)
    {
       log_debug("adding tag '%s'='%s' to object %"PRId64,
             (char*) ((struct fmt_info*) r->data)->addtag, buf, o->id);
-      if ((ot = realloc(o->otag, sizeof(*o->otag) * (o->tag_cnt + 1))) == NULL)
+      if ((ot = realloc_mem(o->otag, sizeof(*o->otag) * o->tag_cnt, sizeof(*o->otag) * (o->tag_cnt + 1))) == NULL)
       {
          log_msg(LOG_ERR, "realloc() failed in strfmt(): %s", strerror(errno));
          return -1;
@@ -1980,7 +1988,7 @@ static int copy_tag_cond(const osm_obj_t *src, osm_obj_t *dst, int si, int force
    // test if destination object has no such a key
    if ((m = match_attr(dst, tag, NULL)) < 0)
    {
-      if ((ot = realloc(dst->otag, sizeof(*dst->otag) * (dst->tag_cnt + 1))) == NULL)
+      if ((ot = realloc_mem(dst->otag, sizeof(*dst->otag) * dst->tag_cnt, sizeof(*dst->otag) * (dst->tag_cnt + 1))) == NULL)
       {
          log_msg(LOG_ERR, "failed to realloc() in copy_tag_cond(): %s", strerror(errno));
          return -1;
@@ -2045,7 +2053,7 @@ int act_inherit_tags_main(smrule_t *r, osm_obj_t *o)
             // test if reverse object (destination) already has no such a key
             if ((m = match_attr(*optr, (*fp)->val, NULL)) < 0)
             {
-               if ((ot = realloc((*optr)->otag, sizeof(*(*optr)->otag) * ((*optr)->tag_cnt + 1))) == NULL)
+               if ((ot = realloc_mem((*optr)->otag, sizeof(*(*optr)->otag) * (*optr)->tag_cnt, sizeof(*(*optr)->otag) * ((*optr)->tag_cnt + 1))) == NULL)
                {
                   log_msg(LOG_ERR, "failed to realloc() in inherit_tags(): %s", strerror(errno));
                   return -1;
@@ -2733,6 +2741,7 @@ int act_translate_ini(smrule_t *r)
    }
 
    r->data = td;
+   sm_unordered(r);
 
    log_debug("found %d keys", i);
 
@@ -2767,7 +2776,7 @@ int act_translate_main(smrule_t *r, osm_obj_t *o)
       // add new tag if newtag is true
       if (td->newtag)
       {
-         if ((tmp_ot = realloc(o->otag, sizeof(struct otag) * (o->tag_cnt + 1))) == NULL)
+         if ((tmp_ot = realloc_mem(o->otag, sizeof(struct otag) * o->tag_cnt, sizeof(struct otag) * (o->tag_cnt + 1))) == NULL)
          {
             log_msg(LOG_DEBUG, "could not realloc tag list: %s", strerror(errno));
             return 0;
@@ -2829,59 +2838,151 @@ static int gather_node(osm_node_t *n, node_list_t *nl)
 }
 
 
-static struct pcoord *node_mtx(node_list_t *nl)
+/*! Grid cell of a node for mask(). The nodes are sorted by their cell, thus
+ * all nodes of a cell are adjacent.
+ */
+typedef struct mask_cell
 {
-   struct pcoord *nmx;
-   struct coord src, dst;
+   long x, y;     //!< cell coordinates
+   int n;         //!< index of node in node list
+} mask_cell_t;
+
+
+static int cmp_mask_cell(const void *a, const void *b)
+{
+   const mask_cell_t *ma = a, *mb = b;
+
+   if (ma->y != mb->y)
+      return ma->y < mb->y ? -1 : 1;
+   if (ma->x != mb->x)
+      return ma->x < mb->x ? -1 : 1;
+   return ma->n - mb->n;
+}
+
+
+/*! Return the number of cells of row y of the mask grid around the globe. The
+ * rows are min_dist high, the cells of a row are wide enough that all nodes
+ * of the row and its adjacent rows which are closer than min_dist differ by
+ * at most one cell in longitude. Thus the cells get wider towards the poles,
+ * rows close to a pole have a single cell.
+ */
+static long mask_cols(double min_dist, long y)
+{
+   double lat, w;
+
+   // latitude of the row's edge farthest from the equator plus the adjacent row
+   lat = fmax(fabs(y * min_dist), fabs((y + 1) * min_dist)) + min_dist;
+   if (lat >= 90)
+      return 1;
+   // maximum difference in longitude of nodes closer than min_dist at lat
+   if ((w = sin(DEG2RAD(min_dist)) / cos(DEG2RAD(lat))) >= 1)
+      return 1;
+   w = RAD2DEG(asin(w)) * 1.01;
+   return w >= 360 ? 1 : (long) (360 / w);
+}
 
-   log_debug("calculating node distance matrix");
-   if ((nmx = malloc(sizeof(*nmx) * (nl->node_cnt * nl->node_cnt))) == NULL)
+
+//! Return the cell in longitude of lon within a row of cols cells.
+static long mask_col(double lon, long cols)
+{
+   long x = fmod2(lon + 180, 360) / 360 * cols;
+
+   return x < cols ? x : cols - 1;
+}
+
+
+/*! Sort the nodes of nl into a grid (see mask_cols()) such that all nodes
+ * closer than min_dist are within adjacent cells. The cells wrap around at
+ * +/-180 degrees longitude.
+ * @param nl Pointer to node list.
+ * @return Returns a sorted array of nl->node_cnt cells or NULL on error.
+ */
+static mask_cell_t *mask_grid(const node_list_t *nl)
+{
+   mask_cell_t *mc;
+   int i;
+
+   if ((mc = malloc(sizeof(*mc) * nl->node_cnt)) == NULL)
    {
-      log_msg(LOG_ERR, "malloc(%ld kB) for matrix failed: %s", sizeof(*nmx) * nl->node_cnt * nl->node_cnt >> 10, strerror(errno));
+      log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
       return NULL;
    }
 
-   for (int i = 0; i < nl->node_cnt; i++)
+   for (i = 0; i < nl->node_cnt; i++)
    {
-      src.lon = nl->node[i]->lon;
-      src.lat = nl->node[i]->lat;
-      memset(&nmx[i * nl->node_cnt], 0, sizeof(*nmx));
-      for (int j = i + 1; j < nl->node_cnt; j++)
-      {
-         dst.lon = nl->node[j]->lon;
-         dst.lat = nl->node[j]->lat;
-         nmx[i * nl->node_cnt + j] = coord_diff(&src, &dst);
-      }
+      mc[i].y = floor(nl->node[i]->lat / nl->min_dist);
+      mc[i].x = mask_col(nl->node[i]->lon, mask_cols(nl->min_dist, mc[i].y));
+      mc[i].n = i;
    }
+   qsort(mc, nl->node_cnt, sizeof(*mc), cmp_mask_cell);
 
-   return nmx;
+   return mc;
 }
 
 
-static void rate_nmx(struct pcoord *nmx, int n, double dist)
+//! Return the index of the first entry of cell x/y within mc.
+static int mask_lookup(const mask_cell_t *mc, int cnt, long x, long y)
 {
-   for (int i = 0; i < n; i++)
-      for (int j = i + 1; j < n; j++)
-      {
-         // ignore nodes which have been masked
-         if (nmx[i * n].dist < 0)
-            continue;
+   int lo = 0, hi = cnt, m;
 
-         if (nmx[i * n + j].dist < dist)
-            nmx[j * n].dist = MASK_NODE;
-      }
+   while (lo < hi)
+   {
+      m = (lo + hi) / 2;
+      if (mc[m].y < y || (mc[m].y == y && mc[m].x < x))
+         lo = m + 1;
+      else
+         hi = m;
+   }
+   return lo;
+}
+
+
+/*! Test if node i is closer than min_dist to a node which was gathered before
+ * and which is not masked.
+ * @return Returns 1 if the node has to be masked, otherwise 0.
+ */
+static int mask_near(const mask_cell_t *mc, const node_list_t *nl, const char *masked, int i)
+{
+   struct coord src, dst;
+   long x, y, cols, dx;
+   int k;
+
+   y = floor(nl->node[i]->lat / nl->min_dist);
+   dst.lon = nl->node[i]->lon;
+   dst.lat = nl->node[i]->lat;
+
+   for (long dy = -1; dy <= 1; dy++)
+   {
+      // the adjacent rows may have a different number of cells
+      cols = mask_cols(nl->min_dist, y + dy);
+      x = mask_col(dst.lon, cols);
+      // with less than 3 cells all of them are adjacent
+      for (dx = cols < 3 ? -x : -1; dx <= (cols < 3 ? cols - 1 - x : 1); dx++)
+         for (k = mask_lookup(mc, nl->node_cnt, (x + dx + cols) % cols, y + dy);
+               k < nl->node_cnt && mc[k].x == (x + dx + cols) % cols && mc[k].y == y + dy && mc[k].n < i; k++)
+         {
+            if (masked[mc[k].n])
+               continue;
+            src.lon = nl->node[mc[k].n]->lon;
+            src.lat = nl->node[mc[k].n]->lat;
+            if (coord_diff(&src, &dst).dist < nl->min_dist)
+               return 1;
+         }
+   }
+
+   return 0;
 }
 
 
-static void mod_node(struct pcoord *nmx, node_list_t *nl)
+static void mod_node(const char *masked, node_list_t *nl)
 {
    struct otag *ot;
 
    for (int i = 0; i < nl->node_cnt; i++)
    {
-      if (nmx[i * nl->node_cnt].dist < 0)
+      if (masked[i])
       {
-         if ((ot = realloc(nl->node[i]->obj.otag, sizeof(*nl->node[i]->obj.otag) * (nl->node[i]->obj.tag_cnt + 1))) == NULL)
+         if ((ot = realloc_mem(nl->node[i]->obj.otag, sizeof(*nl->node[i]->obj.otag) * nl->node[i]->obj.tag_cnt, sizeof(*nl->node[i]->obj.otag) * (nl->node[i]->obj.tag_cnt + 1))) == NULL)
          {
             log_msg(LOG_ERR, "realloc() failed: %s", strerror(errno));
             continue;
@@ -2935,35 +3036,29 @@ int act_mask_main(smrule_t *r, osm_obj_t *o)
 }
 
 
-void output_nmx(const struct pcoord *nmx, int n)
-{
-   for (int i = 0; i < n; i++)
-   {
-      fprintf(stderr, "%d: ", i);
-      for (int j = 0; j < n; j++)
-      {
-         if (j && j < i)
-            fprintf(stderr, "-/-, ");
-         else
-            fprintf(stderr, "%.1f/%.1f, ", nmx[i * n + j].dist * 60, nmx[i * n + j].bearing);
-      }
-      fprintf(stderr, "\n");
-   }
-}
-
-
+/*! Mask all nodes which are closer than min_dist to a node which was gathered
+ * before and which is not masked itself. Only nodes of adjacent grid cells are
+ * compared (see mask_grid()).
+ */
 int act_mask_fini(smrule_t *r)
 {
-   struct pcoord *nmx;
    node_list_t *nl = r->data;
+   mask_cell_t *mc;
+   char *masked;
 
    log_debug("gathered %d nodes", nl->node_cnt);
-   if ((nmx = node_mtx(nl)) != NULL)
+   if (nl->node_cnt && (mc = mask_grid(nl)) != NULL)
    {
-      rate_nmx(nmx, nl->node_cnt, nl->min_dist);
-      //output_nmx(nmx, nl->node_cnt);
-      mod_node(nmx, nl);
-      free(nmx);
+      if ((masked = calloc(nl->node_cnt, sizeof(*masked))) != NULL)
+      {
+         for (int i = 0; i < nl->node_cnt; i++)
+            masked[i] = mask_near(mc, nl, masked, i);
+         mod_node(masked, nl);
+         free(masked);
+      }
+      else
+         log_msg(LOG_ERR, "calloc() failed: %s", strerror(errno));
+      free(mc);
    }
 
    free(nl->node);
@@ -2976,6 +3071,7 @@ int act_mask_fini(smrule_t *r)
 int act_del_match_tags_ini(smrule_t *r)
 {
    r->data = 0;
+   sm_unordered(r);
    return 0;
 }
 
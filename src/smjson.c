@@ -125,7 +125,7 @@ int bs_stresc(bstring_t src, char *dst, int dlen, const char *echars, const char
 /*! This function is a wrapper for bs_stresc(). */
 int stresc(const char *src, int slen, char *dst, int dlen, const char *echars, const char *uchars)
 {
-   return bs_stresc((bstring_t) {slen, (char*) src}, dst, dlen, echars, uchars);
+   return bs_stresc((bstring_t) {.len = slen, .buf = (char*) src}, dst, dlen, echars, uchars);
 }
 
 
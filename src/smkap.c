@@ -37,11 +37,35 @@
 
 #include "smrender_dev.h"
 
+extern int band_mem_;
+
+//! maximum number of pixels which are sampled for the palette of banded output
+#define KAP_SAMPLES (1L << 22)
+
+//! state of the banded KAP output
+struct kap_band
+{
+   FILE *f;
+   int w;                  //!< width of the image
+   int d;                  //!< color depth
+   int off;                //!< current file offset
+   int32_t *offp;          //!< file offsets of all rows
+   uint32_t palette[127];
+   int hcnt;               //!< number of colors in the palette
+   uint32_t *sample;       //!< sampled pixels for the palette
+   long nsample;           //!< number of pixels sampled
+   long step;              //!< every step'th pixel is sampled
+   long next;              //!< number of the next pixel to sample
+   uint8_t *buf_in, *buf_out;
+};
+
 #ifdef HAVE_CAIRO
 #define get_pixel(x, y, z) cairo_smr_get_pixel(x, y, z)
 #define get_image() cairo_smr_image_surface_from_bg(CAIRO_FORMAT_RGB24, CAIRO_ANTIALIAS_NONE)
 #define destroy_image(x) cairo_surface_destroy(x)
 int cairo_smr_image_surface_color_reduce(cairo_surface_t *, int , uint32_t *);
+int mc_palette(const uint32_t *, long, int, uint32_t *);
+int mc_palette_index(const uint32_t *, int, uint32_t);
 #else
 #define get_pixel(x, y, z) 0
 #define get_image() NULL
@@ -193,6 +217,143 @@ static int get_depth(int hcnt)
 }
 
 
+/*! Write the palette and the start of the image data.
+ * @return Returns the number of bytes written.
+ */
+static int kap_palette(FILE *f, const uint32_t *palette, int hcnt, int d)
+{
+   int i, off;
+
+   off = fprintf(f, "OST/1\r\nIFM/%d\r\n", d);
+   for (i = 0; i < hcnt; i++)
+   {
+      off += fprintf(f, "RGB/%d,%d,%d,%d\r\n", i + 1, (palette[i] >> 16) & 0xff, (palette[i] >> 8) & 0xff, palette[i] & 0xff);
+      log_debug("palette[%d] = #%06x", i , palette[i]);
+   }
+
+   off += fprintf(f, "\x1a%c%c", '\0', (char) d);
+   return off;
+}
+
+
+#ifdef HAVE_CAIRO
+//! Band function which samples pixels of the band for the palette.
+static int kap_sample_band(struct kap_band *kb, const unsigned char *data, int stride, int y0, int h)
+{
+   const uint32_t *pix;
+   long row;
+
+   for (int y = 0; y < h; y++)
+   {
+      pix = (const uint32_t*) (data + (long) y * stride);
+      row = (long) (y0 + y) * kb->w;
+      for (; kb->next < row + kb->w; kb->next += kb->step)
+         kb->sample[kb->nsample++] = pix[kb->next - row];
+   }
+   return 0;
+}
+
+
+//! Band function which maps the pixels to the palette and compresses the rows.
+static int kap_write_band(struct kap_band *kb, const unsigned char *data, int stride, int y0, int h)
+{
+   const uint32_t *pix;
+   uint32_t last = 0;
+   int i, x, y, idx = -1;
+
+   for (y = 0; y < h; y++)
+   {
+      pix = (const uint32_t*) (data + (long) y * stride);
+      for (x = 0; x < kb->w; x++)
+      {
+         // neighboring pixels have the same color most of the time
+         if (idx == -1 || pix[x] != last)
+         {
+            last = pix[x];
+            idx = mc_palette_index(kb->palette, kb->hcnt, last) + 1;
+         }
+         kb->buf_in[x] = idx;
+      }
+
+      kb->offp[y0 + y] = htonl(kb->off);
+      i = bsb_compress_row(kb->buf_in, kb->buf_out, kb->d, y0 + y, kb->w, kb->w);
+      if (fwrite(kb->buf_out, i, 1, kb->f) != 1)
+      {
+         log_errno(LOG_ERR, "fwrite() failed");
+         return -1;
+      }
+      kb->off += i;
+   }
+   return 0;
+}
+
+
+/*! Write the image data of the KAP file rendering the image in bands (see
+ * smband.c). The image is rendered twice. The palette is calculated from a
+ * sample of the pixels of the first pass, the rows are written in the second
+ * pass.
+ * @param f File to write to.
+ * @param w Width of the image.
+ * @param h Height of the image.
+ * @param off Current file offset.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int save_kap_bands(FILE *f, int w, int h, int off)
+{
+   struct kap_band kb;
+   int e = -1;
+
+   memset(&kb, 0, sizeof(kb));
+   kb.f = f;
+   kb.w = w;
+   kb.step = ((long) w * h + KAP_SAMPLES - 1) / KAP_SAMPLES;
+   if ((kb.sample = malloc(sizeof(*kb.sample) * (((long) w * h + kb.step - 1) / kb.step))) == NULL ||
+         (kb.offp = malloc(sizeof(*kb.offp) * (h + 1))) == NULL || (kb.buf_in = malloc(w)) == NULL || (kb.buf_out = malloc(w + 4)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      goto skb_exit;
+   }
+
+   log_debug("sampling every %ld. pixel", kb.step);
+   if (cairo_smr_bands(w, h, CAIRO_FORMAT_RGB24, 0, CAIRO_ANTIALIAS_NONE, (band_func_t) kap_sample_band, &kb))
+      goto skb_exit;
+
+   log_debug("reducing colors of %ld pixels", kb.nsample);
+   if ((kb.hcnt = mc_palette(kb.sample, kb.nsample, 127, kb.palette)) <= 0)
+   {
+      log_msg(LOG_ERR, "reducing colors failed");
+      goto skb_exit;
+   }
+   free(kb.sample);
+   kb.sample = NULL;
+   log_debug("reduced to %d colors", kb.hcnt);
+
+   kb.d = get_depth(kb.hcnt);
+   log_debug("KAP color depth %d", kb.d);
+   kb.off = off + kap_palette(f, kb.palette, kb.hcnt, kb.d);
+
+   log_debug("compressing image");
+   if (cairo_smr_bands(w, h, CAIRO_FORMAT_RGB24, 0, CAIRO_ANTIALIAS_NONE, (band_func_t) kap_write_band, &kb))
+      goto skb_exit;
+
+   kb.offp[h] = htonl(kb.off);
+   if (fwrite(kb.offp, sizeof(int32_t), h + 1, f) != (size_t) h + 1)
+   {
+      log_errno(LOG_ERR, "fwrite() failed");
+      goto skb_exit;
+   }
+   e = 0;
+
+skb_exit:
+   free(kb.buf_out);
+   free(kb.buf_in);
+   free(kb.offp);
+   free(kb.sample);
+   return e;
+}
+#endif
+
+
 int save_kap(FILE *f, struct rdata *rd)
 {
    int d, i, x, y, hcnt, off, w = round(rd->w), h = round(rd->h);
@@ -204,6 +365,11 @@ int save_kap(FILE *f, struct rdata *rd)
    log_debug("writing KAP header");
    off = gen_kap_header(f, rd);
 
+#ifdef HAVE_CAIRO
+   if (band_mem_)
+      return save_kap_bands(f, w, h, off);
+#endif
+
    img = get_image();
    log_debug("reducing colors");
    if ((hcnt = cairo_smr_image_surface_color_reduce(img, 127, palette)) <= 0)
@@ -215,14 +381,7 @@ int save_kap(FILE *f, struct rdata *rd)
 
    d = get_depth(hcnt);
    log_debug("KAP color depth %d", d);
-   off += fprintf(f, "OST/1\r\nIFM/%d\r\n", d);
-   for (i = 0; i < hcnt; i++)
-   {
-      off += fprintf(f, "RGB/%d,%d,%d,%d\r\n", i + 1, (palette[i] >> 16) & 0xff, (palette[i] >> 8) & 0xff, palette[i] & 0xff);
-      log_debug("palette[%d] = #%06x", i , palette[i]);
-   }
-
-   off += fprintf(f, "\x1a%c%c", '\0', (char) d);
+   off += kap_palette(f, palette, hcnt, d);
 
    log_debug("compressing image");
    for (y = 0; y < h; y++)
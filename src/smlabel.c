@@ -0,0 +1,293 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smlabel.c
+ * This file contains the placement index of labels, i.e. captions and images.
+ * Each label which is placed on the page is added to the index as a (possibly
+ * rotated) rectangle in page coordinates (pt). Rules which shall not overlap
+ * other labels (see parameter 'overlap' of cap() and img()) test against the
+ * index before placing a label. Since rules are executed in their order,
+ * labels of earlier rules take precedence.
+ *
+ * The index is a regular grid over the page. Each label is inserted into all
+ * cells which are covered by its bounding box. Two labels collide if their
+ * rectangles intersect which is tested with the separating axis theorem.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "smrender_dev.h"
+#include "rdata.h"
+
+
+//! minimum size of a grid cell in pt
+#define LABEL_CELL 32
+//! maximum number of grid cells in each direction
+#define LABEL_GRID 512
+
+#ifdef WITH_THREADS
+#define LABEL_LOCK pthread_mutex_lock(&label_mutex_)
+#define LABEL_UNLOCK pthread_mutex_unlock(&label_mutex_)
+#else
+#define LABEL_LOCK
+#define LABEL_UNLOCK
+#endif
+
+
+//! label with its bounding box
+typedef struct label
+{
+   label_box_t lb;
+   double x1, y1, x2, y2;
+} label_t;
+
+//! list of labels of a grid cell
+typedef struct label_cell
+{
+   int *idx;
+   int cnt, size;
+} label_cell_t;
+
+typedef struct label_index
+{
+   double x, y, cell;
+   int cols, rows;
+   label_t *label;
+   int cnt, size;
+   label_cell_t *grid;
+} label_index_t;
+
+
+static label_index_t *li_ = NULL;
+#ifdef WITH_THREADS
+static pthread_mutex_t label_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static label_index_t *label_index_new(void)
+{
+   label_index_t *li;
+   double w, h;
+
+   if ((li = calloc(1, sizeof(*li))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return NULL;
+   }
+
+   w = rdata_width(U_PT);
+   h = rdata_height(U_PT);
+   li->cell = fmax(fmax(w, h) / LABEL_GRID, LABEL_CELL);
+   li->cols = ceil(w / li->cell) + 1;
+   li->rows = ceil(h / li->cell) + 1;
+   if ((li->grid = calloc(li->cols * li->rows, sizeof(*li->grid))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      free(li);
+      return NULL;
+   }
+
+   log_debug("label index grid %dx%d, cell = %.1f pt", li->cols, li->rows, li->cell);
+   return li;
+}
+
+
+//! Calculate the range of grid cells which is covered by the label.
+static void label_cells(const label_index_t *li, const label_t *l, int *c0, int *r0, int *c1, int *r1)
+{
+   *c0 = fmin(fmax(floor((l->x1 - li->x) / li->cell), 0), li->cols - 1);
+   *r0 = fmin(fmax(floor((l->y1 - li->y) / li->cell), 0), li->rows - 1);
+   *c1 = fmin(fmax(floor((l->x2 - li->x) / li->cell), 0), li->cols - 1);
+   *r1 = fmin(fmax(floor((l->y2 - li->y) / li->cell), 0), li->rows - 1);
+}
+
+
+/*! Test if the projections of the boxes a and b onto the normals of the edges
+ * of a are separated.
+ * @return Returns 1 if there is a separating axis, otherwise 0.
+ */
+static int label_separated(const label_box_t *a, const label_box_t *b)
+{
+   double nx, ny, amin, amax, bmin, bmax, d;
+   int i, j;
+
+   for (i = 0; i < 2; i++)
+   {
+      nx = a->y[i + 1] - a->y[i];
+      ny = a->x[i] - a->x[i + 1];
+      amin = bmin = INFINITY;
+      amax = bmax = -INFINITY;
+      for (j = 0; j < 4; j++)
+      {
+         d = a->x[j] * nx + a->y[j] * ny;
+         amin = fmin(amin, d);
+         amax = fmax(amax, d);
+         d = b->x[j] * nx + b->y[j] * ny;
+         bmin = fmin(bmin, d);
+         bmax = fmax(bmax, d);
+      }
+      if (amax <= bmin || bmax <= amin)
+         return 1;
+   }
+   return 0;
+}
+
+
+//! Test if the labels a and b intersect.
+static int label_collide(const label_t *a, const label_t *b)
+{
+   if (a->x2 <= b->x1 || b->x2 <= a->x1 || a->y2 <= b->y1 || b->y2 <= a->y1)
+      return 0;
+   return !label_separated(&a->lb, &b->lb) && !label_separated(&b->lb, &a->lb);
+}
+
+
+//! Test if l collides with any label of the index.
+static int label_test(const label_index_t *li, const label_t *l)
+{
+   int c0, r0, c1, r1, c, r, i;
+   const label_cell_t *lc;
+
+   label_cells(li, l, &c0, &r0, &c1, &r1);
+   for (r = r0; r <= r1; r++)
+      for (c = c0; c <= c1; c++)
+      {
+         lc = &li->grid[r * li->cols + c];
+         for (i = 0; i < lc->cnt; i++)
+            if (label_collide(&li->label[lc->idx[i]], l))
+               return 1;
+      }
+   return 0;
+}
+
+
+static int label_cell_add(label_cell_t *lc, int n)
+{
+   int *idx;
+
+   if (lc->cnt >= lc->size)
+   {
+      if ((idx = realloc(lc->idx, sizeof(*idx) * (lc->size ? lc->size * 2 : 8))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      lc->idx = idx;
+      lc->size = lc->size ? lc->size * 2 : 8;
+   }
+   lc->idx[lc->cnt++] = n;
+   return 0;
+}
+
+
+//! Add label l to the index.
+static int label_insert(label_index_t *li, const label_t *l)
+{
+   int c0, r0, c1, r1, c, r;
+   label_t *lt;
+
+   if (li->cnt >= li->size)
+   {
+      if ((lt = realloc(li->label, sizeof(*lt) * (li->size ? li->size * 2 : 256))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      li->label = lt;
+      li->size = li->size ? li->size * 2 : 256;
+   }
+   li->label[li->cnt] = *l;
+
+   label_cells(li, l, &c0, &r0, &c1, &r1);
+   for (r = r0; r <= r1; r++)
+      for (c = c0; c <= c1; c++)
+         if (label_cell_add(&li->grid[r * li->cols + c], li->cnt))
+            return -1;
+
+   li->cnt++;
+   return 0;
+}
+
+
+/*! Place a label. The label is added to the placement index if mode is
+ * LABEL_ADD or if it does not overlap any label which was placed before.
+ * This function is thread-safe.
+ * @param lb Corners of the label in page coordinates (pt) in the order of its
+ * circumference.
+ * @param mode LABEL_ADD to add the label unconditionally, LABEL_TEST to add it
+ * only if it is free.
+ * @return Returns 1 if the label was added, 0 if it overlaps another label,
+ * or -1 in case of error.
+ */
+int label_place(const label_box_t *lb, int mode)
+{
+   label_t l;
+   int i, e;
+
+   l.lb = *lb;
+   l.x1 = l.x2 = lb->x[0];
+   l.y1 = l.y2 = lb->y[0];
+   for (i = 1; i < 4; i++)
+   {
+      l.x1 = fmin(l.x1, lb->x[i]);
+      l.x2 = fmax(l.x2, lb->x[i]);
+      l.y1 = fmin(l.y1, lb->y[i]);
+      l.y2 = fmax(l.y2, lb->y[i]);
+   }
+
+   LABEL_LOCK;
+   if (li_ == NULL && (li_ = label_index_new()) == NULL)
+   {
+      LABEL_UNLOCK;
+      return -1;
+   }
+   if (mode == LABEL_TEST && label_test(li_, &l))
+      e = 0;
+   else
+      e = label_insert(li_, &l) ? -1 : 1;
+   LABEL_UNLOCK;
+
+   return e;
+}
+
+
+//! Free the placement index.
+void label_free(void)
+{
+   if (li_ == NULL)
+      return;
+
+   log_debug("%d labels placed", li_->cnt);
+   for (int i = 0; i < li_->cols * li_->rows; i++)
+      free(li_->grid[i].idx);
+   free(li_->grid);
+   free(li_->label);
+   free(li_);
+   li_ = NULL;
+}
+
@@ -37,13 +37,44 @@
 #include <limits.h>
 #include <dirent.h>
 #include <regex.h>
+#include <ctype.h>
 
 #include "smrender_dev.h"
 #include "smloadosm.h"
 #include "libhpxml.h"
+#include "smcore.h"
+
+
+#ifdef WITH_THREADS
+//! minimum and maximum size of a chunk of the parallel loader
+#define OSM_CHUNK_MIN (1L << 20)
+#define OSM_CHUNK_MAX (64L << 20)
+
+//! chunk of the input buffer of the parallel loader
+typedef struct osm_chunk
+{
+   hpx_ctrl_t ctl;         //!< control structure of the part of the buffer
+   osm_obj_t **obj;        //!< objects in order of input
+   long cnt;               //!< number of objects
+   long size;              //!< number of elements allocated in obj
+   int e;                  //!< last return value of read_osm_obj0()
+   int done;               //!< 1 if chunk is parsed
+} osm_chunk_t;
+
+typedef struct osm_chunks
+{
+   osm_chunk_t *chunk;     //!< list of chunks
+   int cnt;                //!< number of chunks
+   int next;               //!< next chunk to parse
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;    //!< signalled if a chunk is done
+} osm_chunks_t;
+#endif
 
 
 static size_t oline_ = 0;
+//! id of next object without id
+static int64_t nid_ = MIN_ID + 1;
 static volatile sig_atomic_t usr1_ = 0;
 
 
@@ -322,14 +353,17 @@ static void clear_ostor(osm_storage_t *o)
 }
 
 
-int read_osm_obj(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj)
+/*! Parse the next object.
+ * @param nid Pointer to the counter of ids of objects which have no id. If it
+ * is NULL, the id of such objects is left 0.
+ */
+static int read_osm_obj0(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj, int64_t *nid)
 {
    bstring_t b;
    int t = 0, e, i, j, rcnt, mcnt;
    osm_storage_t o;
    hpx_tag_t *tag;
    int64_t *ref;
-   static int64_t nid = MIN_ID + 1;
    struct rmember *mem;
    // FIXME: this is temporary
    hpx_tree_t *tlist = *tlistptr;
@@ -341,8 +375,6 @@ int read_osm_obj(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj)
 
    while ((e = hpx_get_elem(ctl, &b, NULL, &tag->line)) > 0)
    {
-      oline_ = tag->line;
-
       if (!hpx_process_elem(b, tag))
       {
          if (!bs_cmp(tag->tag, "node"))
@@ -361,7 +393,7 @@ int read_osm_obj(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj)
                clear_ostor(&o);
                proc_osm_node(tag, (osm_obj_t*) &o);
                o.o.type = t;
-               if (!o.o.id) o.o.id = nid++;
+               if (!o.o.id && nid != NULL) o.o.id = (*nid)++;
                //if (o.o.id <= 0) o.o.id = get_osm_id(&o.o);
 
                if (tlist->nsub >= tlist->msub)
@@ -384,7 +416,7 @@ int read_osm_obj(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj)
                clear_ostor(&o);
                proc_osm_node(tag, (osm_obj_t*) &o);
                o.o.type = t;
-               if (!o.o.id) o.o.id = nid++;
+               if (!o.o.id && nid != NULL) o.o.id = (*nid)++;
                //if (o.o.id <= 0) o.o.id = get_osm_id(&o.o);
 
                switch (o.o.type)
@@ -553,12 +585,253 @@ int read_osm_obj(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj)
 }
 
 
+int read_osm_obj(hpx_ctrl_t *ctl, hpx_tree_t **tlistptr, osm_obj_t **obj)
+{
+   int e;
+
+   e = read_osm_obj0(ctl, tlistptr, obj, &nid_);
+   oline_ = ctl->lineno;
+   return e;
+}
+
+
+/*! Put object into the object tree. A previous object with the same id is
+ * freed.
+ * @return Returns 1 if the object was a duplicate, otherwise 0.
+ */
+int put_osm_obj(bx_node_t **tree, osm_obj_t *obj, struct dstats *ds)
+{
+   bx_node_t *tr;
+   void *old;
+
+   if (sa_is_store(*tree))
+   {
+      (void) sa_put(*tree, obj->id, obj, obj->type - 1, &old);
+   }
+   else
+   {
+      tr = bx_add_node(tree, obj->id);
+      old = tr->next[obj->type - 1];
+      tr->next[obj->type - 1] = obj;
+   }
+
+   if (ds != NULL)
+      update_stats(obj, ds);
+
+   if (old != NULL)
+   {
+      free_obj(old);
+      return 1;
+   }
+   return 0;
+}
+
+
+#ifdef WITH_THREADS
+/*! Check if the buffer buf of length len starts with the element name s
+ * followed by a blank.
+ */
+static int is_elem(const char *buf, long len, const char *s)
+{
+   long n = strlen(s);
+
+   return len > n && !strncmp(buf, s, n) && isspace((unsigned) buf[n]);
+}
+
+
+/*! Return the position of the first element <node, <way, or <relation at or
+ * after position pos which is the first element of its line. Since attribute
+ * values must not contain '<' such a position is never within a tag. Comments
+ * or CDATA sections which contain such lines are not detected.
+ * @return Returns the position of the element or len if there is none.
+ */
+static long next_obj_elem(const char *buf, long pos, long len)
+{
+   const char *p;
+   long i;
+
+   for (; pos < len; pos++)
+   {
+      if ((p = memchr(buf + pos, '<', len - pos)) == NULL)
+         return len;
+      pos = p - buf;
+
+      for (i = pos - 1; i >= 0 && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\r'); i--);
+      if (i >= 0 && buf[i] != '\n')
+         continue;
+
+      p++;
+      if (is_elem(p, len - pos - 1, "node") || is_elem(p, len - pos - 1, "way") || is_elem(p, len - pos - 1, "relation"))
+         return pos;
+   }
+   return len;
+}
+
+
+/*! Thread function of the parallel loader. It parses the chunks in order of
+ * oc->next into the object lists of the chunks.
+ */
+static void *read_osm_chunk_thread(osm_chunks_t *oc)
+{
+   hpx_tree_t *tlist = NULL;
+   osm_chunk_t *c;
+   osm_obj_t *obj, **o;
+   int i;
+
+   if (hpx_tree_resize(&tlist, 0) == -1)
+      perror("hpx_tree_resize"), exit(EXIT_FAILURE);
+   if ((tlist->tag = hpx_tm_create(16)) == NULL)
+      perror("hpx_tm_create"), exit(EXIT_FAILURE);
+
+   while ((i = __atomic_fetch_add(&oc->next, 1, __ATOMIC_SEQ_CST)) < oc->cnt)
+   {
+      c = &oc->chunk[i];
+      // ids of objects without id are assigned in order while merging
+      while ((c->e = read_osm_obj0(&c->ctl, &tlist, &obj, NULL)) > 0)
+      {
+         if (obj == NULL)
+            continue;
+
+         if (c->cnt >= c->size)
+         {
+            if ((o = realloc(c->obj, sizeof(*c->obj) * (c->size ? c->size * 2 : 4096))) == NULL)
+               log_errno(LOG_ERR, "realloc() failed"), exit(EXIT_FAILURE);
+            c->obj = o;
+            c->size = c->size ? c->size * 2 : 4096;
+         }
+         c->obj[c->cnt++] = obj;
+      }
+
+      pthread_mutex_lock(&oc->mutex);
+      c->done = 1;
+      pthread_cond_signal(&oc->cond);
+      pthread_mutex_unlock(&oc->mutex);
+   }
+
+   hpx_tm_free_tree(tlist);
+   return NULL;
+}
+
+
+/*! Parse the memory mapped input in parallel. The buffer is split into chunks
+ * at the beginning of objects. The chunks are parsed by nthreads threads and
+ * the objects are put into the tree in order of the input by the calling
+ * thread. Thus, duplicates and the ids of objects without id are handled
+ * exactly as by the sequential loader.
+ * @param ctl Control structure of the input which must be memory mapped.
+ * @param tree Object tree.
+ * @param ds Pointer to stats structure or NULL.
+ * @param nthreads Number of threads.
+ * @param dup_cnt Pointer to counter of duplicates.
+ * @return Returns 0 on success. If the input cannot be split -2 is returned
+ * and nothing is parsed, -1 is returned if parsing failed.
+ */
+static int read_osm_chunks(hpx_ctrl_t *ctl, bx_node_t **tree, struct dstats *ds, int nthreads, int *dup_cnt)
+{
+   osm_chunks_t oc;
+   osm_chunk_t *c;
+   pthread_t *th;
+   long pos, end, size;
+   int i, n, e = 0;
+
+   size = ctl->len / (nthreads * 4);
+   if (size < OSM_CHUNK_MIN)
+      size = OSM_CHUNK_MIN;
+   if (size > OSM_CHUNK_MAX)
+      size = OSM_CHUNK_MAX;
+
+   memset(&oc, 0, sizeof(oc));
+   if ((oc.chunk = calloc(ctl->len / size + 1, sizeof(*oc.chunk))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return -2;
+   }
+
+   for (pos = 0; pos < ctl->len; pos = end, oc.cnt++)
+   {
+      end = pos + size >= ctl->len ? ctl->len : next_obj_elem(ctl->buf.buf, pos + size, ctl->len);
+      if (end - pos > INT_MAX)
+      {
+         log_msg(LOG_NOTICE, "cannot split input into chunks");
+         free(oc.chunk);
+         return -2;
+      }
+      hpx_init_membuf(&oc.chunk[oc.cnt].ctl, ctl->buf.buf + pos, end - pos);
+   }
+
+   if ((th = calloc(nthreads, sizeof(*th))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      free(oc.chunk);
+      return -2;
+   }
+
+   log_msg(LOG_INFO, "parsing %d chunks of %ld kB with %d threads", oc.cnt, size / 1024, nthreads);
+   pthread_mutex_init(&oc.mutex, NULL);
+   pthread_cond_init(&oc.cond, NULL);
+   for (n = 0; n < nthreads && n < oc.cnt; n++)
+      if ((e = pthread_create(&th[n], NULL, (void*(*)(void*)) read_osm_chunk_thread, &oc)))
+      {
+         log_msg(LOG_ERR, "pthread_create() failed: %s", strerror(e));
+         break;
+      }
+   // parse in this thread if no thread could be created
+   if (!n)
+      (void) read_osm_chunk_thread(&oc);
+
+   for (i = 0, e = 0, pos = 0; i < oc.cnt; i++)
+   {
+      c = &oc.chunk[i];
+      pthread_mutex_lock(&oc.mutex);
+      while (!c->done)
+         pthread_cond_wait(&oc.cond, &oc.mutex);
+      pthread_mutex_unlock(&oc.mutex);
+
+      if (c->e == -1)
+      {
+         log_msg(LOG_ERR, "parsing chunk %d failed", i);
+         e = -1;
+      }
+
+      for (long j = 0; j < c->cnt; j++)
+      {
+         if (!c->obj[j]->id)
+            c->obj[j]->id = nid_++;
+         *dup_cnt += put_osm_obj(tree, c->obj[j], ds);
+      }
+      free(c->obj);
+      pos += c->ctl.len;
+      oline_ += c->ctl.lineno - 1;
+
+      if (usr1_)
+      {
+         if (usr1_ == SIGALRM)
+            alarm(READ_STATS_TIME);
+
+         usr1_ = 0;
+         log_msg(LOG_INFO, "progress %ld %%, onode_memory: %ld kByte, chunk %d", pos * 100 / ctl->len,
+               (long) onode_mem() / 1024, i);
+      }
+   }
+
+   for (i = 0; i < n; i++)
+      pthread_join(th[i], NULL);
+   pthread_cond_destroy(&oc.cond);
+   pthread_mutex_destroy(&oc.mutex);
+   free(th);
+   free(oc.chunk);
+
+   ctl->pos = ctl->len;
+   return e;
+}
+#endif
+
+
 int read_osm_file(hpx_ctrl_t *ctl, bx_node_t **tree, const struct filter *fi, struct dstats *ds)
 {
    osm_obj_t *obj;
    osm_node_t *n;
    hpx_tree_t *tlist = NULL;
-   bx_node_t *tr;
    time_t tim;
    int e, dup_cnt = 0;
 
@@ -578,6 +851,13 @@ int read_osm_file(hpx_ctrl_t *ctl, bx_node_t **tree, const struct filter *fi, st
    // set stats timer
    alarm(READ_STATS_TIME);
 
+#ifdef WITH_THREADS
+   // parse in parallel if the whole input is available in memory
+   e = -2;
+   if (fi == NULL && get_nthreads() > 1 && ctl->mmap && !ctl->pos && ctl->len >= 2 * OSM_CHUNK_MIN)
+      e = read_osm_chunks(ctl, tree, ds, get_nthreads(), &dup_cnt);
+   if (e == -2)
+#endif
    while ((e = read_osm_obj(ctl, &tlist, &obj)) > 0)
    {
       if (usr1_)
@@ -650,16 +930,7 @@ int read_osm_file(hpx_ctrl_t *ctl, bx_node_t **tree, const struct filter *fi, st
          if (obj == NULL)
             continue;
 
-         tr = bx_add_node(tree, obj->id);
-         if (tr->next[obj->type - 1] != NULL)
-         {
-            free_obj(tr->next[obj->type - 1]);
-            dup_cnt++;
-         }
-         tr->next[obj->type - 1] = obj;
-
-         if (ds != NULL)
-            update_stats(obj, ds);
+         dup_cnt += put_osm_obj(tree, obj, ds);
       } //if (obj != NULL)
       else
          log_debug("read_osm_obj() returned NULL object");
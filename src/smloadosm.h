@@ -43,6 +43,18 @@ void osm_read_exit(void);
 int read_osm_obj(hpx_ctrl_t *, hpx_tree_t **, osm_obj_t **);
 int read_osm_file(hpx_ctrl_t*, bx_node_t**, const struct filter*, struct dstats*);
 hpx_ctrl_t *open_osm_source(const char*, int);
+int put_osm_obj(bx_node_t **, osm_obj_t *, struct dstats *);
+
+/* smpbf.c */
+int pbf_detect(int);
+int read_pbf_file(int, bx_node_t **, struct dstats *);
+void pbf_free(void);
+
+/* smsnap.c */
+int snap_write(const char *, bx_node_t *, const struct dstats *);
+int snap_detect(int);
+int read_snap_file(int, bx_node_t **, struct dstats *);
+void snap_free(void);
 
 void init_stats(struct dstats *);
 int update_stats(const osm_obj_t *, struct dstats *);
@@ -190,17 +190,16 @@ int print_tree(osm_obj_t *o, struct ostream *os)
 }
 
 
-/*! Save OSM data of tree to file f.
+/*! Write the header of an OSM file to f.
  *  @param s FILE handle of output file.
- *  @param Pointer to bxtree containing the information.
  *  @param bb Optional bounding box (written to tag <bounds>).
  *  @param info Optional information written to the header as comment (<!-- info -->).
- *  @return The function returns 0.
+ *  @return The function returns the number of bytes written or a negative
+ *  errno in case of error.
  */
-size_t save_osm0(FILE *f, bx_node_t *tree, const struct bbox *bb, const char *info)
+long save_osm_head(FILE *f, const struct bbox *bb, const char *info)
 {
-   struct ostream os;
-   size_t len = 0;
+   long len = 0;
    int n;
 
    if ((n = fprintf(f, "<?xml version='1.0' encoding='UTF-8'?>\n"
@@ -235,12 +234,17 @@ size_t save_osm0(FILE *f, bx_node_t *tree, const struct bbox *bb, const char *in
       len += n;
    }
 
-   os.stream = f;
-   os.len = 0;
-   traverse(tree, 0, IDX_NODE, (tree_func_t) print_tree, &os);
-   traverse(tree, 0, IDX_WAY, (tree_func_t) print_tree, &os);
-   traverse(tree, 0, IDX_REL, (tree_func_t) print_tree, &os);
-   len += os.len;
+   return len;
+}
+
+
+/*! Write the trailer of an OSM file to f.
+ *  @return The function returns the number of bytes written or a negative
+ *  errno in case of error.
+ */
+long save_osm_tail(FILE *f)
+{
+   int n;
 
    if ((n = fprintf(f, "</osm>\n")) < 0)
    {
@@ -248,6 +252,37 @@ size_t save_osm0(FILE *f, bx_node_t *tree, const struct bbox *bb, const char *in
       log_msg(LOG_ERR, "fprintf() failed: '%s'", strerror(n));
       return -n;
    }
+
+   return n;
+}
+
+
+/*! Save OSM data of tree to file f.
+ *  @param s FILE handle of output file.
+ *  @param Pointer to bxtree containing the information.
+ *  @param bb Optional bounding box (written to tag <bounds>).
+ *  @param info Optional information written to the header as comment (<!-- info -->).
+ *  @return The function returns 0.
+ */
+size_t save_osm0(FILE *f, bx_node_t *tree, const struct bbox *bb, const char *info)
+{
+   struct ostream os;
+   size_t len = 0;
+   long n;
+
+   if ((n = save_osm_head(f, bb, info)) < 0)
+      return n;
+   len += n;
+
+   os.stream = f;
+   os.len = 0;
+   traverse(tree, 0, IDX_NODE, (tree_func_t) print_tree, &os);
+   traverse(tree, 0, IDX_WAY, (tree_func_t) print_tree, &os);
+   traverse(tree, 0, IDX_REL, (tree_func_t) print_tree, &os);
+   len += os.len;
+
+   if ((n = save_osm_tail(f)) < 0)
+      return n;
    len += n;
 
    return len;
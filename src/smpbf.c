@@ -0,0 +1,1059 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smpbf.c
+ * This file contains the reader for OSM PBF files. The protocol buffers are
+ * decoded directly, thus there is no dependency on a protobuf library. Blobs
+ * are either uncompressed or zlib compressed.
+ *
+ * The data blobs are decoded in parallel by the threads (see --threads) into
+ * thread-local object lists which are put into the object tree in order of
+ * the file by the calling thread. Thus, duplicates and the stats are handled
+ * as by read_osm_file().
+ *
+ * The strings of the string tables are copied to memory which is kept until
+ * pbf_free() is called because the tags of the objects point to them. The
+ * characters which are escaped in XML files are escaped the same way, thus the
+ * tags are identical to the ones read from an OSM/XML file.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "smrender_dev.h"
+#include "smcore.h"
+#include "smloadosm.h"
+
+//! max size of a BlobHeader and of a decoded Blob according to the spec
+#define PBF_MAX_HEADER (64 * 1024)
+#define PBF_MAX_BLOB (32 * 1024 * 1024)
+
+// protobuf wire types
+enum {PB_VARINT, PB_I64, PB_LEN, PB_I32 = 5};
+
+
+//! protobuf decoding buffer
+typedef struct pbuf
+{
+   const uint8_t *p;       //!< current position
+   const uint8_t *end;     //!< end of buffer
+} pbuf_t;
+
+//! data blob and the objects decoded from it
+typedef struct pbf_blob
+{
+   const uint8_t *data;    //!< Blob message within the mapped file
+   long len;               //!< length of Blob message
+   char *mem;              //!< memory of strings
+   bstring_t *str;         //!< string table
+   int str_cnt;            //!< number of strings
+   osm_obj_t **obj;        //!< objects in order of the blob
+   long cnt;               //!< number of objects
+   long size;              //!< number of elements allocated in obj
+   int e;                  //!< result of decoding, 0 on success
+   int done;               //!< 1 if blob is decoded
+} pbf_blob_t;
+
+typedef struct pbf_blobs
+{
+   pbf_blob_t *blob;       //!< list of data blobs
+   int cnt;                //!< number of blobs
+   int next;               //!< next blob to decode
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;    //!< signalled if a blob is done
+} pbf_blobs_t;
+
+//! parameters of a PrimitiveBlock
+typedef struct pbf_block
+{
+   int64_t granularity;
+   int64_t lat_off;
+   int64_t lon_off;
+   int64_t date_gran;
+} pbf_block_t;
+
+
+//! memory of all string tables
+static char **mem_ = NULL;
+static int mem_cnt_ = 0;
+
+
+/*! Decode a varint.
+ * @return On success 0 is returned, -1 if the buffer is exhausted.
+ */
+static int pb_varint(pbuf_t *b, uint64_t *v)
+{
+   *v = 0;
+   for (int s = 0; b->p < b->end && s < 64; s += 7, b->p++)
+   {
+      *v |= (uint64_t) (*b->p & 0x7f) << s;
+      if (!(*b->p & 0x80))
+      {
+         b->p++;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+
+static int64_t pb_zigzag(uint64_t v)
+{
+   return (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+
+/*! Decode the key of the next field.
+ * @return Returns the field number or 0 at the end of the buffer or -1 on
+ * error.
+ */
+static int pb_field(pbuf_t *b, int *wtype)
+{
+   uint64_t v;
+
+   if (b->p >= b->end)
+      return 0;
+   if (pb_varint(b, &v) == -1)
+      return -1;
+   *wtype = v & 7;
+   return v >> 3;
+}
+
+
+/*! Decode a length-delimited field into sub.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pb_len(pbuf_t *b, pbuf_t *sub)
+{
+   uint64_t len;
+
+   if (pb_varint(b, &len) == -1 || len > (uint64_t) (b->end - b->p))
+      return -1;
+   sub->p = b->p;
+   sub->end = b->p + len;
+   b->p += len;
+   return 0;
+}
+
+
+/*! Skip a field of wire type wtype.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pb_skip(pbuf_t *b, int wtype)
+{
+   pbuf_t sub;
+   uint64_t v;
+
+   switch (wtype)
+   {
+      case PB_VARINT:
+         return pb_varint(b, &v);
+      case PB_I64:
+         if (b->end - b->p < 8)
+            return -1;
+         b->p += 8;
+         return 0;
+      case PB_LEN:
+         return pb_len(b, &sub);
+      case PB_I32:
+         if (b->end - b->p < 4)
+            return -1;
+         b->p += 4;
+         return 0;
+   }
+   return -1;
+}
+
+
+/*! Return the number of varints of the packed field b.
+ */
+static int pb_packed_cnt(pbuf_t b)
+{
+   int n;
+
+   for (n = 0; b.p < b.end; b.p++)
+      if (!(*b.p & 0x80))
+         n++;
+   return n;
+}
+
+
+/*! Test if the file fd is an OSM PBF file, i.e. it starts with a BlobHeader
+ * of type "OSMHeader".
+ * @return Returns 1 if it is a PBF file, otherwise 0.
+ */
+int pbf_detect(int fd)
+{
+   uint8_t buf[64];
+   pbuf_t b, s;
+   int f, w;
+
+   if (pread(fd, buf, sizeof(buf), 0) != sizeof(buf))
+      return 0;
+
+   // BlobHeader starts with the type string
+   b.p = buf + 4;
+   b.end = buf + sizeof(buf);
+   if ((f = pb_field(&b, &w)) != 1 || w != PB_LEN || pb_len(&b, &s) == -1)
+      return 0;
+
+   return s.end - s.p == 9 && !memcmp(s.p, "OSMHeader", 9);
+}
+
+
+/*! Decode a Blob message into a newly allocated buffer.
+ * @param data Pointer to Blob message.
+ * @param len Length of message.
+ * @param out Pointer to buffer which receives the decoded data. It must be
+ * freed by the caller.
+ * @return Returns the length of the decoded data or -1 on error.
+ */
+static long pbf_blob_decode(const uint8_t *data, long len, uint8_t **out)
+{
+   pbuf_t b = {data, data + len}, raw = {NULL, NULL}, zdata = {NULL, NULL};
+   uint64_t raw_size = 0;
+   int f, w;
+
+   while ((f = pb_field(&b, &w)) > 0)
+   {
+      if (f == 1 && w == PB_LEN)
+      {
+         if (pb_len(&b, &raw) == -1)
+            return -1;
+      }
+      else if (f == 2 && w == PB_VARINT)
+      {
+         if (pb_varint(&b, &raw_size) == -1)
+            return -1;
+      }
+      else if (f == 3 && w == PB_LEN)
+      {
+         if (pb_len(&b, &zdata) == -1)
+            return -1;
+      }
+      else if (f >= 4 && f <= 7)
+      {
+         log_msg(LOG_ERR, "unsupported blob compression %d", f);
+         return -1;
+      }
+      else if (pb_skip(&b, w) == -1)
+         return -1;
+   }
+   if (f == -1)
+      return -1;
+
+   if (raw.p != NULL)
+   {
+      if ((*out = malloc(raw.end - raw.p)) == NULL)
+      {
+         log_errno(LOG_ERR, "malloc() failed");
+         return -1;
+      }
+      memcpy(*out, raw.p, raw.end - raw.p);
+      return raw.end - raw.p;
+   }
+
+   if (zdata.p == NULL || !raw_size || raw_size > PBF_MAX_BLOB)
+   {
+      log_msg(LOG_ERR, "blob has no data");
+      return -1;
+   }
+
+#ifdef HAVE_ZLIB
+   uLongf dlen = raw_size;
+   int e;
+
+   if ((*out = malloc(raw_size)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+   if ((e = uncompress(*out, &dlen, zdata.p, zdata.end - zdata.p)) != Z_OK || dlen != raw_size)
+   {
+      log_msg(LOG_ERR, "uncompress() failed: %d", e);
+      free(*out);
+      return -1;
+   }
+   return dlen;
+#else
+   log_msg(LOG_ERR, "zlib compressed blobs not supported, smrender is compiled without zlib");
+   return -1;
+#endif
+}
+
+
+/*! Copy the strings of the StringTable b to one chunk of memory and escape the
+ * characters which are escaped in XML attributes.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_strtbl(pbuf_t b, pbf_blob_t *bl)
+{
+   pbuf_t s, c = b;
+   long len = 0;
+   char *dst;
+   int f, w;
+
+   // count strings and their length including escapes
+   while ((f = pb_field(&c, &w)) > 0)
+   {
+      if (f != 1 || w != PB_LEN)
+      {
+         if (pb_skip(&c, w) == -1)
+            return -1;
+         continue;
+      }
+      if (pb_len(&c, &s) == -1)
+         return -1;
+      for (len += s.end - s.p; s.p < s.end; s.p++)
+         switch (*s.p)
+         {
+            case '&':
+               len += 4;
+               break;
+            case '<':
+            case '>':
+               len += 3;
+               break;
+            case '"':
+               len += 5;
+               break;
+         }
+      bl->str_cnt++;
+   }
+   if (f == -1)
+      return -1;
+
+   if ((bl->str = malloc(sizeof(*bl->str) * bl->str_cnt)) == NULL || (bl->mem = malloc(len + 1)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+
+   for (dst = bl->mem, bl->str_cnt = 0; (f = pb_field(&b, &w)) > 0;)
+   {
+      if (f != 1 || w != PB_LEN)
+      {
+         (void) pb_skip(&b, w);
+         continue;
+      }
+      (void) pb_len(&b, &s);
+      bl->str[bl->str_cnt].buf = dst;
+      for (; s.p < s.end; s.p++)
+         switch (*s.p)
+         {
+            case '&':
+               dst = stpcpy(dst, "&amp;");
+               break;
+            case '<':
+               dst = stpcpy(dst, "&lt;");
+               break;
+            case '>':
+               dst = stpcpy(dst, "&gt;");
+               break;
+            case '"':
+               dst = stpcpy(dst, "&quot;");
+               break;
+            default:
+               *dst++ = *s.p;
+         }
+      bl->str[bl->str_cnt].len = dst - bl->str[bl->str_cnt].buf;
+      bl->str[bl->str_cnt].atom = 0;
+      bl->str_cnt++;
+   }
+   return 0;
+}
+
+
+//! Append object o to the object list of the blob.
+static int pbf_add_obj(pbf_blob_t *bl, osm_obj_t *o)
+{
+   osm_obj_t **obj;
+
+   if (bl->cnt >= bl->size)
+   {
+      if ((obj = realloc(bl->obj, sizeof(*bl->obj) * (bl->size ? bl->size * 2 : 8192))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         free_obj(o);
+         return -1;
+      }
+      bl->obj = obj;
+      bl->size = bl->size ? bl->size * 2 : 8192;
+   }
+   bl->obj[bl->cnt++] = o;
+   return 0;
+}
+
+
+//! Return string number i of the string table or NULL if it does not exist.
+static const bstring_t *pbf_str(const pbf_blob_t *bl, uint64_t i)
+{
+   if (i >= (uint64_t) bl->str_cnt)
+   {
+      log_msg(LOG_ERR, "string index %"PRIu64" out of range", i);
+      return NULL;
+   }
+   return &bl->str[i];
+}
+
+
+/*! Set the default values of object o the same way as the XML parser does.
+ */
+static void pbf_obj_default(osm_obj_t *o)
+{
+   if (!o->ver)
+      o->ver = 1;
+   if (!o->tim)
+      o->tim = time(NULL);
+}
+
+
+/*! Decode an Info message into object o.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_info(pbuf_t b, const pbf_block_t *pb, osm_obj_t *o)
+{
+   uint64_t v;
+   int f, w;
+
+   while ((f = pb_field(&b, &w)) > 0)
+   {
+      if (w != PB_VARINT)
+      {
+         if (pb_skip(&b, w) == -1)
+            return -1;
+         continue;
+      }
+      if (pb_varint(&b, &v) == -1)
+         return -1;
+      switch (f)
+      {
+         case 1:
+            o->ver = v;
+            break;
+         case 2:
+            o->tim = (int64_t) v * pb->date_gran / 1000;
+            break;
+         case 3:
+            o->cs = v;
+            break;
+         case 4:
+            o->uid = (int32_t) v;
+            break;
+         case 6:
+            o->vis = v != 0;
+            break;
+      }
+   }
+   return f;
+}
+
+
+/*! Decode the packed keys and vals of a Node, Way, or Relation into the tags
+ * of object o.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_tags(const pbf_blob_t *bl, pbuf_t keys, pbuf_t vals, osm_obj_t *o)
+{
+   const bstring_t *k, *v;
+   uint64_t ki, vi;
+
+   for (int i = 0; i < o->tag_cnt; i++)
+   {
+      if (pb_varint(&keys, &ki) == -1 || pb_varint(&vals, &vi) == -1)
+         return -1;
+      if ((k = pbf_str(bl, ki)) == NULL || (v = pbf_str(bl, vi)) == NULL)
+         return -1;
+      o->otag[i].k = *k;
+      o->otag[i].v = *v;
+   }
+   return 0;
+}
+
+
+/*! Decode a Node, Way, or Relation message.
+ * @param b Message.
+ * @param type OSM_NODE, OSM_WAY, or OSM_REL.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_obj(pbf_blob_t *bl, const pbf_block_t *pb, pbuf_t b, int type)
+{
+   pbuf_t keys = {NULL, NULL}, vals = {NULL, NULL}, info = {NULL, NULL}, p[3] = {{NULL, NULL}, {NULL, NULL}, {NULL, NULL}};
+   int64_t id = 0, lat = 0, lon = 0, ref = 0;
+   const bstring_t *role;
+   struct rmember *mem;
+   osm_obj_t *o;
+   uint64_t v, t;
+   int f, w, n;
+
+   while ((f = pb_field(&b, &w)) > 0)
+   {
+      if (w == PB_LEN)
+      {
+         pbuf_t s;
+         if (pb_len(&b, &s) == -1)
+            return -1;
+         switch (f)
+         {
+            case 2:
+               keys = s;
+               break;
+            case 3:
+               vals = s;
+               break;
+            case 4:
+               info = s;
+               break;
+            case 8:
+            case 9:
+            case 10:
+               p[f - 8] = s;
+               break;
+         }
+      }
+      else if (w == PB_VARINT)
+      {
+         if (pb_varint(&b, &v) == -1)
+            return -1;
+         if (f == 1)
+            id = type == OSM_NODE ? pb_zigzag(v) : (int64_t) v;
+         else if (type == OSM_NODE && f == 8)
+            lat = pb_zigzag(v);
+         else if (type == OSM_NODE && f == 9)
+            lon = pb_zigzag(v);
+      }
+      else if (pb_skip(&b, w) == -1)
+         return -1;
+   }
+   if (f == -1)
+      return -1;
+
+   if ((n = pb_packed_cnt(keys)) != pb_packed_cnt(vals))
+   {
+      log_msg(LOG_ERR, "number of keys and vals differ");
+      return -1;
+   }
+
+   switch (type)
+   {
+      case OSM_NODE:
+         o = (osm_obj_t*) malloc_node(n);
+         break;
+      case OSM_WAY:
+         o = (osm_obj_t*) malloc_way(n, pb_packed_cnt(p[0]));
+         break;
+      default:
+         o = (osm_obj_t*) malloc_rel(n, pb_packed_cnt(p[1]));
+   }
+   o->id = id;
+   o->vis = 1;
+
+   if ((info.p != NULL && pbf_info(info, pb, o) == -1) || pbf_tags(bl, keys, vals, o) == -1)
+   {
+      free_obj(o);
+      return -1;
+   }
+   pbf_obj_default(o);
+
+   switch (type)
+   {
+      case OSM_NODE:
+         ((osm_node_t*) o)->lat = 1E-9 * (pb->lat_off + pb->granularity * lat);
+         ((osm_node_t*) o)->lon = 1E-9 * (pb->lon_off + pb->granularity * lon);
+         break;
+
+      case OSM_WAY:
+         for (int i = 0; i < ((osm_way_t*) o)->ref_cnt; i++)
+         {
+            (void) pb_varint(&p[0], &v);
+            ((osm_way_t*) o)->ref[i] = ref += pb_zigzag(v);
+         }
+         break;
+
+      case OSM_REL:
+         mem = ((osm_rel_t*) o)->mem;
+         for (int i = 0; i < ((osm_rel_t*) o)->mem_cnt; i++)
+         {
+            if (pb_varint(&p[0], &v) == -1 || pb_varint(&p[1], &t) == -1 || (role = pbf_str(bl, v)) == NULL)
+            {
+               free_obj(o);
+               return -1;
+            }
+            mem[i].id = ref += pb_zigzag(t);
+            mem[i].role = strrole(role);
+            mem[i].type = pb_varint(&p[2], &t) == -1 ? OSM_NODE : t == 2 ? OSM_REL : t == 1 ? OSM_WAY : OSM_NODE;
+         }
+         break;
+   }
+
+   return pbf_add_obj(bl, o);
+}
+
+
+/*! Decode a DenseNodes message.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_dense(pbf_blob_t *bl, const pbf_block_t *pb, pbuf_t b)
+{
+   pbuf_t id = {NULL, NULL}, lat = {NULL, NULL}, lon = {NULL, NULL}, kv = {NULL, NULL}, di[7];
+   int64_t did = 0, dlat = 0, dlon = 0, dinf[7];
+   const bstring_t *k, *v;
+   osm_node_t *n;
+   uint64_t u, x;
+   pbuf_t c, s;
+   int f, w, i, cnt;
+
+   memset(di, 0, sizeof(di));
+   memset(dinf, 0, sizeof(dinf));
+   while ((f = pb_field(&b, &w)) > 0)
+   {
+      if (w != PB_LEN)
+      {
+         if (pb_skip(&b, w) == -1)
+            return -1;
+         continue;
+      }
+      if (pb_len(&b, &s) == -1)
+         return -1;
+      switch (f)
+      {
+         case 1:
+            id = s;
+            break;
+         case 5:
+            // DenseInfo
+            while ((f = pb_field(&s, &w)) > 0)
+            {
+               if (f < 7 && w == PB_LEN)
+               {
+                  if (pb_len(&s, &di[f]) == -1)
+                     return -1;
+               }
+               else if (pb_skip(&s, w) == -1)
+                  return -1;
+            }
+            if (f == -1)
+               return -1;
+            break;
+         case 8:
+            lat = s;
+            break;
+         case 9:
+            lon = s;
+            break;
+         case 10:
+            kv = s;
+            break;
+      }
+   }
+   if (f == -1)
+      return -1;
+
+   while (id.p < id.end)
+   {
+      if (pb_varint(&id, &u) == -1 || pb_varint(&lat, &x) == -1)
+         return -1;
+      did += pb_zigzag(u);
+      dlat += pb_zigzag(x);
+      if (pb_varint(&lon, &u) == -1)
+         return -1;
+      dlon += pb_zigzag(u);
+
+      // count tags of node
+      for (c = kv, cnt = 0; pb_varint(&c, &u) != -1 && u; cnt++)
+         if (pb_varint(&c, &x) == -1)
+            return -1;
+
+      n = malloc_node(cnt);
+      n->obj.id = did;
+      n->obj.vis = 1;
+      n->lat = 1E-9 * (pb->lat_off + pb->granularity * dlat);
+      n->lon = 1E-9 * (pb->lon_off + pb->granularity * dlon);
+
+      for (i = 0; i < cnt; i++)
+      {
+         (void) pb_varint(&kv, &u);
+         (void) pb_varint(&kv, &x);
+         if ((k = pbf_str(bl, u)) == NULL || (v = pbf_str(bl, x)) == NULL)
+         {
+            free_obj((osm_obj_t*) n);
+            return -1;
+         }
+         n->obj.otag[i].k = *k;
+         n->obj.otag[i].v = *v;
+      }
+      // skip terminating 0
+      (void) pb_varint(&kv, &u);
+
+      // version, timestamp, changeset, uid, user_sid, visible
+      if (pb_varint(&di[1], &u) != -1)
+         n->obj.ver = u;
+      if (pb_varint(&di[2], &u) != -1)
+         n->obj.tim = (dinf[2] += pb_zigzag(u)) * pb->date_gran / 1000;
+      if (pb_varint(&di[3], &u) != -1)
+         n->obj.cs = dinf[3] += pb_zigzag(u);
+      if (pb_varint(&di[4], &u) != -1)
+         n->obj.uid = dinf[4] += pb_zigzag(u);
+      if (pb_varint(&di[6], &u) != -1)
+         n->obj.vis = u != 0;
+      pbf_obj_default(&n->obj);
+
+      if (pbf_add_obj(bl, (osm_obj_t*) n) == -1)
+         return -1;
+   }
+   return 0;
+}
+
+
+/*! Decode a PrimitiveBlock into the object list of the blob bl.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_block(pbf_blob_t *bl, pbuf_t b)
+{
+   pbf_block_t pb = {100, 0, 0, 1000};
+   pbuf_t c = b, s, g;
+   uint64_t v;
+   int f, w;
+
+   // 1st pass: string table and block parameters which follow the groups
+   while ((f = pb_field(&c, &w)) > 0)
+   {
+      if (f == 1 && w == PB_LEN)
+      {
+         if (pb_len(&c, &s) == -1 || pbf_strtbl(s, bl) == -1)
+            return -1;
+      }
+      else if (f >= 17 && f <= 20 && w == PB_VARINT)
+      {
+         if (pb_varint(&c, &v) == -1)
+            return -1;
+         switch (f)
+         {
+            case 17:
+               pb.granularity = (int32_t) v;
+               break;
+            case 18:
+               pb.date_gran = (int32_t) v;
+               break;
+            case 19:
+               pb.lat_off = v;
+               break;
+            case 20:
+               pb.lon_off = v;
+               break;
+         }
+      }
+      else if (pb_skip(&c, w) == -1)
+         return -1;
+   }
+   if (f == -1)
+      return -1;
+
+   // 2nd pass: primitive groups
+   while ((f = pb_field(&b, &w)) > 0)
+   {
+      if (f != 2 || w != PB_LEN)
+      {
+         (void) pb_skip(&b, w);
+         continue;
+      }
+      (void) pb_len(&b, &g);
+      while ((f = pb_field(&g, &w)) > 0)
+      {
+         if (w != PB_LEN || pb_len(&g, &s) == -1)
+            return -1;
+         switch (f)
+         {
+            case 1:
+               if (pbf_obj(bl, &pb, s, OSM_NODE) == -1)
+                  return -1;
+               break;
+            case 2:
+               if (pbf_dense(bl, &pb, s) == -1)
+                  return -1;
+               break;
+            case 3:
+               if (pbf_obj(bl, &pb, s, OSM_WAY) == -1)
+                  return -1;
+               break;
+            case 4:
+               if (pbf_obj(bl, &pb, s, OSM_REL) == -1)
+                  return -1;
+               break;
+         }
+      }
+      if (f == -1)
+         return -1;
+   }
+   return 0;
+}
+
+
+/*! Decode the data blob bl.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pbf_decode(pbf_blob_t *bl)
+{
+   uint8_t *data;
+   long len;
+   int e;
+
+   if ((len = pbf_blob_decode(bl->data, bl->len, &data)) == -1)
+      return -1;
+   e = pbf_block(bl, (pbuf_t) {data, data + len});
+   free(data);
+   return e;
+}
+
+
+/*! Thread function which decodes the blobs in order of bs->next.
+ */
+static void *pbf_thread(pbf_blobs_t *bs)
+{
+   pbf_blob_t *bl;
+   int i;
+
+   while ((i = __atomic_fetch_add(&bs->next, 1, __ATOMIC_SEQ_CST)) < bs->cnt)
+   {
+      bl = &bs->blob[i];
+      bl->e = pbf_decode(bl);
+
+      pthread_mutex_lock(&bs->mutex);
+      bl->done = 1;
+      pthread_cond_signal(&bs->cond);
+      pthread_mutex_unlock(&bs->mutex);
+   }
+   return NULL;
+}
+
+
+/*! Check the required features of the HeaderBlock.
+ * @return Returns 0 if all features are supported, otherwise -1.
+ */
+static int pbf_header(const uint8_t *data, long len)
+{
+   uint8_t *hdr;
+   pbuf_t b, s;
+   int f, w, e = 0;
+
+   if ((len = pbf_blob_decode(data, len, &hdr)) == -1)
+      return -1;
+
+   for (b = (pbuf_t) {hdr, hdr + len}; (f = pb_field(&b, &w)) > 0;)
+   {
+      if (f != 4 || w != PB_LEN)
+      {
+         if (pb_skip(&b, w) == -1)
+            break;
+         continue;
+      }
+      if (pb_len(&b, &s) == -1)
+         break;
+      if ((s.end - s.p == 14 && !memcmp(s.p, "OsmSchema-V0.6", 14)) || (s.end - s.p == 10 && !memcmp(s.p, "DenseNodes", 10)))
+         continue;
+      log_msg(LOG_ERR, "unsupported feature '%.*s'", (int) (s.end - s.p), s.p);
+      e = -1;
+   }
+   free(hdr);
+   return f == -1 ? -1 : e;
+}
+
+
+/*! Read an OSM PBF file into the object tree.
+ * @param fd File descriptor of the PBF file.
+ * @param tree Pointer to object tree.
+ * @param ds Pointer to stats structure or NULL.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int read_pbf_file(int fd, bx_node_t **tree, struct dstats *ds)
+{
+   pbf_blobs_t bs;
+   pbf_blob_t *bl;
+   pbuf_t b, s;
+   const uint8_t *data;
+   pthread_t *th = NULL;
+   struct stat st;
+   long pos, hlen, dlen;
+   int i, n = 0, f, w, e = 0, dup_cnt = 0, nthreads;
+   char **mem;
+   uint64_t v;
+
+   if (fstat(fd, &st) == -1)
+   {
+      log_errno(LOG_ERR, "fstat() failed");
+      return -1;
+   }
+   if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+   {
+      log_errno(LOG_ERR, "mmap() failed");
+      return -1;
+   }
+
+   memset(&bs, 0, sizeof(bs));
+   if (ds != NULL)
+      init_stats(ds);
+
+   // collect the data blobs
+   for (pos = 0; pos + 4 <= st.st_size; pos += 4 + hlen + dlen)
+   {
+      hlen = (long) data[pos] << 24 | data[pos + 1] << 16 | data[pos + 2] << 8 | data[pos + 3];
+      if (hlen > PBF_MAX_HEADER || pos + 4 + hlen > st.st_size)
+      {
+         log_msg(LOG_ERR, "corrupt BlobHeader at offset %ld", pos);
+         e = -1;
+         break;
+      }
+
+      memset(&s, 0, sizeof(s));
+      for (b = (pbuf_t) {data + pos + 4, data + pos + 4 + hlen}, dlen = -1; (f = pb_field(&b, &w)) > 0;)
+      {
+         if (f == 1 && w == PB_LEN)
+            e = pb_len(&b, &s);
+         else if (f == 3 && w == PB_VARINT)
+         {
+            e = pb_varint(&b, &v);
+            dlen = v;
+         }
+         else
+            e = pb_skip(&b, w);
+         if (e == -1)
+            break;
+      }
+      if (f == -1 || e == -1 || dlen < 0 || pos + 4 + hlen + dlen > st.st_size)
+      {
+         log_msg(LOG_ERR, "corrupt BlobHeader at offset %ld", pos);
+         e = -1;
+         break;
+      }
+
+      if (s.end - s.p == 9 && !memcmp(s.p, "OSMHeader", 9))
+      {
+         if ((e = pbf_header(data + pos + 4 + hlen, dlen)) == -1)
+            break;
+      }
+      else if (s.end - s.p == 7 && !memcmp(s.p, "OSMData", 7))
+      {
+         if (!(bs.cnt & 1023))
+         {
+            if ((bl = realloc(bs.blob, sizeof(*bs.blob) * (bs.cnt + 1024))) == NULL)
+            {
+               log_errno(LOG_ERR, "realloc() failed");
+               e = -1;
+               break;
+            }
+            bs.blob = bl;
+         }
+         memset(&bs.blob[bs.cnt], 0, sizeof(*bs.blob));
+         bs.blob[bs.cnt].data = data + pos + 4 + hlen;
+         bs.blob[bs.cnt].len = dlen;
+         bs.cnt++;
+      }
+   }
+
+   if (!e && bs.cnt && (mem = realloc(mem_, sizeof(*mem_) * (mem_cnt_ + bs.cnt))) == NULL)
+   {
+      log_errno(LOG_ERR, "realloc() failed");
+      e = -1;
+   }
+   else if (!e && bs.cnt)
+      mem_ = mem;
+
+   if (!e && bs.cnt)
+   {
+      nthreads = get_nthreads();
+      log_msg(LOG_INFO, "decoding %d blobs with %d threads", bs.cnt, nthreads);
+      pthread_mutex_init(&bs.mutex, NULL);
+      pthread_cond_init(&bs.cond, NULL);
+      if (nthreads > 0 && (th = calloc(nthreads, sizeof(*th))) == NULL)
+         log_errno(LOG_ERR, "calloc() failed");
+      for (n = 0; th != NULL && n < nthreads && n < bs.cnt; n++)
+         if ((f = pthread_create(&th[n], NULL, (void*(*)(void*)) pbf_thread, &bs)))
+         {
+            log_msg(LOG_ERR, "pthread_create() failed: %s", strerror(f));
+            break;
+         }
+      // decode in this thread if no thread could be created
+      if (!n)
+         (void) pbf_thread(&bs);
+
+      for (i = 0; i < bs.cnt; i++)
+      {
+         bl = &bs.blob[i];
+         pthread_mutex_lock(&bs.mutex);
+         while (!bl->done)
+            pthread_cond_wait(&bs.cond, &bs.mutex);
+         pthread_mutex_unlock(&bs.mutex);
+
+         if (bl->e)
+         {
+            log_msg(LOG_ERR, "decoding blob %d failed", i);
+            e = -1;
+         }
+         for (long j = 0; j < bl->cnt; j++)
+            dup_cnt += put_osm_obj(tree, bl->obj[j], ds);
+         free(bl->obj);
+         free(bl->str);
+         if (bl->mem != NULL)
+            mem_[mem_cnt_++] = bl->mem;
+      }
+
+      for (i = 0; i < n; i++)
+         pthread_join(th[i], NULL);
+      pthread_cond_destroy(&bs.cond);
+      pthread_mutex_destroy(&bs.mutex);
+      free(th);
+   }
+
+   free(bs.blob);
+   (void) munmap((void*) data, st.st_size);
+
+   if (dup_cnt)
+      log_msg(LOG_WARN, "%d duplicate elements found! This may cause unexpected results!", dup_cnt);
+   log_msg(LOG_NOTICE, "onode_memory: %ld kByte", (long) onode_mem() / 1024);
+
+   if (ds != NULL)
+      fin_stats(ds);
+
+   return e;
+}
+
+
+//! Free the memory of the strings of all PBF files read.
+void pbf_free(void)
+{
+   for (int i = 0; i < mem_cnt_; i++)
+      free(mem_[i]);
+   free(mem_);
+   mem_ = NULL;
+   mem_cnt_ = 0;
+}
+
@@ -0,0 +1,769 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smpixel.c
+ * This file contains the pixel kernels of the auto-rotation of captions and
+ * images (see find_angle() in smrules_cairo.c). The kernels process whole
+ * rows of ARGB32 pixels: they calculate the value of each pixel or the
+ * difference between two pixels in a 1-dimensional color space (luminosity,
+ * YIQ brightness, or the 3d RGB distance) after the color space was
+ * optionally stretched along the black-white axis.
+ *
+ * There is a scalar kernel and on x86 an SSE2 and an AVX2 kernel. The kernel
+ * is selected at startup according to the capabilities of the CPU. All
+ * kernels do the same double precision operations in the same order, thus the
+ * results are bit-identical.
+ *
+ * For benchmarking, compile with
+ * gcc -Wall -O2 -DTEST_SMPIXEL -DHAVE_CONFIG_H -I.. -I../libsmrender -osmpixel smpixel.c -lsmrender -lm
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <math.h>
+
+#include "smrender_dev.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIX_X86
+#include <immintrin.h>
+#endif
+
+
+#define PIX_SCALAR 0
+#define PIX_SSE2 1
+#define PIX_AVX2 2
+
+#define COL_COMPD(x, y) ((double) ((x) >> (y) & 0xff) / 255.0)
+#define COL_LUT(x, y) (comp_lut_[(x) >> (y) & 0xff])
+
+
+typedef void (*pix_row_func_t)(const uint32_t *, const uint32_t *, double *, int, int, double);
+typedef void (*pix_gray_func_t)(const double *, uint32_t *, int, uint32_t);
+
+//! rotation of the color space, see pix_stretch()
+static double rz_c_, rz_s_, ry_c_, ry_s_, ry_c2_, ry_s2_, rz_c2_, rz_s2_;
+//! component values c / 255.0 for c = 0..255
+static double comp_lut_[256];
+//! minimum value of the lower 7 bits of the alpha channel of a pixel
+static int alpha_min_;
+static pix_row_func_t pix_row_;
+static pix_gray_func_t pix_gray_;
+static const char *pix_name_;
+
+
+/*! Stretch the color space along the black-white axis. The color space is
+ * rotated such that the black-white axis is along the z-axis, then the x/y
+ * components are scaled by 1/f and it is rotated back. The result is quantized
+ * to 8 bits per component again.
+ * @param col Pixel.
+ * @param f Stretch factor, 0 means no stretching.
+ * @param c Array of 3 values which receives the components (0 <= c <= 1).
+ */
+static void pix_stretch(uint32_t col, double f, double *c)
+{
+   double x, y, z, t;
+
+   x = COL_LUT(col, 16);
+   y = COL_LUT(col, 8);
+   z = COL_LUT(col, 0);
+
+   if (f == 0)
+   {
+      c[0] = x;
+      c[1] = y;
+      c[2] = z;
+      return;
+   }
+
+   t = x * rz_c_ - y * rz_s_;
+   y = x * rz_s_ + y * rz_c_;
+   x = t;
+   t = x * ry_c_ + z * ry_s_;
+   z = -x * ry_s_ + z * ry_c_;
+   x = t;
+
+   x /= f;
+   y /= f;
+
+   t = x * ry_c2_ + z * ry_s2_;
+   z = -x * ry_s2_ + z * ry_c2_;
+   x = t;
+   t = x * rz_c2_ - y * rz_s2_;
+   y = x * rz_s2_ + y * rz_c2_;
+   x = t;
+
+   c[0] = comp_lut_[(int) round(x * 255) & 0xff];
+   c[1] = comp_lut_[(int) round(y * 255) & 0xff];
+   c[2] = comp_lut_[(int) round(z * 255) & 0xff];
+}
+
+
+static double pix_value(const double *c, int mode)
+{
+   switch (mode)
+   {
+      case PIX_DIFF_BRGT:
+         // YIQ brightness
+         return c[0] * 0.299 + c[1] * 0.587 + c[2] * 0.114;
+      case PIX_DIFF_3D:
+         return (c[0] + c[1] + c[2]) / 3.0;
+      default:
+         // luminosity (CIE XYZ formula)
+         return 0.2125 * c[0] + 0.7154 * c[1] + 0.0721 * c[2];
+   }
+}
+
+
+static int pix_valid(uint32_t col)
+{
+   return (int) (col >> 24 & 0x7f) >= alpha_min_;
+}
+
+
+/*! Scalar row kernel. If q is NULL, the value of each pixel of p is
+ * calculated, otherwise the difference between the pixels of p and q.
+ * Pixels which are (partially) transparent are ignored and get a value of -1.
+ */
+static void pix_row_scalar(const uint32_t *p, const uint32_t *q, double *out, int n, int mode, double f)
+{
+   double c1[3], c2[3];
+   int i;
+
+   for (i = 0; i < n; i++)
+   {
+      if (!pix_valid(p[i]) || (q != NULL && !pix_valid(q[i])))
+      {
+         out[i] = -1;
+         continue;
+      }
+
+      pix_stretch(p[i], f, c1);
+      if (q == NULL)
+      {
+         out[i] = pix_value(c1, mode);
+         continue;
+      }
+
+      pix_stretch(q[i], f, c2);
+      if (mode == PIX_DIFF_3D)
+         out[i] = sqrt(((c1[0] - c2[0]) * (c1[0] - c2[0]) + (c1[1] - c2[1]) * (c1[1] - c2[1]) + (c1[2] - c2[2]) * (c1[2] - c2[2])) / 3.0);
+      else
+         out[i] = fabs(pix_value(c1, mode) - pix_value(c2, mode));
+   }
+}
+
+
+static uint32_t pix_gray(double a)
+{
+   int c;
+
+   if (a > 1.0) a = 1;
+   if (a < 0.0) a = 0.0;
+   c = round(a * 255.0);
+   return c | c << 8 | c << 16 | 0xff000000;
+}
+
+
+static void pix_gray_scalar(const double *v, uint32_t *p, int n, uint32_t trans)
+{
+   for (int i = 0; i < n; i++)
+      p[i] = v[i] < 0 ? trans : pix_gray(v[i]);
+}
+
+
+#ifdef PIX_X86
+/* The SSE2 kernels process 2 pixels at once, the components of the pixels are
+ * converted to doubles in the lower 2 int32 lanes. round() is emulated
+ * exactly by truncating and comparing the remainder to 0.5 because the
+ * rounding instructions of SSE4.1 round half to even.
+ */
+
+__attribute__((target("sse2"))) static inline __m128d pix_round_sse2(__m128d x)
+{
+   __m128d t, d;
+
+   t = _mm_cvtepi32_pd(_mm_cvttpd_epi32(x));
+   d = _mm_sub_pd(x, t);
+   t = _mm_add_pd(t, _mm_and_pd(_mm_cmpge_pd(d, _mm_set1_pd(0.5)), _mm_set1_pd(1.0)));
+   return _mm_sub_pd(t, _mm_and_pd(_mm_cmple_pd(d, _mm_set1_pd(-0.5)), _mm_set1_pd(1.0)));
+}
+
+
+__attribute__((target("sse2"))) static inline __m128d pix_comp_sse2(__m128i p, int shift)
+{
+   return _mm_div_pd(_mm_cvtepi32_pd(_mm_and_si128(_mm_srli_epi32(p, shift), _mm_set1_epi32(0xff))), _mm_set1_pd(255.0));
+}
+
+
+__attribute__((target("sse2"))) static inline __m128d pix_rot_sse2(__m128d a, __m128d b, double c, double s)
+{
+   return _mm_add_pd(_mm_mul_pd(a, _mm_set1_pd(c)), _mm_mul_pd(b, _mm_set1_pd(s)));
+}
+
+
+//! SSE2 version of pix_stretch() for the 2 pixels in the lower half of p.
+__attribute__((target("sse2"))) static void pix_stretch_sse2(__m128i p, double f, __m128d *c)
+{
+   __m128d x, y, z, t, neg = _mm_set1_pd(-0.0);
+
+   x = pix_comp_sse2(p, 16);
+   y = pix_comp_sse2(p, 8);
+   z = pix_comp_sse2(p, 0);
+
+   if (f == 0)
+   {
+      c[0] = x;
+      c[1] = y;
+      c[2] = z;
+      return;
+   }
+
+   t = _mm_sub_pd(_mm_mul_pd(x, _mm_set1_pd(rz_c_)), _mm_mul_pd(y, _mm_set1_pd(rz_s_)));
+   y = pix_rot_sse2(x, y, rz_s_, rz_c_);
+   x = t;
+   t = pix_rot_sse2(x, z, ry_c_, ry_s_);
+   z = pix_rot_sse2(_mm_xor_pd(x, neg), z, ry_s_, ry_c_);
+   x = t;
+
+   x = _mm_div_pd(x, _mm_set1_pd(f));
+   y = _mm_div_pd(y, _mm_set1_pd(f));
+
+   t = pix_rot_sse2(x, z, ry_c2_, ry_s2_);
+   z = pix_rot_sse2(_mm_xor_pd(x, neg), z, ry_s2_, ry_c2_);
+   x = t;
+   t = _mm_sub_pd(_mm_mul_pd(x, _mm_set1_pd(rz_c2_)), _mm_mul_pd(y, _mm_set1_pd(rz_s2_)));
+   y = pix_rot_sse2(x, y, rz_s2_, rz_c2_);
+   x = t;
+
+   c[0] = _mm_div_pd(pix_round_sse2(_mm_mul_pd(x, _mm_set1_pd(255))), _mm_set1_pd(255.0));
+   c[1] = _mm_div_pd(pix_round_sse2(_mm_mul_pd(y, _mm_set1_pd(255))), _mm_set1_pd(255.0));
+   c[2] = _mm_div_pd(pix_round_sse2(_mm_mul_pd(z, _mm_set1_pd(255))), _mm_set1_pd(255.0));
+}
+
+
+__attribute__((target("sse2"))) static __m128d pix_value_sse2(const __m128d *c, int mode)
+{
+   switch (mode)
+   {
+      case PIX_DIFF_BRGT:
+         return _mm_add_pd(_mm_add_pd(_mm_mul_pd(c[0], _mm_set1_pd(0.299)), _mm_mul_pd(c[1], _mm_set1_pd(0.587))), _mm_mul_pd(c[2], _mm_set1_pd(0.114)));
+      case PIX_DIFF_3D:
+         return _mm_div_pd(_mm_add_pd(_mm_add_pd(c[0], c[1]), c[2]), _mm_set1_pd(3.0));
+      default:
+         return _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(0.2125), c[0]), _mm_mul_pd(_mm_set1_pd(0.7154), c[1])), _mm_mul_pd(_mm_set1_pd(0.0721), c[2]));
+   }
+}
+
+
+//! Return a mask of the valid pixels (see pix_valid()) widened to 64 bits.
+__attribute__((target("sse2"))) static inline __m128d pix_valid_sse2(__m128i p)
+{
+   __m128i m;
+
+   m = _mm_cmpgt_epi32(_mm_and_si128(_mm_srli_epi32(p, 24), _mm_set1_epi32(0x7f)), _mm_set1_epi32(alpha_min_ - 1));
+   return _mm_castsi128_pd(_mm_unpacklo_epi32(m, m));
+}
+
+
+__attribute__((target("sse2"))) static void pix_row_sse2(const uint32_t *p, const uint32_t *q, double *out, int n, int mode, double f)
+{
+   __m128d c1[3], c2[3], d, v, m;
+   __m128i a, b;
+   int i;
+
+   for (i = 0; i + 2 <= n; i += 2)
+   {
+      a = _mm_loadl_epi64((const __m128i*) (p + i));
+      m = pix_valid_sse2(a);
+      pix_stretch_sse2(a, f, c1);
+      if (q == NULL)
+         v = pix_value_sse2(c1, mode);
+      else
+      {
+         b = _mm_loadl_epi64((const __m128i*) (q + i));
+         m = _mm_and_pd(m, pix_valid_sse2(b));
+         pix_stretch_sse2(b, f, c2);
+         if (mode == PIX_DIFF_3D)
+         {
+            d = _mm_sub_pd(c1[0], c2[0]);
+            v = _mm_mul_pd(d, d);
+            d = _mm_sub_pd(c1[1], c2[1]);
+            v = _mm_add_pd(v, _mm_mul_pd(d, d));
+            d = _mm_sub_pd(c1[2], c2[2]);
+            v = _mm_add_pd(v, _mm_mul_pd(d, d));
+            v = _mm_sqrt_pd(_mm_div_pd(v, _mm_set1_pd(3.0)));
+         }
+         else
+            v = _mm_andnot_pd(_mm_set1_pd(-0.0), _mm_sub_pd(pix_value_sse2(c1, mode), pix_value_sse2(c2, mode)));
+      }
+      _mm_storeu_pd(out + i, _mm_or_pd(_mm_and_pd(m, v), _mm_andnot_pd(m, _mm_set1_pd(-1))));
+   }
+   pix_row_scalar(p + i, q != NULL ? q + i : NULL, out + i, n - i, mode, f);
+}
+
+
+__attribute__((target("sse2"))) static void pix_gray_sse2(const double *v, uint32_t *p, int n, uint32_t trans)
+{
+   __m128d x;
+   __m128i c, m;
+   int i;
+
+   for (i = 0; i + 2 <= n; i += 2)
+   {
+      x = _mm_loadu_pd(v + i);
+      m = _mm_castpd_si128(_mm_cmplt_pd(x, _mm_setzero_pd()));
+      m = _mm_shuffle_epi32(m, _MM_SHUFFLE(3, 3, 2, 0));
+      x = _mm_min_pd(_mm_max_pd(x, _mm_setzero_pd()), _mm_set1_pd(1.0));
+      c = _mm_cvttpd_epi32(pix_round_sse2(_mm_mul_pd(x, _mm_set1_pd(255.0))));
+      c = _mm_or_si128(_mm_or_si128(c, _mm_slli_epi32(c, 8)), _mm_or_si128(_mm_slli_epi32(c, 16), _mm_set1_epi32(0xff000000)));
+      c = _mm_or_si128(_mm_and_si128(m, _mm_set1_epi32(trans)), _mm_andnot_si128(m, c));
+      _mm_storel_epi64((__m128i*) (p + i), c);
+   }
+   pix_gray_scalar(v + i, p + i, n - i, trans);
+}
+
+
+/* The AVX2 kernels process 4 pixels at once. They are identical to the SSE2
+ * kernels but work on 256 bit vectors of doubles.
+ */
+
+__attribute__((target("avx2"))) static inline __m256d pix_round_avx2(__m256d x)
+{
+   __m256d t, d;
+
+   t = _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(x));
+   d = _mm256_sub_pd(x, t);
+   t = _mm256_add_pd(t, _mm256_and_pd(_mm256_cmp_pd(d, _mm256_set1_pd(0.5), _CMP_GE_OQ), _mm256_set1_pd(1.0)));
+   return _mm256_sub_pd(t, _mm256_and_pd(_mm256_cmp_pd(d, _mm256_set1_pd(-0.5), _CMP_LE_OQ), _mm256_set1_pd(1.0)));
+}
+
+
+__attribute__((target("avx2"))) static inline __m256d pix_comp_avx2(__m128i p, int shift)
+{
+   return _mm256_div_pd(_mm256_cvtepi32_pd(_mm_and_si128(_mm_srli_epi32(p, shift), _mm_set1_epi32(0xff))), _mm256_set1_pd(255.0));
+}
+
+
+__attribute__((target("avx2"))) static inline __m256d pix_rot_avx2(__m256d a, __m256d b, double c, double s)
+{
+   return _mm256_add_pd(_mm256_mul_pd(a, _mm256_set1_pd(c)), _mm256_mul_pd(b, _mm256_set1_pd(s)));
+}
+
+
+//! AVX2 version of pix_stretch() for 4 pixels.
+__attribute__((target("avx2"))) static void pix_stretch_avx2(__m128i p, double f, __m256d *c)
+{
+   __m256d x, y, z, t, neg = _mm256_set1_pd(-0.0);
+
+   x = pix_comp_avx2(p, 16);
+   y = pix_comp_avx2(p, 8);
+   z = pix_comp_avx2(p, 0);
+
+   if (f == 0)
+   {
+      c[0] = x;
+      c[1] = y;
+      c[2] = z;
+      return;
+   }
+
+   t = _mm256_sub_pd(_mm256_mul_pd(x, _mm256_set1_pd(rz_c_)), _mm256_mul_pd(y, _mm256_set1_pd(rz_s_)));
+   y = pix_rot_avx2(x, y, rz_s_, rz_c_);
+   x = t;
+   t = pix_rot_avx2(x, z, ry_c_, ry_s_);
+   z = pix_rot_avx2(_mm256_xor_pd(x, neg), z, ry_s_, ry_c_);
+   x = t;
+
+   x = _mm256_div_pd(x, _mm256_set1_pd(f));
+   y = _mm256_div_pd(y, _mm256_set1_pd(f));
+
+   t = pix_rot_avx2(x, z, ry_c2_, ry_s2_);
+   z = pix_rot_avx2(_mm256_xor_pd(x, neg), z, ry_s2_, ry_c2_);
+   x = t;
+   t = _mm256_sub_pd(_mm256_mul_pd(x, _mm256_set1_pd(rz_c2_)), _mm256_mul_pd(y, _mm256_set1_pd(rz_s2_)));
+   y = pix_rot_avx2(x, y, rz_s2_, rz_c2_);
+   x = t;
+
+   c[0] = _mm256_div_pd(pix_round_avx2(_mm256_mul_pd(x, _mm256_set1_pd(255))), _mm256_set1_pd(255.0));
+   c[1] = _mm256_div_pd(pix_round_avx2(_mm256_mul_pd(y, _mm256_set1_pd(255))), _mm256_set1_pd(255.0));
+   c[2] = _mm256_div_pd(pix_round_avx2(_mm256_mul_pd(z, _mm256_set1_pd(255))), _mm256_set1_pd(255.0));
+}
+
+
+__attribute__((target("avx2"))) static __m256d pix_value_avx2(const __m256d *c, int mode)
+{
+   switch (mode)
+   {
+      case PIX_DIFF_BRGT:
+         return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(c[0], _mm256_set1_pd(0.299)), _mm256_mul_pd(c[1], _mm256_set1_pd(0.587))), _mm256_mul_pd(c[2], _mm256_set1_pd(0.114)));
+      case PIX_DIFF_3D:
+         return _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(c[0], c[1]), c[2]), _mm256_set1_pd(3.0));
+      default:
+         return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(0.2125), c[0]), _mm256_mul_pd(_mm256_set1_pd(0.7154), c[1])), _mm256_mul_pd(_mm256_set1_pd(0.0721), c[2]));
+   }
+}
+
+
+__attribute__((target("avx2"))) static inline __m256d pix_valid_avx2(__m128i p)
+{
+   __m128i m;
+
+   m = _mm_cmpgt_epi32(_mm_and_si128(_mm_srli_epi32(p, 24), _mm_set1_epi32(0x7f)), _mm_set1_epi32(alpha_min_ - 1));
+   return _mm256_castsi256_pd(_mm256_cvtepi32_epi64(m));
+}
+
+
+__attribute__((target("avx2"))) static void pix_row_avx2(const uint32_t *p, const uint32_t *q, double *out, int n, int mode, double f)
+{
+   __m256d c1[3], c2[3], d, v, m;
+   __m128i a, b;
+   int i;
+
+   for (i = 0; i + 4 <= n; i += 4)
+   {
+      a = _mm_loadu_si128((const __m128i*) (p + i));
+      m = pix_valid_avx2(a);
+      pix_stretch_avx2(a, f, c1);
+      if (q == NULL)
+         v = pix_value_avx2(c1, mode);
+      else
+      {
+         b = _mm_loadu_si128((const __m128i*) (q + i));
+         m = _mm256_and_pd(m, pix_valid_avx2(b));
+         pix_stretch_avx2(b, f, c2);
+         if (mode == PIX_DIFF_3D)
+         {
+            d = _mm256_sub_pd(c1[0], c2[0]);
+            v = _mm256_mul_pd(d, d);
+            d = _mm256_sub_pd(c1[1], c2[1]);
+            v = _mm256_add_pd(v, _mm256_mul_pd(d, d));
+            d = _mm256_sub_pd(c1[2], c2[2]);
+            v = _mm256_add_pd(v, _mm256_mul_pd(d, d));
+            v = _mm256_sqrt_pd(_mm256_div_pd(v, _mm256_set1_pd(3.0)));
+         }
+         else
+            v = _mm256_andnot_pd(_mm256_set1_pd(-0.0), _mm256_sub_pd(pix_value_avx2(c1, mode), pix_value_avx2(c2, mode)));
+      }
+      _mm256_storeu_pd(out + i, _mm256_blendv_pd(_mm256_set1_pd(-1), v, m));
+   }
+   pix_row_scalar(p + i, q != NULL ? q + i : NULL, out + i, n - i, mode, f);
+}
+
+
+__attribute__((target("avx2"))) static void pix_gray_avx2(const double *v, uint32_t *p, int n, uint32_t trans)
+{
+   __m256d x;
+   __m128i c, m;
+   int i;
+
+   for (i = 0; i + 4 <= n; i += 4)
+   {
+      x = _mm256_loadu_pd(v + i);
+      m = _mm256_cvtpd_epi32(_mm256_and_pd(_mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ), _mm256_set1_pd(-1.0)));
+      x = _mm256_min_pd(_mm256_max_pd(x, _mm256_setzero_pd()), _mm256_set1_pd(1.0));
+      c = _mm256_cvttpd_epi32(pix_round_avx2(_mm256_mul_pd(x, _mm256_set1_pd(255.0))));
+      c = _mm_or_si128(_mm_or_si128(c, _mm_slli_epi32(c, 8)), _mm_or_si128(_mm_slli_epi32(c, 16), _mm_set1_epi32(0xff000000)));
+      c = _mm_blendv_epi8(c, _mm_set1_epi32(trans), m);
+      _mm_storeu_si128((__m128i*) (p + i), c);
+   }
+   pix_gray_scalar(v + i, p + i, n - i, trans);
+}
+#endif
+
+
+/*! Select the kernels.
+ * @param isa PIX_SCALAR, PIX_SSE2, or PIX_AVX2.
+ * @return Returns 0 on success or -1 if the CPU does not support the
+ * instruction set.
+ */
+static int pix_select(int isa)
+{
+   switch (isa)
+   {
+#ifdef PIX_X86
+      case PIX_AVX2:
+         if (!__builtin_cpu_supports("avx2"))
+            return -1;
+         pix_row_ = pix_row_avx2;
+         pix_gray_ = pix_gray_avx2;
+         pix_name_ = "avx2";
+         return 0;
+
+      case PIX_SSE2:
+         if (!__builtin_cpu_supports("sse2"))
+            return -1;
+         pix_row_ = pix_row_sse2;
+         pix_gray_ = pix_gray_sse2;
+         pix_name_ = "sse2";
+         return 0;
+#endif
+
+      case PIX_SCALAR:
+         pix_row_ = pix_row_scalar;
+         pix_gray_ = pix_gray_scalar;
+         pix_name_ = "scalar";
+         return 0;
+   }
+   return -1;
+}
+
+
+void __attribute__((constructor)) pix_init(void)
+{
+   double a;
+   int i;
+
+   rz_c_ = cos(-M_PI_4);
+   rz_s_ = sin(-M_PI_4);
+   ry_c_ = cos(-acos(1 / sqrt(3)));
+   ry_s_ = sin(-acos(1 / sqrt(3)));
+   ry_c2_ = cos(acos(1 / sqrt(3)));
+   ry_s2_ = sin(acos(1 / sqrt(3)));
+   rz_c2_ = cos(M_PI_4);
+   rz_s2_ = sin(M_PI_4);
+
+   // pixels with a transparency of more than 20% are ignored
+   for (i = 0; i < 0x80; i++)
+   {
+      a = 1.0 - (double) (i << 1) / 255.0;
+      if (a <= 0.2)
+         break;
+   }
+   alpha_min_ = i;
+
+   for (i = 0; i < 256; i++)
+      comp_lut_[i] = (double) i / 255.0;
+
+#ifdef PIX_X86
+   __builtin_cpu_init();
+#endif
+   if (pix_select(PIX_AVX2) && pix_select(PIX_SSE2))
+      (void) pix_select(PIX_SCALAR);
+   log_debug("using %s pixel kernels", pix_name_);
+}
+
+
+/*! Calculate the difference between the pixels of the rows dst and src.
+ * @param dist Array of n values which receives the differences
+ * (0 <= dist <= 1). Pixels which have a transparency of more than 20% in dst
+ * or src are ignored, their difference is set to -1.
+ * @param mode PIX_DIFF_LUM, PIX_DIFF_BRGT, or PIX_DIFF_3D.
+ * @param f Factor by which the color space is stretched along the black-white
+ * axis before the difference is calculated, 0 means no stretching.
+ */
+void pix_diff_row(const uint32_t *dst, const uint32_t *src, double *dist, int n, int mode, double f)
+{
+   pix_row_(dst, src, dist, n, mode, f);
+}
+
+
+/*! Calculate the values of the pixels of the row src in the color space of
+ * pix_diff_row(). Transparent pixels are set to -1 as well. In mode
+ * PIX_DIFF_3D the value is the average of the RGB components.
+ */
+void pix_value_row(const uint32_t *src, double *val, int n, int mode, double f)
+{
+   pix_row_(src, NULL, val, n, mode, f);
+}
+
+
+/*! Convert the values of a row to gray pixels. Values < 0 are set to the
+ * pixel trans.
+ */
+void pix_gray_row(const double *val, uint32_t *dst, int n, uint32_t trans)
+{
+   pix_gray_(val, dst, n, trans);
+}
+
+
+#ifdef TEST_SMPIXEL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// typical size of the surface of the auto-rotation of a caption in pixels
+#define BENCH_W 160
+#define BENCH_H 160
+#define BENCH_ITER 2000
+
+
+static void ref_rot_y(double *c, double a)
+{
+   double x =  c[0] * cos(a) + c[2] * sin(a);
+   double z = -c[0] * sin(a) + c[2] * cos(a);
+   c[0] = x;
+   c[2] = z;
+}
+
+
+static void ref_rot_z(double *c, double a)
+{
+   double x =  c[0] * cos(a) - c[1] * sin(a);
+   double y =  c[0] * sin(a) + c[1] * cos(a);
+   c[0] = x;
+   c[1] = y;
+}
+
+
+static uint32_t ref_stretch(double f, uint32_t col)
+{
+   double c[3] = {COL_COMPD(col, 16), COL_COMPD(col, 8), COL_COMPD(col, 0)};
+
+   ref_rot_z(c, -M_PI_4);
+   ref_rot_y(c, -acos(1 / sqrt(3)));
+   c[0] /= f;
+   c[1] /= f;
+   ref_rot_y(c,  acos(1 / sqrt(3)));
+   ref_rot_z(c,  M_PI_4);
+
+   return (col & 0xff000000) | (int) round(c[0] * 255) << 16 | (int) round(c[1] * 255) << 8 | (int) round(c[2] * 255);
+}
+
+
+static double ref_lum(uint32_t col)
+{
+   return 0.2125 * COL_COMPD(col, 16) + 0.7154 * COL_COMPD(col, 8) + 0.0721 * COL_COMPD(col, 0);
+}
+
+
+/*! Per-pixel implementation of the difference as it was used by
+ * cairo_smr_dist() before (COL_STRETCH_BW and COL_DIFF_LUM).
+ */
+static void ref_row(const uint32_t *p, const uint32_t *q, double *out, int n, int mode, double f)
+{
+   (void) mode;
+   for (int i = 0; i < n; i++)
+   {
+      if ((1.0 - COL_COMPD(p[i] & 0x7f000000, 23)) > 0.2 || (1.0 - COL_COMPD(q[i] & 0x7f000000, 23)) > 0.2)
+      {
+         out[i] = -1;
+         continue;
+      }
+      out[i] = fabs(ref_lum(ref_stretch(f, p[i])) - ref_lum(ref_stretch(f, q[i])));
+   }
+}
+
+
+static double bench(pix_row_func_t func, const uint32_t *p, const uint32_t *q, double *out)
+{
+   struct timespec t0, t1;
+   int i, y;
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (i = 0; i < BENCH_ITER; i++)
+      for (y = 0; y < BENCH_H; y++)
+         func(p + y * BENCH_W, q + y * BENCH_W, out + y * BENCH_W, BENCH_W, PIX_DIFF_LUM, 1.25);
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+
+   return ((t1.tv_sec - t0.tv_sec) * 1E9 + t1.tv_nsec - t0.tv_nsec) / ((double) BENCH_ITER * BENCH_W * BENCH_H);
+}
+
+
+int main(int argc, char **argv)
+{
+   int n = BENCH_W * BENCH_H, i, isa, mode, e = 0;
+   uint32_t *p, *q, *g0, *g1;
+   double *ref, *out;
+   const char *mname[] = {"lum", "brgt", "3d"};
+
+   (void) argc;
+   (void) argv;
+   p = malloc(sizeof(*p) * n);
+   q = malloc(sizeof(*q) * n);
+   g0 = malloc(sizeof(*g0) * n);
+   g1 = malloc(sizeof(*g1) * n);
+   ref = malloc(sizeof(*ref) * n);
+   out = malloc(sizeof(*out) * n);
+
+   srand(1);
+   for (i = 0; i < n; i++)
+   {
+      p[i] = (uint32_t) rand() << 16 ^ rand();
+      q[i] = (uint32_t) rand() << 16 ^ rand();
+      // mostly opaque pixels as on a real map
+      if (rand() % 4)
+      {
+         p[i] |= 0xff000000;
+         q[i] |= 0xff000000;
+      }
+   }
+
+   // compare the scalar kernel to the previous implementation
+   ref_row(p, q, ref, n, PIX_DIFF_LUM, 1.25);
+   pix_row_scalar(p, q, out, n, PIX_DIFF_LUM, 1.25);
+   if (memcmp(ref, out, sizeof(*ref) * n))
+   {
+      printf("scalar kernel differs from reference\n");
+      e = 1;
+   }
+
+   // compare the SIMD kernels to the scalar kernel
+   for (isa = PIX_SSE2; isa <= PIX_AVX2; isa++)
+   {
+      if (pix_select(isa))
+         continue;
+      for (mode = PIX_DIFF_LUM; mode <= PIX_DIFF_3D; mode++)
+      {
+         pix_row_scalar(p, q, ref, n, mode, 1.25);
+         pix_diff_row(p, q, out, n, mode, 1.25);
+         if (memcmp(ref, out, sizeof(*ref) * n))
+         {
+            printf("%s kernel differs in mode %s\n", pix_name_, mname[mode]);
+            e = 1;
+         }
+         pix_row_scalar(p, NULL, ref, n, mode, 0);
+         pix_value_row(p, out, n, mode, 0);
+         if (memcmp(ref, out, sizeof(*ref) * n))
+         {
+            printf("%s kernel differs in mode %s without stretching\n", pix_name_, mname[mode]);
+            e = 1;
+         }
+      }
+      pix_gray_scalar(ref, g0, n, 0x7fffffff);
+      pix_gray_row(ref, g1, n, 0x7fffffff);
+      if (memcmp(g0, g1, sizeof(*g0) * n))
+      {
+         printf("%s gray kernel differs\n", pix_name_);
+         e = 1;
+      }
+   }
+
+   printf("%dx%d pixels, %d iterations, ns/pixel:\n", BENCH_W, BENCH_H, BENCH_ITER);
+   printf("  reference  %6.2f\n", bench(ref_row, p, q, out));
+   for (isa = PIX_SCALAR; isa <= PIX_AVX2; isa++)
+      if (!pix_select(isa))
+         printf("  %-10s %6.2f\n", pix_name_, bench(pix_row_, p, q, out));
+
+   free(p);
+   free(q);
+   free(g0);
+   free(g1);
+   free(ref);
+   free(out);
+   return e;
+}
+
+#endif
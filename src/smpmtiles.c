@@ -0,0 +1,789 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smpmtiles.c
+ * This file contains the code to write tiles into a single archive file
+ * instead of one file per tile. The archive has the layout of PMTiles version
+ * 3: a fixed size header, the root directory, the metadata (JSON), the leaf
+ * directories, and the tile data. Tiles are addressed by a tile id which
+ * enumerates the tiles of all zoom levels along a Hilbert curve. Directories
+ * and tiles are not compressed, thus no additional library is needed.
+ *
+ * Tiles may be added in any order by any number of threads. The encoded tiles
+ * are appended to a temporary spool file. Identical tiles (e.g. open water)
+ * are detected by a hash of their data and are stored only once. The caller
+ * may even skip encoding of a tile if it knows that it is identical to a tile
+ * added before (see pmt_add_ref()). Finally,
+ * pmt_close() sorts the tiles by their id and writes the archive sequentially
+ * with the tile data clustered in Hilbert order.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "smrender_dev.h"
+
+
+//! size of the header
+#define PMT_HDR_LEN 127
+//! header and root directory must fit into this size
+#define PMT_ROOT_MAX 16384
+//! initial number of entries per leaf directory
+#define PMT_LEAF_SIZE 4096
+//! offset of a content which is not placed in the tile data section yet
+#define PMT_UNSET UINT64_MAX
+
+#define PMT_COMP_NONE 1
+#define PMT_TYPE_PNG 2
+#define PMT_TYPE_JPG 3
+
+#ifdef WITH_THREADS
+#define PMT_LOCK(x) pthread_mutex_lock(&(x)->mutex)
+#define PMT_UNLOCK(x) pthread_mutex_unlock(&(x)->mutex)
+#else
+#define PMT_LOCK(x)
+#define PMT_UNLOCK(x)
+#endif
+
+
+//! distinct tile data
+typedef struct pmt_content
+{
+   uint64_t hash;          //!< hash of the data
+   off_t spool;            //!< position of the data within the spool file
+   uint64_t off;           //!< position within the tile data section of the archive
+   uint32_t len;           //!< length of the data
+} pmt_content_t;
+
+//! tile added to the archive
+typedef struct pmt_tile
+{
+   uint64_t id;            //!< tile id
+   long c;                 //!< index of its content
+} pmt_tile_t;
+
+//! entry of a directory
+typedef struct pmt_dirent
+{
+   uint64_t id;            //!< tile id of the first tile
+   uint64_t off;           //!< offset of the data or of the leaf directory
+   uint32_t len;           //!< length of the data or of the leaf directory
+   uint32_t run;           //!< number of consecutive tiles with the same data, 0 for leaves
+} pmt_dirent_t;
+
+//! growing memory buffer
+typedef struct pmt_buf
+{
+   unsigned char *data;
+   size_t len, size;
+} pmt_buf_t;
+
+struct pmtiles
+{
+   char *path;             //!< file name of the archive
+   char *spath;            //!< file name of the spool file
+   int fd;                 //!< file descriptor of the spool file
+   off_t slen;             //!< length of the spool file
+   int ftype;              //!< file type of the tiles, FTYPE_PNG or FTYPE_JPG
+   int zmin, zmax;         //!< lowest and highest zoom level added
+   pmt_content_t *cont;    //!< distinct contents
+   long ccnt, csize;
+   long *hash;             //!< hash table of content indices + 1, size is a power of 2
+   long hsize;
+   pmt_tile_t *tile;       //!< all tiles added
+   long tcnt, tsize;
+   int err;                //!< 1 if writing to the spool file failed
+#ifdef WITH_THREADS
+   pthread_mutex_t mutex;
+#endif
+};
+
+
+/*! Calculate the tile id of tile x/y of zoom level z. Tile ids are counted
+ * consecutively through all zoom levels beginning at level 0. Within a zoom
+ * level the tiles are enumerated along a Hilbert curve.
+ */
+static uint64_t pmt_tileid(int z, uint32_t x, uint32_t y)
+{
+   uint64_t d = ((1ULL << (2 * z)) - 1) / 3;
+   uint32_t s, rx, ry, t;
+
+   for (s = z ? 1U << (z - 1) : 0; s > 0; s >>= 1)
+   {
+      rx = (x & s) != 0;
+      ry = (y & s) != 0;
+      d += (uint64_t) s * s * ((3 * rx) ^ ry);
+      if (!ry)
+      {
+         if (rx)
+         {
+            x = s - 1 - x;
+            y = s - 1 - y;
+         }
+         t = x;
+         x = y;
+         y = t;
+      }
+   }
+   return d;
+}
+
+
+//! FNV-1a hash of the tile data.
+static uint64_t pmt_hash(const unsigned char *data, size_t len)
+{
+   uint64_t h = 0xcbf29ce484222325ULL;
+
+   for (; len; len--, data++)
+      h = (h ^ *data) * 0x100000001b3ULL;
+   return h;
+}
+
+
+//! Make sure that len more bytes fit into the buffer. Returns 0 on success.
+static int pmt_buf_grow(pmt_buf_t *b, size_t len)
+{
+   unsigned char *p;
+   size_t size;
+
+   if (b->len + len <= b->size)
+      return 0;
+
+   for (size = b->size ? b->size * 2 : 4096; size < b->len + len; size *= 2);
+   if ((p = realloc(b->data, size)) == NULL)
+   {
+      log_errno(LOG_ERR, "realloc() failed");
+      return -1;
+   }
+   b->data = p;
+   b->size = size;
+   return 0;
+}
+
+
+//! Append v as varint (LEB128) to the buffer. Returns 0 on success.
+static int pmt_put_varint(pmt_buf_t *b, uint64_t v)
+{
+   if (pmt_buf_grow(b, 10))
+      return -1;
+
+   for (; v >= 0x80; v >>= 7)
+      b->data[b->len++] = (v & 0x7f) | 0x80;
+   b->data[b->len++] = v;
+   return 0;
+}
+
+
+/*! Serialize the n directory entries d into the buffer. The buffer is reset
+ * before.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pmt_dir(pmt_buf_t *b, const pmt_dirent_t *d, long n)
+{
+   long i;
+   int e;
+
+   b->len = 0;
+   e = pmt_put_varint(b, n);
+   for (i = 0; i < n; i++)
+      e |= pmt_put_varint(b, i ? d[i].id - d[i - 1].id : d[i].id);
+   for (i = 0; i < n; i++)
+      e |= pmt_put_varint(b, d[i].run);
+   for (i = 0; i < n; i++)
+      e |= pmt_put_varint(b, d[i].len);
+   // 0 means that the data directly follows the data of the previous entry
+   for (i = 0; i < n; i++)
+      e |= pmt_put_varint(b, i && d[i].off == d[i - 1].off + d[i - 1].len ? 0 : d[i].off + 1);
+
+   return e ? -1 : 0;
+}
+
+
+/*! Serialize the directory entries d into a root directory and, if it does not
+ * fit into the first PMT_ROOT_MAX bytes of the archive, into leaf directories.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pmt_dirs(pmt_buf_t *root, pmt_buf_t *leaves, const pmt_dirent_t *d, long n)
+{
+   pmt_dirent_t *re;
+   pmt_buf_t lb;
+   long i, leaf_size, rn;
+
+   leaves->len = 0;
+   if (pmt_dir(root, d, n))
+      return -1;
+   if (root->len <= PMT_ROOT_MAX - PMT_HDR_LEN)
+      return 0;
+
+   memset(&lb, 0, sizeof(lb));
+   for (leaf_size = PMT_LEAF_SIZE; ; leaf_size *= 2)
+   {
+      if ((re = malloc(sizeof(*re) * (n / leaf_size + 1))) == NULL)
+      {
+         log_errno(LOG_ERR, "malloc() failed");
+         break;
+      }
+
+      leaves->len = 0;
+      for (i = 0, rn = 0; i < n; i += leaf_size, rn++)
+      {
+         if (pmt_dir(&lb, d + i, n - i < leaf_size ? n - i : leaf_size) || pmt_buf_grow(leaves, lb.len))
+            break;
+         re[rn].id = d[i].id;
+         re[rn].off = leaves->len;
+         re[rn].len = lb.len;
+         re[rn].run = 0;
+         memcpy(leaves->data + leaves->len, lb.data, lb.len);
+         leaves->len += lb.len;
+      }
+
+      if (i < n || pmt_dir(root, re, rn))
+      {
+         free(re);
+         break;
+      }
+      free(re);
+
+      if (root->len <= PMT_ROOT_MAX - PMT_HDR_LEN)
+      {
+         log_debug("%ld leaf directories with up to %ld entries", rn, leaf_size);
+         free(lb.data);
+         return 0;
+      }
+   }
+
+   free(lb.data);
+   return -1;
+}
+
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+   for (int i = 0; i < 8; i++, v >>= 8)
+      p[i] = v;
+}
+
+
+static void put_le32(unsigned char *p, int32_t v)
+{
+   for (int i = 0; i < 4; i++)
+      p[i] = (uint32_t) v >> (i * 8);
+}
+
+
+//! Return 1 if the file name has the extension ".pmtiles", otherwise 0.
+int is_pmtiles_path(const char *path)
+{
+   size_t len;
+
+   return path != NULL && (len = strlen(path)) >= 8 && !strcasecmp(path + len - 8, ".pmtiles");
+}
+
+
+/*! Create a new archive. The tiles are collected in a temporary spool file
+ * with the extension ".tmp" until pmt_close() writes the archive.
+ * @param path File name of the archive.
+ * @param ftype File type of the tiles, FTYPE_PNG or FTYPE_JPG.
+ * @return Returns a pointer to the archive or NULL on error.
+ */
+pmtiles_t *pmt_open(const char *path, int ftype)
+{
+   pmtiles_t *pt;
+   size_t len;
+
+   if ((pt = calloc(1, sizeof(*pt))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return NULL;
+   }
+
+   len = strlen(path);
+   if ((pt->path = strdup(path)) == NULL || (pt->spath = malloc(len + 5)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      free(pt->path);
+      free(pt);
+      return NULL;
+   }
+   snprintf(pt->spath, len + 5, "%s.tmp", path);
+
+   if ((pt->fd = open(pt->spath, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1)
+   {
+      log_errno(LOG_ERR, "open() failed");
+      free(pt->spath);
+      free(pt->path);
+      free(pt);
+      return NULL;
+   }
+
+   pt->ftype = ftype;
+   pt->zmin = INT32_MAX;
+   pt->zmax = -1;
+#ifdef WITH_THREADS
+   pthread_mutex_init(&pt->mutex, NULL);
+#endif
+   log_msg(LOG_INFO, "writing tiles to archive %s", path);
+   return pt;
+}
+
+
+/*! Return the content which is identical to the data or -1 if there is none.
+ * The archive must be locked.
+ */
+static long pmt_find(pmtiles_t *pt, uint64_t h, const void *data, size_t len, long *slot)
+{
+   unsigned char *buf = NULL;
+   long i, c;
+
+   for (i = h & (pt->hsize - 1); pt->hash[i]; i = (i + 1) & (pt->hsize - 1))
+   {
+      c = pt->hash[i] - 1;
+      if (pt->cont[c].hash != h || pt->cont[c].len != len)
+         continue;
+
+      // compare the data to be safe against hash collisions
+      if (buf == NULL && (buf = malloc(len)) == NULL)
+         continue;
+      if (pread(pt->fd, buf, len, pt->cont[c].spool) == (ssize_t) len && !memcmp(buf, data, len))
+      {
+         free(buf);
+         return c;
+      }
+   }
+   free(buf);
+   *slot = i;
+   return -1;
+}
+
+
+//! Double the size of the hash table. The archive must be locked.
+static int pmt_rehash(pmtiles_t *pt)
+{
+   long *hash, i, j, size = pt->hsize ? pt->hsize * 2 : 4096;
+
+   if ((hash = calloc(size, sizeof(*hash))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return -1;
+   }
+   for (i = 0; i < pt->ccnt; i++)
+   {
+      for (j = pt->cont[i].hash & (size - 1); hash[j]; j = (j + 1) & (size - 1));
+      hash[j] = i + 1;
+   }
+   free(pt->hash);
+   pt->hash = hash;
+   pt->hsize = size;
+   return 0;
+}
+
+
+/*! Make sure that the next tile and its content fit into the arrays and that
+ * the hash table has enough free slots. The archive must be locked.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pmt_reserve(pmtiles_t *pt)
+{
+   pmt_content_t *pc;
+   pmt_tile_t *t;
+
+   if (pt->ccnt * 2 >= pt->hsize && pmt_rehash(pt))
+      return -1;
+
+   if (pt->ccnt >= pt->csize)
+   {
+      if ((pc = realloc(pt->cont, sizeof(*pc) * (pt->csize ? pt->csize * 2 : 4096))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      pt->cont = pc;
+      pt->csize = pt->csize ? pt->csize * 2 : 4096;
+   }
+
+   if (pt->tcnt >= pt->tsize)
+   {
+      if ((t = realloc(pt->tile, sizeof(*t) * (pt->tsize ? pt->tsize * 2 : 4096))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      pt->tile = t;
+      pt->tsize = pt->tsize ? pt->tsize * 2 : 4096;
+   }
+
+   return 0;
+}
+
+
+//! Append tile z/x/y with content c to the list of tiles. The archive must be locked.
+static void pmt_put_tile(pmtiles_t *pt, int z, int x, int y, long c)
+{
+   pmt_tile_t *t;
+
+   t = &pt->tile[pt->tcnt++];
+   t->id = pmt_tileid(z, x, y);
+   t->c = c;
+   if (z < pt->zmin)
+      pt->zmin = z;
+   if (z > pt->zmax)
+      pt->zmax = z;
+}
+
+
+/*! Add a tile to the archive. This function is thread-safe.
+ * @param pt Pointer to the archive.
+ * @param z Zoom level.
+ * @param x X position of the tile.
+ * @param y Y position of the tile.
+ * @param data Encoded tile.
+ * @param len Length of the data.
+ * @return On success the index of the content of the tile is returned which
+ * may be passed to pmt_add_ref() for identical tiles. On error -1 is returned.
+ */
+long pmt_add(pmtiles_t *pt, int z, int x, int y, const void *data, size_t len)
+{
+   uint64_t h;
+   long c, slot;
+
+   if (z < 0 || z > 31 || len > UINT32_MAX)
+   {
+      log_msg(LOG_ERR, "cannot add tile %d/%d/%d to archive", z, x, y);
+      return -1;
+   }
+
+   h = pmt_hash(data, len);
+
+   PMT_LOCK(pt);
+   if (pmt_reserve(pt))
+   {
+      PMT_UNLOCK(pt);
+      return -1;
+   }
+
+   if ((c = pmt_find(pt, h, data, len, &slot)) == -1)
+   {
+      if (pwrite(pt->fd, data, len, pt->slen) != (ssize_t) len)
+      {
+         pt->err = 1;
+         PMT_UNLOCK(pt);
+         log_errno(LOG_ERR, "pwrite() failed");
+         return -1;
+      }
+      c = pt->ccnt++;
+      pt->cont[c].hash = h;
+      pt->cont[c].spool = pt->slen;
+      pt->cont[c].off = PMT_UNSET;
+      pt->cont[c].len = len;
+      pt->slen += len;
+      pt->hash[slot] = c + 1;
+   }
+
+   pmt_put_tile(pt, z, x, y, c);
+   PMT_UNLOCK(pt);
+
+   return c;
+}
+
+
+/*! Add a tile which is identical to a tile added before, i.e. it refers to
+ * the same data in the archive. This function is thread-safe.
+ * @param pt Pointer to the archive.
+ * @param z Zoom level.
+ * @param x X position of the tile.
+ * @param y Y position of the tile.
+ * @param c Index of the content as returned by pmt_add().
+ * @return On success 0 is returned, otherwise -1.
+ */
+int pmt_add_ref(pmtiles_t *pt, int z, int x, int y, long c)
+{
+   if (z < 0 || z > 31 || c < 0)
+   {
+      log_msg(LOG_ERR, "cannot add tile %d/%d/%d to archive", z, x, y);
+      return -1;
+   }
+
+   PMT_LOCK(pt);
+   if (c >= pt->ccnt)
+   {
+      PMT_UNLOCK(pt);
+      log_msg(LOG_ERR, "tile %d/%d/%d refers to unknown content %ld", z, x, y, c);
+      return -1;
+   }
+   if (pmt_reserve(pt))
+   {
+      PMT_UNLOCK(pt);
+      return -1;
+   }
+   pmt_put_tile(pt, z, x, y, c);
+   PMT_UNLOCK(pt);
+
+   return 0;
+}
+
+
+static int cmp_tile(const void *a, const void *b)
+{
+   const pmt_tile_t *ta = a, *tb = b;
+
+   if (ta->id != tb->id)
+      return ta->id < tb->id ? -1 : 1;
+   return ta->c < tb->c ? -1 : ta->c > tb->c;
+}
+
+
+/*! Sort the tiles by their id and create the directory entries. Consecutive
+ * tiles with identical data are merged into a single entry (run). The
+ * contents are placed into the tile data section in the order of their
+ * first use.
+ * @param pt Pointer to the archive.
+ * @param dlen Pointer which receives the length of the tile data section.
+ * @param n Pointer which receives the number of directory entries.
+ * @return Returns the directory entries which have to be freed by the caller
+ * or NULL on error.
+ */
+static pmt_dirent_t *pmt_entries(pmtiles_t *pt, uint64_t *dlen, long *n)
+{
+   pmt_content_t *pc;
+   pmt_dirent_t *d;
+   long i;
+
+   qsort(pt->tile, pt->tcnt, sizeof(*pt->tile), cmp_tile);
+
+   if ((d = malloc(sizeof(*d) * (pt->tcnt + 1))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return NULL;
+   }
+
+   *dlen = 0;
+   *n = 0;
+   for (i = 0; i < pt->tcnt; i++)
+   {
+      // a tile which was added twice is stored only once
+      if (i && pt->tile[i].id == pt->tile[i - 1].id)
+         continue;
+
+      pc = &pt->cont[pt->tile[i].c];
+      if (pc->off == PMT_UNSET)
+      {
+         pc->off = *dlen;
+         *dlen += pc->len;
+      }
+
+      if (*n && d[*n - 1].id + d[*n - 1].run == pt->tile[i].id && d[*n - 1].off == pc->off && d[*n - 1].run < UINT32_MAX)
+      {
+         d[*n - 1].run++;
+         continue;
+      }
+      d[*n].id = pt->tile[i].id;
+      d[*n].off = pc->off;
+      d[*n].len = pc->len;
+      d[*n].run = 1;
+      (*n)++;
+   }
+
+   return d;
+}
+
+
+//! Fill in the header of the archive.
+static void pmt_header(unsigned char *h, const pmtiles_t *pt, const struct bbox *bb, const uint64_t *sec, long n, long ntiles)
+{
+   memset(h, 0, PMT_HDR_LEN);
+   memcpy(h, "PMTiles", 7);
+   h[7] = 3;
+   // offsets and lengths of root directory, metadata, leaves, and tile data
+   for (int i = 0; i < 8; i++)
+      put_le64(h + 8 + i * 8, sec[i]);
+   put_le64(h + 72, ntiles);
+   put_le64(h + 80, n);
+   put_le64(h + 88, pt->ccnt);
+   h[96] = 1;
+   h[97] = PMT_COMP_NONE;
+   h[98] = PMT_COMP_NONE;
+   h[99] = pt->ftype == FTYPE_JPG ? PMT_TYPE_JPG : PMT_TYPE_PNG;
+   h[100] = pt->zmax >= 0 ? pt->zmin : 0;
+   h[101] = pt->zmax >= 0 ? pt->zmax : 0;
+   put_le32(h + 102, bb->ll.lon * 1E7);
+   put_le32(h + 106, bb->ll.lat * 1E7);
+   put_le32(h + 110, bb->ru.lon * 1E7);
+   put_le32(h + 114, bb->ru.lat * 1E7);
+   h[118] = h[100];
+   put_le32(h + 119, (bb->ll.lon + bb->ru.lon) / 2 * 1E7);
+   put_le32(h + 123, (bb->ll.lat + bb->ru.lat) / 2 * 1E7);
+}
+
+
+/*! Copy the contents from the spool file to the tile data section of the
+ * archive in the order of their offsets. The tiles must be sorted (see
+ * pmt_entries()).
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pmt_copy_data(pmtiles_t *pt, FILE *f)
+{
+   pmt_content_t *pc;
+   unsigned char *buf = NULL, *p;
+   uint64_t off = 0;
+   size_t size = 0;
+   long i;
+
+   for (i = 0; i < pt->tcnt; i++)
+   {
+      pc = &pt->cont[pt->tile[i].c];
+      // only the first use of each content matches
+      if ((i && pt->tile[i].id == pt->tile[i - 1].id) || pc->off != off)
+         continue;
+
+      if (pc->len > size)
+      {
+         if ((p = realloc(buf, pc->len)) == NULL)
+         {
+            log_errno(LOG_ERR, "realloc() failed");
+            break;
+         }
+         buf = p;
+         size = pc->len;
+      }
+
+      if (pread(pt->fd, buf, pc->len, pc->spool) != (ssize_t) pc->len)
+      {
+         log_errno(LOG_ERR, "pread() failed");
+         break;
+      }
+      if (fwrite(buf, pc->len, 1, f) != 1)
+      {
+         log_errno(LOG_ERR, "fwrite() failed");
+         break;
+      }
+      off += pc->len;
+   }
+
+   free(buf);
+   return i < pt->tcnt ? -1 : 0;
+}
+
+
+//! Free all resources of the archive and remove the spool file.
+static void pmt_free(pmtiles_t *pt)
+{
+   close(pt->fd);
+   (void) unlink(pt->spath);
+#ifdef WITH_THREADS
+   pthread_mutex_destroy(&pt->mutex);
+#endif
+   free(pt->tile);
+   free(pt->hash);
+   free(pt->cont);
+   free(pt->spath);
+   free(pt->path);
+   free(pt);
+}
+
+
+/*! Write the archive and free all resources. The directories are written in
+ * front of the tile data, thus the file is written sequentially.
+ * @param pt Pointer to the archive.
+ * @param bb Bounding box of the tiles.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int pmt_close(pmtiles_t *pt, const struct bbox *bb)
+{
+   unsigned char hdr[PMT_HDR_LEN];
+   pmt_buf_t root, leaves;
+   pmt_dirent_t *d = NULL;
+   char meta[256];
+   uint64_t sec[8];
+   long i, n, ntiles;
+   FILE *f = NULL;
+   int e = -1;
+
+   memset(&root, 0, sizeof(root));
+   memset(&leaves, 0, sizeof(leaves));
+
+   if (pt->err)
+   {
+      log_msg(LOG_ERR, "archive %s is incomplete, not written", pt->path);
+      goto pmt_exit;
+   }
+
+   if ((d = pmt_entries(pt, &sec[7], &n)) == NULL || pmt_dirs(&root, &leaves, d, n))
+      goto pmt_exit;
+
+   snprintf(meta, sizeof(meta), "{\"format\":\"%s\",\"generator\":\"%s\"}",
+         pt->ftype == FTYPE_JPG ? "jpg" : "png", PACKAGE_STRING);
+
+   sec[0] = PMT_HDR_LEN;
+   sec[1] = root.len;
+   sec[2] = sec[0] + sec[1];
+   sec[3] = strlen(meta);
+   sec[4] = sec[2] + sec[3];
+   sec[5] = leaves.len;
+   sec[6] = sec[4] + sec[5];
+   for (i = 0, ntiles = 0; i < n; i++)
+      ntiles += d[i].run;
+   pmt_header(hdr, pt, bb, sec, n, ntiles);
+
+   if ((f = fopen(pt->path, "w")) == NULL)
+   {
+      log_msg(LOG_ERR, "fopen(%s) failed: %s", pt->path, strerror(errno));
+      goto pmt_exit;
+   }
+
+   if (fwrite(hdr, PMT_HDR_LEN, 1, f) != 1 || fwrite(root.data, root.len, 1, f) != 1 ||
+         fwrite(meta, sec[3], 1, f) != 1 || (leaves.len && fwrite(leaves.data, leaves.len, 1, f) != 1))
+   {
+      log_errno(LOG_ERR, "fwrite() failed");
+      goto pmt_exit;
+   }
+
+   if (pmt_copy_data(pt, f))
+      goto pmt_exit;
+
+   log_msg(LOG_NOTICE, "archive %s: %ld tiles, %ld unique, %ld directory entries, %ld bytes of tile data",
+         pt->path, ntiles, pt->ccnt, n, (long) sec[7]);
+   e = 0;
+
+pmt_exit:
+   if (f != NULL && fclose(f))
+   {
+      log_errno(LOG_ERR, "fclose() failed");
+      e = -1;
+   }
+   free(leaves.data);
+   free(root.data);
+   free(d);
+   pmt_free(pt);
+   return e;
+}
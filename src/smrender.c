@@ -66,6 +66,10 @@ extern volatile sig_atomic_t alarm_;
 static volatile sig_atomic_t pipe_ = 0;
 int render_all_nodes_ = 0;
 extern int traverse_alarm_;
+extern int tag_index_;
+extern int spatial_index_;
+extern int tile_dedup_;
+extern int band_mem_;
 #ifdef HAVE_GETOPT_LONG
 //! long options for getopt_long()
 static const struct option lopts_[] =
@@ -73,6 +77,7 @@ static const struct option lopts_[] =
    {"all-nodes", no_argument, NULL, 'a'},
    {"border", required_argument, NULL, 'B'},
    {"bgcolor", required_argument, NULL, 'b'},
+   {"band-memory", required_argument, NULL, 'b' + 256},
    {"no-color", no_argument, NULL, 'C'},
    {"color", no_argument, NULL, 'C' + 256},
    {"inc-loglevel", no_argument, NULL, 'D'},
@@ -89,13 +94,19 @@ static const struct option lopts_[] =
    {"id-offset", required_argument, NULL, 'N'},
    {"id-positive", no_argument, NULL, 'n'},
    {"rules", required_argument, NULL, 'r'},
+   {"snapshot", required_argument, NULL, 's' + 256},
    {"out-rules", required_argument, NULL, 'R'},
    {"img-scale", required_argument, NULL, 's'},
    {"title", required_argument, NULL, 't'},
    {"threads", required_argument, NULL, 't' + 257},
    {"traverse-alarm", required_argument, NULL, 't' + 256},
    {"tiles", required_argument, NULL, 'T'},
+   {"tag-index", no_argument, NULL, 'T' + 256},
+   {"spatial-index", no_argument, NULL, 'S' + 256},
+   {"tile-pyramid", no_argument, NULL, 'T' + 257},
+   {"tile-dedup", no_argument, NULL, 'T' + 258},
    {"out", required_argument, NULL, 'o'},
+   {"obj-store", required_argument, NULL, 'o' + 256},
    {"projection", required_argument, NULL, 'p'},
    {"page", required_argument, NULL, 'P'},
    {"urls", no_argument, NULL, 'u'},
@@ -857,10 +868,10 @@ int main(int argc, char *argv[])
    FILE *f;
    char *cf = "rules.osm", *img_file = NULL, *osm_ifile = NULL, *osm_ofile =
       NULL, *osm_rfile = NULL, *kap_file = NULL, *kap_hfile = NULL, *pdf_file = NULL,
-      *svg_file = NULL;
+      *svg_file = NULL, *snap_file = NULL;
    struct rdata *rd;
    struct timeval tv_start, tv_end;
-   int w_mmap = 1, load_filter = 0, init_exit = 0, gen_grid = AUTO_GRID, prt_url = 0;
+   int w_mmap = 1, load_filter = 0, init_exit = 0, gen_grid = AUTO_GRID, prt_url = 0, sarray = 0, snap = 0, tile_pyramid = 0, img_ftype = FTYPE_PNG;
    char *paper = "A3", *bg = NULL, *border = NULL;
    struct filter fi;
    struct dstats rstats;
@@ -1017,10 +1028,22 @@ int main(int argc, char *argv[])
             rd->flags |= RD_UIDS;
             break;
 
+         case 'o' + 256:
+            if (!strcmp(optarg, "array"))
+               sarray = 1;
+            else if (strcmp(optarg, "tree"))
+               log_msg(LOG_WARN, "unknown object store '%s', defaulting to tree", optarg);
+            break;
+
          case 'o':
             log_debug("parsing '-o %s'", optarg);
             if (!strrcasecmp(optarg, ".png"))
                img_file = optarg;
+            else if (!strrcasecmp(optarg, ".jpg") || !strrcasecmp(optarg, ".jpeg"))
+            {
+               img_file = optarg;
+               img_ftype = FTYPE_JPG;
+            }
             else if (!strrcasecmp(optarg, ".pdf"))
                pdf_file = optarg;
             else if (!strrcasecmp(optarg, ".svg"))
@@ -1083,6 +1106,10 @@ int main(int argc, char *argv[])
             }
             break;
 
+         case 's' + 256:
+            snap_file = optarg;
+            break;
+
          case 'S':
             log_msg(LOG_NOTICE, "option -%c deprecated, use -%c instead", n, 'R');
             ri.fname = optarg;
@@ -1100,6 +1127,30 @@ int main(int argc, char *argv[])
             rd->nthreads = atoi(optarg);
             break;
 
+         case 'T' + 256:
+            tag_index_ = 1;
+            break;
+
+         case 'S' + 256:
+            spatial_index_ = 1;
+            break;
+
+         case 'T' + 257:
+            tile_pyramid = 1;
+            break;
+
+         case 'T' + 258:
+            tile_dedup_ = 1;
+            break;
+
+         case 'b' + 256:
+            if ((band_mem_ = atoi(optarg)) <= 0)
+            {
+               log_msg(LOG_ERR, "band memory must be a positive number of MB");
+               exit(EXIT_FAILURE);
+            }
+            break;
+
          case 'T':
             if (parse_tile_info(optarg, &ti))
             {
@@ -1155,6 +1206,13 @@ int main(int argc, char *argv[])
       rd->nthreads = 0;
    rd->nthreads = init_threads(rd->nthreads);
 
+   if (sarray)
+   {
+      log_msg(LOG_INFO, "using sorted array object store");
+      if (sa_new_store(get_objtree()))
+         exit(EXIT_FAILURE);
+   }
+
    // preparing image
 #ifdef HAVE_CAIRO
    cairo_smr_init_main_image(bg);
@@ -1184,20 +1242,6 @@ int main(int argc, char *argv[])
       save_osm(osm_rfile, rd->rules, NULL, NULL);
    }
 
-   if (!norules)
-   {
-      log_msg(LOG_INFO, "preparing rules");
-      if (execute_treefunc(rd->rules, NODES_FIRST, (tree_func_t) init_rules, rd->rules) < 0)
-         log_msg(LOG_ERR, "rule parser failed"),
-            exit(EXIT_FAILURE);
-   }
-
-   if (ri.fname != NULL)
-   {
-      log_msg(LOG_NOTICE, "saving rules info to %s", ri.fname);
-      rules_info(rd, &ri, &rstats);
-   }
-
    if ((osm_ifile != NULL) && ((fd = open(osm_ifile, O_RDONLY)) == -1))
       log_msg(LOG_ERR, "cannot open file %s: %s", osm_ifile, strerror(errno)),
          exit(EXIT_FAILURE);
@@ -1205,68 +1249,129 @@ int main(int argc, char *argv[])
    if (fstat(fd, &st) == -1)
       perror("stat"), exit(EXIT_FAILURE);
 
-   if (w_mmap)
+   // objects of the input data are allocated from the arena
+   arena_enable(1);
+   if (snap_detect(fd))
    {
-      log_msg(LOG_INFO, "input file will be memory mapped with mmap()");
-      st.st_size = -st.st_size;
+      if (load_filter || index)
+         log_msg(LOG_NOTICE, "index and load filter not supported with snapshot input, ignoring");
+      log_msg(LOG_NOTICE, "reading snapshot (file size %ld kb)", (long) st.st_size / 1024);
+      if (read_snap_file(fd, get_objtree(), &rd->ds) == -1)
+         exit(EXIT_FAILURE);
+      ctl = NULL;
+      snap = 1;
    }
-   if ((ctl = hpx_init(fd, st.st_size)) == NULL)
-      perror("hpx_init_simple"), exit(EXIT_FAILURE);
-
-   if (load_filter)
+   else if (pbf_detect(fd))
    {
-      if (index)
-         log_msg(LOG_NOTICE, "index together with load filter no supported yet, ignoring");
-
-      memset(&fi, 0, sizeof(fi));
-      fi.c1.lat = rd->bb.ru.lat + rd->hc * 0.05;
-      fi.c1.lon = rd->bb.ll.lon - rd->wc * 0.05;
-      fi.c2.lat = rd->bb.ll.lat - rd->hc * 0.05;
-      fi.c2.lon = rd->bb.ru.lon + rd->wc * 0.05;
-      fi.use_bbox = 1;
-      log_msg(LOG_INFO, "using input bounding box %.3f/%.3f - %.3f/%.3f",
-            fi.c1.lat, fi.c1.lon, fi.c2.lat, fi.c2.lon);
-      log_msg(LOG_NOTICE, "reading osm data (file size %ld kb, memory at %p)",
-         (long) labs(st.st_size) / 1024, ctl->buf.buf);
-      (void) read_osm_file(ctl, get_objtree(), &fi, &rd->ds);
-
-     }
+      if (load_filter || index)
+         log_msg(LOG_NOTICE, "index and load filter not supported with PBF input, ignoring");
+      log_msg(LOG_NOTICE, "reading osm pbf data (file size %ld kb)", (long) st.st_size / 1024);
+      if (read_pbf_file(fd, get_objtree(), &rd->ds) == -1)
+         exit(EXIT_FAILURE);
+      ctl = NULL;
+   }
    else
    {
-      int e = ESM_NOFILE;
-      if (index)
-         e = index_read(osm_ifile, ctl->buf.buf, &rd->ds);
+      if (w_mmap)
+      {
+         log_msg(LOG_INFO, "input file will be memory mapped with mmap()");
+         st.st_size = -st.st_size;
+      }
+      if ((ctl = hpx_init(fd, st.st_size)) == NULL)
+         perror("hpx_init_simple"), exit(EXIT_FAILURE);
 
-      switch (e)
+      if (load_filter)
       {
-         case 0:
-            log_msg(LOG_NOTICE, "index successfully read");
-            break;
+         if (index)
+            log_msg(LOG_NOTICE, "index together with load filter no supported yet, ignoring");
+
+         memset(&fi, 0, sizeof(fi));
+         fi.c1.lat = rd->bb.ru.lat + rd->hc * 0.05;
+         fi.c1.lon = rd->bb.ll.lon - rd->wc * 0.05;
+         fi.c2.lat = rd->bb.ll.lat - rd->hc * 0.05;
+         fi.c2.lon = rd->bb.ru.lon + rd->wc * 0.05;
+         fi.use_bbox = 1;
+         log_msg(LOG_INFO, "using input bounding box %.3f/%.3f - %.3f/%.3f",
+               fi.c1.lat, fi.c1.lon, fi.c2.lat, fi.c2.lon);
+         log_msg(LOG_NOTICE, "reading osm data (file size %ld kb, memory at %p)",
+            (long) labs(st.st_size) / 1024, ctl->buf.buf);
+         (void) read_osm_file(ctl, get_objtree(), &fi, &rd->ds);
+
+        }
+      else
+      {
+         int e = ESM_NOFILE;
+         if (index)
+            e = index_read(osm_ifile, ctl->buf.buf, &rd->ds);
 
-         case ESM_NULLPTR:
-         case ESM_OUTDATED:
-         case ESM_NOFILE:
-            log_msg(LOG_NOTICE, "reading osm data (file size %ld kb, memory at %p)",
-               (long) labs(st.st_size) / 1024, ctl->buf.buf);
-            (void) read_osm_file(ctl, get_objtree(), NULL, &rd->ds);
-            if (index)
-               index_write(osm_ifile, *get_objtree(), ctl->buf.buf, &rd->ds);
-            break;
+         switch (e)
+         {
+            case 0:
+               log_msg(LOG_NOTICE, "index successfully read");
+               break;
 
-         default:
-            log_msg(LOG_ERR, "index file corrupt (e = %d)", e);
-            exit(EXIT_FAILURE);
+            case ESM_NULLPTR:
+            case ESM_OUTDATED:
+            case ESM_NOFILE:
+               log_msg(LOG_NOTICE, "reading osm data (file size %ld kb, memory at %p)",
+                  (long) labs(st.st_size) / 1024, ctl->buf.buf);
+               (void) read_osm_file(ctl, get_objtree(), NULL, &rd->ds);
+               if (index)
+                  index_write(osm_ifile, *get_objtree(), ctl->buf.buf, &rd->ds);
+               break;
+
+            default:
+               log_msg(LOG_ERR, "index file corrupt (e = %d)", e);
+               exit(EXIT_FAILURE);
+         }
       }
    }
 
+   arena_enable(0);
+
+   // the snapshot contains the input data only, thus it is written before
+   // the rules are initialized because some of them create objects (e.g.
+   // grid, ruler)
+   if (snap_file != NULL && snap_write(snap_file, *get_objtree(), &rd->ds))
+      log_msg(LOG_ERR, "could not write snapshot");
+
    if (!rd->ds.cnt[OSM_NODE])
    {
       log_msg(LOG_ERR, "no data to render");
       exit(EXIT_NODATA);
    }
 
+   // the tags of a snapshot are interned already
+   if (!snap)
+   {
+      log_msg(LOG_INFO, "interning tag strings");
+      if (execute_treefunc(*get_objtree(), NODES_FIRST, (tree_func_t) intern_tags, NULL))
+         log_msg(LOG_WARN, "interning tags failed");
+   }
+   log_msg(LOG_INFO, "%d distinct tag strings", intern_cnt());
+
+   if (!norules)
+   {
+      log_msg(LOG_INFO, "preparing rules");
+      if (execute_treefunc(rd->rules, NODES_FIRST, (tree_func_t) init_rules, rd->rules) < 0)
+         log_msg(LOG_ERR, "rule parser failed"),
+            exit(EXIT_FAILURE);
+   }
+
+   if (ri.fname != NULL)
+   {
+      log_msg(LOG_NOTICE, "saving rules info to %s", ri.fname);
+      rules_info(rd, &ri, &rstats);
+   }
+
+   if (!norules)
+      (void) execute_rules0(rd->rules, (tree_func_t) intern_rule_tags, NULL);
+
    log_debug("tree memory used: %ld kb", (long) bx_sizeof() / 1024);
+   if (sa_is_store(*get_objtree()))
+      log_debug("object store memory used: %ld kb", (long) sa_sizeof(*get_objtree()) / 1024);
    log_debug("onode memory used: %ld kb", (long) onode_mem() / 1024);
+   log_debug("arena memory allocated: %ld kb", (long) arena_size() / 1024);
 
    log_msg(LOG_INFO, "stripping filtered way nodes");
    traverse(*get_objtree(), 0, IDX_WAY, (tree_func_t) strip_ways, NULL);
@@ -1294,6 +1399,11 @@ int main(int argc, char *argv[])
          log_debug("no command line grid");
    }
 
+   // the nodes on the page are taken from the spatial index as long as no rule
+   // modified objects
+   if (spatial_index_ && !render_all_nodes_ && spidx_main_init(0))
+      log_msg(LOG_WARN, "cannot build spatial index");
+
    install_sigint();
    //FIXME: this is now called in act_cat_poly_ini() -- not sure if this is too late
    //init_cat_poly(rd);
@@ -1314,18 +1424,22 @@ int main(int argc, char *argv[])
    if (ti.path != NULL)
    {
       log_msg(LOG_INFO, "creating tiles in directory %s", ti.path);
-      for (i = ti.zlo; i <= ti.zhi; i++)
-      {
-         log_msg(LOG_INFO, "zoom level %d", i);
-         (void) create_tiles(ti.path, rd, i, ti.ftype);
-      }
+      if (tile_pyramid && ti.zlo < ti.zhi)
+         (void) create_tile_pyramid(ti.path, rd, ti.zlo, ti.zhi, ti.ftype);
+      else
+         for (i = ti.zlo; i <= ti.zhi; i++)
+         {
+            log_msg(LOG_INFO, "zoom level %d", i);
+            (void) create_tiles(ti.path, rd, i, ti.ftype);
+         }
+      (void) finish_tiles(rd);
    }
 
    if (img_file != NULL)
    {
       if ((f = fopen(img_file, "w")) != NULL)
       {
-         save_main_image(f, FTYPE_PNG);
+         save_main_image(f, img_ftype);
          fclose(f);
       }
       else
@@ -1381,12 +1495,21 @@ int main(int argc, char *argv[])
    }
 
    log_msg(LOG_NOTICE, "cleaning up...");
-   (void) close(ctl->fd);
-   hpx_free(ctl);
+   if (ctl != NULL)
+   {
+      (void) close(ctl->fd);
+      hpx_free(ctl);
+   }
+   else
+      (void) close(fd);
    hpx_free(cfctl);
 
+   tidx_free();
+   spidx_main_free();
+
    log_debug("freeing main objects");
    execute_rules0(*get_objtree(), free_objects, NULL);
+   arena_free();
 
    if (!norules)
    {
@@ -1394,6 +1517,9 @@ int main(int argc, char *argv[])
       execute_rules0(rd->rules, (tree_func_t) free_rules, NULL);
    }
 
+   intern_free();
+   pbf_free();
+   snap_free();
    log_debug("freeing main object tree");
    bx_free_tree(*get_objtree());
    log_debug("freeing rules tree");
@@ -40,6 +40,7 @@
 #include "osm_inplace.h"
 #include "bstring.h"
 #include "bxtree.h"
+#include "sarray.h"
 #include "smath.h"
 #include "lists.h"
 #include "libhpxml.h"
@@ -70,6 +71,13 @@
 #define POS_W1 (POS_W | POS_1)
 #define POS_DIR_MSK (POS_N | POS_S | POS_E | POS_W)
 
+//! labels are placed even if they overlap others
+#define OVERLAP_ALLOW 0
+//! labels which overlap others are not placed
+#define OVERLAP_SKIP 1
+//! labels which overlap others are moved to another position if possible
+#define OVERLAP_SHIFT 2
+
 #define COORD_LAT 0
 #define COORD_LON 1
 
@@ -189,6 +197,7 @@ struct actImage
    char *akey;          //!< angle is defined in a tag
    char *alignkey;      //!< alignment defined in a tag
    double trans;        //!< transparancy of image, 0.0 = opaque, 1.0 = absolute transparent
+   int overlap;         //!< handling of overlapping images, OVERLAP_xxx
 #ifdef HAVE_CAIRO
    cairo_surface_t *img;
    cairo_pattern_t *pat;
@@ -242,9 +251,10 @@ struct actCaption
    struct drawStyle fill;  //!< this defines if the background is filled
    double bgbox_scale;     //!< factor to scale the background box
    int fontbox;            //!< generate OSM data-based box
+   int overlap;            //!< handling of overlapping captions, OVERLAP_xxx
 #ifdef HAVE_CAIRO
    cairo_t *ctx;
-   cairo_surface_t *auto_sfc;
+   struct dlist *auto_dl;  //!< background for auto-rotation, display list on top of the chart
    cairo_t *auto_ctx;
 #endif
 };
@@ -330,6 +340,8 @@ void mk_chart_coords(int, int, struct rdata*, double*, double*);
 int poly_area(const osm_way_t*, struct coord *, double *);
 struct rdata *get_rdata(void);
 size_t save_osm(const char *, bx_node_t *, const struct bbox *, const char *);
+long save_osm_head(FILE *, const struct bbox *, const char *);
+long save_osm_tail(FILE *);
 void print_version(void);
 void usage(const char *);
 
@@ -347,14 +359,22 @@ void *create_tile(void);
 void delete_tile(void *);
 void cut_tile(const struct bbox *, void *);
 void clear_tile(void *);
+void downsample_tile(void *, void *const *);
+int tile_digest(void *, uint64_t *);
 int save_image(const char *, void *, int);
+int encode_image(void *, int, void **, size_t *);
 void *cairo_smr_image_surface_from_bg(cairo_format_t, cairo_antialias_t);
+void cairo_smr_paint_band(cairo_surface_t *, int, int, cairo_antialias_t);
 #else
-#define save_main_image(a, b)
+#define save_main_image(a, b) ((void) (a), (void) (b))
 #define create_tile() NULL
-#define delete_tile(a)
-#define cut_tile(a, b)
-#define save_image(a, b, x) 0
+#define delete_tile(a) ((void) (a))
+#define cut_tile(a, b) ((void) (b))
+#define clear_tile(a) ((void) (a))
+#define downsample_tile(a, b) ((void) (a), (void) (b))
+#define tile_digest(a, b) ((void) (a), (void) (b), -1)
+#define save_image(a, b, x) ((void) (b), 0)
+#define encode_image(a, b, c, d) ((void) (a), (void) (b), (void) (c), (void) (d), -1)
 #endif
 
 /* smlog.c */
@@ -370,6 +390,7 @@ int parse_style(const char *s);
 int parse_matchtag(struct otag *, struct stag *);
 void free_rule(smrule_t*);
 int init_rules(osm_obj_t*, void*);
+int intern_rule_tags(smrule_t*, void*);
 fparam_t **parse_fparam(char*);
 void free_fparam(fparam_t **);
 int parse_alignment(const action_t *act);
@@ -381,6 +402,7 @@ int parse_keylist(const char *, keylist_t *);
 int parse_coord(const char *, double *);
 int parse_coord2(const char *, double *, int );
 void parse_auto_rot(const action_t *, double *, struct auto_rot *);
+int parse_overlap(const action_t *);
 void parse_dash_style(const char *, struct drawStyle *);
 
 /* smkap.c */
@@ -401,6 +423,53 @@ image_t *smqr_image(void);
 
 /* smtile.c */
 int create_tiles(const char *, const struct rdata *, int , int );
+int create_tile_pyramid(const char *, const struct rdata *, int, int, int);
+int finish_tiles(const struct rdata *);
+
+/* smband.c */
+#ifdef HAVE_CAIRO
+typedef int (*band_func_t)(void *, const unsigned char *, int, int, int);
+int band_supported(int);
+int cairo_smr_bands(int, int, cairo_format_t, int, cairo_antialias_t, band_func_t, void *);
+int save_main_image_bands(FILE *, int);
+#endif
+
+/* smdlist.c */
+#ifdef HAVE_CAIRO
+typedef struct dlist dlist_t;
+dlist_t *dl_new(const cairo_rectangle_t *, const dlist_t *);
+void dl_free(dlist_t *);
+int dl_add_surface(dlist_t *, cairo_surface_t *);
+int dl_add_fill(dlist_t *, cairo_t *);
+void dl_replay(const dlist_t *, cairo_t *);
+#endif
+
+/* smlabel.c */
+#define LABEL_ADD 0
+#define LABEL_TEST 1
+//! corners of a label in page coordinates
+typedef struct label_box
+{
+   double x[4], y[4];
+} label_box_t;
+int label_place(const label_box_t *, int);
+void label_free(void);
+
+/* smpixel.c */
+#define PIX_DIFF_LUM 0
+#define PIX_DIFF_BRGT 1
+#define PIX_DIFF_3D 2
+void pix_diff_row(const uint32_t *, const uint32_t *, double *, int, int, double);
+void pix_value_row(const uint32_t *, double *, int, int, double);
+void pix_gray_row(const double *, uint32_t *, int, uint32_t);
+
+/* smpmtiles.c */
+typedef struct pmtiles pmtiles_t;
+pmtiles_t *pmt_open(const char *, int);
+long pmt_add(pmtiles_t *, int, int, int, const void *, size_t);
+int pmt_add_ref(pmtiles_t *, int, int, int, long);
+int pmt_close(pmtiles_t *, const struct bbox *);
+int is_pmtiles_path(const char *);
 
 /* smjson.c */
 int rules_info(const struct rdata *, rinfo_t *, const struct dstats *);
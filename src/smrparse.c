@@ -498,6 +498,29 @@ int init_rules(osm_obj_t *o, void *p)
 }
 
 
+/*! This is the tree function to resolve the literal match tags of a rule to
+ * the atoms of the interned tag strings of the objects (see smintern.c). Thus,
+ * it has to be called after the objects were interned. Strings which do not
+ * exist within the objects are left as they are.
+ * @param r Pointer to rule.
+ * @param p Unused.
+ * @return The function always returns 0.
+ */
+int intern_rule_tags(smrule_t *r, void *UNUSED(p))
+{
+   int i;
+
+   for (i = 0; i < r->oo->tag_cnt; i++)
+   {
+      if ((r->act->stag[i].stk.type & SPECIAL_MASK) == SPECIAL_DIRECT)
+         (void) bs_intern_lookup(&r->oo->otag[i].k);
+      if ((r->act->stag[i].stv.type & SPECIAL_MASK) == SPECIAL_DIRECT)
+         (void) bs_intern_lookup(&r->oo->otag[i].v);
+   }
+   return 0;
+}
+
+
 void free_fparam(fparam_t **fp)
 {
    fparam_t **fp0 = fp;
@@ -1074,6 +1097,26 @@ void parse_auto_rot(const action_t *act, double *angle, struct auto_rot *rot)
 }
 
 
+/*! Parse the parameter 'overlap' which defines how labels are handled which
+ * overlap labels that were placed before.
+ * @return Returns OVERLAP_ALLOW (default), OVERLAP_SKIP, or OVERLAP_SHIFT.
+ */
+int parse_overlap(const action_t *act)
+{
+   char *val;
+
+   if ((val = get_param("overlap", NULL, act)) == NULL || !strcasecmp("allow", val))
+      return OVERLAP_ALLOW;
+   if (!strcasecmp("skip", val))
+      return OVERLAP_SKIP;
+   if (!strcasecmp("shift", val))
+      return OVERLAP_SHIFT;
+
+   log_msg(LOG_WARN, "unknown overlap mode '%s', using 'allow'", val);
+   return OVERLAP_ALLOW;
+}
+
+
 void parse_dash_style(const char *s, struct drawStyle *ds)
 {
    if (s != NULL)
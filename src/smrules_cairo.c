@@ -85,6 +85,20 @@
 #define COL_STRETCH_BW
 #define COL_STRETCH_F 1.25
 
+// color space and stretch factor of the kernels of smpixel.c
+#if defined(COL_DIFF_3D)
+#define COL_DIFF_MODE PIX_DIFF_3D
+#elif defined(COL_DIFF_LUM)
+#define COL_DIFF_MODE PIX_DIFF_LUM
+#else
+#define COL_DIFF_MODE PIX_DIFF_BRGT
+#endif
+#ifdef COL_STRETCH_BW
+#define COL_STRETCH COL_STRETCH_F
+#else
+#define COL_STRETCH 0
+#endif
+
 #define POS_OFFSET mm2unit(1.4)
 
 #define COL_COMP(x, y) ((x) >> (y) & 0xff)
@@ -105,6 +119,7 @@
 #define PX2PT_SCALE (72.0 / rdata_dpi())
 #define DP_LIMIT 0.95
 #define TILE_SIZE 256
+#define TILE_JPG_QUALITY 90
 #define TRANSPIX 0x7fffffff
 #define sqr(x) pow(x, 2)
 
@@ -112,6 +127,10 @@
 #define WAVY 2
 #define WAVY_LENGTH 0.0015
 #define PIPE_DOT_SCALE 2.5
+//! number of radial bins of the polar histograms of find_angle()
+#define FA_RBINS 8
+//! number of angles of find_angle() which are compared pixel by pixel
+#define FA_CANDIDATES 6
 
 #define RENDER_IMMEDIATE 0
 #define CREATE_PATH 1
@@ -144,17 +163,14 @@ typedef struct diffpeak
 } diffpeak_t;
 
 
-typedef struct cartesian
-{
-   double x, y, z;
-} cartesian_t;
-
-
 int color_by_cs(const osm_obj_t *o, const struct col_spec *cs);
 static int img_ini(smrule_t *r, struct actImage *img);
 static void img_fini(struct actImage *img);
 
 static cairo_surface_t *sfc_;
+//! spatially indexed display list of sfc_ (see smdlist.c)
+static dlist_t *dl_;
+extern int band_mem_;
 static cairo_rectangle_t ext_;
 
 
@@ -194,14 +210,21 @@ static void cairo_smr_push_group(cairo_t *ctx)
 }
 
 
+/*! Pop the group and paint it to the target of ctx. If the target is the main
+ * surface, the group is added to the display list as well.
+ */
 static void cairo_smr_pop_group0(cairo_t *ctx)
 {
+   cairo_surface_t *grp;
+
    // safety check
    if (ctx == NULL)
       return;
 
    cairo_pop_group_to_source(ctx);
    CSS_INC(CSS_POP);
+   if (cairo_get_group_target(ctx) == sfc_ && cairo_pattern_get_surface(cairo_get_source(ctx), &grp) == CAIRO_STATUS_SUCCESS)
+      (void) dl_add_surface(dl_, grp);
    cairo_paint(ctx);
    CSS_INC(CSS_PAINT);
 }
@@ -297,6 +320,8 @@ static cairo_surface_t *cairo_smr_surface(void)
 
 void __attribute__((destructor)) cairo_smr_fini(void)
 {
+   label_free();
+   dl_free(dl_);
    cairo_surface_destroy(sfc_);
 #ifdef CAIRO_SMR_STATS
    for (int i = 0; i < CSS_MAX; i++)
@@ -314,16 +339,18 @@ void cairo_smr_init_main_image(const char *bg)
    ext_.width = rdata_width(U_PT);
    ext_.height = rdata_height(U_PT);
 
-   if ((sfc_ = cairo_smr_surface()) == NULL)
+   if ((sfc_ = cairo_smr_surface()) == NULL || (dl_ = dl_new(&ext_, NULL)) == NULL)
       exit(EXIT_FAILURE);
 
    if (bg != NULL)
       set_color("bgcolor", parse_color(bg));
 
    ctx = cairo_create(sfc_);
+   cairo_smr_push_group0(ctx);
    cairo_smr_set_source_color(ctx, parse_color("bgcolor"));
    cairo_paint(ctx);
    CSS_INC(CSS_PAINT);
+   cairo_smr_pop_group0(ctx);
    cairo_destroy(ctx);
 
    log_debug("background color is set to 0x%08x", parse_color("bgcolor"));
@@ -339,40 +366,15 @@ static cairo_status_t cairo_smr_write_func(void *closure, const unsigned char *d
 void *cairo_smr_image_surface_from_bg(cairo_format_t fmt, cairo_antialias_t alias)
 {
    cairo_surface_t *sfc;
-   cairo_t *dst;
 
    sfc = cairo_image_surface_create(fmt, round(rdata_width(U_PX)), round(rdata_height(U_PX)));
    cairo_smr_log_surface_status(sfc);
-   dst = cairo_create(sfc);
-   cairo_smr_log_status(dst);
-   cairo_scale(dst, (double) rdata_dpi() / 72, (double) rdata_dpi() / 72);
-   cairo_set_source_surface(dst, sfc_, 0, 0);
-   cairo_set_antialias(dst, alias);
-   cairo_paint(dst);
-   CSS_INC(CSS_PAINT);
-   cairo_destroy(dst);
+   cairo_smr_paint_band(sfc, 0, 0, alias);
    cairo_smr_log_surface_data(sfc);
    return sfc;
 }
 
 
-void *cairo_smr_recording_surface_from_bg(void)
-{
-   cairo_surface_t *sfc;
-   cairo_t *ctx;
-
-   sfc = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &ext_);
-   cairo_smr_log_surface_status(sfc);
-   ctx = cairo_create(sfc);
-   cairo_smr_log_status(ctx);
-   cairo_set_source_surface(ctx, sfc_, 0, 0);
-   cairo_paint(ctx);
-   cairo_destroy(ctx);
-
-   return sfc;
-}
-
-
 static void cairo_smr_page_rotate(cairo_t *ctx)
 {
    struct rdata *rd = get_rdata();
@@ -385,6 +387,39 @@ static void cairo_smr_page_rotate(cairo_t *ctx)
 }
 
 
+/*! Paint the part of the main image which begins at row y0 into the image
+ * surface band. The band is cleared before.
+ * @param band Pointer to image surface.
+ * @param y0 First row (in pixels) of the image.
+ * @param page 1 to paint the page (rotated and with margins) as it is done by
+ * save_main_image(), 0 to paint the chart only as it is done by
+ * cairo_smr_image_surface_from_bg().
+ * @param alias Antialiasing mode.
+ */
+void cairo_smr_paint_band(cairo_surface_t *band, int y0, int page, cairo_antialias_t alias)
+{
+   cairo_t *dst;
+
+   dst = cairo_create(band);
+   cairo_smr_log_status(dst);
+   cairo_set_operator(dst, CAIRO_OPERATOR_CLEAR);
+   cairo_paint(dst);
+   cairo_set_operator(dst, CAIRO_OPERATOR_OVER);
+   cairo_translate(dst, 0, -y0);
+   cairo_scale(dst, (double) rdata_dpi() / 72, (double) rdata_dpi() / 72);
+   if (page)
+   {
+      cairo_translate(dst, rdata_page_width(U_PT) / 2, rdata_page_height(U_PT) / 2);
+      cairo_smr_page_rotate(dst);
+      cairo_translate(dst, rdata_width(U_PT) / -2, rdata_height(U_PT) / -2);
+   }
+   cairo_set_antialias(dst, alias);
+   dl_replay(dl_, dst);
+   CSS_INC(CSS_PAINT);
+   cairo_destroy(dst);
+}
+
+
 void save_main_image(FILE *f, int ftype)
 {
    cairo_surface_t *sfc;
@@ -396,18 +431,32 @@ void save_main_image(FILE *f, int ftype)
    switch (ftype)
    {
       case FTYPE_PNG:
-         log_debug("PNG: width = %d px, height = %d pt", (int) round(rdata_page_width(U_PX)), (int) round(rdata_page_height(U_PX)));
+      case FTYPE_JPG:
+         // render in bands to limit the memory (see smband.c)
+         if (band_mem_ && band_supported(ftype))
+         {
+            (void) save_main_image_bands(f, ftype);
+            return;
+         }
+         log_debug("%s: width = %d px, height = %d pt", ftype == FTYPE_JPG ? "JPG" : "PNG",
+               (int) round(rdata_page_width(U_PX)), (int) round(rdata_page_height(U_PX)));
+#ifndef HAVE_LIBJPEG
+         if (ftype == FTYPE_JPG)
+         {
+            log_msg(LOG_ERR, "cannot create JPEG, smrender was compiled without libjpeg");
+            return;
+         }
+#endif
          sfc = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, round(rdata_page_width(U_PX)), round(rdata_page_height(U_PX)));
-         dst = cairo_create(sfc);
-         cairo_smr_log_status(dst);
-         cairo_scale(dst, (double) rdata_dpi() / 72, (double) rdata_dpi() / 72);
-         cairo_translate(dst, rdata_page_width(U_PT) / 2, rdata_page_height(U_PT) / 2);
-         cairo_smr_page_rotate(dst);
-         cairo_set_source_surface(dst, sfc_, rdata_width(U_PT) / -2, rdata_height(U_PT) / -2);
-         cairo_paint(dst);
-         cairo_destroy(dst);
-         if ((e = cairo_surface_write_to_png_stream(sfc, cairo_smr_write_func, f)) != CAIRO_STATUS_SUCCESS)
-            log_msg(LOG_ERR, "failed to save png image: %s", cairo_status_to_string(e));
+         cairo_smr_paint_band(sfc, 0, 1, CAIRO_ANTIALIAS_DEFAULT);
+#ifdef HAVE_LIBJPEG
+         if (ftype == FTYPE_JPG)
+            e = cairo_image_surface_write_to_jpeg_stream(sfc, cairo_smr_write_func, f, TILE_JPG_QUALITY);
+         else
+#endif
+            e = cairo_surface_write_to_png_stream(sfc, cairo_smr_write_func, f);
+         if (e != CAIRO_STATUS_SUCCESS)
+            log_msg(LOG_ERR, "failed to save image: %s", cairo_status_to_string(e));
          cairo_surface_destroy(sfc);
          return;
 
@@ -465,6 +514,10 @@ int save_image(const char *s, void *img, int ftype)
    {
       case FTYPE_PNG:
          return cairo_surface_write_to_png(img, s) == CAIRO_STATUS_SUCCESS ? 0 : -1;
+#ifdef HAVE_LIBJPEG
+      case FTYPE_JPG:
+         return cairo_image_surface_write_to_jpeg(img, s, TILE_JPG_QUALITY) == CAIRO_STATUS_SUCCESS ? 0 : -1;
+#endif
    }
 
    // FIXME
@@ -473,6 +526,77 @@ int save_image(const char *s, void *img, int ftype)
 }
 
 
+//! memory buffer for cairo_smr_mem_write()
+struct mem_buf
+{
+   unsigned char *data;
+   size_t len, size;
+};
+
+
+static cairo_status_t cairo_smr_mem_write(void *closure, const unsigned char *data, unsigned int length)
+{
+   struct mem_buf *mb = closure;
+   unsigned char *p;
+   size_t size;
+
+   if (mb->len + length > mb->size)
+   {
+      for (size = mb->size ? mb->size * 2 : 16384; size < mb->len + length; size *= 2);
+      if ((p = realloc(mb->data, size)) == NULL)
+         return CAIRO_STATUS_NO_MEMORY;
+      mb->data = p;
+      mb->size = size;
+   }
+   memcpy(mb->data + mb->len, data, length);
+   mb->len += length;
+   return CAIRO_STATUS_SUCCESS;
+}
+
+
+/*! Encode an image into memory instead of writing it to a file (see
+ * save_image()).
+ * @param img Pointer to image surface.
+ * @param ftype File type, FTYPE_PNG or FTYPE_JPG.
+ * @param data Pointer to a pointer which receives the encoded data. It must be
+ * freed by the caller with free().
+ * @param len Pointer which receives the length of the data.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int encode_image(void *img, int ftype, void **data, size_t *len)
+{
+   struct mem_buf mb;
+   cairo_status_t e;
+
+   memset(&mb, 0, sizeof(mb));
+   switch (ftype)
+   {
+      case FTYPE_PNG:
+         e = cairo_surface_write_to_png_stream(img, cairo_smr_mem_write, &mb);
+         break;
+#ifdef HAVE_LIBJPEG
+      case FTYPE_JPG:
+         e = cairo_image_surface_write_to_jpeg_mem(img, &mb.data, &mb.len, TILE_JPG_QUALITY);
+         break;
+#endif
+      default:
+         log_msg(LOG_ERR, "cannot encode image, file type %d not implemented yet", ftype);
+         return -1;
+   }
+
+   if (e != CAIRO_STATUS_SUCCESS)
+   {
+      log_msg(LOG_ERR, "failed to encode image: %s", cairo_status_to_string(e));
+      free(mb.data);
+      return -1;
+   }
+
+   *data = mb.data;
+   *len = mb.len;
+   return 0;
+}
+
+
 void *create_tile(void)
 {
    cairo_surface_t *sfc;
@@ -494,8 +618,16 @@ void delete_tile(void *img)
 }
 
 
+/*! Cut the area bb out of the main image into the tile img. This function is
+ * thread-safe. The replay is serialized because cairo does not guarantee that
+ * a recording surface can be replayed by several threads concurrently, it
+ * lazily updates internal state of the surface while replaying.
+ */
 void cut_tile(const struct bbox *bb, void *img)
 {
+#ifdef WITH_THREADS
+   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
    double x, y, w, h;
    cairo_t *ctx;
 
@@ -505,8 +637,14 @@ void cut_tile(const struct bbox *bb, void *img)
    ctx = cairo_create(img);
    log_debug("cutting %.1f/%.1f - %.1f/%.1f", x, y, w, h);
    cairo_scale(ctx, TILE_SIZE / (w - x), TILE_SIZE / (h - y));
-   cairo_set_source_surface(ctx, sfc_, -x, -y);
-   cairo_paint(ctx);
+   cairo_translate(ctx, -x, -y);
+#ifdef WITH_THREADS
+   pthread_mutex_lock(&mutex);
+#endif
+   dl_replay(dl_, ctx);
+#ifdef WITH_THREADS
+   pthread_mutex_unlock(&mutex);
+#endif
    cairo_destroy(ctx);
 }
 
@@ -522,6 +660,82 @@ void clear_tile(void *img)
 }
 
 
+/*! Calculate a 128 bit digest of the pixels of the tile img. The two halves
+ * are calculated with different hash functions.
+ * @param img Tile surface.
+ * @param d Pointer to an array of 2 uint64_t which receives the digest.
+ * @return Returns 1 if all pixels of the tile are equal, otherwise 0.
+ */
+int tile_digest(void *img, uint64_t *d)
+{
+   unsigned char *data;
+   uint32_t p, p0;
+   int stride, x, y, uniform = 1;
+
+   cairo_surface_flush(img);
+   data = cairo_image_surface_get_data(img);
+   stride = cairo_image_surface_get_stride(img);
+   p0 = *(uint32_t*) data;
+
+   d[0] = 0xcbf29ce484222325ULL;
+   d[1] = TILE_SIZE;
+   for (y = 0; y < TILE_SIZE; y++)
+      for (x = 0; x < TILE_SIZE; x++)
+      {
+         p = ((uint32_t*) (data + y * stride))[x];
+         uniform &= p == p0;
+         d[0] = (d[0] ^ p) * 0x100000001b3ULL;
+         d[1] += p * 0x9e3779b97f4a7c15ULL;
+         d[1] = ((d[1] << 31) | (d[1] >> 33)) * 0xc2b2ae3d27d4eb4fULL;
+      }
+
+   return uniform;
+}
+
+
+/*! Downsample the four tiles of the next zoom level into the tile img by
+ * averaging 2x2 pixels (box filter). Since the pixels are premultiplied, all
+ * channels are averaged independently.
+ * @param img Destination tile.
+ * @param child Array of the four child tiles in order upper left, upper right,
+ * lower left, lower right. Missing tiles (NULL) are transparent.
+ */
+void downsample_tile(void *img, void *const *child)
+{
+   unsigned char *dst, *src, *s0, *s1;
+   int dstride, sstride, i, x, y, c;
+
+   cairo_surface_flush(img);
+   dst = cairo_image_surface_get_data(img);
+   dstride = cairo_image_surface_get_stride(img);
+
+   for (i = 0; i < 4; i++, dst = cairo_image_surface_get_data(img))
+   {
+      dst += (i >> 1) * (TILE_SIZE / 2) * dstride + (i & 1) * (TILE_SIZE / 2) * 4;
+      if (child[i] == NULL)
+      {
+         for (y = 0; y < TILE_SIZE / 2; y++)
+            memset(dst + y * dstride, 0, TILE_SIZE / 2 * 4);
+         continue;
+      }
+
+      cairo_surface_flush(child[i]);
+      src = cairo_image_surface_get_data(child[i]);
+      sstride = cairo_image_surface_get_stride(child[i]);
+      for (y = 0; y < TILE_SIZE / 2; y++)
+      {
+         s0 = src + 2 * y * sstride;
+         s1 = s0 + sstride;
+         for (x = 0; x < TILE_SIZE / 2 * 4; x += 4, s0 += 8, s1 += 8)
+            for (c = 0; c < 4; c++)
+               dst[y * dstride + x + c] = (s0[c] + s0[c + 4] + s1[c] + s1[c + 4] + 2) / 4;
+      }
+   }
+
+   cairo_surface_mark_dirty(img);
+}
+
+
 /*! Return the memory address of a Pixel.
  *  @param x X position.
  *  @param y Y position.
@@ -690,6 +904,8 @@ int act_draw_ini(smrule_t *r)
         d->border.cs.col, d->border.width, d->border.style, d->border.used, d->border.dashlen, d->border.dash[0], d->border.dash[1],
         d->directional, d->collect_open, d->wl, d->img.ctx);
 
+   sm_unordered(r);
+   sm_tags_ro(r);
    return 0;
 }
 
@@ -1324,6 +1540,7 @@ int act_cap_ini(smrule_t *r)
    }
 
    cap.hide = get_param_bool("hide", r->act);
+   cap.overlap = parse_overlap(r->act);
 
    // parameters for filling of background rectangle
    if ((s = get_param("fillcolor", NULL, r->act)) != NULL)
@@ -1376,8 +1593,15 @@ int act_cap_ini(smrule_t *r)
    memcpy(r->data, &cap, sizeof(cap));
 
    // FIXME: auto angle is not thread-safe yet
-   if (!isnan(cap.angle))
+   // placement of non-overlapping captions depends on the order
+   if (!isnan(cap.angle) && cap.overlap == OVERLAP_ALLOW)
       sm_threaded(r);
+   // auto-rotation depends on the output of previous rules, fontboxes create new objects
+   if (!isnan(cap.angle) && !cap.fontbox && cap.overlap == OVERLAP_ALLOW)
+   {
+      sm_unordered(r);
+      sm_tags_ro(r);
+   }
 
    return 0;
 }
@@ -1508,7 +1732,10 @@ static void pos_offset(int pos, double width, double height, double xoff, double
 }
 
 
-static cairo_surface_t *cairo_smr_cut_out(cairo_surface_t *bg, double x, double y, double r)
+/*! Render the square area of size r around x/y of the display list bg into
+ * a new image surface.
+ */
+static cairo_surface_t *cairo_smr_cut_out(const dlist_t *bg, double x, double y, double r)
 {
    cairo_surface_t *sfc;
    cairo_t *ctx;
@@ -1523,10 +1750,8 @@ static cairo_surface_t *cairo_smr_cut_out(cairo_surface_t *bg, double x, double
 
    ctx = cairo_create(sfc);
    cairo_scale(ctx, PT2PX_SCALE, PT2PX_SCALE);
-   x = -x + r / 2;
-   y = -y + r / 2;
-   cairo_set_source_surface(ctx, bg, x, y);
-   cairo_paint(ctx);
+   cairo_translate(ctx, -x + r / 2, -y + r / 2);
+   dl_replay(bg, ctx);
    cairo_destroy(ctx);
 
    return sfc;
@@ -1558,106 +1783,6 @@ static cairo_surface_t *cairo_smr_plane(int w, int h, int x, int col)
 }
 
 
-static uint32_t cairo_smr_double_to_gray(double a)
-{
-   int c;
-
-   if (a > 1.0) a = 1;
-   if (a < 0.0) a = 0.0;
-
-   c = round(a * 255.0);
-   return c | c << 8 | c << 16 | 0xff000000;
-}
-
-
-#ifdef COL_STRETCH_BW
-static void rot_y(cartesian_t *c, double a)
-{
-   double x =  c->x * cos(a) + c->z * sin(a);
-   double z = -c->x * sin(a) + c->z * cos(a);
-   c->x = x;
-   c->z = z;
-}
-
-
-static void rot_z(cartesian_t *c, double a)
-{
-   double x =  c->x * cos(a) - c->y * sin(a);
-   double y =  c->x * sin(a) + c->y * cos(a);
-   c->x = x;
-   c->y = y;
-}
-
-
-static uint32_t cairo_smr_rgb_to_color(double r, double g, double b)
-{
-   return COL_RED(r) | COL_GREEN(g) | COL_BLUE(b);
-}
-
-
-static void cairo_smr_color_bw_stretch(double f, uint32_t *col)
-{
-   cartesian_t c;
-
-   c.x = REDD(*col);
-   c.y = GREEND(*col);
-   c.z = BLUED(*col);
-
-	// rotate color space that bw components are along z-axis
-   rot_z(&c, -M_PI_4);
-   rot_y(&c, -acos(1 / sqrt(3)));
-
-	// scale x/y components
-   c.x /= f;
-   c.y /= f;
-
-	// rotate back into RGB color space
-   rot_y(&c,  acos(1 / sqrt(3)));
-   rot_z(&c,  M_PI_4);
-
-   *col = (*col & 0xff000000) | cairo_smr_rgb_to_color(c.x, c.y, c.z);
-}
-#endif
-
-
-#ifdef COL_DIFF_LUM
-static double cairo_smr_rgb_luminosity(double r, double g, double b)
-{
-   // Luminosity (CIE XYZ formula)
-   return 0.2125 * r + 0.7154 * g + 0.0721 * b;
-}
-
-
-static double cairo_smr_color_luminosity(uint32_t col)
-{
-   return cairo_smr_rgb_luminosity(REDD(col), GREEND(col), BLUED(col));
-}
-#endif
-
-
-#ifdef COL_DIFF_BRGT
-static double cairo_smr_rgb_brightness(double r, double g, double b)
-{
-   // YIQ brightness forumlar
-   return r * 0.299 + g * 0.587 + b * 0.114;
-}
-
-
-static double cairo_smr_color_brightness(uint32_t col)
-{
-   return cairo_smr_rgb_brightness(REDD(col), GREEND(col), BLUED(col));
-}
-#endif
-
-
-#ifdef COL_DIFF_3D
-static double cairo_smr_color_dist(uint32_t c1, uint32_t c2)
-{
-   return sqrt((sqr(REDD(c1) - REDD(c2)) + sqr(GREEND(c1) - GREEND(c2)) + sqr(BLUED(c1) - BLUED(c2))) / 3.0);
-}
-#endif
-
-
 /*! This calculates the difference and its variance between two surfaces.
  * Pixels which have a transparancy of more than 20% are ignored.
  * @param dst Destination surface. This surface will receive the actual
@@ -1670,8 +1795,7 @@ static double cairo_smr_color_dist(uint32_t c1, uint32_t c2)
 static double cairo_smr_dist(cairo_surface_t *dst, cairo_surface_t *src, double *v)
 {
    unsigned char *psrc, *pdst;
-   uint32_t dst_pixel;
-   double dist, avg, var;
+   double *dist, avg, var;
    int x, y, mx, my, cnt;
 
    cairo_surface_flush(src);
@@ -1681,59 +1805,37 @@ static double cairo_smr_dist(cairo_surface_t *dst, cairo_surface_t *src, double
    my = cairo_image_surface_get_height(dst);
    pdst = cairo_image_surface_get_data(dst);
 
+   if ((dist = malloc(sizeof(*dist) * mx)) == NULL)
+   {
+      log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
+      return 0;
+   }
+
    avg = 0;
    cnt = 0;
    var = 0;
    for (y = 0; y < my; y++)
    {
+      // see http://www.w3.org/TR/AERT#color-contrast and
+      // http://www.hgrebdes.com/colour/spectrum/colourvisibility.html and
+      // http://colaargh.blogspot.co.uk/2012/08/readability-of-type-in-colour-w3c.html
+      // for visibility of colors and the background.
+      // Also read this: http://www.lighthouse.org/accessibility/design/accessible-print-design/effective-color-contrast
+      pix_diff_row((uint32_t*) pdst, (uint32_t*) psrc, dist, mx, COL_DIFF_MODE, COL_STRETCH);
+      // (partially) transparent pixels are ignored (dist < 0)
+      pix_gray_row(dist, (uint32_t*) pdst, mx, TRANSPIX);
       for (x = 0; x < mx; x++)
       {
-         // ignore (partially) transparent pixels
-         if (ALPHAD(*(((uint32_t*) pdst) + x)) > 0.2 || ALPHAD(*(((uint32_t*) psrc) + x)) > 0.2)
-         {
-#define CLEAR_TRANS_PIX
-#ifdef CLEAR_TRANS_PIX
-            *(((uint32_t*) pdst) + x) = TRANSPIX;
-#endif
+         if (dist[x] < 0)
             continue;
-         }
-
-         // see http://www.w3.org/TR/AERT#color-contrast and
-         // http://www.hgrebdes.com/colour/spectrum/colourvisibility.html and
-         // http://colaargh.blogspot.co.uk/2012/08/readability-of-type-in-colour-w3c.html
-         // for visibility of colors and the background.
-         // Also read this: http://www.lighthouse.org/accessibility/design/accessible-print-design/effective-color-contrast
-
-         uint32_t dst_col = *(((uint32_t*) pdst) + x);
-         uint32_t src_col = *(((uint32_t*) psrc) + x);
-
-#ifdef COL_STRETCH_BW
-         cairo_smr_color_bw_stretch(COL_STRETCH_F, &dst_col);
-         cairo_smr_color_bw_stretch(COL_STRETCH_F, &src_col);
-#endif
-
-#ifdef COL_DIFF_BRGT
-         dist = fabs(cairo_smr_color_brightness(dst_col) -
-                  cairo_smr_color_brightness(src_col));
-#endif
-#ifdef COL_DIFF_LUM
-         dist = fabs(cairo_smr_color_luminosity(dst_col) -
-                  cairo_smr_color_luminosity(src_col));
-#endif
-#ifdef COL_DIFF_3D
-         // calculate 3D color distance
-         dist = cairo_smr_color_dist(dst_col, src_col);
-#endif
-
-         dst_pixel = cairo_smr_double_to_gray(dist);
-         *(((uint32_t*) pdst) + x) = dst_pixel;
-         avg += dist;
-         var += sqr(dist);
+         avg += dist[x];
+         var += sqr(dist[x]);
          cnt++;
       }
       pdst += cairo_image_surface_get_stride(dst);
       psrc += cairo_image_surface_get_stride(src);
    }
+   free(dist);
    cairo_surface_mark_dirty(dst);
    if (cnt)
       avg /= cnt;
@@ -1821,46 +1923,244 @@ static void dv_weight(diffvec_t *dv, int len, double phase, double weight)
 }
 
 
-/*! 
- * @param max_angle Number of degrees to be rotated. It should be M_PI or
- * M_2PI.
+//! Compare fg to bg rotated by the angle of dv pixel by pixel.
+static void dv_sample1(cairo_t *ctx, cairo_surface_t *dst, cairo_surface_t *bg, cairo_surface_t *fg, diffvec_t *dv)
+{
+   cairo_smr_diff(ctx, bg, cairo_image_surface_get_width(dst), cairo_image_surface_get_height(dst), dv->dv_angle);
+   dv->dv_diff = cairo_smr_dist(dst, fg, &dv->dv_var);
+//#define DV_SAMPLES_TO_DISK
+#ifdef DV_SAMPLES_TO_DISK
+   char buf[256];
+   snprintf(buf, sizeof(buf), "dv_sample_%d_%d_%.1f.png", cairo_image_surface_get_width(dst), cairo_image_surface_get_height(dst), RAD2DEG(dv->dv_angle));
+   cairo_surface_write_to_png(dst, buf);
+   //log_debug("diff = %.1f, sqrt(var) = %.1f, a = %.1f", dv->dv_diff, sqrt(dv->dv_var), RAD2DEG(dv->dv_angle));
+#endif
+}
+
+
+/*! Compare fg to bg pixel by pixel at the angles of the diffvecs in dv which
+ * are given by the index list idx.
+ * @param idx List of indexes into dv, or NULL to sample all num_dv angles.
+ * @param num_dv Number of indexes in idx, or number of diffvecs in dv if idx is
+ * NULL.
  */
-static void dv_sample(cairo_surface_t *bg, cairo_surface_t *fg, diffvec_t *dv, int num_dv)
+static void dv_sample(cairo_surface_t *bg, cairo_surface_t *fg, diffvec_t *dv, const int *idx, int num_dv)
 {
    cairo_surface_t *dst;
    cairo_t *ctx;
-   double x, y, a;
    int i;
 
-   x = cairo_image_surface_get_width(fg);
-   y = cairo_image_surface_get_height(fg);
-   dst = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, x, y);
+   dst = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(fg), cairo_image_surface_get_height(fg));
    cairo_smr_log_surface_status(dst);
    ctx = cairo_create(dst);
    cairo_smr_log_status(ctx);
 
-   for (a = 0, i = 0; i < num_dv; a += M_2PI / num_dv, i++)
-   {
-      cairo_smr_diff(ctx, bg, x, y, a);
-      dv[i].dv_diff = cairo_smr_dist(dst, fg, &dv[i].dv_var);
-      dv[i].dv_angle = a;
-      dv[i].dv_x = 0;
-      dv[i].dv_y = 0;
-      dv[i].dv_index = i;
-//#define DV_SAMPLES_TO_DISK
-#ifdef DV_SAMPLES_TO_DISK
-      char buf[256];
-      snprintf(buf, sizeof(buf), "dv_sample_%d_%d_%.1f.png", (int) x, (int) y, RAD2DEG(a));
-      cairo_surface_write_to_png(dst, buf);
-      //log_debug("diff = %.1f, sqrt(var) = %.1f, a = %.1f", dv[i].dv_diff, sqrt(dv[i].dv_var), RAD2DEG(dv[i].dv_angle));
-#endif
-   }
+   for (i = 0; i < num_dv; i++)
+      dv_sample1(ctx, dst, bg, fg, &dv[idx != NULL ? idx[i] : i]);
 
    cairo_destroy(ctx);
    cairo_surface_destroy(dst);
 }
 
 
+static inline int mod(int a, int n)
+{
+   a %= n;
+   return a >= 0 ? a : a + n;
+}
+
+
+/*! Accumulate the opaque pixels of the image surface sfc into a polar
+ * histogram around its center. The histogram has FA_RBINS radial bins up to
+ * the radius rmax and num_dv angular bins, the latter correspond to the
+ * angles of the diffvecs.
+ * @param sum Array of FA_RBINS * num_dv values receiving the sum of the pixel
+ * values of each bin.
+ * @param cnt Array of FA_RBINS * num_dv values receiving the number of pixels.
+ * @return On success 0 is returned, -1 on error.
+ */
+static int polar_hist(cairo_surface_t *sfc, double rmax, int num_dv, double *sum, int *cnt)
+{
+   unsigned char *data;
+   double cx, cy, u, v, rho, *val;
+   int x, y, w, h, stride, b;
+
+   memset(sum, 0, sizeof(*sum) * FA_RBINS * num_dv);
+   memset(cnt, 0, sizeof(*cnt) * FA_RBINS * num_dv);
+
+   cairo_surface_flush(sfc);
+   data = cairo_image_surface_get_data(sfc);
+   stride = cairo_image_surface_get_stride(sfc);
+   w = cairo_image_surface_get_width(sfc);
+   h = cairo_image_surface_get_height(sfc);
+   cx = w / 2.0;
+   cy = h / 2.0;
+
+   if ((val = malloc(sizeof(*val) * w)) == NULL)
+   {
+      log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
+      return -1;
+   }
+
+   for (y = 0; y < h; y++)
+   {
+      pix_value_row((uint32_t*) (data + y * stride), val, w, COL_DIFF_MODE, COL_STRETCH);
+      for (x = 0; x < w; x++)
+      {
+         // ignore (partially) transparent pixels
+         if (val[x] < 0)
+            continue;
+         u = x + 0.5 - cx;
+         v = y + 0.5 - cy;
+         if ((rho = hypot(u, v)) >= rmax)
+            continue;
+         b = (int) (rho / rmax * FA_RBINS) * num_dv + mod(floor(fmod2(atan2(v, u), M_2PI) / M_2PI * num_dv), num_dv);
+         sum[b] += val[x];
+         cnt[b]++;
+      }
+   }
+
+   free(val);
+   return 0;
+}
+
+
+/*! Estimate the difference between fg and bg rotated by each angle of dv by
+ * comparing the polar histograms of both surfaces. Each surface is sampled
+ * just once, thus this is much faster than dv_sample() but it compares the
+ * mean values of the bins instead of single pixels.
+ * @return On success 0 is returned, -1 on error.
+ */
+static int dv_estimate(cairo_surface_t *bg, cairo_surface_t *fg, diffvec_t *dv, int num_dv)
+{
+   double *fsum, *bsum, rmax, d, n;
+   int *fcnt, *bcnt, i, k, r, t, bf, bb;
+
+   fsum = malloc(sizeof(*fsum) * FA_RBINS * num_dv * 2);
+   fcnt = malloc(sizeof(*fcnt) * FA_RBINS * num_dv * 2);
+   if (fsum == NULL || fcnt == NULL)
+   {
+      log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
+      free(fsum);
+      free(fcnt);
+      return -1;
+   }
+   bsum = fsum + FA_RBINS * num_dv;
+   bcnt = fcnt + FA_RBINS * num_dv;
+
+   rmax = fmin(cairo_image_surface_get_width(bg), cairo_image_surface_get_height(bg)) / 2.0;
+   if (polar_hist(fg, rmax, num_dv, fsum, fcnt) || polar_hist(bg, rmax, num_dv, bsum, bcnt))
+   {
+      free(fsum);
+      free(fcnt);
+      return -1;
+   }
+
+   for (i = 0; i < FA_RBINS * num_dv; i++)
+   {
+      if (fcnt[i])
+         fsum[i] /= fcnt[i];
+      if (bcnt[i])
+         bsum[i] /= bcnt[i];
+   }
+
+   // the pixel of fg at polar angle t is compared to the pixel of bg at t - k
+   for (k = 0; k < num_dv; k++)
+   {
+      for (r = 0, d = n = 0; r < FA_RBINS; r++)
+         for (t = 0; t < num_dv; t++)
+         {
+            bf = r * num_dv + t;
+            bb = r * num_dv + mod(t - k, num_dv);
+            if (!fcnt[bf] || !bcnt[bb])
+               continue;
+            d += fcnt[bf] * fabs(fsum[bf] - bsum[bb]);
+            n += fcnt[bf];
+         }
+      dv[k].dv_diff = n > 0 ? d / n : 0;
+      dv[k].dv_var = 0;
+   }
+
+   free(fsum);
+   free(fcnt);
+   return 0;
+}
+
+
+/*! Return the indexes of the cnt angles with the greatest weighted estimated
+ * difference in idx.
+ * @return Returns the number of indexes in idx.
+ */
+static int dv_candidates(const diffvec_t *dv, int num_dv, const struct auto_rot *rot, int *idx, int cnt)
+{
+   diffvec_t *wdv;
+   int i, j, n;
+
+   if ((wdv = malloc(sizeof(*wdv) * num_dv)) == NULL)
+   {
+      log_msg(LOG_ERR, "malloc() failed: %s", strerror(errno));
+      return 0;
+   }
+   memcpy(wdv, dv, sizeof(*wdv) * num_dv);
+   dv_weight(wdv, num_dv, DEG2RAD(rot->phase), rot->weight);
+
+   // insertion into sorted list of the best cnt angles
+   for (i = 0, n = 0; i < num_dv; i++)
+   {
+      for (j = n; j > 0 && wdv[idx[j - 1]].dv_diff < wdv[i].dv_diff; j--)
+         if (j < cnt)
+            idx[j] = idx[j - 1];
+      if (j < cnt)
+      {
+         idx[j] = i;
+         if (n < cnt)
+            n++;
+      }
+   }
+
+   free(wdv);
+   return n;
+}
+
+
+/*! Sample the differences between fg and bg at all angles. The differences
+ * are estimated with dv_estimate() and the FA_CANDIDATES best angles are
+ * compared pixel by pixel. The estimates of the remaining angles are scaled
+ * to the exact values.
+ */
+static void dv_sample_fast(cairo_surface_t *bg, cairo_surface_t *fg, diffvec_t *dv, int num_dv, const struct auto_rot *rot)
+{
+   double est[FA_CANDIDATES], se, sx;
+   int idx[FA_CANDIDATES], i, n;
+
+   if (num_dv <= FA_CANDIDATES || dv_estimate(bg, fg, dv, num_dv) == -1 ||
+         !(n = dv_candidates(dv, num_dv, rot, idx, FA_CANDIDATES)))
+   {
+      dv_sample(bg, fg, dv, NULL, num_dv);
+      return;
+   }
+
+   for (i = 0; i < n; i++)
+      est[i] = dv[idx[i]].dv_diff;
+   dv_sample(bg, fg, dv, idx, n);
+
+   for (i = 0, se = sx = 0; i < n; i++)
+   {
+      se += est[i];
+      sx += dv[idx[i]].dv_diff;
+      // mark as exact
+      dv[idx[i]].dv_var = -1;
+   }
+   for (i = 0; se > 0 && i < num_dv; i++)
+   {
+      if (dv[i].dv_var == -1)
+         dv[i].dv_var = 0;
+      else
+         dv[i].dv_diff = fmin(dv[i].dv_diff * sx / se, 1.0);
+   }
+}
+
+
 /*! This function stretches the dv_diff values to the range 0.0 to 1.0.
  * @param dv Pointer to list of diffvec_ts.
  * @param num_dv Number of diffvec_ts in dv.
@@ -1890,13 +2190,6 @@ static void dv_quantize(diffvec_t *dv, int num_dv)
 }
 
 
-static inline int mod(int a, int n)
-{
-   a %= n;
-   return a >= 0 ? a : a + n;
-}
-
-
 static int dp_get(const diffvec_t *dv, int num_dv, diffpeak_t **rp)
 {
    int i, peak, cnt = 0, last;
@@ -1956,7 +2249,7 @@ static int dp_get(const diffvec_t *dv, int num_dv, diffpeak_t **rp)
 }
 
 
-static double find_angle(const struct coord *c, const struct auto_rot *rot, cairo_surface_t *fg, cairo_surface_t *bg)
+static double find_angle(const struct coord *c, const struct auto_rot *rot, cairo_surface_t *fg, const dlist_t *bg)
 {
    diffvec_t *dv;
    cairo_surface_t *sfc;
@@ -1991,7 +2284,18 @@ static double find_angle(const struct coord *c, const struct auto_rot *rot, cair
       return 0;
    }
 
-   dv_sample(sfc, fg, dv, num_steps);
+   for (i = 0; i < num_steps; i++)
+   {
+      dv[i].dv_angle = i * M_2PI / num_steps;
+      dv[i].dv_x = 0;
+      dv[i].dv_y = 0;
+      dv[i].dv_index = i;
+   }
+   // all angles are sampled exactly if they are output for debugging
+   if (rot->mkarea)
+      dv_sample(sfc, fg, dv, NULL, num_steps);
+   else
+      dv_sample_fast(sfc, fg, dv, num_steps, rot);
    cairo_surface_destroy(sfc);
 
    dv_weight(dv, num_steps, DEG2RAD(rot->phase), rot->weight);
@@ -2176,6 +2480,64 @@ static int cap_geo_rect(const struct actCaption *cap, double x, double y, double
 }
 
 
+/*! Calculate the corners of the rectangle x/y/w/h of the user space of ctx in
+ * page coordinates.
+ */
+static void cairo_smr_label_box(cairo_t *ctx, double x, double y, double w, double h, label_box_t *lb)
+{
+   lb->x[0] = lb->x[3] = x;
+   lb->x[1] = lb->x[2] = x + w;
+   lb->y[0] = lb->y[1] = y;
+   lb->y[2] = lb->y[3] = y + h;
+   for (int i = 0; i < 4; i++)
+      cairo_user_to_device(ctx, &lb->x[i], &lb->y[i]);
+}
+
+
+/*! Find a position for a caption in respect to the labels which were placed
+ * before and add it to the placement index (see smlabel.c). If cap->overlap
+ * is OVERLAP_SHIFT, all other positions around the origin are tried if the
+ * caption overlaps at its position pos.
+ * @param cap Pointer to the caption structure. The transformation of its
+ * context has to be set to the origin and angle of the caption.
+ * @param pos Pointer to the position, it is updated if the caption was moved.
+ * @param w Width of the text.
+ * @param h Height of the text.
+ * @param desc The descent of the font.
+ * @return Returns 1 if the caption shall be placed, otherwise 0.
+ */
+static int cap_place(const struct actCaption *cap, short *pos, double w, double h, double desc)
+{
+   static const short alt[] = {POS_E, POS_W, POS_N, POS_S, POS_NE, POS_NW, POS_SE, POS_SW, POS_C};
+   label_box_t lb;
+   double x, y;
+   int i, n, p;
+
+   if (cap->hide)
+      return 1;
+
+   n = cap->overlap == OVERLAP_SHIFT ? (int) (sizeof(alt) / sizeof(*alt)) + 1 : 1;
+   for (i = 0; i < n; i++)
+   {
+      p = i ? alt[i - 1] : *pos;
+      if (i && p == (*pos & POS_DIR_MSK))
+         continue;
+
+      pos_offset(p, w, h, cap->xoff, cap->yoff, &x, &y);
+      cairo_smr_label_box(cap->ctx, x, y + desc, w, -h, &lb);
+      if (label_place(&lb, cap->overlap == OVERLAP_ALLOW ? LABEL_ADD : LABEL_TEST))
+      {
+         if (i)
+            *pos = (*pos & ~POS_DIR_MSK) | p;
+         return 1;
+      }
+   }
+
+   log_debug("caption overlaps, not placed");
+   return 0;
+}
+
+
 /*! This function physically draws the background box of a text. The box will be scaled by BGBOX_SCALE.
  * @param cap Pointer to the caption structure.
  * @param x X position of box, which is typically the same as from the text itself.
@@ -2278,7 +2640,7 @@ static int cap_coord(const struct actCaption *cap, const struct coord *c, const
             return -1;
       }
 
-      a = find_angle(c, &cap->rot, pat, cap->auto_sfc);
+      a = find_angle(c, &cap->rot, pat, cap->auto_dl);
 
       // flip text if necessary
       if (a > M_PI_2 && a < 3 * M_PI_2)
@@ -2363,6 +2725,15 @@ static int cap_coord(const struct actCaption *cap, const struct coord *c, const
    cairo_rotate(cap->ctx, a);
    double hgt = fmax(tx.height, fe.ascent + fe.descent);
    double x0 = x, y0 = y;
+   if (!cap_place(cap, &pos, tx.width + tx.x_bearing, hgt, fe.descent))
+   {
+#ifdef AUTOSFC
+      if (isnan(cap->angle))
+         cairo_restore(cap->auto_ctx);
+#endif
+      cairo_restore(cap->ctx);
+      return 0;
+   }
    pos_offset(pos, tx.width + tx.x_bearing, hgt, cap->xoff, cap->yoff, &x, &y);
    if (cap->fill.used)
    {
@@ -2377,7 +2748,7 @@ static int cap_coord(const struct actCaption *cap, const struct coord *c, const
    {
       cairo_rotate(cap->auto_ctx, a);
       cairo_rectangle(cap->auto_ctx, x, y, tx.width + tx.x_bearing + cap->xoff, -fe.ascent);
-      cairo_fill(cap->auto_ctx);
+      (void) dl_add_fill(cap->auto_dl, cap->auto_ctx);
       cairo_restore(cap->auto_ctx);
    }
 #endif
@@ -2452,10 +2823,13 @@ int act_cap_main(smrule_t *r, osm_obj_t *o)
 
 #ifdef AUTOSFC
    // create temporary background surface at first call to cap_main()
-   if (isnan(cap->angle) && (cap->auto_sfc == NULL))
+   // the boxes of the captions are added to the display list, the context is
+   // used only to construct their paths
+   if (isnan(cap->angle) && (cap->auto_dl == NULL))
    {
-      cap->auto_sfc = cairo_smr_recording_surface_from_bg();
-      cap->auto_ctx = cairo_create(cap->auto_sfc);
+      if ((cap->auto_dl = dl_new(&ext_, dl_)) == NULL)
+         return -1;
+      cap->auto_ctx = cairo_create(sfc_);
       cairo_smr_set_source_color(cap->auto_ctx, color_by_cs(o, &cap->cs));
    }
 #endif
@@ -2494,11 +2868,7 @@ int act_cap_fini(smrule_t *r)
 #ifdef AUTOSFC
    if (cap->auto_ctx != NULL)
       cairo_destroy(cap->auto_ctx);
-   if (cap->auto_sfc != NULL)
-   {
-      //cairo_surface_write_to_png(cap->auto_sfc, "autosfcbg.png");
-      cairo_surface_destroy(cap->auto_sfc);
-   }
+   dl_free(cap->auto_dl);
 #endif
 
    free(cap->klist.key);
@@ -2726,6 +3096,7 @@ int act_img_ini(smrule_t *r)
 
    if ((e = img_ini(r, &img)) != 0)
       return e;
+   img.overlap = parse_overlap(r->act);
 
    if ((r->data = malloc(sizeof(img))) == NULL)
    {
@@ -2735,6 +3106,14 @@ int act_img_ini(smrule_t *r)
 
    memcpy(r->data, &img, sizeof(img));
 
+   // auto-rotation depends on the output of previous rules, so does the
+   // placement of non-overlapping images
+   if (!isnan(img.angle) && img.overlap == OVERLAP_ALLOW)
+   {
+      sm_unordered(r);
+      sm_tags_ro(r);
+   }
+
    return 0;
 }
 
@@ -2755,6 +3134,7 @@ int img_place(const struct actImage *img, const osm_node_t *n)
 {
    double x, y, a;
    struct coord c;
+   label_box_t lb;
 
    // safety check
    if (img->img == NULL)
@@ -2787,7 +3167,7 @@ int img_place(const struct actImage *img, const osm_node_t *n)
          cairo_destroy(fgx);
       }
 
-      a = find_angle(&c, &img->rot, fg, sfc_);
+      a = find_angle(&c, &img->rot, fg, dl_);
 
       if (nimg)
          cairo_surface_destroy(fg);
@@ -2817,6 +3197,14 @@ int img_place(const struct actImage *img, const osm_node_t *n)
    }
 
    cairo_rotate(img->ctx, a);
+   // add image to placement index (see smlabel.c)
+   cairo_smr_label_box(img->ctx, img->w / -2.0, img->h / -2.0, img->w, img->h, &lb);
+   if (!label_place(&lb, img->overlap == OVERLAP_ALLOW ? LABEL_ADD : LABEL_TEST))
+   {
+      log_debug("image overlaps, not placed");
+      cairo_restore(img->ctx);
+      return 0;
+   }
    cairo_set_source_surface(img->ctx, img->img, img->w / -2.0, img->h / -2.0);
    cairo_paint(img->ctx);
    CSS_INC(CSS_PAINT);
@@ -2934,6 +3322,7 @@ int act_clip_fini(smrule_t *r)
    log_debug("%.1f, %.1f, %.1f, %.1f", bc[0], bc[1], bc[2], bc[3]);
 
    ctx = cairo_create(sfc_);
+   cairo_smr_push_group0(ctx);
 
    cairo_move_to(ctx, 0, 0);
    cairo_line_to(ctx, rdata_width(U_PT), 0);
@@ -2950,6 +3339,7 @@ int act_clip_fini(smrule_t *r)
    cairo_smr_set_source_color(ctx, parse_color("bgcolor"));
    cairo_fill(ctx);
    CSS_INC(CSS_FILL);
+   cairo_smr_pop_group0(ctx);
  
    cairo_destroy(ctx);
 
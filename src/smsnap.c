@@ -0,0 +1,690 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smsnap.c
+ * This file contains the snapshot file. In contrast to the index file (see
+ * smindex.c) a snapshot is self-contained, i.e. it does not need the original
+ * OSM data.
+ *
+ * The snapshot is an image of the objects as they are in memory. It contains
+ * the object structures, the tags, the refs of the ways, the members of the
+ * relations, a table of all (interned) tag strings, the roles, the data
+ * stats, and the sorted lists of objects which are attached to the sorted
+ * array object store (see sarray.c). All pointers are absolute addresses as if
+ * the file was mapped to the address SNAP_BASE.
+ *
+ * While reading, the file is mapped to SNAP_BASE privately (copy-on-write),
+ * thus the objects are used in place without parsing or allocating memory.
+ * Only if the kernel maps the file at a different address, the pointers are
+ * relocated once. The memory range of the snapshot is registered with
+ * add_static_mem() to make sure that it is never passed to free() or
+ * realloc().
+ *
+ * The file starts with a header (snap_hdr_t) which contains an identification
+ * string, the format version, and the sizes of the structures. It is followed
+ * by the sections (snap_sect_t), each one prepended by a variable header
+ * similar to the index file.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "smrender_dev.h"
+#include "smcore.h"
+#include "smloadosm.h"
+#include "sarray.h"
+
+#define SNAP_IDENT "SMRENDER.SNAP"
+#define SNAP_VERSION 1
+#define SNAP_FDIRTY 1
+//! byte order mark
+#define SNAP_BOM 0x01020304
+
+//! preferred address of the mapping, all pointers are relative to it
+#if UINTPTR_MAX > 0xffffffffUL
+#define SNAP_BASE ((uintptr_t) 0x3f0000000000ULL)
+#else
+#define SNAP_BASE ((uintptr_t) 0x60000000UL)
+#endif
+#define SNAP_PTR(x) ((void*) (SNAP_BASE + (x)))
+#define SNAP_ALIGN(x) (((x) + 7) & ~7L)
+
+//! section types
+enum {SNAP_ROLE, SNAP_DSTS, SNAP_ATOM, SNAP_STRS, SNAP_OBJS, SNAP_TAGS,
+   SNAP_REFS, SNAP_MEMS, SNAP_NIDX, SNAP_WIDX, SNAP_RIDX, SNAP_NSECT};
+
+
+typedef struct snap_hdr
+{
+   //! file identification string (SNAP_IDENT)
+   char type_str[16];
+   //! file format version
+   int version;
+   //! file flags (SNAP_F...)
+   int flags;
+   //! size of this header
+   int hdr_len;
+   //! byte order mark (SNAP_BOM)
+   int bom;
+   //! sizes of the data structures
+   short ptr_size, node_size, way_size, rel_size, tag_size, mem_size, ent_size, bs_size;
+   //! address to which the pointers are relative
+   uint64_t base;
+   //! total size of the file
+   uint64_t size;
+} snap_hdr_t;
+
+typedef struct snap_sect
+{
+   //! type field of section
+   union
+   {
+      char type_str[4];
+      int type;
+   };
+   //! flags (no flags yet defined)
+   int flags;
+   //! length of data in section (excluding this header)
+   long len;
+} snap_sect_t;
+
+//! state of snapshot writer
+typedef struct snapw
+{
+   //! memory mapped output file
+   char *map;
+   //! offset of the data of each section
+   long off[SNAP_NSECT];
+   //! length of the data of each section
+   long len[SNAP_NSECT];
+   //! current position within the sections
+   long pos[SNAP_NSECT];
+} snapw_t;
+
+
+static const char *sect_type_[SNAP_NSECT] = {"ROLE", "DSTS", "ATOM", "STRS",
+   "OBJS", "TAGS", "REFS", "MEMS", "NIDX", "WIDX", "RIDX"};
+//! memory mapped snapshot
+static void *snap_map_ = NULL;
+static size_t snap_size_ = 0;
+
+
+static void snap_init_header(snap_hdr_t *sh, int flags)
+{
+   memset(sh, 0, sizeof(*sh));
+   strcpy(sh->type_str, SNAP_IDENT);
+   sh->version = SNAP_VERSION;
+   sh->flags = flags;
+   sh->hdr_len = sizeof(*sh);
+   sh->bom = SNAP_BOM;
+   sh->ptr_size = sizeof(void*);
+   sh->node_size = sizeof(osm_node_t);
+   sh->way_size = sizeof(osm_way_t);
+   sh->rel_size = sizeof(osm_rel_t);
+   sh->tag_size = sizeof(struct otag);
+   sh->mem_size = sizeof(struct rmember);
+   sh->ent_size = sizeof(sa_ent_t);
+   sh->bs_size = sizeof(bstring_t);
+   sh->base = SNAP_BASE;
+}
+
+
+/*! Tree function which counts the sizes of the sections of all objects. The
+ * tags are interned if not done yet.
+ */
+static int snap_count(osm_obj_t *o, snapw_t *sw)
+{
+   if (intern_tags(o, NULL))
+      return -1;
+
+   sw->len[SNAP_OBJS] += SIZEOF_OSM_OBJ(o);
+   sw->len[SNAP_TAGS] += sizeof(struct otag) * o->tag_cnt;
+   sw->len[SNAP_NIDX + o->type - 1] += sizeof(sa_ent_t);
+   if (o->type == OSM_WAY)
+      sw->len[SNAP_REFS] += sizeof(int64_t) * ((osm_way_t*) o)->ref_cnt;
+   else if (o->type == OSM_REL)
+      sw->len[SNAP_MEMS] += sizeof(struct rmember) * ((osm_rel_t*) o)->mem_cnt;
+   return 0;
+}
+
+
+/*! Set the bstring b to the corresponding string of the string table.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int snap_str(const snapw_t *sw, bstring_t *b)
+{
+   const bstring_t *atom = (bstring_t*) (sw->map + sw->off[SNAP_ATOM]);
+   int a;
+
+   if (!(a = bs_atom(b)))
+   {
+      if (b->buf != NULL)
+      {
+         log_msg(LOG_ERR, "tag string '%.*s' is not interned", b->len, b->buf);
+         return -1;
+      }
+      b->atom = 0;
+      return 0;
+   }
+
+   b->buf = atom[a].buf;
+   b->atom = a;
+   return 0;
+}
+
+
+//! Reserve len bytes of section s and return the pointer to it.
+static void *snap_next(snapw_t *sw, int s, long len)
+{
+   void *p = sw->map + sw->off[s] + sw->pos[s];
+
+   sw->pos[s] += len;
+   return p;
+}
+
+
+//! Tree function which writes object o to the snapshot.
+static int snap_write_obj(osm_obj_t *o, snapw_t *sw)
+{
+   osm_storage_t *os;
+   struct otag *ot;
+   sa_ent_t *ent;
+   int i;
+
+   ent = snap_next(sw, SNAP_NIDX + o->type - 1, sizeof(*ent));
+   ent->id = o->id;
+   ent->p = SNAP_PTR(sw->off[SNAP_OBJS] + sw->pos[SNAP_OBJS]);
+
+   os = snap_next(sw, SNAP_OBJS, SIZEOF_OSM_OBJ(o));
+   memcpy(os, o, SIZEOF_OSM_OBJ(o));
+
+   os->o.otag = o->tag_cnt ? SNAP_PTR(sw->off[SNAP_TAGS] + sw->pos[SNAP_TAGS]) : NULL;
+   ot = snap_next(sw, SNAP_TAGS, sizeof(*ot) * o->tag_cnt);
+   for (i = 0; i < o->tag_cnt; i++)
+   {
+      ot[i] = o->otag[i];
+      if (snap_str(sw, &ot[i].k) || snap_str(sw, &ot[i].v))
+         return -1;
+   }
+
+   if (o->type == OSM_WAY)
+   {
+      os->w.ref = os->w.ref_cnt ? SNAP_PTR(sw->off[SNAP_REFS] + sw->pos[SNAP_REFS]) : NULL;
+      memcpy(snap_next(sw, SNAP_REFS, sizeof(int64_t) * os->w.ref_cnt), ((osm_way_t*) o)->ref, sizeof(int64_t) * os->w.ref_cnt);
+   }
+   else if (o->type == OSM_REL)
+   {
+      os->r.mem = os->r.mem_cnt ? SNAP_PTR(sw->off[SNAP_MEMS] + sw->pos[SNAP_MEMS]) : NULL;
+      memcpy(snap_next(sw, SNAP_MEMS, sizeof(struct rmember) * os->r.mem_cnt), ((osm_rel_t*) o)->mem, sizeof(struct rmember) * os->r.mem_cnt);
+   }
+
+   return 0;
+}
+
+
+//! Write the roles in the same format as the index file.
+static void snap_write_roles(snapw_t *sw)
+{
+   const char *s;
+   short len;
+
+   for (int i = ROLE_FIRST_FREE_NUM; strcmp(s = role_str(i), "n/a"); i++)
+   {
+      len = strlen(s) + 1;
+      if (sw->map != NULL)
+      {
+         memcpy(snap_next(sw, SNAP_ROLE, sizeof(len)), &len, sizeof(len));
+         memcpy(snap_next(sw, SNAP_ROLE, len), s, len);
+      }
+      else
+         sw->len[SNAP_ROLE] += sizeof(len) + len;
+   }
+}
+
+
+//! Write the string table.
+static void snap_write_strs(snapw_t *sw, const bstring_t *tbl, int cnt)
+{
+   bstring_t *atom;
+
+   atom = snap_next(sw, SNAP_ATOM, sizeof(*atom) * cnt);
+   memset(atom, 0, sizeof(*atom));
+   for (int i = 1; i < cnt; i++)
+   {
+      atom[i].len = tbl[i].len;
+      atom[i].atom = i;
+      atom[i].buf = SNAP_PTR(sw->off[SNAP_STRS] + sw->pos[SNAP_STRS]);
+      memcpy(snap_next(sw, SNAP_STRS, tbl[i].len + 1), tbl[i].buf, tbl[i].len);
+   }
+}
+
+
+/*! Write a snapshot of all objects of the tree to the file fname. This also
+ * interns all tags which are not interned yet.
+ * @param fname Name of snapshot file.
+ * @param tree Pointer to object tree.
+ * @param ds Pointer to data stats.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int snap_write(const char *fname, bx_node_t *tree, const struct dstats *ds)
+{
+   const bstring_t *tbl;
+   snap_sect_t *sect;
+   snap_hdr_t *sh;
+   struct dstats *dsts;
+   snapw_t sw;
+   size_t size;
+   int i, fd, cnt, e = -1;
+
+   if (fname == NULL || tree == NULL)
+   {
+      log_msg(LOG_CRIT, "null pointer caught");
+      return -1;
+   }
+
+   // calculate size of sections
+   memset(&sw, 0, sizeof(sw));
+   for (i = IDX_NODE; i <= IDX_REL; i++)
+      if (traverse(tree, 0, i, (tree_func_t) snap_count, &sw))
+         return -1;
+
+   tbl = intern_table(&cnt);
+   for (i = 1; i < cnt; i++)
+      sw.len[SNAP_STRS] += tbl[i].len + 1;
+   sw.len[SNAP_ATOM] = sizeof(*tbl) * cnt;
+   sw.len[SNAP_DSTS] = sizeof(*ds);
+   snap_write_roles(&sw);
+
+   size = sizeof(*sh);
+   for (i = 0; i < SNAP_NSECT; i++)
+   {
+      sw.off[i] = size + sizeof(*sect);
+      size = SNAP_ALIGN(sw.off[i] + sw.len[i]);
+   }
+
+   log_msg(LOG_NOTICE, "creating snapshot file \"%s\" (%ld kb)", fname, (long) size / 1024);
+   if ((fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+   {
+      log_errno(LOG_ERR, "could not create snapshot file");
+      return -1;
+   }
+
+   if (ftruncate(fd, size) == -1)
+   {
+      log_errno(LOG_ERR, "ftruncate() failed");
+      goto sw_err;
+   }
+
+   if ((sw.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+   {
+      log_errno(LOG_ERR, "mmap() failed");
+      goto sw_err;
+   }
+
+   sh = (snap_hdr_t*) sw.map;
+   snap_init_header(sh, SNAP_FDIRTY);
+   sh->size = size;
+   for (i = 0; i < SNAP_NSECT; i++)
+   {
+      sect = (snap_sect_t*) (sw.map + sw.off[i] - sizeof(*sect));
+      memcpy(sect->type_str, sect_type_[i], sizeof(sect->type_str));
+      sect->len = SNAP_ALIGN(sw.len[i]);
+   }
+
+   snap_write_roles(&sw);
+   dsts = snap_next(&sw, SNAP_DSTS, sizeof(*dsts));
+   *dsts = *ds;
+   dsts->lo_addr = dsts->hi_addr = NULL;
+   snap_write_strs(&sw, tbl, cnt);
+
+   log_debug("writing objects...");
+   for (i = IDX_NODE; i <= IDX_REL; i++)
+      if (traverse(tree, 0, i, (tree_func_t) snap_write_obj, &sw))
+         goto sw_err2;
+
+   if (msync(sw.map, size, MS_SYNC) == -1)
+   {
+      log_errno(LOG_ERR, "msync() failed");
+      goto sw_err2;
+   }
+   sh->flags = 0;
+   e = 0;
+
+sw_err2:
+   munmap(sw.map, size);
+
+sw_err:
+   close(fd);
+   if (e)
+      (void) unlink(fname);
+   return e;
+}
+
+
+/*! Check if the file fd is a snapshot file.
+ * @return Returns 1 if it is a snapshot, otherwise 0.
+ */
+int snap_detect(int fd)
+{
+   snap_hdr_t sh;
+
+   if (pread(fd, &sh, sizeof(sh), 0) != sizeof(sh))
+      return 0;
+   return !memcmp(sh.type_str, SNAP_IDENT, strlen(SNAP_IDENT) + 1);
+}
+
+
+/*! Check the header of the snapshot.
+ * @return Returns 0 if the snapshot is usable, otherwise -1.
+ */
+static int snap_check_header(const snap_hdr_t *sh, size_t size)
+{
+   snap_hdr_t ref;
+
+   snap_init_header(&ref, 0);
+   if (memcmp(sh->type_str, SNAP_IDENT, strlen(SNAP_IDENT) + 1))
+   {
+      log_msg(LOG_ERR, "file identification does not match");
+      return -1;
+   }
+   if (sh->version != SNAP_VERSION)
+   {
+      log_msg(LOG_ERR, "incorrect snapshot version: %d", sh->version);
+      return -1;
+   }
+   if (sh->flags & SNAP_FDIRTY)
+   {
+      log_msg(LOG_ERR, "snapshot is flagged as dirty");
+      return -1;
+   }
+   if (sh->size != size)
+   {
+      log_msg(LOG_ERR, "snapshot truncated: %"PRIu64" != %ld", sh->size, (long) size);
+      return -1;
+   }
+   // compare byte order and sizes of all structures
+   if (memcmp(&sh->hdr_len, &ref.hdr_len, (char*) &ref.base - (char*) &ref.hdr_len))
+   {
+      log_msg(LOG_ERR, "snapshot was created on an incompatible platform");
+      return -1;
+   }
+   return 0;
+}
+
+
+//! Return the pointer p relocated by d bytes.
+static void *snap_reloc(void *p, intptr_t d)
+{
+   return p == NULL ? NULL : (char*) p + d;
+}
+
+
+/*! Relocate all pointers of the snapshot by d bytes.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int snap_relocate(char **sect, const long *len, intptr_t d)
+{
+   bstring_t *atom = (bstring_t*) sect[SNAP_ATOM];
+   struct otag *ot = (struct otag*) sect[SNAP_TAGS];
+   sa_ent_t *ent;
+   osm_obj_t *o;
+   long i;
+   int j;
+
+   for (i = 0; i < len[SNAP_ATOM] / (long) sizeof(*atom); i++)
+      atom[i].buf = snap_reloc(atom[i].buf, d);
+
+   for (i = 0; i < len[SNAP_TAGS] / (long) sizeof(*ot); i++)
+   {
+      ot[i].k.buf = snap_reloc(ot[i].k.buf, d);
+      ot[i].v.buf = snap_reloc(ot[i].v.buf, d);
+   }
+
+   for (i = 0; i < len[SNAP_OBJS]; i += SIZEOF_OSM_OBJ(o))
+   {
+      o = (osm_obj_t*) (sect[SNAP_OBJS] + i);
+      if (!SIZEOF_OSM_OBJ(o))
+      {
+         log_msg(LOG_ERR, "snapshot corrupt, illegal object type %d", o->type);
+         return -1;
+      }
+      o->otag = snap_reloc(o->otag, d);
+      if (o->type == OSM_WAY)
+         ((osm_way_t*) o)->ref = snap_reloc(((osm_way_t*) o)->ref, d);
+      else if (o->type == OSM_REL)
+         ((osm_rel_t*) o)->mem = snap_reloc(((osm_rel_t*) o)->mem, d);
+   }
+
+   for (j = SNAP_NIDX; j <= SNAP_RIDX; j++)
+      for (i = 0, ent = (sa_ent_t*) sect[j]; i < len[j] / (long) sizeof(*ent); i++)
+         ent[i].p = snap_reloc(ent[i].p, d);
+
+   return 0;
+}
+
+
+/*! Read the roles. The role numbers of the members are renumbered if the
+ * roles get different numbers, e.g. because the rules contain other roles.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int snap_read_roles(const char *base, long len, struct rmember *mem, long mem_cnt)
+{
+   short map[SHRT_MAX], rlen;
+   bstring_t b;
+   int i, n, renum = 0;
+
+   for (n = ROLE_FIRST_FREE_NUM; len >= (long) sizeof(rlen); n++)
+   {
+      memcpy(&rlen, base, sizeof(rlen));
+      base += sizeof(rlen);
+      len -= sizeof(rlen);
+      // end of list (padding)
+      if (!rlen)
+         break;
+      if (rlen < 0 || rlen > len || base[rlen - 1] != '\0' || n >= SHRT_MAX)
+         return -1;
+      b.buf = (char*) base;
+      b.len = rlen - 1;
+      map[n] = strrole(&b);
+      renum |= map[n] != n;
+      base += rlen;
+      len -= rlen;
+   }
+
+   if (!renum)
+      return 0;
+
+   log_msg(LOG_INFO, "renumbering roles of relation members");
+   for (; mem_cnt; mem_cnt--, mem++)
+      if (mem->role >= ROLE_FIRST_FREE_NUM)
+      {
+         if ((i = mem->role) >= n)
+            return -1;
+         mem->role = map[i];
+      }
+
+   return 0;
+}
+
+
+/*! Read a snapshot file. The file is mapped to memory and the objects are
+ * used in place. If *tree is empty a sorted array store is created to which
+ * the object lists of the snapshot are attached. Otherwise the objects are
+ * inserted into the tree.
+ * @param fd File descriptor of open snapshot file.
+ * @param tree Pointer to object tree.
+ * @param ds Pointer to dstats which receives the data stats.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int read_snap_file(int fd, bx_node_t **tree, struct dstats *ds)
+{
+   char *sect[SNAP_NSECT], *map;
+   long len[SNAP_NSECT], off, i;
+   snap_hdr_t sh;
+   snap_sect_t *vh;
+   struct stat st;
+   sa_ent_t *ent;
+   int j, flags = MAP_PRIVATE | MAP_NORESERVE;
+
+   if (fstat(fd, &st) == -1)
+   {
+      log_errno(LOG_ERR, "fstat() failed");
+      return -1;
+   }
+
+   if (pread(fd, &sh, sizeof(sh), 0) != sizeof(sh))
+   {
+      log_msg(LOG_ERR, "snapshot file too small: %ld", (long) st.st_size);
+      return -1;
+   }
+   if (snap_check_header(&sh, st.st_size))
+      return -1;
+
+#ifdef MAP_FIXED_NOREPLACE
+   flags |= MAP_FIXED_NOREPLACE;
+#endif
+   // map to base address to avoid relocation, fall back to any address
+   if ((map = mmap((void*) (uintptr_t) sh.base, st.st_size, PROT_READ | PROT_WRITE, flags, fd, 0)) == MAP_FAILED
+         && (map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0)) == MAP_FAILED)
+   {
+      log_errno(LOG_ERR, "mmap() failed");
+      return -1;
+   }
+   snap_map_ = map;
+   snap_size_ = st.st_size;
+
+   // find sections
+   memset(sect, 0, sizeof(sect));
+   memset(len, 0, sizeof(len));
+   for (off = sizeof(sh); off + (long) sizeof(*vh) <= st.st_size; off += sizeof(*vh) + vh->len)
+   {
+      vh = (snap_sect_t*) (map + off);
+      if (vh->len < 0 || vh->len > st.st_size - off - (long) sizeof(*vh))
+      {
+         log_msg(LOG_ERR, "snapshot corrupt, section \"%.*s\" exceeds file",
+               (int) sizeof(vh->type_str), vh->type_str);
+         goto rs_err;
+      }
+
+      for (j = 0; j < SNAP_NSECT; j++)
+         if (!memcmp(vh->type_str, sect_type_[j], sizeof(vh->type_str)))
+            break;
+      if (j >= SNAP_NSECT)
+      {
+         log_msg(LOG_INFO, "ignoring unknown section \"%.*s\"", (int) sizeof(vh->type_str), vh->type_str);
+         continue;
+      }
+      sect[j] = map + off + sizeof(*vh);
+      len[j] = vh->len;
+   }
+
+   for (j = 0; j < SNAP_NSECT; j++)
+      if (sect[j] == NULL)
+      {
+         log_msg(LOG_ERR, "snapshot corrupt, section \"%s\" missing", sect_type_[j]);
+         goto rs_err;
+      }
+
+   if (len[SNAP_DSTS] != sizeof(*ds))
+   {
+      log_msg(LOG_ERR, "snapshot corrupt, dstats size mismatch");
+      goto rs_err;
+   }
+
+   if ((uintptr_t) map != sh.base)
+   {
+      log_msg(LOG_NOTICE, "snapshot mapped to %p instead of %p, relocating", map, (void*) (uintptr_t) sh.base);
+      if (snap_relocate(sect, len, (intptr_t) map - (intptr_t) sh.base))
+         goto rs_err;
+   }
+
+   if (snap_read_roles(sect[SNAP_ROLE], len[SNAP_ROLE], (struct rmember*) sect[SNAP_MEMS], len[SNAP_MEMS] / sizeof(struct rmember)))
+   {
+      log_msg(LOG_ERR, "snapshot corrupt, illegal roles");
+      goto rs_err;
+   }
+
+   if (intern_load((bstring_t*) sect[SNAP_ATOM], len[SNAP_ATOM] / sizeof(bstring_t)))
+      goto rs_err;
+
+   if (add_static_mem(map, st.st_size))
+      goto rs_err;
+   if (*tree == NULL && sa_new_store(tree))
+      goto rs_err;
+
+   for (j = SNAP_NIDX; j <= SNAP_RIDX; j++)
+   {
+      ent = (sa_ent_t*) sect[j];
+      if (sa_is_store(*tree))
+      {
+         if (sa_attach(*tree, j - SNAP_NIDX, ent, len[j] / sizeof(*ent)))
+            goto rs_err;
+      }
+      else
+      {
+         for (i = 0; i < len[j] / (long) sizeof(*ent); i++)
+            if (put_object0(tree, ent[i].id, ent[i].p, j - SNAP_NIDX))
+               goto rs_err;
+      }
+   }
+
+   memcpy(ds, sect[SNAP_DSTS], sizeof(*ds));
+   ds->lo_addr = map;
+   ds->hi_addr = map + st.st_size;
+   fin_stats(ds);
+
+   log_msg(LOG_INFO, "snapshot: %ld nodes, %ld ways, %ld relations, %d strings",
+         ds->cnt[OSM_NODE], ds->cnt[OSM_WAY], ds->cnt[OSM_REL], intern_cnt());
+   return 0;
+
+rs_err:
+   del_static_mem(map);
+   munmap(map, st.st_size);
+   snap_map_ = NULL;
+   snap_size_ = 0;
+   return -1;
+}
+
+
+/*! Unmap the snapshot. This must be called after all objects were freed.
+ */
+void snap_free(void)
+{
+   if (snap_map_ == NULL)
+      return;
+
+   del_static_mem(snap_map_);
+   munmap(snap_map_, snap_size_);
+   snap_map_ = NULL;
+   snap_size_ = 0;
+}
@@ -0,0 +1,704 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smspidx.c
+ * This file contains the spatial index. It is a packed Hilbert R-tree over
+ * the bounding boxes of objects, i.e. the position of nodes and the bounding
+ * boxes of ways. The tree is built once from all objects which are sorted by
+ * the Hilbert value of the center of their boxes. Then SPIDX_NODE adjacent
+ * boxes are combined to a box of the next level until a single root box
+ * remains.
+ *
+ * The boxes are stored as floats which are rounded outwards, thus a query
+ * returns a superset of the matching objects and the caller has to do the
+ * exact check.
+ *
+ * The index of the main object tree is valid only as long as no rule was
+ * executed which may modify objects (see sm_tags_ro()). While it is valid,
+ * the list of nodes on the page is retrieved from the index instead of
+ * traversing all nodes. Rules which do not modify objects are applied to this
+ * list only. The list is sorted by id, thus it has the same order as
+ * traverse() and the output is identical to a full traversal.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+
+#include "smrender_dev.h"
+#include "smcore.h"
+
+//! number of boxes combined to a box of the next level
+#define SPIDX_NODE 16
+//! maximum number of levels, this is sufficient for 16^12 objects
+#define SPIDX_MAXLVL 12
+//! resolution of the Hilbert curve in bits per dimension
+#define SPIDX_HBITS 16
+
+
+//! bounding box of the index, rounded outwards
+typedef struct spidx_box
+{
+   float lat0, lon0, lat1, lon1;
+} spidx_box_t;
+
+struct spidx
+{
+   spidx_box_t *box;       //!< boxes of all levels, objects first, root last
+   osm_obj_t **obj;        //!< objects in order of the boxes of level 0
+   long cnt;               //!< number of objects
+   long size;              //!< number of objects allocated
+   int nlvl;               //!< number of levels, 0 if index is not finished
+   long lvl[SPIDX_MAXLVL + 1];   //!< position of the first box of each level
+};
+
+//! parameters of a radius query
+typedef struct spidx_radius
+{
+   double lat, lon;        //!< center
+   double r;               //!< radius in degrees of latitude
+   double coslat;          //!< cos(lat), scale of longitude
+   tree_func_t dhandler;
+   void *p;
+} spidx_radius_t;
+
+
+extern volatile sig_atomic_t int_;
+extern int render_all_nodes_;
+//! enable spatial index, 0 = disabled (default), otherwise enabled
+int spatial_index_ = 0;
+//! index of the main object tree, NULL if not built or invalidated
+static spidx_t *spidx_ = NULL;
+//! nodes of the main object tree which are on the page
+static tidx_list_t page_;
+//! 1 if page_ reflects the current object tree
+static int page_valid_ = 0;
+//! stats: number of (re)builds of the page list, rules applied to page list
+static long page_builds_, page_rules_, page_cand_;
+
+
+//! Round x down to the next float.
+static float float_lo(double x)
+{
+   float f = x;
+   return f > x ? nextafterf(f, -INFINITY) : f;
+}
+
+
+//! Round x up to the next float.
+static float float_hi(double x)
+{
+   float f = x;
+   return f < x ? nextafterf(f, INFINITY) : f;
+}
+
+
+/*! Return the distance along the Hilbert curve of the point x/y. x and y must
+ * be within [0, 2^SPIDX_HBITS).
+ */
+static uint32_t hilbert(uint32_t x, uint32_t y)
+{
+   uint32_t rx, ry, s, t, d = 0;
+   const uint32_t n = 1 << SPIDX_HBITS;
+
+   for (s = n / 2; s > 0; s /= 2)
+   {
+      rx = (x & s) > 0;
+      ry = (y & s) > 0;
+      d += s * s * ((3 * rx) ^ ry);
+      // rotate quadrant without branches, n - 1 - x equals x ^ (n - 1)
+      t = -(rx & (ry ^ 1)) & (n - 1);
+      x ^= t;
+      y ^= t;
+      t = (x ^ y) & -(ry ^ 1);
+      x ^= t;
+      y ^= t;
+   }
+   return d;
+}
+
+
+/*! Create a new empty spatial index. Objects are added with spidx_add() and
+ * the index has to be finished with spidx_finish() before it is queried.
+ * @return Returns a pointer to the index or NULL on error.
+ */
+spidx_t *spidx_new(void)
+{
+   spidx_t *idx;
+
+   if ((idx = calloc(1, sizeof(*idx))) == NULL)
+      log_errno(LOG_ERR, "calloc() failed");
+   return idx;
+}
+
+
+/*! Add the object o with the bounding box bb to the index.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int spidx_add(spidx_t *idx, const struct bbox *bb, osm_obj_t *o)
+{
+   spidx_box_t *box;
+   osm_obj_t **obj;
+   long size;
+
+   if (idx->nlvl)
+   {
+      log_msg(LOG_ERR, "spatial index already finished");
+      return -1;
+   }
+
+   if (idx->cnt >= idx->size)
+   {
+      size = idx->size ? idx->size * 2 : 1024;
+      if ((box = realloc(idx->box, sizeof(*box) * size)) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      idx->box = box;
+      if ((obj = realloc(idx->obj, sizeof(*obj) * size)) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      idx->obj = obj;
+      idx->size = size;
+   }
+
+   box = &idx->box[idx->cnt];
+   box->lat0 = float_lo(bb->ll.lat);
+   box->lon0 = float_lo(bb->ll.lon);
+   box->lat1 = float_hi(bb->ru.lat);
+   box->lon1 = float_hi(bb->ru.lon);
+   idx->obj[idx->cnt++] = o;
+
+   return 0;
+}
+
+
+/*! Sort the keys k by their upper 32 bits (the Hilbert value) with a stable
+ * radix sort.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int spidx_sort(uint64_t *k, long n)
+{
+   long cnt[256], i, s;
+   uint64_t *t, *a = k, *b;
+   int sh;
+
+   if ((t = malloc(sizeof(*t) * n)) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+   b = t;
+
+   for (sh = 32; sh < 64; sh += 8)
+   {
+      memset(cnt, 0, sizeof(cnt));
+      for (i = 0; i < n; i++)
+         cnt[(a[i] >> sh) & 0xff]++;
+      for (i = 0, s = 0; i < 256; i++)
+      {
+         long c = cnt[i];
+         cnt[i] = s;
+         s += c;
+      }
+      for (i = 0; i < n; i++)
+         b[cnt[(a[i] >> sh) & 0xff]++] = a[i];
+      // swap buffers, the number of passes is even, thus the result is in k
+      uint64_t *x = a;
+      a = b;
+      b = x;
+   }
+
+   free(t);
+   return 0;
+}
+
+
+/*! Sort the objects along the Hilbert curve and build the levels of the tree.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int spidx_finish(spidx_t *idx)
+{
+   double lat0 = 90, lon0 = 180, lat1 = -90, lon1 = -180, dlat, dlon;
+   spidx_box_t *box, *b;
+   osm_obj_t **obj;
+   uint64_t *key;
+   long i, j, n, total;
+   int l;
+
+   if (idx->nlvl)
+      return 0;
+
+   // extent of all objects
+   for (i = 0; i < idx->cnt; i++)
+   {
+      if (idx->box[i].lat0 < lat0) lat0 = idx->box[i].lat0;
+      if (idx->box[i].lon0 < lon0) lon0 = idx->box[i].lon0;
+      if (idx->box[i].lat1 > lat1) lat1 = idx->box[i].lat1;
+      if (idx->box[i].lon1 > lon1) lon1 = idx->box[i].lon1;
+   }
+   dlat = lat1 > lat0 ? ((1 << SPIDX_HBITS) - 1) / (lat1 - lat0) : 0;
+   dlon = lon1 > lon0 ? ((1 << SPIDX_HBITS) - 1) / (lon1 - lon0) : 0;
+
+   // sort by Hilbert value of the box centers, the lower 32 bits keep the
+   // original position
+   if ((key = malloc(sizeof(*key) * (idx->cnt + 1))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      return -1;
+   }
+   for (i = 0; i < idx->cnt; i++)
+      key[i] = (uint64_t) hilbert(
+            ((idx->box[i].lon0 + idx->box[i].lon1) / 2 - lon0) * dlon,
+            ((idx->box[i].lat0 + idx->box[i].lat1) / 2 - lat0) * dlat) << 32 | i;
+   if (spidx_sort(key, idx->cnt))
+   {
+      free(key);
+      return -1;
+   }
+
+   // number of boxes of all levels
+   for (n = idx->cnt, total = n, l = 1; n > 1 && l < SPIDX_MAXLVL; l++)
+   {
+      n = (n + SPIDX_NODE - 1) / SPIDX_NODE;
+      total += n;
+   }
+
+   if ((box = malloc(sizeof(*box) * (total + 1))) == NULL || (obj = malloc(sizeof(*obj) * (idx->cnt + 1))) == NULL)
+   {
+      log_errno(LOG_ERR, "malloc() failed");
+      free(box);
+      free(key);
+      return -1;
+   }
+   for (i = 0; i < idx->cnt; i++)
+   {
+      box[i] = idx->box[key[i] & 0xffffffff];
+      obj[i] = idx->obj[key[i] & 0xffffffff];
+   }
+   free(key);
+   free(idx->box);
+   free(idx->obj);
+   idx->box = box;
+   idx->obj = obj;
+   idx->size = idx->cnt;
+
+   // build upper levels
+   idx->lvl[0] = 0;
+   idx->lvl[1] = n = idx->cnt;
+   for (l = 1; n > 1 && l < SPIDX_MAXLVL; l++)
+   {
+      b = &idx->box[idx->lvl[l]];
+      for (i = idx->lvl[l - 1]; i < idx->lvl[l]; i += SPIDX_NODE, b++)
+      {
+         *b = idx->box[i];
+         for (j = i + 1; j < i + SPIDX_NODE && j < idx->lvl[l]; j++)
+         {
+            b->lat0 = fminf(b->lat0, idx->box[j].lat0);
+            b->lon0 = fminf(b->lon0, idx->box[j].lon0);
+            b->lat1 = fmaxf(b->lat1, idx->box[j].lat1);
+            b->lon1 = fmaxf(b->lon1, idx->box[j].lon1);
+         }
+      }
+      n = (n + SPIDX_NODE - 1) / SPIDX_NODE;
+      idx->lvl[l + 1] = idx->lvl[l] + n;
+   }
+   idx->nlvl = l;
+
+   log_debug("spatial index: %ld objects, %d levels", idx->cnt, idx->nlvl);
+   return 0;
+}
+
+
+//! Test if the box b overlaps the bounding box bb (including the borders).
+static int box_overlaps(const spidx_box_t *b, const struct bbox *bb)
+{
+   return b->lat0 <= bb->ru.lat && b->lat1 >= bb->ll.lat && b->lon0 <= bb->ru.lon && b->lon1 >= bb->ll.lon;
+}
+
+
+/*! Recursively descend into box i of level l.
+ * @return On success 0 is returned. If dhandler() returns a value != 0 the
+ * query is stopped and this value is returned.
+ */
+static int spidx_query0(const spidx_t *idx, int l, long i, const struct bbox *bb, tree_func_t dhandler, void *p)
+{
+   long j, end;
+   int e;
+
+   if (!l)
+      return dhandler(idx->obj[i], p);
+
+   j = idx->lvl[l - 1] + (i - idx->lvl[l]) * SPIDX_NODE;
+   end = j + SPIDX_NODE < idx->lvl[l] ? j + SPIDX_NODE : idx->lvl[l];
+   for (; j < end && !int_; j++)
+      if (box_overlaps(&idx->box[j], bb) && (e = spidx_query0(idx, l - 1, j, bb, dhandler, p)))
+         return e;
+
+   return 0;
+}
+
+
+/*! Call dhandler for all objects of the index whose bounding box overlaps the
+ * bounding box bb. The objects are not returned in a specific order. Since
+ * the boxes of the index are rounded outwards dhandler may be called for
+ * objects which are slightly outside of bb, thus dhandler has to do the exact
+ * check.
+ * @return On success 0 is returned. If dhandler() returns a value != 0 the
+ * query is stopped and this value is returned.
+ */
+int spidx_query(const spidx_t *idx, const struct bbox *bb, tree_func_t dhandler, void *p)
+{
+   long root;
+   int e;
+
+   if (!idx->nlvl || !idx->cnt)
+      return 0;
+
+   root = idx->lvl[idx->nlvl - 1];
+   if (box_overlaps(&idx->box[root], bb) && (e = spidx_query0(idx, idx->nlvl - 1, root, bb, dhandler, p)))
+   {
+      log_msg(LOG_WARNING, "dhandler() returned %d, breaking loop", e);
+      return e;
+   }
+   return 0;
+}
+
+
+/*! Return the approximate distance between the center of the radius query rq
+ * and the closest point of the box b in degrees of latitude.
+ */
+static double radius_dist(const spidx_radius_t *rq, const spidx_box_t *b)
+{
+   double dlat, dlon;
+
+   dlat = rq->lat < b->lat0 ? b->lat0 - rq->lat : rq->lat > b->lat1 ? rq->lat - b->lat1 : 0;
+   dlon = rq->lon < b->lon0 ? b->lon0 - rq->lon : rq->lon > b->lon1 ? rq->lon - b->lon1 : 0;
+   dlon *= rq->coslat;
+   return sqrt(dlat * dlat + dlon * dlon);
+}
+
+
+//! Descend into box i of level l and filter objects by distance.
+static int spidx_radius0(const spidx_t *idx, int l, long i, const struct bbox *bb, spidx_radius_t *rq)
+{
+   long j, end;
+   int e;
+
+   if (!l)
+      return radius_dist(rq, &idx->box[i]) <= rq->r ? rq->dhandler(idx->obj[i], rq->p) : 0;
+
+   j = idx->lvl[l - 1] + (i - idx->lvl[l]) * SPIDX_NODE;
+   end = j + SPIDX_NODE < idx->lvl[l] ? j + SPIDX_NODE : idx->lvl[l];
+   for (; j < end && !int_; j++)
+      if (box_overlaps(&idx->box[j], bb) && (e = spidx_radius0(idx, l - 1, j, bb, rq)))
+         return e;
+
+   return 0;
+}
+
+
+/*! Call dhandler for all objects of the index whose bounding box is closer
+ * than radius r to the coordinate c. The distance is approximated on an
+ * equirectangular projection which is sufficient for small radii. Like
+ * spidx_query() this returns a superset, dhandler has to do the exact check.
+ * @param c Center of the query.
+ * @param r Radius in nautical miles.
+ * @return On success 0 is returned. If dhandler() returns a value != 0 the
+ * query is stopped and this value is returned.
+ */
+int spidx_radius(const spidx_t *idx, const struct coord *c, double r, tree_func_t dhandler, void *p)
+{
+   spidx_radius_t rq;
+   struct bbox bb;
+   long root;
+   int e;
+
+   if (!idx->nlvl || !idx->cnt)
+      return 0;
+
+   rq.lat = c->lat;
+   rq.lon = c->lon;
+   rq.r = r / 60;
+   rq.coslat = cos(DEG2RAD(c->lat));
+   rq.dhandler = dhandler;
+   rq.p = p;
+
+   // bounding box of the circle as prefilter
+   bb.ll.lat = c->lat - rq.r;
+   bb.ru.lat = c->lat + rq.r;
+   if (rq.coslat > rq.r / 90)
+   {
+      bb.ll.lon = c->lon - rq.r / rq.coslat;
+      bb.ru.lon = c->lon + rq.r / rq.coslat;
+   }
+   else
+   {
+      bb.ll.lon = -180;
+      bb.ru.lon = 180;
+   }
+
+   root = idx->lvl[idx->nlvl - 1];
+   if (box_overlaps(&idx->box[root], &bb) && (e = spidx_radius0(idx, idx->nlvl - 1, root, &bb, &rq)))
+   {
+      log_msg(LOG_WARNING, "dhandler() returned %d, breaking loop", e);
+      return e;
+   }
+   return 0;
+}
+
+
+//! Free the index.
+void spidx_free(spidx_t *idx)
+{
+   if (idx == NULL)
+      return;
+   free(idx->box);
+   free(idx->obj);
+   free(idx);
+}
+
+
+//! Tree function which adds a node to the index.
+static int spidx_add_node(osm_node_t *n, spidx_t *idx)
+{
+   struct bbox bb;
+
+   bb.ll.lat = bb.ru.lat = n->lat;
+   bb.ll.lon = bb.ru.lon = n->lon;
+   return spidx_add(idx, &bb, (osm_obj_t*) n);
+}
+
+
+//! Tree function which adds the bounding box of a way to the index.
+static int spidx_add_way(osm_way_t *w, spidx_t *idx)
+{
+   struct bbox bb = {{90, 180}, {-90, -180}};
+   osm_node_t *n;
+   int i, cnt;
+
+   for (i = 0, cnt = 0; i < w->ref_cnt; i++)
+   {
+      if ((n = get_object(OSM_NODE, w->ref[i])) == NULL)
+         continue;
+      bb.ll.lat = fmin(bb.ll.lat, n->lat);
+      bb.ll.lon = fmin(bb.ll.lon, n->lon);
+      bb.ru.lat = fmax(bb.ru.lat, n->lat);
+      bb.ru.lon = fmax(bb.ru.lon, n->lon);
+      cnt++;
+   }
+
+   // ways without any nodes have no position
+   return cnt ? spidx_add(idx, &bb, (osm_obj_t*) w) : 0;
+}
+
+
+/*! Build a spatial index over all nodes and optionally all ways of the object
+ * tree. The bounding boxes of the ways are calculated from the nodes of the
+ * main object tree.
+ * @param tree Object tree.
+ * @param ways 1 if ways shall be added to the index, otherwise 0.
+ * @return Returns a pointer to the finished index or NULL on error.
+ */
+spidx_t *spidx_build(const bx_node_t *tree, int ways)
+{
+   spidx_t *idx;
+
+   if ((idx = spidx_new()) == NULL)
+      return NULL;
+
+   if (traverse(tree, 0, IDX_NODE, (tree_func_t) spidx_add_node, idx)
+         || (ways && traverse(tree, 0, IDX_WAY, (tree_func_t) spidx_add_way, idx))
+         || spidx_finish(idx))
+   {
+      spidx_free(idx);
+      return NULL;
+   }
+
+   return idx;
+}
+
+
+/*! Build the spatial index of the main object tree. It is available by
+ * get_spidx() until a rule is executed which may modify objects.
+ * @param ways 1 if the bounding boxes of ways shall be added to the index.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int spidx_main_init(int ways)
+{
+   spidx_free(spidx_);
+   page_valid_ = 0;
+
+   log_msg(LOG_INFO, "building spatial index");
+   if (*get_objtree() == NULL || (spidx_ = spidx_build(*get_objtree(), ways)) == NULL)
+      return -1;
+
+   log_msg(LOG_INFO, "spatial index contains %ld objects", spidx_->cnt);
+   return 0;
+}
+
+
+/*! Return the spatial index of the main object tree or NULL if it is not
+ * available, i.e. it was not built or objects may have been modified since.
+ */
+const spidx_t *get_spidx(void)
+{
+   return spidx_;
+}
+
+
+//! Tree function which appends a node to the page list if it is on the page.
+static int page_add(osm_node_t *n, void * UNUSED(p))
+{
+   osm_obj_t **obj;
+   struct coord c;
+
+   if (n->obj.type != OSM_NODE)
+      return 0;
+
+   c.lat = n->lat;
+   c.lon = n->lon;
+   if (!is_on_page(&c))
+      return 0;
+
+   if (page_.cnt >= page_.size)
+   {
+      if ((obj = realloc(page_.obj, sizeof(*page_.obj) * (page_.size ? page_.size * 2 : 1024))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      page_.obj = obj;
+      page_.size = page_.size ? page_.size * 2 : 1024;
+   }
+   page_.obj[page_.cnt++] = &n->obj;
+   return 0;
+}
+
+
+//! Compare objects by their id in the order of traverse().
+static int cmp_obj_id(const void *a, const void *b)
+{
+   uint64_t x = (*(osm_obj_t* const*) a)->id, y = (*(osm_obj_t* const*) b)->id;
+   return x < y ? -1 : x > y;
+}
+
+
+/*! (Re)build the list of nodes on the page. The spatial index is used if it
+ * is still valid, otherwise all nodes are traversed.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int page_build(void)
+{
+   page_.cnt = 0;
+   if (spidx_ != NULL)
+   {
+      if (spidx_query(spidx_, &get_rdata()->bb, (tree_func_t) page_add, NULL))
+         return -1;
+      qsort(page_.obj, page_.cnt, sizeof(*page_.obj), cmp_obj_id);
+   }
+   else if (traverse(*get_objtree(), 0, IDX_NODE, (tree_func_t) page_add, NULL))
+      return -1;
+
+   log_debug("%d nodes on page", page_.cnt);
+   page_builds_++;
+   page_valid_ = 1;
+   return 0;
+}
+
+
+/*! Check if the rule r can be applied to the list of nodes on the page only,
+ * i.e. the spatial index is enabled, nodes are clipped to the page, and r is
+ * a node rule which does not modify the object database.
+ * @param r Pointer to rule.
+ * @param objtree Object tree to which the rule is applied.
+ * @return Returns 1 if the page list is usable, otherwise 0.
+ */
+int page_usable(const smrule_t *r, const bx_node_t *objtree)
+{
+   return spatial_index_ && !render_all_nodes_ && objtree == *get_objtree() && r->oo->type == OSM_NODE &&
+      r->act->main.func != NULL && sm_is_flag_set(r, ACTION_TAGS_RO);
+}
+
+
+/*! Return the list of nodes on the page in order of traverse(). The list is
+ * rebuilt if necessary.
+ * @param r Pointer to rule.
+ * @param objtree Object tree to which the rule is applied.
+ * @return Returns a pointer to the list or NULL if it is not usable for this
+ * rule. In the latter case the rule has to traverse all objects.
+ */
+const tidx_list_t *page_lookup(const smrule_t *r, const bx_node_t *objtree)
+{
+   if (!page_usable(r, objtree))
+      return NULL;
+
+   if (!page_valid_ && page_build())
+   {
+      log_msg(LOG_WARN, "cannot build list of nodes on page, disabling spatial index");
+      spatial_index_ = 0;
+      return NULL;
+   }
+
+   page_rules_++;
+   page_cand_ += page_.cnt;
+   return &page_;
+}
+
+
+/*! This function has to be called after rule r was executed. It invalidates
+ * the spatial index and the page list if the rule may have modified objects.
+ */
+void page_update(const smrule_t *r)
+{
+   if (sm_is_flag_set(r, ACTION_TAGS_RO))
+      return;
+
+   page_valid_ = 0;
+   if (spidx_ != NULL)
+   {
+      log_debug("rule 0x%"PRIx64" invalidates spatial index", r->oo->id);
+      spidx_free(spidx_);
+      spidx_ = NULL;
+   }
+}
+
+
+//! Free the spatial index and the page list and output some stats.
+void spidx_main_free(void)
+{
+   if (page_builds_)
+      log_msg(LOG_NOTICE, "spatial index: %ld page list builds, %ld rules applied to %ld nodes",
+            page_builds_, page_rules_, page_cand_);
+   spidx_free(spidx_);
+   spidx_ = NULL;
+   free(page_.obj);
+   memset(&page_, 0, sizeof(page_));
+   page_valid_ = 0;
+}
@@ -0,0 +1,361 @@
+/* Copyright 2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of smrender.
+ *
+ * Smrender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Smrender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with smrender. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file smtagidx.c
+ * This file contains the inverted tag index. It maps the literal keys and
+ * key/value pairs which are used within the rules to the lists of objects
+ * which carry them. Rules which match such a tag just have to be applied to
+ * the objects of the shortest list instead of traversing all objects.
+ *
+ * The lists are created by traversing the object tree, thus they have the
+ * same order as traverse() and the output is identical to a full traversal.
+ * Each list carries the generation of the object tree for which it was built.
+ * The generation is incremented as soon as a rule is executed which may
+ * modify tags or objects (see sm_tags_ro()). Outdated lists are rebuilt
+ * lazily, i.e. only the lists of the keys and the object type which the next
+ * rule looks up are rebuilt within a single traversal of that type.
+ *
+ *  \author Bernhard R. Fischer
+ *  \date 2025/10/16
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "smrender_dev.h"
+#include "smcore.h"
+
+#define TIDX_NUM_TYPES 3
+
+
+//! index entry of a single key or key/value pair
+typedef struct tidx_entry
+{
+   tidx_list_t l[TIDX_NUM_TYPES];   //!< object lists per type (IDX_NODE...IDX_REL)
+   long gen[TIDX_NUM_TYPES];        //!< generation of the object tree of each list
+} tidx_entry_t;
+
+//! outdated entries which are rebuilt within a single traversal
+typedef struct tidx_refresh
+{
+   int idx;                //!< object type (IDX_NODE...IDX_REL)
+   int cnt;                //!< number of entries
+   int64_t *h;             //!< ids of the entries
+   tidx_entry_t **te;      //!< entries
+} tidx_refresh_t;
+
+
+extern volatile sig_atomic_t int_;
+//! enable tag index, 0 = disabled (default), otherwise enabled
+int tag_index_ = 0;
+//! tree of index entries, the hash of the key (or key/value pair) is the id
+static bx_node_t *tidx_ = NULL;
+//! generation of the object tree, incremented by every modifying rule
+static long tidx_gen_ = 1;
+//! stats: number of list (re)builds, rules applied by index, candidates, entries
+static long tidx_builds_, tidx_rules_, tidx_cand_, tidx_ent_;
+
+
+/*! Return the index id of key k. If v is not NULL the id of the key/value pair
+ * is returned.
+ */
+static int64_t tidx_hash(const bstring_t *k, const bstring_t *v)
+{
+   uint64_t h;
+
+   h = bs_hash(*k, BS_HASH_INIT);
+   if (v != NULL)
+   {
+      // separate key from value
+      h = bs_hash((bstring_t) {.len = 1, .buf = "\xff"}, h);
+      h = bs_hash(*v, h);
+   }
+   return h;
+}
+
+
+/*! Check if the match tag i of rule r is usable for the index.
+ * @return Returns 0 if the tag cannot be used, 1 if the key is literal, and 2
+ * if both key and value are literal.
+ */
+static int tidx_tag_type(const smrule_t *r, int i)
+{
+   const struct stag *st = &r->act->stag[i];
+
+   if (!r->oo->otag[i].k.len || (st->stk.type & (SPECIAL_MASK | SPECIAL_INVERT | SPECIAL_NOT)) != SPECIAL_DIRECT)
+      return 0;
+   if (st->stv.type & SPECIAL_NOT)
+      return 0;
+   if (!r->oo->otag[i].v.len || (st->stv.type & (SPECIAL_MASK | SPECIAL_INVERT)) != SPECIAL_DIRECT)
+      return 1;
+   return 2;
+}
+
+
+/*! Tree function which adds an (empty) index entry for all usable match tags
+ * of a rule.
+ */
+static int tidx_add_rule(smrule_t *r, void * UNUSED(p))
+{
+   tidx_entry_t *te;
+   int64_t h;
+   int i, t;
+
+   for (i = 0; i < r->oo->tag_cnt; i++)
+   {
+      if (!(t = tidx_tag_type(r, i)))
+         continue;
+
+      h = tidx_hash(&r->oo->otag[i].k, t == 2 ? &r->oo->otag[i].v : NULL);
+      if (get_object0(tidx_, h, 0) != NULL)
+         continue;
+
+      if ((te = calloc(1, sizeof(*te))) == NULL)
+      {
+         log_errno(LOG_ERR, "calloc() failed");
+         return -1;
+      }
+      put_object0(&tidx_, h, te, 0);
+      tidx_ent_++;
+   }
+   return 0;
+}
+
+
+//! Append object o to the list tl.
+static int tidx_append(tidx_list_t *tl, osm_obj_t *o)
+{
+   osm_obj_t **obj;
+
+   // an object may carry the same key several times
+   if (tl->cnt && tl->obj[tl->cnt - 1] == o)
+      return 0;
+
+   if (tl->cnt >= tl->size)
+   {
+      if ((obj = realloc(tl->obj, sizeof(*tl->obj) * (tl->size ? tl->size * 2 : 64))) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc() failed");
+         return -1;
+      }
+      tl->obj = obj;
+      tl->size = tl->size ? tl->size * 2 : 64;
+   }
+   tl->obj[tl->cnt++] = o;
+   return 0;
+}
+
+
+/*! Tree function which adds the object o to all outdated entries of tr which
+ * match one of its tags.
+ */
+static int tidx_add_obj(osm_obj_t *o, tidx_refresh_t *tr)
+{
+   int64_t hk, hv;
+   int i, j;
+
+   for (i = 0; i < o->tag_cnt; i++)
+   {
+      hk = tidx_hash(&o->otag[i].k, NULL);
+      hv = tidx_hash(&o->otag[i].k, &o->otag[i].v);
+      for (j = 0; j < tr->cnt; j++)
+         if ((tr->h[j] == hk || tr->h[j] == hv) && tidx_append(&tr->te[j]->l[tr->idx], o) == -1)
+            return -1;
+   }
+   return 0;
+}
+
+
+/*! Create the index entries from the rules. This is done once because the
+ * rules never change.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int tidx_init(void)
+{
+   if (execute_rules0(get_rdata()->rules, (tree_func_t) tidx_add_rule, NULL))
+      return -1;
+   if (tidx_ == NULL)
+      return -1;
+   log_msg(LOG_INFO, "tag index of %ld tags created", tidx_ent_);
+   return 0;
+}
+
+
+/*! Rebuild the outdated lists of type idx of the usable match tags of rule r
+ * by a single traversal of the objects of that type.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int tidx_refresh(const smrule_t *r, int idx)
+{
+   int64_t h[r->oo->tag_cnt];
+   tidx_entry_t *te[r->oo->tag_cnt];
+   tidx_refresh_t tr = {idx, 0, h, te};
+   int i, t, e;
+
+   for (i = 0; i < r->oo->tag_cnt; i++)
+   {
+      if (!(t = tidx_tag_type(r, i)))
+         continue;
+      h[tr.cnt] = tidx_hash(&r->oo->otag[i].k, t == 2 ? &r->oo->otag[i].v : NULL);
+      if ((te[tr.cnt] = get_object0(tidx_, h[tr.cnt], 0)) == NULL)
+         return -1;
+      // a rule may contain the same tag twice
+      if (te[tr.cnt]->gen[idx] == tidx_gen_ || te[tr.cnt]->gen[idx] == -1)
+         continue;
+      te[tr.cnt]->l[idx].cnt = 0;
+      te[tr.cnt]->gen[idx] = -1;
+      tr.cnt++;
+   }
+
+   if (!tr.cnt)
+      return 0;
+
+   log_debug("rebuilding %d lists of tag index", tr.cnt);
+   e = *get_objtree() != NULL && traverse(*get_objtree(), 0, idx, (tree_func_t) tidx_add_obj, &tr);
+   for (i = 0; i < tr.cnt; i++)
+      te[i]->gen[idx] = e ? 0 : tidx_gen_;
+   tidx_builds_ += tr.cnt;
+
+   return e ? -1 : 0;
+}
+
+
+/*! Check if the rule r can be applied by the tag index, i.e. it is enabled,
+ * the rule does not modify the object database and it has at least one match
+ * tag with a literal key.
+ * @param r Pointer to rule.
+ * @param objtree Object tree to which the rule is applied.
+ * @return Returns 1 if the index is usable, otherwise 0.
+ */
+int tidx_usable(const smrule_t *r, const bx_node_t *objtree)
+{
+   int i;
+
+   if (!tag_index_ || objtree != *get_objtree() || r->act->main.func == NULL || !sm_is_flag_set(r, ACTION_TAGS_RO))
+      return 0;
+
+   for (i = 0; i < r->oo->tag_cnt; i++)
+      if (tidx_tag_type(r, i))
+         return 1;
+
+   return 0;
+}
+
+
+/*! Return the shortest list of candidate objects for rule r. Outdated lists
+ * of the match tags of r are rebuilt.
+ * @param r Pointer to rule.
+ * @param objtree Object tree to which the rule is applied.
+ * @return Returns a pointer to the object list or NULL if the index is not
+ * usable for this rule. In the latter case the rule has to traverse all
+ * objects.
+ */
+const tidx_list_t *tidx_lookup(const smrule_t *r, const bx_node_t *objtree)
+{
+   const tidx_list_t *tl = NULL;
+   tidx_entry_t *te;
+   int i, t;
+
+   if (!tidx_usable(r, objtree))
+      return NULL;
+
+   if ((tidx_ == NULL && tidx_init()) || tidx_refresh(r, r->oo->type - 1))
+   {
+      log_msg(LOG_WARN, "cannot build tag index, disabling");
+      tag_index_ = 0;
+      return NULL;
+   }
+
+   for (i = 0; i < r->oo->tag_cnt; i++)
+   {
+      if (!(t = tidx_tag_type(r, i)))
+         continue;
+      if ((te = get_object0(tidx_, tidx_hash(&r->oo->otag[i].k, t == 2 ? &r->oo->otag[i].v : NULL), 0)) == NULL)
+         return NULL;
+      if (tl == NULL || te->l[r->oo->type - 1].cnt < tl->cnt)
+         tl = &te->l[r->oo->type - 1];
+   }
+
+   if (tl != NULL)
+   {
+      log_debug("applying rule to %d candidates of tag index", tl->cnt);
+      tidx_rules_++;
+      tidx_cand_ += tl->cnt;
+   }
+   return tl;
+}
+
+
+/*! Call dhandler for all objects of the list tl in order. This is the
+ * counterpart to traverse().
+ * @return On success 0 is returned. If dhandler() returns a value != 0 the
+ * loop is stopped and this value is returned.
+ */
+int tidx_traverse(const tidx_list_t *tl, tree_func_t dhandler, void *p)
+{
+   int i, e;
+
+   for (i = 0; i < tl->cnt && !int_; i++)
+      if ((e = dhandler(tl->obj[i], p)))
+      {
+         log_msg(LOG_WARNING, "dhandler() returned %d, breaking loop", e);
+         return e;
+      }
+
+   return 0;
+}
+
+
+/*! This function has to be called after rule r was executed. It outdates all
+ * lists of the index if the rule may have modified tags or objects.
+ */
+void tidx_update(const smrule_t *r)
+{
+   if (sm_is_flag_set(r, ACTION_TAGS_RO))
+      return;
+   tidx_gen_++;
+}
+
+
+static int tidx_free_entry(tidx_entry_t *te, void * UNUSED(p))
+{
+   for (int i = 0; i < TIDX_NUM_TYPES; i++)
+      free(te->l[i].obj);
+   free(te);
+   return 0;
+}
+
+
+//! Free the index and output some stats.
+void tidx_free(void)
+{
+   if (tidx_ == NULL)
+      return;
+
+   log_msg(LOG_NOTICE, "tag index: %ld list builds, %ld rules applied to %ld candidates",
+         tidx_builds_, tidx_rules_, tidx_cand_);
+   (void) traverse(tidx_, 0, 0, (tree_func_t) tidx_free_entry, NULL);
+   bx_free_tree(tidx_);
+   tidx_ = NULL;
+   tidx_gen_++;
+}
@@ -18,8 +18,21 @@
 /*! \file smthread.c
  * This file contains the code for multi-threaded execution of rules.
  *
+ * Each worker thread has a ring buffer of objects to which the main thread
+ * appends the objects found by traverse(). The main thread is the only writer
+ * of the tail of the queues, the objects are published in batches by a single
+ * atomic store, thus no lock is acquired while queueing. The workers dequeue
+ * objects from the head of their own queue. If it is empty they steal half of
+ * the objects of the longest queue of the other threads. Dequeuing is done by
+ * an atomic compare-and-swap of the head. The mutex is just used to put idle
+ * threads to sleep and to wake them up.
+ *
+ * The batch size adapts to the load. It is decreased if the queue was drained
+ * by the worker before the next batch was published (i.e. the thread was
+ * starving) and it is increased if there is a backlog of several batches.
+ *
  * \author Bernhard R. Fischer, <bf@abenteuerland.at>
- * \version 2025/03/28
+ * \version 2025/10/16
  */
 
 #include <stdio.h>
@@ -27,30 +40,55 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 
 #include "smrender.h"
 #include "smcore.h"
 
 
-#define SM_THREAD_EXEC 1
-#define SM_THREAD_WAIT 0
-#define SM_THREAD_EXIT -1
+//! number of objects of queue of each thread, must be a power of 2
+#define SM_QUEUE_SIZE 8192
+#define SM_QUEUE_MASK (SM_QUEUE_SIZE - 1)
+//! min and max batch size
+#define SM_BATCH_MIN 8
+#define SM_BATCH_MAX 1024
+
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(x, y) __atomic_store_n(&(x), (y), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(x, y) __atomic_add_fetch(&(x), (y), __ATOMIC_SEQ_CST)
+#define ATOMIC_SUB(x, y) __atomic_sub_fetch(&(x), (y), __ATOMIC_SEQ_CST)
 
 
 void *sm_thread_loop(sm_thread_t*);
 
-//! mutex for thread structures
+//! mutex for sleeping and waking up threads
 static pthread_mutex_t mmutex_ = PTHREAD_MUTEX_INITIALIZER;
 //! condition of main thread
 static pthread_cond_t mcond_ = PTHREAD_COND_INITIALIZER;
+//! condition of idle worker threads
+static pthread_cond_t wcond_ = PTHREAD_COND_INITIALIZER;
 //! pointer to thread structures
 static sm_thread_t *smth_ = NULL;
 //! total number of threads
 static int nthreads_ = 0;
-//! max number of objs in obj list
-static int obj_max_ = 8;
+//! current batch size
+static unsigned batch_ = SM_BATCH_MIN;
 //! current thread id to queue objects to
 static int cur_id_ = -1;
+//! number of objects of the current batch not yet published
+static unsigned cur_cnt_;
+//! number of objects queued but not yet processed
+static unsigned long pending_;
+//! number of objects queued since obj_queue_ini()
+static unsigned long queued_;
+//! number of sleeping worker threads
+static int idle_;
+//! 1 if main thread waits for free space in the queues
+static int prod_wait_;
+//! first result != 0 of this.main(), the remaining objects are dropped
+static int result_;
+//! 1 if threads shall exit
+static int exit_;
 
 
 /*! This function reads the number of CPUs from /proc/cpuinfo and returns it.
@@ -76,6 +114,16 @@ int get_ncpu(void)
 }
 
 
+//! Return monotonic time in microseconds.
+static uint64_t sm_time_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
 /*! This function initializes the threads for rule parallel processing.
  * @param nthreads Number of threads to initialize, 0 <= nthreads.
  * @return This function returns the number if threads initialized.
@@ -99,7 +147,7 @@ int init_threads(int nthreads)
       smth_ = &_smth;
    }
 
-   if ((smth_[0].obj = malloc(sizeof(*smth_[0].obj) * obj_max_ * (nthreads + 1))) == NULL)
+   if (nthreads && (smth_[0].obj = malloc(sizeof(*smth_[0].obj) * SM_QUEUE_SIZE * nthreads)) == NULL)
    {
       free(smth_);
       log_errno(LOG_ERR, "malloc() failed");
@@ -112,24 +160,18 @@ int init_threads(int nthreads)
    nthreads_ = nthreads;
    for (i = 0; i < nthreads; i++)
    {
-      smth_[i].status = SM_THREAD_WAIT;
       smth_[i].id = i;
       smth_[i].cnt = nthreads;
-      smth_[i].obj = smth_[0].obj + obj_max_ * i;
-      pthread_cond_init(&smth_[i].cond, NULL);
+      smth_[i].obj = smth_[0].obj + SM_QUEUE_SIZE * i;
       // FIXME: error handling should be improved!
       if ((e = pthread_create(&smth_[i].thandle, NULL, (void*(*)(void*)) sm_thread_loop, &smth_[i])))
-      {
          log_msg(LOG_ERR, "pthread_create() failed: %s", strerror(e));
-         smth_[i].status = SM_THREAD_EXIT;
-      }
    }
 
    // set values for main thread
    smth_[nthreads].thandle = pthread_self();
    smth_[nthreads].id = nthreads;
    smth_[nthreads].cnt = nthreads;
-   smth_[nthreads].obj = smth_[0].obj + obj_max_ * nthreads;
 
    return nthreads;
 }
@@ -165,198 +207,359 @@ void __attribute__((destructor)) delete_threads(void)
 {
    int i;
 
+   if (smth_ == NULL)
+      return;
+
    sm_wait_threads();
 
    // instruct all threads to exit
    pthread_mutex_lock(&mmutex_);
-   for (i = 0; i < nthreads_; i++)
-   {
-      smth_[i].status = SM_THREAD_EXIT;
-      pthread_cond_signal(&smth_[i].cond);
-   }
+   exit_ = 1;
+   pthread_cond_broadcast(&wcond_);
    pthread_mutex_unlock(&mmutex_);
 
    // join all threads
    for (i = 0; i < nthreads_; i++)
-   {
       pthread_join(smth_[i].thandle, NULL);
-      pthread_cond_destroy(&smth_[i].cond);
+
+   if (nthreads_)
+   {
+      free(smth_[0].obj);
+      free(smth_);
    }
+   smth_ = NULL;
+}
 
-   free(smth_);
+
+//! Return the number of objects in the queue of thread smth.
+static unsigned long sm_queue_len(sm_thread_t *smth)
+{
+   return ATOMIC_LOAD(smth->tail) - ATOMIC_LOAD(smth->head);
 }
 
 
-void *sm_thread_loop(sm_thread_t *smth)
+//! Return 1 if there is at least one object queued to any thread, otherwise 0.
+static int sm_work_available(void)
 {
-   sigset_t sset;
-   int e, res;
+   for (int i = 0; i < nthreads_; i++)
+      if (sm_queue_len(&smth_[i]))
+         return 1;
+   return 0;
+}
 
-   sigemptyset(&sset);
-   if ((e = pthread_sigmask(SIG_BLOCK, &sset, NULL)))
-      log_msg(LOG_ERR, "pthread_sigmask() failed: %s", strerror(e));
 
+/*! Dequeue up to max objects from the head of the queue of thread smth. The
+ * objects are copied before the head is moved because the slots may be reused
+ * by the main thread immediately afterwards.
+ * @param smth Thread whose queue is dequeued.
+ * @param obj Array which receives the objects.
+ * @param max Maximum number of objects to dequeue. If it is 0, half of the
+ * objects of the queue are dequeued.
+ * @return Returns the number of objects dequeued.
+ */
+static unsigned sm_queue_get(sm_thread_t *smth, void **obj, unsigned max)
+{
+   unsigned long head, n;
+
+   head = ATOMIC_LOAD(smth->head);
    for (;;)
    {
-      log_debug("thread %d waiting for objects", smth->id);
+      if (!(n = ATOMIC_LOAD(smth->tail) - head))
+         return 0;
+
+      if (!max)
+         n = (n + 1) / 2;
+      else if (n > max)
+         n = max;
+      if (n > SM_BATCH_MAX)
+         n = SM_BATCH_MAX;
+
+      for (unsigned long i = 0; i < n; i++)
+         obj[i] = __atomic_load_n(&smth->obj[(head + i) & SM_QUEUE_MASK], __ATOMIC_RELAXED);
+
+      // on failure head is updated to its current value
+      if (__atomic_compare_exchange_n(&smth->head, &head, head + n, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+         break;
+   }
+
+   // wake up main thread if it waits for free space
+   if (ATOMIC_LOAD(prod_wait_))
+   {
       pthread_mutex_lock(&mmutex_);
-      while (smth->status != SM_THREAD_EXEC)
+      pthread_cond_signal(&mcond_);
+      pthread_mutex_unlock(&mmutex_);
+   }
+
+   return n;
+}
+
+
+/*! Steal objects from the thread with the longest queue.
+ * @return Returns the number of objects stolen.
+ */
+static unsigned sm_steal(sm_thread_t *smth, void **obj)
+{
+   unsigned long len, max = 0;
+   int i, n, victim = -1;
+
+   for (i = 1; i < nthreads_; i++)
+   {
+      n = (smth->id + i) % nthreads_;
+      if ((len = sm_queue_len(&smth_[n])) > max)
       {
-         if (smth->status == SM_THREAD_EXIT)
-         {
-            pthread_mutex_unlock(&mmutex_);
-            return NULL;
-         }
-         pthread_cond_wait(&smth->cond, &mmutex_);
+         max = len;
+         victim = n;
       }
-      pthread_mutex_unlock(&mmutex_);
+   }
+
+   if (victim < 0 || !(n = sm_queue_get(&smth_[victim], obj, 0)))
+      return 0;
+
+   smth->steal_cnt++;
+   return n;
+}
+
 
-      // execute rule
-#if defined(TH_OBJ_LIST)
-      log_debug("processing object list");
-      for (res = 0; !res && smth->obj_cnt;)
+/*! Call this.main() for all objects of the list obj. The objects are dropped if
+ * a previous call failed.
+ */
+static void sm_thread_exec(sm_thread_t *smth, void **obj, unsigned cnt)
+{
+   int res, zero;
+
+   for (unsigned i = 0; i < cnt && !ATOMIC_LOAD(result_); i++)
+   {
+      smth->call_cnt++;
+      if ((res = smth->main(smth->param, obj[i])))
       {
-         smth->obj_cnt--;
-         smth->call_cnt++;
-         res = smth->main(smth->param, smth->obj[smth->obj_cnt]);
+         zero = 0;
+         __atomic_compare_exchange_n(&result_, &zero, res, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
       }
-#endif
+   }
 
+   // wake up main thread if all objects are processed
+   if (!ATOMIC_SUB(pending_, cnt))
+   {
       pthread_mutex_lock(&mmutex_);
-      smth->result = res;
-      smth->status = SM_THREAD_WAIT;
       pthread_cond_signal(&mcond_);
       pthread_mutex_unlock(&mmutex_);
    }
-
-   return NULL;
 }
 
 
-/*! This function blocks as long as at least one thread is execution, i.e. its
- * state == SM_THREAD_EXEC. The mutex mmutex_ must be acquired before calling
- * this function.
- */
-void block_while_exec(void)
+void *sm_thread_loop(sm_thread_t *smth)
 {
-   for (int i = 0;;)
-   {
-      for (; i < nthreads_ && smth_[i].status != SM_THREAD_EXEC; i++);
+   void *obj[SM_BATCH_MAX];
+   sigset_t sset;
+   unsigned n;
+   int e;
 
-      if (i >= nthreads_)
-         return;
+   sigemptyset(&sset);
+   if ((e = pthread_sigmask(SIG_BLOCK, &sset, NULL)))
+      log_msg(LOG_ERR, "pthread_sigmask() failed: %s", strerror(e));
 
-      pthread_cond_wait(&mcond_, &mmutex_);
+   for (;;)
+   {
+      if ((n = sm_queue_get(smth, obj, ATOMIC_LOAD(batch_))) || (n = sm_steal(smth, obj)))
+      {
+         sm_thread_exec(smth, obj, n);
+         continue;
+      }
+
+      log_debug("thread %d waiting for objects", smth->id);
+      pthread_mutex_lock(&mmutex_);
+      ATOMIC_ADD(idle_, 1);
+      smth->idle_start = sm_time_us();
+      while (!sm_work_available())
+      {
+         if (exit_)
+         {
+            pthread_mutex_unlock(&mmutex_);
+            return NULL;
+         }
+         pthread_cond_wait(&wcond_, &mmutex_);
+      }
+      smth->idle_us += sm_time_us() - smth->idle_start;
+      smth->idle_start = 0;
+      ATOMIC_SUB(idle_, 1);
+      pthread_mutex_unlock(&mmutex_);
    }
+
+   return NULL;
 }
 
 
-/*! Wait for all threads to finish execution, i.e. their state becomes !=
- * SM_THREAD_EXEC.
+/*! Wait for all threads to finish execution, i.e. all queued objects are
+ * processed.
  */
 void sm_wait_threads(void)
 {
    log_debug("waiting for all threads to finish action");
    pthread_mutex_lock(&mmutex_);
-   block_while_exec();
+   while (ATOMIC_LOAD(pending_))
+      pthread_cond_wait(&mcond_, &mmutex_);
    pthread_mutex_unlock(&mmutex_);
    log_debug("threads ready");
 }
 
 
-/*! This function returns the number if a free (not working) thread, i.e. whose
- * status is SM_THREAD_WAIT. If no thread is ready it waits for the condition
- * to be signalled.
- * @return Returns the number of the thread which is 0 <= n < nthreads_.
+/*! Return the id of a thread which has space for a batch of objects in its
+ * queue. The threads are selected round robin.
+ * @return Returns the number of the thread which is 0 <= n < nthreads_, or -1
+ * if all queues are full.
  */
-int get_free_thread(void)
+static int sm_free_queue(void)
 {
    static int _last = 0;
    int n;
 
-   for (;;)
+   for (int i = 0; i < nthreads_; i++)
    {
-      for (int i = 0; i < nthreads_; i++)
+      n = (i + _last) % nthreads_;
+      if (SM_QUEUE_SIZE - sm_queue_len(&smth_[n]) >= batch_)
       {
-         n = (i + _last) % nthreads_;
-         if (smth_[n].status == SM_THREAD_WAIT)
-         {
-            _last = n + 1;
-            return n;
-         }
+         _last = n + 1;
+         return n;
       }
-      pthread_cond_wait(&mcond_, &mmutex_);
+   }
+   return -1;
+}
+
+
+/*! This function returns the number of a thread which has space in its queue.
+ * If all queues are full it waits for the condition to be signalled.
+ * @return Returns the number of the thread which is 0 <= n < nthreads_.
+ */
+static int get_free_thread(void)
+{
+   int n;
+
+   while ((n = sm_free_queue()) < 0)
+   {
+      pthread_mutex_lock(&mmutex_);
+      ATOMIC_STORE(prod_wait_, 1);
+      if ((n = sm_free_queue()) < 0)
+         pthread_cond_wait(&mcond_, &mmutex_);
+      ATOMIC_STORE(prod_wait_, 0);
+      pthread_mutex_unlock(&mmutex_);
+   }
+   return n;
+}
+
+
+/*! Publish the current batch of objects to the queue of thread cur_id_ and
+ * adapt the batch size.
+ */
+static void obj_queue_publish(void)
+{
+   sm_thread_t *smth = &smth_[cur_id_];
+   unsigned long len;
+
+   len = sm_queue_len(smth);
+   if (!len && batch_ > SM_BATCH_MIN)
+      ATOMIC_STORE(batch_, batch_ / 2);
+   else if (len >= 4 * batch_ && batch_ < SM_BATCH_MAX)
+      ATOMIC_STORE(batch_, batch_ * 2);
+
+   // pending_ must be increased before the objects become visible
+   ATOMIC_ADD(pending_, cur_cnt_);
+   queued_ += cur_cnt_;
+   ATOMIC_STORE(smth->tail, smth->tail + cur_cnt_);
+   cur_id_ = -1;
+   cur_cnt_ = 0;
+
+   if (ATOMIC_LOAD(idle_))
+   {
+      pthread_mutex_lock(&mmutex_);
+      pthread_cond_signal(&wcond_);
+      pthread_mutex_unlock(&mmutex_);
    }
 }
 
 
 void obj_queue_ini(int (*main)(void*, osm_obj_t*), smrule_threaded_t *rth)
 {
+   uint64_t now = sm_time_us();
+
    cur_id_ = -1;
+   cur_cnt_ = 0;
+   queued_ = 0;
+   result_ = 0;
    rth -= nthreads_;
    pthread_mutex_lock(&mmutex_);
    for (int n = 0; n <= nthreads_; n++)
    {
       smth_[n].main = main;
       smth_[n].param = &rth[n];
-      //smth_[n].obj_cnt = 0;
       smth_[n].call_cnt = 0;
+      smth_[n].steal_cnt = 0;
+      smth_[n].idle_us = 0;
+      if (smth_[n].idle_start)
+         smth_[n].idle_start = now;
    }
    pthread_mutex_unlock(&mmutex_);
 }
 
 
+/*! Queue an object to the threads.
+ * @param obj Pointer to object.
+ * @return Returns 0 or the return value of this.main() if a previous call
+ * failed. In the latter case the object is not queued.
+ */
 int obj_queue(osm_obj_t *obj)
 {
    int res;
 
+   if ((res = ATOMIC_LOAD(result_)))
+      return res;
+
    if (cur_id_ < 0)
-   {
-      pthread_mutex_lock(&mmutex_);
       cur_id_ = get_free_thread();
 
-      // save previous result
-      if ((res = smth_[cur_id_].result))
-      {
-         smth_[cur_id_].obj_cnt = 0;
-         smth_[cur_id_].result = 0;
-         smth_[cur_id_].status = SM_THREAD_WAIT;
-         pthread_mutex_unlock(&mmutex_);
-         return res;
-      }
-      pthread_mutex_unlock(&mmutex_);
-   }
-
-   // add obj to obj list
-   smth_[cur_id_].obj[smth_[cur_id_].obj_cnt++] = obj;
+   // add obj to the queue but do not publish yet
+   __atomic_store_n(&smth_[cur_id_].obj[(smth_[cur_id_].tail + cur_cnt_++) & SM_QUEUE_MASK], obj, __ATOMIC_RELAXED);
 
-   if (smth_[cur_id_].obj_cnt >= obj_max_)
+   if (cur_cnt_ >= batch_)
    {
-      log_debug("signalling thread %d to process objects", cur_id_);
-      // signal threads to start
-      pthread_mutex_lock(&mmutex_);
-      smth_[cur_id_].status = SM_THREAD_EXEC;
-      pthread_cond_signal(&smth_[cur_id_].cond);
-      pthread_mutex_unlock(&mmutex_);
-
-      cur_id_ = -1;
+      log_debug("publishing %u objects to thread %d", cur_cnt_, cur_id_);
+      obj_queue_publish();
    }
 
    return 0;
 }
 
 
+//! Publish the remaining objects of the current batch.
 void obj_queue_signal(void)
 {
-   //FIXME: check result
    log_debug("signalling threads for remaining objects");
+   if (cur_id_ >= 0 && cur_cnt_)
+      obj_queue_publish();
+   cur_id_ = -1;
+}
+
+
+/*! Output the per-thread stats of the current rule. This function should be
+ * called after sm_wait_threads().
+ */
+void sm_thread_stats(void)
+{
+   uint64_t now, idle;
+
+   if (!queued_)
+      return;
+
+   log_msg(LOG_INFO, "%lu objects processed by %d threads, batch size %u", queued_, nthreads_, batch_);
+   now = sm_time_us();
    pthread_mutex_lock(&mmutex_);
    for (int n = 0; n < nthreads_; n++)
-      if (smth_[n].obj_cnt && smth_[n].status == SM_THREAD_WAIT)
-      {
-         smth_[n].status = SM_THREAD_EXEC;
-         pthread_cond_signal(&smth_[n].cond);
-      }
+   {
+      idle = smth_[n].idle_us;
+      if (smth_[n].idle_start)
+         idle += now - smth_[n].idle_start;
+      log_msg(LOG_INFO, "thread %d: %u calls, %u steals, %lu.%03lu ms idle",
+            n, smth_[n].call_cnt, smth_[n].steal_cnt, (unsigned long) (idle / 1000), (unsigned long) (idle % 1000));
+   }
    pthread_mutex_unlock(&mmutex_);
 }
 
@@ -35,11 +35,16 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
-
+#include <stdlib.h>
+#include <stdint.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include "smrender.h"
 #include "rdata.h"
 #include "smrender_dev.h"
+#include "smcore.h"
 
 
 #define ZOOM_LEVEL 10
@@ -147,27 +152,87 @@ static int check_dir_i(const char *dir, int i)
 }
 
 
-int create_tiles(const char *tile_path, const struct rdata *rd, int zoom, int ftype)
+#ifdef WITH_THREADS
+#define DEDUP_LOCK pthread_mutex_lock(&dedup_mutex_)
+#define DEDUP_UNLOCK pthread_mutex_unlock(&dedup_mutex_)
+#else
+#define DEDUP_LOCK
+#define DEDUP_UNLOCK
+#endif
+
+
+//! entry of the table of saved tiles used for deduplication
+typedef struct tile_ent
 {
-   char buf[PBUFSIZE], tbuf[2*PBUFSIZE];
-   struct tpoint tp;
-   struct coord lu;
-   struct bbox bb;
-   void *tile;
-   int x, y;
+   uint64_t d[2];          //!< digest of the pixels
+   char *path;             //!< file name of the first tile with these pixels
+   long c;                 //!< content of the first tile within the archive, see pmt_add()
+   int used;               //!< 1 if the entry is in use
+   int ready;              //!< 1 after the first tile was written successfully
+} tile_ent_t;
+
+//! range of tiles of a zoom level which are completely within the chart
+typedef struct tile_range
+{
+   int x0, y0;             //!< first tile
+   int nx, ny;             //!< number of tiles in x and y direction
+} tile_range_t;
 
-   // safety check
-   if (tile_path == NULL)
-      tile_path = ".";
+//! position of a tile
+typedef struct tile_pos
+{
+   int z, x, y;
+} tile_pos_t;
 
-   if (check_dir_i(tile_path, -1))
-      return -1;
+//! parameters of the tile generation of a zoom level shared by all threads
+typedef struct tile_job
+{
+   const char *path;       //!< base directory of the tiles
+   int zoom;               //!< zoom level
+   int ftype;              //!< file type, FTYPE_PNG or FTYPE_JPG
+   tile_range_t r;         //!< tiles to create
+   int next;               //!< number of the next tile to create
+   int err;                //!< number of tiles which failed
+} tile_job_t;
+
+//! parameters of the generation of a tile pyramid shared by all threads
+typedef struct pyr_job
+{
+   const char *path;       //!< base directory of the tiles
+   int ftype;              //!< file type, FTYPE_PNG or FTYPE_JPG
+   int zlo, zhi;           //!< lowest and highest zoom level
+   tile_range_t *zr;       //!< tile ranges of all zoom levels, index is zoom - zlo
+   tile_pos_t *task;       //!< root tiles of the subtrees to create
+   int ntask;              //!< number of tasks
+   int next;               //!< number of the next task
+   int err;                //!< number of tiles which failed
+   int zt;                 //!< zoom level of the tiles which are kept
+   void **keep;            //!< tiles of zoom level zt, index is position within its range
+} pyr_job_t;
+
+
+//! enable deduplication of identical tiles, 0 = disabled (default)
+int tile_dedup_ = 0;
+//! hash table of saved tiles, size is a power of 2
+static tile_ent_t *dedup_ = NULL;
+static long dedup_size_ = 0, dedup_cnt_ = 0;
+#ifdef WITH_THREADS
+static pthread_mutex_t dedup_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+#endif
+//! stats: number of tiles saved, linked, and linked uniform tiles
+static long tile_saved_, tile_linked_, tile_uniform_;
+//! archive if tiles are written to a single file instead of directories
+static pmtiles_t *pmt_ = NULL;
 
-   if (check_dir_i(tile_path, zoom))
-      return -1;
 
-   if ((tile = create_tile()) == NULL)
-      return -1;
+/*! Calculate the range of tiles of a zoom level which are completely within
+ * the bounding box of the chart.
+ */
+static void tile_range(const struct rdata *rd, int zoom, tile_range_t *tr)
+{
+   struct tpoint tp;
+   struct coord lu;
+   int x, y;
 
    lu.lon = rd->bb.ll.lon;
    lu.lat = rd->bb.ru.lat;
@@ -183,47 +248,648 @@ int create_tiles(const char *tile_path, const struct rdata *rd, int zoom, int ft
    if (lu.lat > rd->bb.ru.lat)
       tp.y++;
 
-   snprintf(buf, sizeof(buf), "%s/%d", tile_path, zoom);
+   for (x = tp.x; rd->bb.ru.lon >= tile2lon(x + 1, zoom); x++);
+   for (y = tp.y; rd->bb.ll.lat <= tile2lat(y + 1, zoom); y++);
 
-   for (x = tp.x; rd->bb.ru.lon >= tile2lon(x + 1, zoom); x++)
-   {
-      bb.ll.lon = tile2lon(x, zoom);
-      bb.ru.lon = tile2lon(x + 1, zoom);
+   tr->x0 = tp.x;
+   tr->y0 = tp.y;
+   tr->nx = x - tp.x;
+   tr->ny = y - tp.y;
+}
 
-      log_debug("tile x = %d, %f - %f", x, bb.ll.lon, bb.ru.lon);
 
+//! Return the position of tile x/y within the range or -1 if it is outside.
+static int range_index(const tile_range_t *tr, int x, int y)
+{
+   if (x < tr->x0 || x >= tr->x0 + tr->nx || y < tr->y0 || y >= tr->y0 + tr->ny)
+      return -1;
+   return (x - tr->x0) * tr->ny + y - tr->y0;
+}
+
+
+/*! Create the directories of the zoom level and of all columns of its tile
+ * range.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int tile_dirs(const char *tile_path, int zoom, const tile_range_t *tr)
+{
+   char buf[PBUFSIZE];
+
+   if (pmt_ != NULL)
+      return 0;
+
+   if (check_dir_i(tile_path, zoom))
+      return -1;
+
+   snprintf(buf, sizeof(buf), "%s/%d", tile_path, zoom);
+   for (int x = tr->x0; x < tr->x0 + tr->nx; x++)
       if (check_dir_i(buf, x))
       {
          log_msg(LOG_ERR, "check_dir_i(%s, %d) failed", buf, x);
-         delete_tile(tile);
          return -1;
       }
 
-      for (y = tp.y; rd->bb.ll.lat <= tile2lat(y + 1, zoom); y++)
+   return 0;
+}
+
+
+//! Cut the tile x/y of the zoom level out of the main image.
+static void cut_tile_xy(void *tile, int zoom, int x, int y)
+{
+   struct bbox bb;
+
+   bb.ll.lon = tile2lon(x, zoom);
+   bb.ru.lon = tile2lon(x + 1, zoom);
+   bb.ru.lat = tile2lat(y, zoom);
+   bb.ll.lat = tile2lat(y + 1, zoom);
+
+   log_debug("tile z = %d, x = %d, y = %d, %f - %f, %f - %f", zoom, x, y, bb.ll.lon, bb.ru.lon, bb.ru.lat, bb.ll.lat);
+
+   clear_tile(tile);
+   cut_tile(&bb, tile);
+}
+
+
+/*! Return the entry of the dedup table with the digest d. If there is no such
+ * entry, the position at which it has to be inserted is returned. The table
+ * must be locked.
+ */
+static tile_ent_t *dedup_find(const uint64_t *d)
+{
+   long i;
+
+   for (i = d[0] & (dedup_size_ - 1); dedup_[i].used; i = (i + 1) & (dedup_size_ - 1))
+      if (dedup_[i].d[0] == d[0] && dedup_[i].d[1] == d[1])
+         break;
+   return &dedup_[i];
+}
+
+
+/*! Grow the dedup table to twice its size. The table must be locked.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int dedup_grow(void)
+{
+   tile_ent_t *old = dedup_;
+   long i, size = dedup_size_;
+
+   if ((dedup_ = calloc(size ? size * 2 : 1024, sizeof(*dedup_))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      dedup_ = old;
+      return -1;
+   }
+   dedup_size_ = size ? size * 2 : 1024;
+   for (i = 0; i < size; i++)
+      if (old[i].used)
+         *dedup_find(old[i].d) = old[i];
+   free(old);
+   return 0;
+}
+
+
+/*! Return the entry of the dedup table with the digest d. If there is no such
+ * entry yet, it is registered for the tile name (which may be NULL if tiles
+ * are written to an archive). The table must be locked.
+ * @param d Digest of the tile.
+ * @param name File name of the tile or NULL.
+ * @param owner Pointer to variable which is set to 1 if the entry was
+ * registered. In that case the caller has to call dedup_ready() after the
+ * tile was written.
+ * @return Pointer to the entry or NULL on error.
+ */
+static tile_ent_t *dedup_enter(const uint64_t *d, const char *name, int *owner)
+{
+   tile_ent_t *te;
+
+   if (dedup_cnt_ * 2 >= dedup_size_ && dedup_grow())
+      return NULL;
+   te = dedup_find(d);
+   if (te->used)
+      return te;
+
+   if (name != NULL && (te->path = strdup(name)) == NULL)
+      return NULL;
+   te->d[0] = d[0];
+   te->d[1] = d[1];
+   te->c = -1;
+   te->used = 1;
+   te->ready = 0;
+   dedup_cnt_++;
+   *owner = 1;
+   return te;
+}
+
+
+/*! Check if a tile with identical pixels was already saved and hard link the
+ * file name to it. Otherwise the file name is registered for the pixels of
+ * this tile. Other tiles are linked to it not before the caller marked it as
+ * written with dedup_ready(), until then they are saved as separate files.
+ * @param tile Tile surface.
+ * @param name File name of the tile. The file must not exist.
+ * @param d Array of 2 which receives the digest of the tile.
+ * @param owner Pointer to variable which is set to 1 if the file name was
+ * registered. In that case the caller has to call dedup_ready() after the file
+ * was written.
+ * @return Returns 1 if the tile was linked, 0 if the tile has to be saved.
+ */
+static int dedup_tile(void *tile, const char *name, uint64_t *d, int *owner)
+{
+   char first[2*PBUFSIZE];
+   tile_ent_t *te;
+   int uniform;
+
+   *owner = 0;
+   if ((uniform = tile_digest(tile, d)) == -1)
+      return 0;
+
+   *first = '\0';
+   DEDUP_LOCK;
+   if ((te = dedup_enter(d, name, owner)) != NULL && !*owner && te->ready && te->path != NULL)
+      snprintf(first, sizeof(first), "%s", te->path);
+   DEDUP_UNLOCK;
+
+   if (!*first)
+      return 0;
+
+   if (link(first, name) == -1)
+   {
+      log_debug("link(%s, %s) failed: %s", first, name, strerror(errno));
+      return 0;
+   }
+
+   __atomic_fetch_add(&tile_linked_, 1, __ATOMIC_SEQ_CST);
+   if (uniform)
+      __atomic_fetch_add(&tile_uniform_, 1, __ATOMIC_SEQ_CST);
+   return 1;
+}
+
+
+/*! Mark the first tile with digest d as written, i.e. it may be linked now.
+ * @param d Digest of the tile.
+ * @param c Content within the archive or -1 if the tile was written to a file.
+ */
+static void dedup_ready(const uint64_t *d, long c)
+{
+   tile_ent_t *te;
+
+   DEDUP_LOCK;
+   te = dedup_find(d);
+   te->c = c;
+   te->ready = 1;
+   DEDUP_UNLOCK;
+}
+
+
+/*! Add the tile x/y of the zoom level to the archive. Tiles with pixels
+ * identical to a tile added before (which is frequent, e.g. open water) are
+ * not encoded again but refer to the content of the first one. The archive
+ * itself detects identical encoded data, thus this just saves the time of
+ * encoding.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int pmt_tile(int ftype, int zoom, int x, int y, void *tile)
+{
+   tile_ent_t *te;
+   uint64_t d[2];
+   size_t len;
+   void *data;
+   long c = -1;
+   int uniform, owner = 0;
+
+   if ((uniform = tile_digest(tile, d)) != -1)
+   {
+      DEDUP_LOCK;
+      if ((te = dedup_enter(d, NULL, &owner)) != NULL && !owner && te->ready && te->c != -1)
+         c = te->c;
+      DEDUP_UNLOCK;
+   }
+
+   if (c != -1)
+   {
+      if (pmt_add_ref(pmt_, zoom, x, y, c))
+         return -1;
+      __atomic_fetch_add(&tile_linked_, 1, __ATOMIC_SEQ_CST);
+      if (uniform)
+         __atomic_fetch_add(&tile_uniform_, 1, __ATOMIC_SEQ_CST);
+      return 0;
+   }
+
+   if (encode_image(tile, ftype, &data, &len))
+      return -1;
+   c = pmt_add(pmt_, zoom, x, y, data, len);
+   free(data);
+   if (c == -1)
+      return -1;
+
+   __atomic_fetch_add(&tile_saved_, 1, __ATOMIC_SEQ_CST);
+   if (owner)
+      dedup_ready(d, c);
+   return 0;
+}
+
+
+/*! Finish the creation of tiles. If tiles are written to an archive, the
+ * archive is written. Stats of the tile deduplication are output and the dedup
+ * table is freed.
+ * @param rd Pointer to rdata.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int finish_tiles(const struct rdata *rd)
+{
+   int e = 0;
+
+   if (pmt_ != NULL)
+   {
+      log_msg(LOG_NOTICE, "tiles: %ld encoded, %ld identical tiles referenced (%ld of them uniform)",
+            tile_saved_, tile_linked_, tile_uniform_);
+      e = pmt_close(pmt_, &rd->bb);
+      pmt_ = NULL;
+   }
+   else if (tile_dedup_)
+      log_msg(LOG_NOTICE, "tiles: %ld saved, %ld identical tiles linked (%ld of them uniform)",
+            tile_saved_, tile_linked_, tile_uniform_);
+
+   for (long i = 0; i < dedup_size_; i++)
+      free(dedup_[i].path);
+   free(dedup_);
+   dedup_ = NULL;
+   dedup_size_ = dedup_cnt_ = 0;
+
+   return e;
+}
+
+
+/*! Open the output of the tiles. If the tile path has the extension
+ * ".pmtiles", all tiles are written into this archive (see smpmtiles.c), it is
+ * kept open until finish_tiles(). Otherwise the base directory is created.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int tile_output(const char *tile_path, int ftype)
+{
+   if (!is_pmtiles_path(tile_path))
+      return check_dir_i(tile_path, -1);
+
+   if (pmt_ == NULL && (pmt_ = pmt_open(tile_path, ftype)) == NULL)
+      return -1;
+   return 0;
+}
+
+
+/*! Save the tile x/y of the zoom level to its file or to the archive (see
+ * pmt_tile()). If deduplication is enabled, tiles with identical pixels are
+ * hard linked to the first file instead of being encoded again.
+ * @return On success 0 is returned, otherwise -1.
+ */
+static int save_tile(const char *tile_path, int ftype, int zoom, int x, int y, void *tile)
+{
+   char buf[2*PBUFSIZE];
+   uint64_t d[2];
+   int owner = 0;
+
+   if (pmt_ != NULL)
+      return pmt_tile(ftype, zoom, x, y, tile);
+
+   snprintf(buf, sizeof(buf), "%s/%d/%d/%d.%s", tile_path, zoom, x, y, ftype == FTYPE_JPG ? "jpg" : "png");
+   // existing files are removed because they may be hard links to other tiles
+   // of a previous run with deduplication which must not be overwritten
+   if (unlink(buf) == -1 && errno != ENOENT)
+      log_msg(LOG_WARN, "unlink(%s) failed: %s", buf, strerror(errno));
+   if (tile_dedup_ && dedup_tile(tile, buf, d, &owner))
+      return 0;
+
+   __atomic_fetch_add(&tile_saved_, 1, __ATOMIC_SEQ_CST);
+   if (save_image(buf, tile, ftype))
+   {
+      log_msg(LOG_ERR, "failed to save tile %s", buf);
+      return -1;
+   }
+   if (owner)
+      dedup_ready(d, -1);
+   return 0;
+}
+
+
+/*! Run func(p) in up to ntask threads (see --threads) including the calling
+ * thread and wait until all of them finished.
+ */
+static void run_tile_threads(void *(*func)(void*), void *p, int ntask)
+{
+#ifdef WITH_THREADS
+   pthread_t *th = NULL;
+   int i, n = 0, nthreads, e;
+
+   nthreads = get_nthreads();
+   if (nthreads > ntask)
+      nthreads = ntask;
+   if (nthreads > 1 && (th = calloc(nthreads - 1, sizeof(*th))) == NULL)
+      log_errno(LOG_WARN, "calloc() failed");
+   if (th != NULL)
+   {
+      log_msg(LOG_INFO, "creating tiles with %d threads", nthreads);
+      // the calling thread is the last one
+      for (n = 0; n < nthreads - 1; n++)
+         if ((e = pthread_create(&th[n], NULL, func, p)))
+         {
+            log_msg(LOG_ERR, "pthread_create() failed: %s", strerror(e));
+            break;
+         }
+   }
+#else
+   (void) ntask;
+#endif
+
+   (void) func(p);
+
+#ifdef WITH_THREADS
+   for (i = 0; i < n; i++)
+      pthread_join(th[i], NULL);
+   free(th);
+#endif
+}
+
+
+/*! Thread function which creates the tiles of the job until all tiles are
+ * done. Each thread uses its own tile surface. The replay of the main image
+ * into the tile is serialized by cut_tile(), encoding and saving of the tile
+ * is done in parallel.
+ */
+static void *create_tiles_thread(tile_job_t *tj)
+{
+   void *tile;
+   int i, x, y;
+
+   if ((tile = create_tile()) == NULL)
+      return NULL;
+
+   while ((i = __atomic_fetch_add(&tj->next, 1, __ATOMIC_SEQ_CST)) < tj->r.nx * tj->r.ny)
+   {
+      x = tj->r.x0 + i / tj->r.ny;
+      y = tj->r.y0 + i % tj->r.ny;
+      cut_tile_xy(tile, tj->zoom, x, y);
+      if (save_tile(tj->path, tj->ftype, tj->zoom, x, y, tile))
+         __atomic_fetch_add(&tj->err, 1, __ATOMIC_SEQ_CST);
+   }
+
+   delete_tile(tile);
+   return NULL;
+}
+
+
+/*! Create all tiles of a zoom level which are completely within the bounding
+ * box of the chart. If threads are enabled the tiles are distributed across
+ * all threads. Each thread cuts the tiles out of the main image into its own
+ * tile surface, encodes and saves them. Cutting is serialized (see
+ * cut_tile()), encoding and file writes run in parallel.
+ * @param tile_path Base directory of the tiles.
+ * @param rd Pointer to rdata.
+ * @param zoom Zoom level.
+ * @param ftype File type, FTYPE_PNG or FTYPE_JPG.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int create_tiles(const char *tile_path, const struct rdata *rd, int zoom, int ftype)
+{
+   tile_job_t tj;
+
+   // safety check
+   if (tile_path == NULL)
+      tile_path = ".";
+
+   if (ftype != FTYPE_PNG && ftype != FTYPE_JPG)
+   {
+      log_msg(LOG_ERR, "unknown file type %d", ftype);
+      return -1;
+   }
+
+   memset(&tj, 0, sizeof(tj));
+   tj.path = tile_path;
+   tj.zoom = zoom;
+   tj.ftype = ftype;
+   tile_range(rd, zoom, &tj.r);
+
+   if (tile_output(tile_path, ftype) || tile_dirs(tile_path, zoom, &tj.r))
+      return -1;
+
+   if (tj.r.nx * tj.r.ny <= 0)
+      return 0;
+
+   run_tile_threads((void*(*)(void*)) create_tiles_thread, &tj, tj.r.nx * tj.r.ny);
+
+   if (tj.err)
+   {
+      log_msg(LOG_ERR, "%d of %d tiles failed", tj.err, tj.r.nx * tj.r.ny);
+      return -1;
+   }
+   return 0;
+}
+
+
+/*! Create the tile x/y of zoom level z and recursively all tiles below it
+ * down to the highest zoom level. Tiles of the highest zoom level are cut out
+ * of the main image, all others are downsampled from their four children.
+ * Thus, at most four tiles per zoom level are in memory.
+ * @return Returns the tile which has to be freed by the caller or NULL on
+ * error.
+ */
+static void *pyramid_tile(pyr_job_t *pj, int z, int x, int y)
+{
+   void *tile, *child[4];
+   int i;
+
+   if ((tile = create_tile()) == NULL)
+   {
+      __atomic_fetch_add(&pj->err, 1, __ATOMIC_SEQ_CST);
+      return NULL;
+   }
+
+   if (z >= pj->zhi)
+      cut_tile_xy(tile, z, x, y);
+   else
+   {
+      // order is upper left, upper right, lower left, lower right
+      for (i = 0; i < 4; i++)
+         child[i] = pyramid_tile(pj, z + 1, 2 * x + (i & 1), 2 * y + (i >> 1));
+      downsample_tile(tile, child);
+      for (i = 0; i < 4; i++)
+         delete_tile(child[i]);
+   }
+
+   if (save_tile(pj->path, pj->ftype, z, x, y, tile))
+      __atomic_fetch_add(&pj->err, 1, __ATOMIC_SEQ_CST);
+
+   return tile;
+}
+
+
+/*! Thread function which creates the subtrees of the tasks of the pyramid job
+ * until all are done. The tiles of zoom level zt are kept if there are lower
+ * zoom levels.
+ */
+static void *pyramid_thread(pyr_job_t *pj)
+{
+   tile_pos_t *t;
+   void *tile;
+   int i;
+
+   while ((i = __atomic_fetch_add(&pj->next, 1, __ATOMIC_SEQ_CST)) < pj->ntask)
+   {
+      t = &pj->task[i];
+      tile = pyramid_tile(pj, t->z, t->x, t->y);
+      // every thread writes to different elements
+      if (t->z == pj->zt && pj->zt > pj->zlo)
+         pj->keep[range_index(&pj->zr[t->z - pj->zlo], t->x, t->y)] = tile;
+      else
+         delete_tile(tile);
+   }
+
+   return NULL;
+}
+
+
+//! Free the n tiles of the array t and the array itself.
+static void free_tiles(void **t, int n)
+{
+   if (t == NULL)
+      return;
+   for (int i = 0; i < n; i++)
+      delete_tile(t[i]);
+   free(t);
+}
+
+
+/*! Create all tiles of the zoom levels zlo to zhi which are completely within
+ * the bounding box of the chart. Only the tiles of the highest zoom level are
+ * cut out of the main image, the tiles of all lower levels are created by
+ * downsampling their four child tiles which are still in memory.
+ *
+ * The work is split into subtrees of tiles which are distributed across the
+ * threads. The roots of the subtrees are the tiles of the lowest zoom level
+ * zt which has at least 4 tiles per thread, and the tiles of higher zoom
+ * levels whose parent is outside of the chart. The tiles of zoom level zt are
+ * kept, all levels below are finally built from them.
+ * @param tile_path Base directory of the tiles.
+ * @param rd Pointer to rdata.
+ * @param zlo Lowest zoom level.
+ * @param zhi Highest zoom level.
+ * @param ftype File type, FTYPE_PNG or FTYPE_JPG.
+ * @return On success 0 is returned, otherwise -1.
+ */
+int create_tile_pyramid(const char *tile_path, const struct rdata *rd, int zlo, int zhi, int ftype)
+{
+   void **cur, **prev, *child[4];
+   const tile_range_t *tr, *pr;
+   tile_pos_t *t;
+   pyr_job_t pj;
+   int x, y, z, i, j, n;
+
+   // safety check
+   if (tile_path == NULL)
+      tile_path = ".";
+
+   if (ftype != FTYPE_PNG && ftype != FTYPE_JPG)
+   {
+      log_msg(LOG_ERR, "unknown file type %d", ftype);
+      return -1;
+   }
+
+   memset(&pj, 0, sizeof(pj));
+   pj.path = tile_path;
+   pj.ftype = ftype;
+   pj.zlo = zlo;
+   pj.zhi = zhi;
+
+   if ((pj.zr = calloc(zhi - zlo + 1, sizeof(*pj.zr))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      return -1;
+   }
+
+   if (tile_output(tile_path, ftype))
+   {
+      free(pj.zr);
+      return -1;
+   }
+   for (z = zlo, n = 0; z <= zhi; z++)
+   {
+      tile_range(rd, z, &pj.zr[z - zlo]);
+      if (tile_dirs(tile_path, z, &pj.zr[z - zlo]))
       {
-         bb.ru.lat = tile2lat(y, zoom);
-         bb.ll.lat = tile2lat(y + 1, zoom);
-
-         log_debug("tile y = %d, %f - %f", y, bb.ru.lat, bb.ll.lat);
-
-         clear_tile(tile);
-         cut_tile(&bb, tile);
-         if (!ftype)
-            snprintf(tbuf, sizeof(tbuf), "%s/%d/%d.png", buf, x, y);
-         else if (ftype == 1)
-            snprintf(tbuf, sizeof(tbuf), "%s/%d/%d.jpg", buf, x, y);
-         else
+         free(pj.zr);
+         return -1;
+      }
+      n += pj.zr[z - zlo].nx * pj.zr[z - zlo].ny;
+   }
+   log_msg(LOG_INFO, "creating pyramid of %d tiles, zoom levels %d - %d", n, zlo, zhi);
+
+   // zoom level with enough subtrees for all threads
+   for (pj.zt = zlo; pj.zt < zhi && pj.zr[pj.zt - zlo].nx * pj.zr[pj.zt - zlo].ny < 4 * get_nthreads(); pj.zt++);
+
+   // at most all tiles are roots of subtrees
+   if ((pj.task = calloc(n + 1, sizeof(*pj.task))) == NULL || (pj.keep = calloc(pj.zr[pj.zt - zlo].nx * pj.zr[pj.zt - zlo].ny + 1, sizeof(*pj.keep))) == NULL)
+   {
+      log_errno(LOG_ERR, "calloc() failed");
+      free(pj.task);
+      free(pj.zr);
+      return -1;
+   }
+
+   for (z = pj.zt; z <= zhi; z++)
+   {
+      tr = &pj.zr[z - zlo];
+      for (x = tr->x0; x < tr->x0 + tr->nx; x++)
+         for (y = tr->y0; y < tr->y0 + tr->ny; y++)
          {
-            log_msg(LOG_ERR, "unknown file type %d", ftype);
-            delete_tile(tile);
-            return -1;
+            // tiles below zt are part of the subtree of their parent
+            if (z > pj.zt && range_index(&pj.zr[z - 1 - zlo], x / 2, y / 2) >= 0)
+               continue;
+            t = &pj.task[pj.ntask++];
+            t->z = z;
+            t->x = x;
+            t->y = y;
          }
+   }
 
-         save_image(tbuf, tile, ftype);
+   if (pj.ntask)
+      run_tile_threads((void*(*)(void*)) pyramid_thread, &pj, pj.ntask);
+
+   // build the lower zoom levels from the tiles of level zt
+   prev = pj.keep;
+   for (z = pj.zt - 1; z >= zlo; z--, prev = cur)
+   {
+      tr = &pj.zr[z - zlo];
+      pr = &pj.zr[z + 1 - zlo];
+      if ((cur = calloc(tr->nx * tr->ny + 1, sizeof(*cur))) == NULL)
+      {
+         log_errno(LOG_ERR, "calloc() failed");
+         pj.err++;
+         break;
       }
+      for (x = tr->x0; x < tr->x0 + tr->nx; x++)
+         for (y = tr->y0; y < tr->y0 + tr->ny; y++)
+         {
+            for (i = 0; i < 4; i++)
+               child[i] = (j = range_index(pr, 2 * x + (i & 1), 2 * y + (i >> 1))) >= 0 ? prev[j] : NULL;
+            if ((cur[range_index(tr, x, y)] = create_tile()) == NULL)
+            {
+               pj.err++;
+               continue;
+            }
+            downsample_tile(cur[range_index(tr, x, y)], child);
+            if (save_tile(tile_path, ftype, z, x, y, cur[range_index(tr, x, y)]))
+               pj.err++;
+         }
+      free_tiles(prev, pr->nx * pr->ny);
    }
+   free_tiles(prev, pj.zr[z + 1 - zlo].nx * pj.zr[z + 1 - zlo].ny);
 
-   delete_tile(tile);
+   free(pj.task);
+   free(pj.zr);
+
+   if (pj.err)
+   {
+      log_msg(LOG_ERR, "%d of %d tiles failed", pj.err, n);
+      return -1;
+   }
    return 0;
 }
 
@@ -47,7 +47,8 @@ static const char *usage_txt_ =
    "\n"
    "Inuput/Output Options\n"
    "   --in <osm_inpur>\n"
-   "   -i <osm_input> ......... OSM input data (default is stdin).\n"
+   "   -i <osm_input> ......... OSM input data (default is stdin). It is either OSM/XML, OSM PBF,\n"
+   "                            or a snapshot (see --snapshot).\n"
    "\n"
    "   --filter\n"
    "   -f ..................... Use loading filter.\n"
@@ -63,9 +64,20 @@ static const char *usage_txt_ =
    "\n"
    "   --out <image_file>\n"
    "   -o <image_file> ........ Name of output file. The extensions determines the output format.\n"
-   "                            Currently supported formats: .PDF, .PNG, .SVG.\n"
+   "                            Currently supported formats: .PDF, .PNG, .JPG, .SVG.\n"
    "   -O <pdf_file> .......... Filename of output PDF file (DEPRECATED: use -o).\n"
    "\n"
+   "   --band-memory <MB> ..... Render PNG, JPG, and KAP output in horizontal bands using at most\n"
+   "                            <MB> MB of image memory instead of rendering the whole image at\n"
+   "                            once. This is useful for huge charts at high resolution.\n"
+   "\n"
+   "   --obj-store <store> .... Internal storage of the OSM objects, either 'tree' (default) or 'array'.\n"
+   "                            The sorted 'array' needs much less memory for huge datasets.\n"
+   "\n"
+   "   --snapshot <file> ...... Save a snapshot of the OSM data to <file> after loading. A snapshot\n"
+   "                            can be used as input instead of the original data. It is memory\n"
+   "                            mapped and used in place, thus loading needs no parsing at all.\n"
+   "\n"
    "   --write <osm_file>\n"
    "   -w <osm_file> .......... Output internal OSM database to file at the end of processing.\n"
    "\n"
@@ -122,6 +134,13 @@ static const char *usage_txt_ =
    "   -t <title> ............. Set descriptional chart title. This title will also be used\n"
    "                            as title in the PDF metadata.\n"
    "\n"
+   "   --tag-index ............ Apply rules only to objects which carry their literal tags by using an\n"
+   "                            inverted index of the tags. This may speed up huge datasets.\n"
+   "\n"
+   "   --spatial-index ........ Build a spatial index after loading and apply rules which do not\n"
+   "                            modify objects only to the nodes on the page. This speeds up\n"
+   "                            rendering of small areas out of huge datasets.\n"
+   "\n"
    "Logging:\n"
    "   --logfile [+]<logfile>[:<lopt]\n"
    "   -L [+]<logfile>[:<lopt]\n"
@@ -143,6 +162,14 @@ static const char *usage_txt_ =
    "   -T <tile_info> ......... Create tiles.\n"
    "      <tile_info> := <zoom_lo> [ '-' <zoom_hi> ] ':' <tile_path> [ ':' <file_type> ]\n"
    "      <file_type> := 'png' | 'jpg'\n"
+   "      If <tile_path> ends with '.pmtiles', all tiles are written into this single archive\n"
+   "      file (PMTiles version 3) instead of a directory tree.\n"
+   "\n"
+   "   --tile-pyramid ......... Cut only the tiles of the highest zoom level out of the image and\n"
+   "                            create the lower zoom levels by downsampling their child tiles.\n"
+   "\n"
+   "   --tile-dedup ........... Save tiles with identical pixels (e.g. open water) only once and\n"
+   "                            create hard links for all further copies.\n"
    "\n"
    "Miscellaneous Options:\n"
    "   --urls\n"